@@ -507,6 +507,79 @@ typedef struct MDB_envinfo {
 	unsigned int me_numreaders;		/**< max reader slots used in the environment */
 } MDB_envinfo;
 
+/** @brief Information about a transaction */
+typedef struct MDB_txnstat {
+	mdb_size_t	mi_txnid;			/**< ID of this transaction */
+	mdb_size_t	mi_snapshot;		/**< ID of the committed snapshot this txn is based on */
+	mdb_size_t	mi_next_pgno;		/**< Next unallocated page, the pgno high-water mark */
+	unsigned int mi_dirty_room;		/**< Dirty pages that may still be added before #MDB_TXN_FULL */
+	mdb_size_t	mi_dirty_pages;		/**< Number of dirty pages held in memory */
+	mdb_size_t	mi_loose_pages;		/**< Number of loose pages available for reuse */
+	mdb_size_t	mi_spill_pages;		/**< Number of dirty pages spilled to disk */
+	mdb_size_t	mi_reclaim_pages;	/**< Reclaimed freeDB pages ready for reuse */
+} MDB_txnstat;
+
+/** @brief Number of tree levels tracked by #MDB_heatmap, deeper pages count in the last */
+#define MDB_HEAT_LEVELS		8
+/** @brief Number of page-number ranges tracked by #MDB_heatmap */
+#define MDB_HEAT_BUCKETS	64
+
+/** @brief Page kinds counted in #MDB_heatmap.%mh_type */
+enum MDB_heat_type {
+	MDB_HEAT_ROOT,				/**< Root page of a tree */
+	MDB_HEAT_BRANCH,			/**< Other branch pages */
+	MDB_HEAT_LEAF,				/**< Other leaf pages */
+	MDB_HEAT_OVERFLOW,			/**< Overflow pages of large values */
+	MDB_HEAT_TYPES
+};
+
+/** @brief Sampled page accesses for a database, see #mdb_env_set_heatmap() */
+typedef struct MDB_heatmap {
+	mdb_size_t	mh_samples;					/**< Number of sampled accesses */
+	mdb_size_t	mh_type[MDB_HEAT_TYPES];	/**< Samples by #MDB_heat_type */
+	mdb_size_t	mh_level[MDB_HEAT_LEVELS];	/**< Samples by tree level, the root is level 0 */
+	mdb_size_t	mh_bucket[MDB_HEAT_BUCKETS];	/**< Samples by page number, the map
+											split into equal ranges */
+} MDB_heatmap;
+
+/** @brief Page kinds reported in #MDB_walkpage.%mw_type */
+enum MDB_walk_type {
+	MDB_WALK_BRANCH,			/**< Branch page */
+	MDB_WALK_LEAF,				/**< Leaf page */
+	MDB_WALK_LEAF2,				/**< Leaf page of fixed-size #MDB_DUPFIXED items */
+	MDB_WALK_OVERFLOW			/**< First page of a run of overflow pages */
+};
+
+/** @brief A page visited by #mdb_dbi_walk() or #mdb_env_walk() */
+typedef struct MDB_walkpage {
+	mdb_size_t	mw_pgno;		/**< Page number */
+	MDB_dbi		mw_dbi;			/**< Database the page belongs to, or ~0 for
+								a named database that is not open in the environment */
+	MDB_val		mw_name;		/**< Name of a named database, empty for the
+								free-page and main DBs. Only valid during the callback. */
+	int			mw_thread;		/**< Index of the walking thread, from 0 */
+	int			mw_type;		/**< One of #MDB_walk_type */
+	unsigned int	mw_depth;	/**< Depth below the root of its tree, the root is 0.
+								Overflow pages are one below their leaf. */
+	unsigned int	mw_subdb;	/**< Nonzero for pages of a #MDB_DUPSORT sub-DB */
+	unsigned int	mw_pages;	/**< Number of pages, more than 1 only for overflow */
+	unsigned int	mw_nkeys;	/**< Number of items on the page */
+	size_t		mw_used;		/**< Bytes in use, including the page header */
+	size_t		mw_size;		/**< Total bytes, #mw_pages times the page size */
+	unsigned int	mw_subpages;	/**< Leaf items whose duplicates are in an inline sub-page */
+	unsigned int	mw_subdbs;		/**< Leaf items whose duplicates are in a sub-DB */
+	unsigned int	mw_bigdata;		/**< Leaf items whose data is on overflow pages */
+	size_t		mw_subpage_used;	/**< Bytes taken by the inline sub-pages */
+} MDB_walkpage;
+
+/** @brief A callback function for #mdb_dbi_walk() and #mdb_env_walk().
+ *
+ * @param[in] wp The page being visited.
+ * @param[in] ctx An arbitrary context pointer for the callback.
+ * @return 0 to continue the walk, anything else stops it and is returned.
+ */
+typedef int (MDB_walk_func)(const MDB_walkpage *wp, void *ctx);
+
 	/** @brief Return the LMDB library version information.
 	 *
 	 * @param[out] major if non-NULL, the library major version number is copied here
@@ -959,6 +1032,40 @@ int  mdb_env_set_userctx(MDB_env *env, void *ctx);
 	 */
 void *mdb_env_get_userctx(MDB_env *env);
 
+	/** @brief Enable sampled page access accounting.
+	 *
+	 * One in \b rate page accesses made while searching a tree or reading
+	 * an overflow value is recorded in a per-database #MDB_heatmap, by
+	 * page kind, tree level and page number range. This shows which
+	 * databases and which part of the map the cache has to hold.
+	 * Counters are updated without locking and are approximate when
+	 * several threads read concurrently. Each call resets the counters.
+	 * This function may only be called after #mdb_env_open().
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] rate Sample one in this many page accesses, 0 to disable
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified, or the environment is not open.
+	 *	<li>ENOMEM - out of memory.
+	 * </ul>
+	 */
+int  mdb_env_set_heatmap(MDB_env *env, unsigned int rate);
+
+	/** @brief Return the sampled page accesses of a database.
+	 *
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[out] hm The address of an #MDB_heatmap structure
+	 * 	where the counters will be copied, all zero if sampling is disabled
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_env_heatmap(MDB_env *env, MDB_dbi dbi, MDB_heatmap *hm);
+
 	/** @brief A callback function for most LMDB assert() failures,
 	 * called before printing the message and aborting.
 	 *
@@ -1033,6 +1140,23 @@ MDB_env *mdb_txn_env(MDB_txn *txn);
 	 */
 mdb_size_t mdb_txn_id(MDB_txn *txn);
 
+	/** @brief Return information about a transaction.
+	 *
+	 * For a write transaction this reports the live dirty, loose and spilled
+	 * page counts and the freelist pages reclaimed so far, so an application
+	 * can decide to commit before hitting #MDB_TXN_FULL or before the commit
+	 * grows too large. For a read-only transaction the page counts are zero.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[out] stat The address of an #MDB_txnstat structure
+	 * 	where the information will be copied
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_txn_info(MDB_txn *txn, MDB_txnstat *stat);
+
 	/** @brief Commit all the operations of a transaction into the database.
 	 *
 	 * The transaction handle is freed. It and its cursors must not be used
@@ -1114,6 +1238,9 @@ int  mdb_txn_renew(MDB_txn *txn);
 	 * aborted the handle will be closed automatically.
 	 * After a successful commit the handle will reside in the shared
 	 * environment, and may be used by other transactions.
+	 * A handle opened in a read-only transaction is shared at once, so
+	 * other read-only transactions may use it while that one is still
+	 * open; it is still closed if that transaction is aborted.
 	 *
 	 * This function must not be called from multiple concurrent
 	 * transactions in the same process. A transaction that uses
@@ -1186,6 +1313,42 @@ int  mdb_dbi_open(MDB_txn *txn, const char *name, unsigned int flags, MDB_dbi *d
 	 */
 int  mdb_stat(MDB_txn *txn, MDB_dbi dbi, MDB_stat *stat);
 
+	/** @brief Visit every page of a database.
+	 *
+	 * The tree is walked depth-first, each page is reported after its
+	 * children. Overflow pages and the pages of #MDB_DUPSORT sub-DBs
+	 * are reported along with the leaf that refers to them. Nothing is
+	 * modified, the walk is meant for read-only transactions.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open(),
+	 *	or 0 for the free-page DB
+	 * @param[in] func A #MDB_walk_func to call for every page
+	 * @param[in] ctx An arbitrary context pointer for the callback.
+	 * @return A non-zero error value on failure and 0 on success, or
+	 *	the nonzero value returned by \b func.
+	 */
+int  mdb_dbi_walk(MDB_txn *txn, MDB_dbi dbi, MDB_walk_func *func, void *ctx);
+
+	/** @brief Visit every page of every database, using several threads.
+	 *
+	 * The free-page DB, the main DB and all named databases are walked
+	 * from the snapshot of \b txn, which should be read-only. Subtrees
+	 * are handed out to \b nthreads threads, so pages are reported in
+	 * no particular order and \b func is called concurrently. It must
+	 * be thread-safe; #MDB_walkpage.%mw_thread may be used to keep
+	 * per-thread state without locking. Together the pages reported are
+	 * all the pages in use, apart from the meta pages and free pages.
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] func A #MDB_walk_func to call for every page
+	 * @param[in] ctx An arbitrary context pointer for the callback.
+	 * @param[in] nthreads The number of threads to walk with. With 1
+	 *	the walk runs in the calling thread. Always 1 on Windows.
+	 * @return A non-zero error value on failure and 0 on success, or
+	 *	a nonzero value returned by \b func.
+	 */
+int  mdb_env_walk(MDB_env *env, MDB_txn *txn, MDB_walk_func *func, void *ctx, int nthreads);
+
 	/** @brief Retrieve the DB flags for a database handle.
 	 *
 	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
@@ -1195,6 +1358,21 @@ int  mdb_stat(MDB_txn *txn, MDB_dbi dbi, MDB_stat *stat);
 	 */
 int mdb_dbi_flags(MDB_txn *txn, MDB_dbi dbi, unsigned int *flags);
 
+	/** @brief Report whether a database was modified in a transaction.
+	 *
+	 * A database is dirty once a write, #mdb_drop() or #mdb_dbi_swap() has
+	 * touched it in this transaction or in a committed child of it. For the
+	 * main DB this is true whenever the transaction has modified anything,
+	 * since named databases keep their records there. Callers keeping
+	 * caches per database can check this before #mdb_txn_commit() to learn
+	 * which ones the commit changes.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[out] dirty Set to 1 if the database was modified, else 0.
+	 * @return A non-zero error value on failure and 0 on success.
+	 */
+int mdb_dbi_dirty(MDB_txn *txn, MDB_dbi dbi, int *dirty);
+
 	/** @brief Close a database handle. Normally unnecessary. Use with care:
 	 *
 	 * This call is not mutex protected. Handles should only be closed by
@@ -1224,6 +1402,32 @@ void mdb_dbi_close(MDB_env *env, MDB_dbi dbi);
 	 */
 int  mdb_drop(MDB_txn *txn, MDB_dbi dbi, int del);
 
+	/** @brief Exchange the contents of two databases.
+	 *
+	 * The two database records (root page, depth, page and entry counts)
+	 * are swapped, so each handle now refers to what the other one held.
+	 * This takes constant time, and once the transaction commits, new
+	 * snapshots see both databases switched at once. It is meant for
+	 * reloading a dataset into a scratch database and then publishing it
+	 * under the live name; the old contents can be emptied later with
+	 * #mdb_drop(). Cursors open on either database are invalidated.
+	 *
+	 * Both databases must have been opened with the same flags. Custom
+	 * comparison functions stay with the handles.
+	 * @param[in] txn A write transaction handle returned by #mdb_txn_begin()
+	 * @param[in] a A database handle returned by #mdb_dbi_open()
+	 * @param[in] b Another database handle returned by #mdb_dbi_open()
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified, or one of the
+	 *		handles is the main DB.
+	 *	<li>EACCES - an attempt was made to modify a read-only transaction.
+	 *	<li>MDB_INCOMPATIBLE - the databases have different flags.
+	 * </ul>
+	 */
+int  mdb_dbi_swap(MDB_txn *txn, MDB_dbi a, MDB_dbi b);
+
 	/** @brief Set a custom key comparison function for a database.
 	 *
 	 * The comparison function is called whenever it is necessary to compare a
@@ -1430,10 +1634,40 @@ int  mdb_del(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
 	 */
 int  mdb_cursor_open(MDB_txn *txn, MDB_dbi dbi, MDB_cursor **cursor);
 
+	/** @brief Create a cursor handle which writes do not keep up to date.
+	 *
+	 * Every write in a write-transaction adjusts all cursors open on the
+	 * written database, so each write costs time proportional to the
+	 * number of open cursors. A cursor from this function is not adjusted.
+	 * Instead it remembers a copy of its current key (and data item for
+	 * #MDB_DUPSORT), and when it is used after any write in the environment
+	 * it first re-seeks to that position. If the item was deleted
+	 * meanwhile, the cursor is placed as if it had been deleted through
+	 * this cursor: #MDB_NEXT returns the following item, #MDB_PREV the one
+	 * before. #mdb_cursor_del() and #MDB_CURRENT writes fail with
+	 * #MDB_NOTFOUND in that case.
+	 *
+	 * Positioning such a cursor costs a copy of the key, so it pays off
+	 * for long-lived lookup cursors next to frequent writes.
+	 * In a read-only transaction it is the same as #mdb_cursor_open().
+	 * Unlike other cursors in a write-transaction, it is not closed when
+	 * its transaction ends and must be closed explicitly.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[out] cursor Address where the new #MDB_cursor handle will be stored
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_cursor_open_untracked(MDB_txn *txn, MDB_dbi dbi, MDB_cursor **cursor);
+
 	/** @brief Close a cursor handle.
 	 *
 	 * The cursor handle will be freed and must not be used again after this call.
-	 * Its transaction must still be live if it is a write-transaction.
+	 * Its transaction must still be live if it is a write-transaction,
+	 * unless the cursor came from #mdb_cursor_open_untracked().
 	 * @param[in] cursor A cursor handle returned by #mdb_cursor_open()
 	 */
 void mdb_cursor_close(MDB_cursor *cursor);
@@ -612,6 +612,35 @@ static txnid_t mdb_debug_start;
 	(((mc)->mc_flags & C_SUB) ? -(int)(mc)->mc_dbi : (int)(mc)->mc_dbi)
 /** @} */
 
+/** @defgroup probes	Static Tracepoints
+ *	@{
+ */
+#ifdef MDB_USE_SDT
+	/**	Emit a USDT probe in the "lmdb" provider, e.g. for perf or
+	 *	bpftrace: usdt:liblmdb.so:lmdb:page_get. Needs <sys/sdt.h>
+	 *	from SystemTap. Compiled out unless MDB_USE_SDT is defined.
+	 */
+# include <sys/sdt.h>
+# define MDB_PROBE1(name, a)	DTRACE_PROBE1(lmdb, name, a)
+# define MDB_PROBE2(name, a, b)	DTRACE_PROBE2(lmdb, name, a, b)
+# define MDB_PROBE3(name, a, b, c)	DTRACE_PROBE3(lmdb, name, a, b, c)
+# define MDB_PROBE4(name, a, b, c, d)	DTRACE_PROBE4(lmdb, name, a, b, c, d)
+#else
+# define MDB_PROBE1(name, a)	((void) 0)
+# define MDB_PROBE2(name, a, b)	((void) 0)
+# define MDB_PROBE3(name, a, b, c)	((void) 0)
+# define MDB_PROBE4(name, a, b, c, d)	((void) 0)
+#endif
+	/** Source of a page for the page_get probe */
+#define MDB_PROBE_MAPPED	0
+#define MDB_PROBE_DIRTY	1
+#define MDB_PROBE_SPILLED	2
+	/** Source of a page for the page_alloc probe */
+#define MDB_PROBE_LOOSE	0
+#define MDB_PROBE_FREELIST	1
+#define MDB_PROBE_NEW	2
+/** @} */
+
 	/**	@brief The maximum size of a database page.
 	 *
 	 *	It is 32k or 64k, since value-PAGEBASE must fit in
@@ -1353,6 +1382,24 @@ struct MDB_txn {
 	MDB_cursor	**mt_cursors;
 	/** Array of flags for each DB */
 	unsigned char	*mt_dbflags;
+	/** Array of stamps for each DB. The per-txn state of a DB
+	 *	(#mt_dbs, #mt_dbflags, #mt_cursors) is only valid while its
+	 *	stamp equals #mt_dbstamp, see #mdb_dbi_touch().
+	 */
+	unsigned int	*mt_dbstamps;
+	/** List of the DBs set up in this txn, in the order they were touched */
+	MDB_dbi		*mt_dbtouched;
+	MDB_dbi		mt_numtouched;	/**< length of #mt_dbtouched */
+	unsigned int	mt_dbstamp;		/**< current stamp for #mt_dbstamps */
+	/** #MDB_env.%me_dbiclock when this write txn began. A DB whose
+	 *	sequence number is newer was closed or reopened since then.
+	 */
+	unsigned int	mt_dbiclock;
+	/** Page accesses left until this txn takes its next heatmap sample.
+	 *	Kept per txn so concurrent readers never share a countdown; it
+	 *	carries over when a txn handle is reset and renewed.
+	 */
+	unsigned int	mt_heat_tick;
 #ifdef MDB_VL32
 	/** List of read-only pages (actually chunks) */
 	MDB_ID3L	mt_rpages;
@@ -1445,6 +1492,7 @@ struct MDB_cursor {
 #define C_SUB	0x04			/**< Cursor is a sub-cursor */
 #define C_DEL	0x08			/**< last op was a cursor_del */
 #define C_UNTRACK	0x40		/**< Un-track cursor when closing */
+#define C_LAZY	0x80			/**< Never tracked, re-seeks after writes, see #MDB_lazy */
 #define C_WRITEMAP	MDB_TXN_WRITEMAP /**< Copy of txn flag */
 /** Read-only cursor into the txn's original snapshot in the map.
  *	Set for read-only txns, and in #mdb_page_alloc() for #FREE_DBI when
@@ -1481,6 +1529,33 @@ typedef struct MDB_xcursor {
 	unsigned char mx_dbflag;
 } MDB_xcursor;
 
+	/** Position of a #C_LAZY cursor, stored after its cursor and xcursor,
+	 *	followed by buffers for the key and data copies. Such cursors are
+	 *	not in #MDB_txn.%mt_cursors, so writes do not fix them up. Instead
+	 *	they remember their position by value, and re-seek to it when used
+	 *	after #MDB_env.%me_wgen changed.
+	 */
+typedef struct MDB_lazy {
+	unsigned int	ml_wgen;	/**< #MDB_env.%me_wgen when position was saved */
+	unsigned short	ml_state;	/**< what the saved position is */
+#define ML_NONE	0		/**< not positioned */
+#define ML_ITEM	1		/**< at #ml_key */
+#define ML_DUP	2		/**< at #ml_key, dup item #ml_data */
+#define ML_END	3		/**< past the last item */
+	unsigned char	ml_flags;	/**< #C_DEL of the cursor */
+	unsigned char	ml_xflags;	/**< #C_DEL of its xcursor */
+	MDB_val		ml_key;		/**< copy of the current key */
+	MDB_val		ml_data;	/**< copy of the current dup item */
+} MDB_lazy;
+
+	/** The #MDB_lazy of a #C_LAZY cursor */
+#define MC_LAZY(mc)	((MDB_lazy *)((char *)((mc) + 1) + \
+	((mc)->mc_xcursor ? sizeof(MDB_xcursor) : 0)))
+
+	/** Check if a cursor must re-seek before use */
+#define MC_LAZY_STALE(mc)	(((mc)->mc_flags & C_LAZY) && \
+	MC_LAZY(mc)->ml_wgen != (mc)->mc_txn->mt_env->me_wgen)
+
 	/** Check if there is an inited xcursor */
 #define XCURSOR_INITED(mc) \
 	((mc)->mc_xcursor && ((mc)->mc_xcursor->mx_cursor.mc_flags & C_INITIALIZED))
@@ -1545,6 +1620,12 @@ struct MDB_env {
 	MDB_dbx		*me_dbxs;		/**< array of static DB info */
 	uint16_t	*me_dbflags;	/**< array of flags from MDB_db.md_flags */
 	unsigned int	*me_dbiseqs;	/**< array of dbi sequence numbers */
+	unsigned int	me_dbiclock;	/**< last value stored in #me_dbiseqs */
+	/** Open-addressed hash of named DB slots, keyed by name. 0 = empty */
+	MDB_dbi		*me_dbhash;
+	unsigned int	me_dbhmask;		/**< size of #me_dbhash minus 1 */
+	MDB_dbi		*me_dbfree;		/**< min-heap of closed DB slots for reuse */
+	MDB_dbi		me_numfree;		/**< length of #me_dbfree */
 	pthread_key_t	me_txkey;	/**< thread-key for readers */
 	txnid_t		me_pgoldest;	/**< ID of oldest reader last time we looked */
 	MDB_pgstate	me_pgstate;		/**< state of old pages from freeDB */
@@ -1588,6 +1669,10 @@ struct MDB_env {
 #endif
 	void		*me_userctx;	 /**< User-settable context */
 	MDB_assert_func *me_assert_func; /**< Callback for assertion failures */
+	unsigned int	me_heat_rate;	/**< sample 1 in N page accesses, 0 = off */
+	MDB_heatmap	*me_heat;		/**< per-DBI sampled page accesses */
+	/** Bumped by every write, so #C_LAZY cursors know to re-seek */
+	unsigned int	me_wgen;
 };
 
 	/** Nested transaction */
@@ -1608,7 +1693,12 @@ typedef struct MDB_ntxn {
 
 	/** Check \b txn and \b dbi arguments to a function */
 #define TXN_DBI_EXIST(txn, dbi, validity) \
-	((txn) && (dbi)<(txn)->mt_numdbs && ((txn)->mt_dbflags[dbi] & (validity)))
+	((txn) && (dbi)<(txn)->mt_numdbs && (TXN_DBI_FLAGS(txn, dbi) & (validity)))
+
+	/** Flags of \b dbi in \b txn, setting up its per-txn state if needed */
+#define TXN_DBI_FLAGS(txn, dbi) \
+	((txn)->mt_dbstamps[dbi] == (txn)->mt_dbstamp ? \
+	 (txn)->mt_dbflags[dbi] : mdb_dbi_touch(txn, dbi))
 
 	/** Check for misused \b dbi handles */
 #define TXN_DBI_CHANGED(txn, dbi) \
@@ -1632,6 +1722,13 @@ enum {
 static void mdb_txn_end(MDB_txn *txn, unsigned mode);
 
 static int  mdb_page_get(MDB_cursor *mc, pgno_t pgno, MDB_page **mp, int *lvl);
+static void mdb_heat_sample(MDB_cursor *mc, MDB_page *mp, int level, int type);
+	/** Count a page access in the heatmap of \b mc's DB, if sampling is on */
+#define MDB_HEAT(mc, mp, level, type) do { \
+	MDB_txn *he_txn = (mc)->mc_txn; \
+	if (he_txn->mt_env->me_heat_rate && he_txn->mt_heat_tick-- <= 1) \
+		mdb_heat_sample(mc, mp, level, type); \
+} while (0)
 static int  mdb_page_search_root(MDB_cursor *mc,
 			    MDB_val *key, int modify);
 #define MDB_PS_MODIFY	1
@@ -1689,6 +1786,7 @@ static void	mdb_xcursor_init1(MDB_cursor *mc, MDB_node *node);
 static void	mdb_xcursor_init2(MDB_cursor *mc, MDB_xcursor *src_mx, int force);
 
 static int	mdb_drop0(MDB_cursor *mc, int subs);
+static unsigned char	mdb_dbi_touch(MDB_txn *txn, MDB_dbi dbi);
 static void mdb_default_cmp(MDB_txn *txn, MDB_dbi dbi);
 static int mdb_reader_check0(MDB_env *env, int rlocked, int *dead);
 
@@ -2004,7 +2102,7 @@ static void mdb_audit(MDB_txn *txn)
 	count = 0;
 	for (i = 0; i<txn->mt_numdbs; i++) {
 		MDB_xcursor mx;
-		if (!(txn->mt_dbflags[i] & DB_VALID))
+		if (!(TXN_DBI_FLAGS(txn, i) & DB_VALID))
 			continue;
 		mdb_cursor_init(&mc, txn, i, &mx);
 		if (txn->mt_dbs[i].md_root == P_INVALID)
@@ -2253,7 +2351,7 @@ mdb_pages_xkeep(MDB_cursor *mc, unsigned pflags, int all)
 	int rc = MDB_SUCCESS, level;
 
 	/* Mark pages seen by cursors: First m0, then tracked cursors */
-	for (i = txn->mt_numdbs;; ) {
+	for (i = txn->mt_numtouched;; ) {
 		if (mc->mc_flags & C_INITIALIZED) {
 			for (m3 = mc;; m3 = &mx->mx_cursor) {
 				mp = NULL;
@@ -2274,7 +2372,7 @@ mdb_pages_xkeep(MDB_cursor *mc, unsigned pflags, int all)
 			}
 		}
 		mc = mc->mc_next;
-		for (; !mc || mc == m0; mc = txn->mt_cursors[--i])
+		for (; !mc || mc == m0; mc = txn->mt_cursors[txn->mt_dbtouched[--i]])
 			if (i == 0)
 				goto mark_done;
 	}
@@ -2282,7 +2380,8 @@ mdb_pages_xkeep(MDB_cursor *mc, unsigned pflags, int all)
 mark_done:
 	if (all) {
 		/* Mark dirty root pages */
-		for (i=0; i<txn->mt_numdbs; i++) {
+		for (j=0; j<txn->mt_numtouched; j++) {
+			i = txn->mt_dbtouched[j];
 			if (txn->mt_dbflags[i] & DB_DIRTY) {
 				pgno_t pgno = txn->mt_dbs[i].md_root;
 				if (pgno == P_INVALID)
@@ -2426,6 +2525,8 @@ mdb_page_spill(MDB_cursor *m0, MDB_val *key, MDB_val *data)
 	rc = mdb_pages_xkeep(m0, P_DIRTY|P_KEEP, i);
 
 done:
+	MDB_PROBE3(page_spill, txn->mt_txnid,
+		txn->mt_spill_pgs ? txn->mt_spill_pgs[0] : 0, rc);
 	txn->mt_flags |= rc ? MDB_TXN_ERROR : MDB_TXN_SPILLS;
 	return rc;
 }
@@ -2520,6 +2621,7 @@ mdb_page_alloc(MDB_cursor *mc, int num, MDB_page **mp)
 		txn->mt_loose_pgs = NEXT_LOOSE_PAGE(np);
 		txn->mt_loose_count--;
 		DPRINTF(("db %d use loose page %"Yu, DDBI(mc), np->mp_pgno));
+		MDB_PROBE4(page_alloc, DDBI(mc), np->mp_pgno, 1, MDB_PROBE_LOOSE);
 		*mp = np;
 		return MDB_SUCCESS;
 	}
@@ -2673,6 +2775,8 @@ search_done:
 	}
 	np->mp_pgno = pgno;
 	mdb_page_dirty(txn, np);
+	MDB_PROBE4(page_alloc, DDBI(mc), pgno, num,
+		i ? MDB_PROBE_FREELIST : MDB_PROBE_NEW);
 	*mp = np;
 
 	return MDB_SUCCESS;
@@ -2882,6 +2986,7 @@ mdb_env_sync0(MDB_env *env, int force, pgno_t numpgs)
 		|| !(env->me_flags & MDB_NOSYNC)
 #endif
 		) {
+		MDB_PROBE2(sync_begin, force, numpgs);
 		if (env->me_flags & MDB_WRITEMAP) {
 			int flags = ((env->me_flags & MDB_MAPASYNC) && !force)
 				? MS_ASYNC : MS_SYNC;
@@ -2901,6 +3006,7 @@ mdb_env_sync0(MDB_env *env, int force, pgno_t numpgs)
 			if (MDB_FDATASYNC(env->me_fd))
 				rc = ErrCode();
 		}
+		MDB_PROBE2(sync_end, force, rc);
 	}
 	return rc;
 }
@@ -2919,10 +3025,12 @@ mdb_cursor_shadow(MDB_txn *src, MDB_txn *dst)
 	MDB_cursor *mc, *bk;
 	MDB_xcursor *mx;
 	size_t size;
-	int i;
+	MDB_dbi i, k;
 
-	for (i = src->mt_numdbs; --i >= 0; ) {
+	for (k = src->mt_numtouched; k-- > 0; ) {
+		i = src->mt_dbtouched[k];
 		if ((mc = src->mt_cursors[i]) != NULL) {
+			TXN_DBI_FLAGS(dst, i);
 			size = sizeof(MDB_cursor);
 			if (mc->mc_xcursor)
 				size += sizeof(MDB_xcursor);
@@ -2961,9 +3069,10 @@ mdb_cursors_close(MDB_txn *txn, unsigned merge)
 {
 	MDB_cursor **cursors = txn->mt_cursors, *mc, *next, *bk;
 	MDB_xcursor *mx;
-	int i;
+	MDB_dbi i, k;
 
-	for (i = txn->mt_numdbs; --i >= 0; ) {
+	for (k = txn->mt_numtouched; k-- > 0; ) {
+		i = txn->mt_dbtouched[k];
 		for (mc = cursors[i]; mc; mc = next) {
 			next = mc->mc_next;
 			if ((bk = mc->mc_backup) != NULL) {
@@ -3045,6 +3154,160 @@ mdb_reader_pid(MDB_env *env, enum Pidlock_op op, MDB_PID_T pid)
 #endif
 }
 
+/** Hash a DB name for #MDB_env.%me_dbhash. FNV-1a. */
+static unsigned int
+mdb_dbhash_val(MDB_val *name)
+{
+	unsigned char *p = name->mv_data, *end = p + name->mv_size;
+	unsigned int h = 2166136261U;
+
+	while (p < end) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/** Find the slot of a named DB in the environment.
+ * @param[in] env the environment handle
+ * @param[in] name the name of the DB
+ * @return the slot, or 0 if no handle with this name is open.
+ */
+static MDB_dbi
+mdb_dbhash_find(MDB_env *env, MDB_val *name)
+{
+	unsigned int h = mdb_dbhash_val(name);
+	MDB_val *n;
+	MDB_dbi slot;
+
+	for (; (slot = env->me_dbhash[h & env->me_dbhmask]) != 0; h++) {
+		n = &env->me_dbxs[slot].md_name;
+		if (n->mv_size == name->mv_size &&
+			!memcmp(n->mv_data, name->mv_data, name->mv_size))
+			return slot;
+	}
+	return 0;
+}
+
+/** Add a named DB slot to the name hash. Its name must be set. */
+static void
+mdb_dbhash_add(MDB_env *env, MDB_dbi slot)
+{
+	unsigned int h = mdb_dbhash_val(&env->me_dbxs[slot].md_name);
+
+	while (env->me_dbhash[h & env->me_dbhmask])
+		h++;
+	env->me_dbhash[h & env->me_dbhmask] = slot;
+}
+
+/** Release a named DB slot: drop it from the name hash and make it
+ * available for reuse. Must be called before its name is freed.
+ */
+static void
+mdb_dbi_release(MDB_env *env, MDB_dbi slot)
+{
+	MDB_dbi *hash = env->me_dbhash;
+	unsigned int mask = env->me_dbhmask, i, j, k;
+
+	i = mdb_dbhash_val(&env->me_dbxs[slot].md_name) & mask;
+	while (hash[i] != slot)
+		i = (i + 1) & mask;
+	/* Backward-shift deletion: pull up each following entry whose
+	 * home position is not cyclically within (i, j].
+	 */
+	for (j = i;;) {
+		j = (j + 1) & mask;
+		if (!hash[j])
+			break;
+		k = mdb_dbhash_val(&env->me_dbxs[hash[j]].md_name) & mask;
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			hash[i] = hash[j];
+			i = j;
+		}
+	}
+	hash[i] = 0;
+
+	/* Slots past me_numdbs are reused anyway by the next new DB */
+	if (slot < env->me_numdbs) {
+		MDB_dbi *heap = env->me_dbfree;
+		for (i = env->me_numfree++; i && heap[(i - 1) >> 1] > slot; i = j) {
+			j = (i - 1) >> 1;
+			heap[i] = heap[j];
+		}
+		heap[i] = slot;
+	}
+}
+
+/** Take the lowest closed DB slot off #MDB_env.%me_dbfree.
+ * Slots are reused lowest first, as when they were found by a scan.
+ */
+static MDB_dbi
+mdb_dbfree_pop(MDB_env *env)
+{
+	MDB_dbi *heap = env->me_dbfree, top = heap[0], last;
+	unsigned int n = --env->me_numfree, i, j;
+
+	last = heap[n];
+	for (i = 0; (j = 2 * i + 1) < n; i = j) {
+		if (j + 1 < n && heap[j + 1] < heap[j])
+			j++;
+		if (heap[j] >= last)
+			break;
+		heap[i] = heap[j];
+	}
+	heap[i] = last;
+	return top;
+}
+
+/** Give \b dbi a new sequence number, invalidating its old handles */
+#define MDB_DBI_BUMP(env, dbi)	((env)->me_dbiseqs[dbi] = ++(env)->me_dbiclock)
+
+/** Mark a DB as set up in this txn */
+static void
+mdb_dbi_mark(MDB_txn *txn, MDB_dbi dbi)
+{
+	txn->mt_dbstamps[dbi] = txn->mt_dbstamp;
+	txn->mt_dbtouched[txn->mt_numtouched++] = dbi;
+}
+
+/** Set up the per-txn state of a DB on its first use in the txn.
+ * Txns begin with only the core DBs set up, so that beginning and
+ * ending a txn costs the same no matter how many DBs are open.
+ * Use #TXN_DBI_FLAGS() to only call this when needed.
+ * @param[in] txn the transaction handle
+ * @param[in] dbi a DB handle below \b txn->mt_numdbs
+ * @return the txn's flags for the DB, see @ref mt_dbflag.
+ */
+static unsigned char
+mdb_dbi_touch(MDB_txn *txn, MDB_dbi dbi)
+{
+	MDB_txn *parent = txn->mt_parent;
+	MDB_env *env = txn->mt_env;
+	unsigned char x;
+	uint16_t f;
+
+	mdb_dbi_mark(txn, dbi);
+	if (parent) {
+		/* Copy parent's DB info and flags, but clear DB_NEW */
+		x = TXN_DBI_FLAGS(parent, dbi) & ~DB_NEW;
+		txn->mt_dbs[dbi] = parent->mt_dbs[dbi];
+		txn->mt_cursors[dbi] = NULL;
+	} else {
+		f = env->me_dbflags[dbi];
+		txn->mt_dbs[dbi].md_flags = f & PERSISTENT_FLAGS;
+		x = (f & MDB_VALID) ? DB_VALID|DB_USRVALID|DB_STALE : 0;
+		if (!(txn->mt_flags & MDB_TXN_RDONLY)) {
+			/* Same result as copying all sequence numbers at txn begin:
+			 * a DB closed or reopened since then looks changed.
+			 */
+			unsigned int seq = env->me_dbiseqs[dbi];
+			txn->mt_dbiseqs[dbi] = seq > txn->mt_dbiclock ? txn->mt_dbiclock : seq;
+			txn->mt_cursors[dbi] = NULL;
+		}
+	}
+	return txn->mt_dbflags[dbi] = x;
+}
+
 /** Common code for #mdb_txn_begin() and #mdb_txn_renew().
  * @param[in] txn the transaction handle to initialize
  * @return 0 on success, non-zero on failure.
@@ -3056,7 +3319,6 @@ mdb_txn_renew0(MDB_txn *txn)
 	MDB_txninfo *ti = env->me_txns;
 	MDB_meta *meta;
 	unsigned int i, nr, flags = txn->mt_flags;
-	uint16_t x;
 	int rc, new_notls = 0;
 
 	if ((flags &= MDB_TXN_RDONLY) != 0) {
@@ -3152,8 +3414,8 @@ mdb_txn_renew0(MDB_txn *txn)
 		txn->mt_free_pgs = env->me_free_pgs;
 		txn->mt_free_pgs[0] = 0;
 		txn->mt_spill_pgs = NULL;
+		txn->mt_dbiclock = env->me_dbiclock;
 		env->me_txn = txn;
-		memcpy(txn->mt_dbiseqs, env->me_dbiseqs, env->me_maxdbs * sizeof(unsigned int));
 	}
 
 	/* Copy the DB info and flags */
@@ -3167,12 +3429,26 @@ mdb_txn_renew0(MDB_txn *txn)
 
 	txn->mt_flags = flags;
 
-	/* Setup db info */
+	/* Start a fresh handle at a txnid-dependent phase, so short txns
+	 * that each touch fewer than me_heat_rate pages still get sampled.
+	 */
+	if (env->me_heat_rate &&
+		(!txn->mt_heat_tick || txn->mt_heat_tick > env->me_heat_rate))
+		txn->mt_heat_tick = 1 + txn->mt_txnid % env->me_heat_rate;
+
+	/* Setup db info. Named DBs are set up on first use by mdb_dbi_touch(),
+	 * so this does not depend on the number of open DBs.
+	 */
 	txn->mt_numdbs = env->me_numdbs;
-	for (i=CORE_DBS; i<txn->mt_numdbs; i++) {
-		x = env->me_dbflags[i];
-		txn->mt_dbs[i].md_flags = x & PERSISTENT_FLAGS;
-		txn->mt_dbflags[i] = (x & MDB_VALID) ? DB_VALID|DB_USRVALID|DB_STALE : 0;
+	txn->mt_numtouched = 0;
+	if (!++txn->mt_dbstamp) {
+		memset(txn->mt_dbstamps, 0, env->me_maxdbs * sizeof(unsigned int));
+		txn->mt_dbstamp = 1;
+	}
+	for (i=0; i<CORE_DBS; i++) {
+		mdb_dbi_mark(txn, i);
+		if (txn->mt_cursors)
+			txn->mt_cursors[i] = NULL;
 	}
 	txn->mt_dbflags[MAIN_DBI] = DB_VALID|DB_USRVALID;
 	txn->mt_dbflags[FREE_DBI] = DB_VALID;
@@ -3226,10 +3502,12 @@ mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **ret)
 			return (parent->mt_flags & MDB_TXN_RDONLY) ? EINVAL : MDB_BAD_TXN;
 		}
 		/* Child txns save MDB_pgstate and use own copy of cursors */
-		size = env->me_maxdbs * (sizeof(MDB_db)+sizeof(MDB_cursor *)+1);
+		size = env->me_maxdbs * (sizeof(MDB_db)+sizeof(MDB_cursor *)+
+			sizeof(unsigned int)+sizeof(MDB_dbi)+1);
 		size += tsize = sizeof(MDB_ntxn);
 	} else if (flags & MDB_RDONLY) {
-		size = env->me_maxdbs * (sizeof(MDB_db)+1);
+		size = env->me_maxdbs * (sizeof(MDB_db)+
+			sizeof(unsigned int)+sizeof(MDB_dbi)+1);
 		size += tsize = sizeof(MDB_txn);
 	} else {
 		/* Reuse preallocated write txn. However, do not touch it until
@@ -3256,11 +3534,12 @@ mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **ret)
 	txn->mt_dbxs = env->me_dbxs;	/* static */
 	txn->mt_dbs = (MDB_db *) ((char *)txn + tsize);
 	txn->mt_dbflags = (unsigned char *)txn + size - env->me_maxdbs;
+	txn->mt_dbtouched = (MDB_dbi *)txn->mt_dbflags - env->me_maxdbs;
+	txn->mt_dbstamps = (unsigned int *)txn->mt_dbtouched - env->me_maxdbs;
 	txn->mt_flags = flags;
 	txn->mt_env = env;
 
 	if (parent) {
-		unsigned int i;
 		txn->mt_cursors = (MDB_cursor **)(txn->mt_dbs + env->me_maxdbs);
 		txn->mt_dbiseqs = parent->mt_dbiseqs;
 		txn->mt_u.dirty_list = malloc(sizeof(MDB_ID2)*MDB_IDL_UM_SIZE);
@@ -3272,6 +3551,7 @@ mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **ret)
 			return ENOMEM;
 		}
 		txn->mt_txnid = parent->mt_txnid;
+		txn->mt_heat_tick = parent->mt_heat_tick;
 		txn->mt_dirty_room = parent->mt_dirty_room;
 		txn->mt_u.dirty_list[0].mid = 0;
 		txn->mt_spill_pgs = NULL;
@@ -3283,10 +3563,10 @@ mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **ret)
 #ifdef MDB_VL32
 		txn->mt_rpages = parent->mt_rpages;
 #endif
-		memcpy(txn->mt_dbs, parent->mt_dbs, txn->mt_numdbs * sizeof(MDB_db));
-		/* Copy parent's mt_dbflags, but clear DB_NEW */
-		for (i=0; i<txn->mt_numdbs; i++)
-			txn->mt_dbflags[i] = parent->mt_dbflags[i] & ~DB_NEW;
+		/* Parent's DBs are copied on first use by mdb_dbi_touch() */
+		txn->mt_dbstamp = 1;
+		mdb_dbi_touch(txn, FREE_DBI);
+		mdb_dbi_touch(txn, MAIN_DBI);
 		rc = 0;
 		ntxn = (MDB_ntxn *)txn;
 		ntxn->mnt_pgstate = env->me_pgstate; /* save parent me_pghead & co */
@@ -3317,6 +3597,7 @@ renew:
 	} else {
 		txn->mt_flags |= flags;	/* could not change txn=me_txn0 earlier */
 		*ret = txn;
+		MDB_PROBE3(txn_begin, txn, txn->mt_txnid, (flags & MDB_RDONLY) != 0);
 		DPRINTF(("begin txn %"Yu"%c %p on mdbenv %p, root page %"Yu,
 			txn->mt_txnid, (flags & MDB_RDONLY) ? 'r' : 'w',
 			(void *) txn, (void *) env, txn->mt_dbs[MAIN_DBI].md_root));
@@ -3340,26 +3621,67 @@ mdb_txn_id(MDB_txn *txn)
     return txn->mt_txnid;
 }
 
+int
+mdb_txn_info(MDB_txn *txn, MDB_txnstat *arg)
+{
+	MDB_env *env;
+	MDB_IDL sl;
+	unsigned i;
+
+	if (!txn || !arg)
+		return EINVAL;
+	if (txn->mt_flags & MDB_TXN_FINISHED)
+		return MDB_BAD_TXN;
+
+	env = txn->mt_env;
+	memset(arg, 0, sizeof(*arg));
+	arg->mi_txnid = txn->mt_txnid;
+	arg->mi_next_pgno = txn->mt_next_pgno;
+	if (F_ISSET(txn->mt_flags, MDB_TXN_RDONLY)) {
+		arg->mi_snapshot = txn->mt_txnid;
+		return MDB_SUCCESS;
+	}
+
+	arg->mi_snapshot = txn->mt_txnid - 1;
+	arg->mi_dirty_room = txn->mt_dirty_room;
+	/* With MDB_WRITEMAP the dirty list is not kept sorted, but its
+	 * length is still the number of dirty pages.
+	 */
+	arg->mi_dirty_pages = txn->mt_u.dirty_list[0].mid;
+	arg->mi_loose_pages = txn->mt_loose_count;
+	if ((sl = txn->mt_spill_pgs) != NULL) {
+		/* Unspilled pages stay in the list with the LSB set */
+		for (i = sl[0]; i; i--)
+			if (!(sl[i] & 1))
+				arg->mi_spill_pages++;
+	}
+	if (env->me_pghead)
+		arg->mi_reclaim_pages = env->me_pghead[0];
+	return MDB_SUCCESS;
+}
+
 /** Export or close DBI handles opened in this txn. */
 static void
 mdb_dbis_update(MDB_txn *txn, int keep)
 {
-	int i;
+	MDB_dbi i, k;
 	MDB_dbi n = txn->mt_numdbs;
 	MDB_env *env = txn->mt_env;
 	unsigned char *tdbflags = txn->mt_dbflags;
 
-	for (i = n; --i >= CORE_DBS;) {
-		if (tdbflags[i] & DB_NEW) {
+	for (k = n ? txn->mt_numtouched : 0; k-- > 0; ) {
+		i = txn->mt_dbtouched[k];
+		if (i >= CORE_DBS && (tdbflags[i] & DB_NEW)) {
 			if (keep) {
 				env->me_dbflags[i] = txn->mt_dbs[i].md_flags | MDB_VALID;
 			} else {
 				char *ptr = env->me_dbxs[i].md_name.mv_data;
 				if (ptr) {
+					mdb_dbi_release(env, i);
 					env->me_dbxs[i].md_name.mv_data = NULL;
 					env->me_dbxs[i].md_name.mv_size = 0;
 					env->me_dbflags[i] = 0;
-					env->me_dbiseqs[i]++;
+					MDB_DBI_BUMP(env, i);
 					free(ptr);
 				}
 			}
@@ -3382,6 +3704,8 @@ mdb_txn_end(MDB_txn *txn, unsigned mode)
 	static const char *const names[] = MDB_END_NAMES;
 #endif
 
+	MDB_PROBE3(txn_end, txn, txn->mt_txnid, mode & MDB_END_OPMASK);
+
 	/* Export or close DBI handles opened in this txn */
 	mdb_dbis_update(txn, mode & MDB_END_UPDATE);
 
@@ -3755,6 +4079,7 @@ mdb_page_flush(MDB_txn *txn, int keep)
 	MDB_OFF_T	wpos = 0, next_pos = 1; /* impossible pos, so pos != next_pos */
 	int			n = 0;
 
+	MDB_PROBE3(page_flush, txn->mt_txnid, pagecount, keep);
 	j = i = keep;
 	if (env->me_flags & MDB_WRITEMAP
 #ifdef _WIN32
@@ -4019,14 +4344,20 @@ _mdb_txn_commit(MDB_txn *txn)
 		/* Merge our cursors into parent's and close them */
 		mdb_cursors_close(txn, 1);
 
-		/* Update parent's DB table. */
-		memcpy(parent->mt_dbs, txn->mt_dbs, txn->mt_numdbs * sizeof(MDB_db));
+		/* Update parent's DB table. Only DBs we touched can differ. */
 		parent->mt_numdbs = txn->mt_numdbs;
-		parent->mt_dbflags[FREE_DBI] = txn->mt_dbflags[FREE_DBI];
-		parent->mt_dbflags[MAIN_DBI] = txn->mt_dbflags[MAIN_DBI];
-		for (i=CORE_DBS; i<txn->mt_numdbs; i++) {
-			/* preserve parent's DB_NEW status */
-			x = parent->mt_dbflags[i] & DB_NEW;
+		for (y=0; y<txn->mt_numtouched; y++) {
+			i = txn->mt_dbtouched[y];
+			if (parent->mt_dbstamps[i] == parent->mt_dbstamp) {
+				/* preserve parent's DB_NEW status */
+				x = parent->mt_dbflags[i] & DB_NEW;
+			} else {
+				/* DB was opened by us */
+				mdb_dbi_mark(parent, i);
+				parent->mt_cursors[i] = NULL;
+				x = 0;
+			}
+			parent->mt_dbs[i] = txn->mt_dbs[i];
 			parent->mt_dbflags[i] = txn->mt_dbflags[i] | x;
 		}
 
@@ -4146,13 +4477,14 @@ _mdb_txn_commit(MDB_txn *txn)
 	/* Update DB root pointers */
 	if (txn->mt_numdbs > CORE_DBS) {
 		MDB_cursor mc;
-		MDB_dbi i;
+		MDB_dbi i, k;
 		MDB_val data;
 		data.mv_size = sizeof(MDB_db);
 
 		mdb_cursor_init(&mc, txn, MAIN_DBI, NULL);
-		for (i = CORE_DBS; i < txn->mt_numdbs; i++) {
-			if (txn->mt_dbflags[i] & DB_DIRTY) {
+		for (k = 0; k < txn->mt_numtouched; k++) {
+			i = txn->mt_dbtouched[k];
+			if (i >= CORE_DBS && (txn->mt_dbflags[i] & DB_DIRTY)) {
 				if (TXN_DBI_CHANGED(txn, i)) {
 					rc = MDB_BAD_DBI;
 					goto fail;
@@ -4692,6 +5024,36 @@ mdb_env_set_maxdbs(MDB_env *env, MDB_dbi dbs)
 	return MDB_SUCCESS;
 }
 
+int ESECT
+mdb_env_set_heatmap(MDB_env *env, unsigned int rate)
+{
+	if (!env || !env->me_map)
+		return EINVAL;
+	env->me_heat_rate = 0;
+	if (rate) {
+		if (!env->me_heat) {
+			env->me_heat = malloc(env->me_maxdbs * sizeof(MDB_heatmap));
+			if (!env->me_heat)
+				return ENOMEM;
+		}
+		memset(env->me_heat, 0, env->me_maxdbs * sizeof(MDB_heatmap));
+		env->me_heat_rate = rate;
+	}
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_heatmap(MDB_env *env, MDB_dbi dbi, MDB_heatmap *hm)
+{
+	if (!env || !hm || dbi >= env->me_maxdbs)
+		return EINVAL;
+	if (env->me_heat && env->me_heat_rate)
+		*hm = env->me_heat[dbi];
+	else
+		memset(hm, 0, sizeof(*hm));
+	return MDB_SUCCESS;
+}
+
 int ESECT
 mdb_env_set_maxreaders(MDB_env *env, unsigned int readers)
 {
@@ -5619,6 +5981,7 @@ int ESECT
 mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_mode_t mode)
 {
 	int rc, excl = -1;
+	unsigned int i;
 	MDB_name fname;
 
 	if (env->me_fd!=INVALID_HANDLE_VALUE || (flags & ~(CHANGEABLE|CHANGELESS)))
@@ -5684,7 +6047,14 @@ mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_mode_t mode
 	env->me_dbxs = calloc(env->me_maxdbs, sizeof(MDB_dbx));
 	env->me_dbflags = calloc(env->me_maxdbs, sizeof(uint16_t));
 	env->me_dbiseqs = calloc(env->me_maxdbs, sizeof(unsigned int));
-	if (!(env->me_dbxs && env->me_path && env->me_dbflags && env->me_dbiseqs)) {
+	/* Keep the name hash at most half full */
+	for (i = 4; i < 2 * env->me_maxdbs; i <<= 1) ;
+	env->me_dbhmask = i - 1;
+	env->me_dbhash = calloc(i, sizeof(MDB_dbi));
+	env->me_dbfree = malloc(env->me_maxdbs * sizeof(MDB_dbi));
+	env->me_numfree = 0;
+	if (!(env->me_dbxs && env->me_path && env->me_dbflags && env->me_dbiseqs &&
+		env->me_dbhash && env->me_dbfree)) {
 		rc = ENOMEM;
 		goto leave;
 	}
@@ -5736,14 +6106,17 @@ mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_mode_t mode
 		if (!(flags & MDB_RDONLY)) {
 			MDB_txn *txn;
 			int tsize = sizeof(MDB_txn), size = tsize + env->me_maxdbs *
-				(sizeof(MDB_db)+sizeof(MDB_cursor *)+sizeof(unsigned int)+1);
+				(sizeof(MDB_db)+sizeof(MDB_cursor *)+2*sizeof(unsigned int)+
+				sizeof(MDB_dbi)+1);
 			if ((env->me_pbuf = calloc(1, env->me_psize)) &&
 				(txn = calloc(1, size)))
 			{
 				txn->mt_dbs = (MDB_db *)((char *)txn + tsize);
 				txn->mt_cursors = (MDB_cursor **)(txn->mt_dbs + env->me_maxdbs);
 				txn->mt_dbiseqs = (unsigned int *)(txn->mt_cursors + env->me_maxdbs);
-				txn->mt_dbflags = (unsigned char *)(txn->mt_dbiseqs + env->me_maxdbs);
+				txn->mt_dbstamps = txn->mt_dbiseqs + env->me_maxdbs;
+				txn->mt_dbtouched = (MDB_dbi *)(txn->mt_dbstamps + env->me_maxdbs);
+				txn->mt_dbflags = (unsigned char *)(txn->mt_dbtouched + env->me_maxdbs);
 				txn->mt_env = env;
 #ifdef MDB_VL32
 				txn->mt_rpages = malloc(MDB_TRPAGE_SIZE * sizeof(MDB_ID3));
@@ -5790,7 +6163,14 @@ mdb_env_close0(MDB_env *env, int excl)
 	}
 
 	free(env->me_pbuf);
+	free(env->me_heat);
+	env->me_heat = NULL;
+	env->me_heat_rate = 0;
 	free(env->me_dbiseqs);
+	free(env->me_dbhash);
+	env->me_dbhash = NULL;
+	free(env->me_dbfree);
+	env->me_dbfree = NULL;
 	free(env->me_dbflags);
 	free(env->me_path);
 	free(env->me_dirty_list);
@@ -6533,12 +6913,39 @@ mapped:
 	}
 
 done:
+	MDB_PROBE3(page_get, DDBI(mc), pgno, !level ? MDB_PROBE_MAPPED :
+		(p->mp_flags & P_DIRTY) ? MDB_PROBE_DIRTY : MDB_PROBE_SPILLED);
 	*ret = p;
 	if (lvl)
 		*lvl = level;
 	return MDB_SUCCESS;
 }
 
+/** Record a sampled page access in the heatmap of \b mc's DB.
+ * @param[in] mc the cursor which accessed the page.
+ * @param[in] mp the page.
+ * @param[in] level the tree level of the page, or -1 for overflow pages.
+ * @param[in] type the @ref MDB_heat_type of the page.
+ */
+static void
+mdb_heat_sample(MDB_cursor *mc, MDB_page *mp, int level, int type)
+{
+	MDB_env *env = mc->mc_txn->mt_env;
+	MDB_heatmap *hm;
+	mdb_size_t bucket;
+
+	mc->mc_txn->mt_heat_tick = env->me_heat_rate;
+	if (!env->me_heat || mc->mc_dbi >= env->me_maxdbs)
+		return;
+	hm = &env->me_heat[mc->mc_dbi];
+	hm->mh_samples++;
+	hm->mh_type[type]++;
+	if (level >= 0)
+		hm->mh_level[level < MDB_HEAT_LEVELS ? level : MDB_HEAT_LEVELS-1]++;
+	bucket = mp->mp_pgno * MDB_HEAT_BUCKETS / env->me_maxpg;
+	hm->mh_bucket[bucket < MDB_HEAT_BUCKETS ? bucket : MDB_HEAT_BUCKETS-1]++;
+}
+
 /** Finish #mdb_page_search() / #mdb_page_search_lowest().
  *	The cursor is at the root page, set up the rest of it.
  */
@@ -6598,6 +7005,8 @@ mdb_page_search_root(MDB_cursor *mc, MDB_val *key, int flags)
 		mc->mc_ki[mc->mc_top] = i;
 		if ((rc = mdb_cursor_push(mc, mp)))
 			return rc;
+		MDB_HEAT(mc, mp, mc->mc_top,
+			IS_BRANCH(mp) ? MDB_HEAT_BRANCH : MDB_HEAT_LEAF);
 
 ready:
 		if (flags & MDB_PS_MODIFY) {
@@ -6728,6 +7137,7 @@ mdb_page_search(MDB_cursor *mc, MDB_val *key, int flags)
 #endif
 	mc->mc_snum = 1;
 	mc->mc_top = 0;
+	MDB_HEAT(mc, mc->mc_pg[0], 0, MDB_HEAT_ROOT);
 
 	DPRINTF(("db %d root page %"Yu" has flags 0x%X",
 		DDBI(mc), root, mc->mc_pg[0]->mp_flags));
@@ -6856,6 +7266,7 @@ mdb_node_read(MDB_cursor *mc, MDB_node *leaf, MDB_val *data)
 	}
 	data->mv_data = METADATA(omp);
 	MC_SET_OVPG(mc, omp);
+	MDB_HEAT(mc, omp, -1, MDB_HEAT_OVERFLOW);
 
 	return MDB_SUCCESS;
 }
@@ -7414,6 +7825,181 @@ mdb_cursor_last(MDB_cursor *mc, MDB_val *key, MDB_val *data)
 	return MDB_SUCCESS;
 }
 
+/** Perform \b act while tracking temporary cursor \b mn */
+#define WITH_CURSOR_TRACKING(mn, act) do { \
+	MDB_cursor dummy, *tracked, **tp = &(mn).mc_txn->mt_cursors[(mn).mc_dbi]; \
+	if ((mn).mc_flags & C_SUB) { \
+		dummy.mc_flags =  C_INITIALIZED; \
+		dummy.mc_xcursor = (MDB_xcursor *)&(mn);	\
+		tracked = &dummy; \
+	} else { \
+		tracked = &(mn); \
+	} \
+	tracked->mc_next = *tp; \
+	*tp = tracked; \
+	{ act; } \
+	*tp = tracked->mc_next; \
+} while (0)
+
+/** Save the position of a #C_LAZY cursor by value. */
+static void
+mdb_cursor_lazy_save(MDB_cursor *mc)
+{
+	MDB_lazy *ml = MC_LAZY(mc);
+	MDB_cursor *mx;
+	MDB_page *mp;
+	MDB_node *leaf;
+	MDB_val key, data;
+
+	ml->ml_wgen = mc->mc_txn->mt_env->me_wgen;
+	if (!(mc->mc_flags & C_INITIALIZED) || !mc->mc_snum) {
+		ml->ml_state = ML_NONE;
+		return;
+	}
+	mp = mc->mc_pg[mc->mc_top];
+	if (mc->mc_ki[mc->mc_top] >= NUMKEYS(mp)) {
+		/* Past the end, as a restore would leave it */
+		mc->mc_flags |= C_EOF;
+		ml->ml_state = ML_END;
+		return;
+	}
+	ml->ml_state = ML_ITEM;
+	ml->ml_flags = mc->mc_flags & C_DEL;
+	ml->ml_xflags = 0;
+	if (IS_LEAF2(mp)) {
+		key.mv_size = mc->mc_db->md_pad;
+		key.mv_data = LEAF2KEY(mp, mc->mc_ki[mc->mc_top], key.mv_size);
+	} else {
+		leaf = NODEPTR(mp, mc->mc_ki[mc->mc_top]);
+		MDB_GET_KEY(leaf, &key);
+		mx = mc->mc_xcursor ? &mc->mc_xcursor->mx_cursor : NULL;
+		if (F_ISSET(leaf->mn_flags, F_DUPDATA) && mx &&
+			!(mx->mc_flags & C_INITIALIZED))
+		{
+			/* A failed lookup can leave it pointing at another
+			 * key's data; a relative op would descend into that.
+			 */
+			mdb_xcursor_init1(mc, leaf);
+		} else if (mx && (!F_ISSET(leaf->mn_flags, F_DUPDATA) ||
+			mx->mc_ki[mx->mc_top] < NUMKEYS(mx->mc_pg[mx->mc_top])))
+		{
+			/* Keep the data even for a single value; dups may
+			 * be added around it before the restore.
+			 */
+			if (!F_ISSET(leaf->mn_flags, F_DUPDATA)) {
+				data.mv_size = NODEDSZ(leaf);
+				data.mv_data = NODEDATA(leaf);
+			} else {
+				mp = mx->mc_pg[mx->mc_top];
+				if (IS_LEAF2(mp)) {
+					data.mv_size = mx->mc_db->md_pad;
+					data.mv_data = LEAF2KEY(mp, mx->mc_ki[mx->mc_top], data.mv_size);
+				} else {
+					leaf = NODEPTR(mp, mx->mc_ki[mx->mc_top]);
+					MDB_GET_KEY(leaf, &data);
+				}
+				ml->ml_xflags = mx->mc_flags & C_DEL;
+			}
+			ml->ml_data.mv_size = data.mv_size;
+			memcpy(ml->ml_data.mv_data, data.mv_data, data.mv_size);
+			ml->ml_state = ML_DUP;
+		}
+	}
+	ml->ml_key.mv_size = key.mv_size;
+	memcpy(ml->ml_key.mv_data, key.mv_data, key.mv_size);
+}
+
+/** Re-seek a #C_LAZY cursor to its saved position after writes.
+ * If the saved item is gone, the cursor is left on the next item with
+ * #C_DEL set, as if the item had been deleted through this cursor.
+ * @param[in] mc the cursor.
+ * @param[in] mode 0 if the next operation does not depend on the
+ * position, 1 to re-seek, 2 to re-seek and require the same item.
+ * @return 0 on success, non-zero on failure. #MDB_NOTFOUND if mode
+ * is 2 and the item is gone; the cursor then stays stale.
+ */
+static int
+mdb_cursor_lazy_restore(MDB_cursor *mc, int mode)
+{
+	MDB_lazy *ml = MC_LAZY(mc);
+	MDB_xcursor *mx = mc->mc_xcursor;
+	MDB_val key, data;
+	int rc, exact, moved = 0;
+
+	ml->ml_wgen = mc->mc_txn->mt_env->me_wgen;
+	mc->mc_flags &= ~(C_INITIALIZED|C_EOF|C_DEL);
+	if (mx)
+		mx->mx_cursor.mc_flags &= ~(C_INITIALIZED|C_EOF|C_DEL);
+	if (!mode || ml->ml_state == ML_NONE)
+		return MDB_SUCCESS;
+
+	if (ml->ml_state == ML_END)
+		goto last;
+	key = ml->ml_key;
+	if (ml->ml_state == ML_DUP) {
+		data = ml->ml_data;
+		rc = mdb_cursor_set(mc, &key, &data, MDB_GET_BOTH_RANGE, &exact);
+		if (rc == MDB_SUCCESS) {
+			if (mc->mc_dbx->md_dcmp(&data, &ml->ml_data)) {
+				moved = 1;
+				if (mx->mx_cursor.mc_flags & C_INITIALIZED)
+					mx->mx_cursor.mc_flags |= C_DEL;
+				else
+					mc->mc_flags |= C_DEL;
+			} else {
+				mc->mc_flags |= ml->ml_flags;
+				mx->mx_cursor.mc_flags |= ml->ml_xflags;
+			}
+			goto done;
+		}
+		if (rc != MDB_NOTFOUND)
+			return rc;
+		key = ml->ml_key;
+	}
+	moved = 1;
+	rc = mdb_cursor_set(mc, &key, &data, MDB_SET_RANGE, NULL);
+	if (rc == MDB_SUCCESS) {
+		if (!mc->mc_dbx->md_cmp(&key, &ml->ml_key)) {
+			if (ml->ml_state == ML_ITEM) {
+				mc->mc_flags |= ml->ml_flags;
+				moved = 0;
+				goto done;
+			}
+			/* The key is left, but none of the dups from ours on */
+			rc = mdb_cursor_next(mc, &key, &data, MDB_NEXT_NODUP);
+		}
+		if (rc == MDB_SUCCESS) {
+			mc->mc_flags |= C_DEL;
+			if (mx && (mx->mx_cursor.mc_flags & C_INITIALIZED))
+				mx->mx_cursor.mc_flags |= C_DEL;
+			goto done;
+		}
+	}
+	if (rc != MDB_NOTFOUND)
+		return rc;
+
+last:
+	rc = mdb_cursor_last(mc, &key, &data);
+	if (rc == MDB_NOTFOUND) {
+		/* DB is empty now */
+		mc->mc_flags &= ~(C_INITIALIZED|C_EOF);
+		rc = MDB_SUCCESS;
+	} else if (rc == MDB_SUCCESS) {
+		mc->mc_flags |= C_EOF;
+		mc->mc_ki[mc->mc_top] = NUMKEYS(mc->mc_pg[mc->mc_top]);
+	} else {
+		return rc;
+	}
+
+done:
+	if (moved && mode == 2) {
+		/* Keep the saved position so the next call fails the same way */
+		ml->ml_wgen--;
+		return MDB_NOTFOUND;
+	}
+	return MDB_SUCCESS;
+}
+
 int
 mdb_cursor_get(MDB_cursor *mc, MDB_val *key, MDB_val *data,
     MDB_cursor_op op)
@@ -7428,6 +8014,24 @@ mdb_cursor_get(MDB_cursor *mc, MDB_val *key, MDB_val *data,
 	if (mc->mc_txn->mt_flags & MDB_TXN_BLOCKED)
 		return MDB_BAD_TXN;
 
+	if (MC_LAZY_STALE(mc)) {
+		switch (op) {
+		case MDB_FIRST:
+		case MDB_LAST:
+		case MDB_SET:
+		case MDB_SET_KEY:
+		case MDB_SET_RANGE:
+		case MDB_GET_BOTH:
+		case MDB_GET_BOTH_RANGE:
+			rc = mdb_cursor_lazy_restore(mc, 0);
+			break;
+		default:
+			rc = mdb_cursor_lazy_restore(mc, 1);
+		}
+		if (rc)
+			return rc;
+	}
+
 	switch (op) {
 	case MDB_GET_CURRENT:
 		if (!(mc->mc_flags & C_INITIALIZED)) {
@@ -7599,6 +8203,9 @@ fetchm:
 	if (mc->mc_flags & C_DEL)
 		mc->mc_flags ^= C_DEL;
 
+	if (mc->mc_flags & C_LAZY)
+		mdb_cursor_lazy_save(mc);
+
 	return rc;
 }
 
@@ -7657,6 +8264,7 @@ _mdb_cursor_put(MDB_cursor *mc, MDB_val *key, MDB_val *data,
 		return EINVAL;
 
 	env = mc->mc_txn->mt_env;
+	env->me_wgen++;
 
 	/* Check this first so counter will always be zero on any
 	 * early failures.
@@ -8172,7 +8780,19 @@ mdb_cursor_put(MDB_cursor *mc, MDB_val *key, MDB_val *data,
 {
 	DKBUF;
 	DDBUF;
-	int rc = _mdb_cursor_put(mc, key, data, flags);
+	int rc;
+
+	if (mc && MC_LAZY_STALE(mc) &&
+		(rc = mdb_cursor_lazy_restore(mc, (flags & MDB_CURRENT) ? 2 : 0)))
+		return rc;
+	if (mc && (mc->mc_flags & C_LAZY)) {
+		/* Fixups after a split or rebalance only reach tracked cursors */
+		WITH_CURSOR_TRACKING(*mc,
+			rc = _mdb_cursor_put(mc, key, data, flags));
+		mdb_cursor_lazy_save(mc);
+	} else {
+		rc = _mdb_cursor_put(mc, key, data, flags);
+	}
 	MDB_TRACE(("%p, %"Z"u[%s], %"Z"u%s, %u",
 		mc, key ? key->mv_size:0, DKEY(key), data ? data->mv_size:0,
 			data ? mdb_dval(mc->mc_txn, mc->mc_dbi, data, dbuf):"", flags));
@@ -8195,6 +8815,8 @@ _mdb_cursor_del(MDB_cursor *mc, unsigned int flags)
 	if (mc->mc_ki[mc->mc_top] >= NUMKEYS(mc->mc_pg[mc->mc_top]))
 		return MDB_NOTFOUND;
 
+	mc->mc_txn->mt_env->me_wgen++;
+
 	if (!(flags & MDB_NOSPILL) && (rc = mdb_page_spill(mc, NULL, NULL)))
 		return rc;
 
@@ -8285,9 +8907,20 @@ fail:
 int
 mdb_cursor_del(MDB_cursor *mc, unsigned int flags)
 {
+	int rc;
+
 	MDB_TRACE(("%p, %u",
 		mc, flags));
-	return _mdb_cursor_del(mc, flags);
+	if (MC_LAZY_STALE(mc) && (rc = mdb_cursor_lazy_restore(mc, 2)))
+		return rc;
+	if (mc->mc_flags & C_LAZY) {
+		WITH_CURSOR_TRACKING(*mc,
+			rc = _mdb_cursor_del(mc, flags));
+		mdb_cursor_lazy_save(mc);
+	} else {
+		rc = _mdb_cursor_del(mc, flags);
+	}
+	return rc;
 }
 
 /** Allocate and initialize new pages for a database.
@@ -8789,6 +9422,47 @@ mdb_cursor_open(MDB_txn *txn, MDB_dbi dbi, MDB_cursor **ret)
 	return MDB_SUCCESS;
 }
 
+int
+mdb_cursor_open_untracked(MDB_txn *txn, MDB_dbi dbi, MDB_cursor **ret)
+{
+	MDB_cursor	*mc;
+	MDB_lazy	*ml;
+	size_t size = sizeof(MDB_cursor), klen;
+
+	if (!ret || !TXN_DBI_EXIST(txn, dbi, DB_VALID))
+		return EINVAL;
+
+	/* Read-only txns do not track cursors anyway */
+	if (!txn->mt_cursors)
+		return mdb_cursor_open(txn, dbi, ret);
+
+	if (txn->mt_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	if (dbi == FREE_DBI)
+		return EINVAL;
+
+	if (txn->mt_dbs[dbi].md_flags & MDB_DUPSORT)
+		size += sizeof(MDB_xcursor);
+
+	/* Room for a key and a dup item, each at most ENV_MAXKEY() */
+	klen = ENV_MAXKEY(txn->mt_env);
+	if ((mc = malloc(size + sizeof(MDB_lazy) + 2 * klen)) == NULL)
+		return ENOMEM;
+	mdb_cursor_init(mc, txn, dbi, (MDB_xcursor *)(mc + 1));
+	mc->mc_flags |= C_LAZY;
+	ml = MC_LAZY(mc);
+	ml->ml_state = ML_NONE;
+	ml->ml_key.mv_data = ml + 1;
+	ml->ml_data.mv_data = (char *)(ml + 1) + klen;
+	mdb_cursor_lazy_save(mc);
+
+	MDB_TRACE(("%p, %u = %p", txn, dbi, mc));
+	*ret = mc;
+
+	return MDB_SUCCESS;
+}
+
 int
 mdb_cursor_renew(MDB_txn *txn, MDB_cursor *mc)
 {
@@ -8820,6 +9494,12 @@ mdb_cursor_count(MDB_cursor *mc, mdb_size_t *countp)
 	if (mc->mc_txn->mt_flags & MDB_TXN_BLOCKED)
 		return MDB_BAD_TXN;
 
+	if (MC_LAZY_STALE(mc)) {
+		int rc = mdb_cursor_lazy_restore(mc, 1);
+		if (rc)
+			return rc;
+	}
+
 	if (!(mc->mc_flags & C_INITIALIZED))
 		return EINVAL;
 
@@ -8957,22 +9637,6 @@ mdb_update_key(MDB_cursor *mc, MDB_val *key)
 static void
 mdb_cursor_copy(const MDB_cursor *csrc, MDB_cursor *cdst);
 
-/** Perform \b act while tracking temporary cursor \b mn */
-#define WITH_CURSOR_TRACKING(mn, act) do { \
-	MDB_cursor dummy, *tracked, **tp = &(mn).mc_txn->mt_cursors[mn.mc_dbi]; \
-	if ((mn).mc_flags & C_SUB) { \
-		dummy.mc_flags =  C_INITIALIZED; \
-		dummy.mc_xcursor = (MDB_xcursor *)&(mn);	\
-		tracked = &dummy; \
-	} else { \
-		tracked = &(mn); \
-	} \
-	tracked->mc_next = *tp; \
-	*tp = tracked; \
-	{ act; } \
-	*tp = tracked->mc_next; \
-} while (0)
-
 /** Move a node from csrc to cdst.
  */
 static int
@@ -9391,6 +10055,8 @@ mdb_rebalance(MDB_cursor *mc)
 	    IS_LEAF(mc->mc_pg[mc->mc_top]) ? "leaf" : "branch",
 	    mdb_dbg_pgno(mc->mc_pg[mc->mc_top]), NUMKEYS(mc->mc_pg[mc->mc_top]),
 		(float)PAGEFILL(mc->mc_txn->mt_env, mc->mc_pg[mc->mc_top]) / 10));
+	MDB_PROBE4(rebalance, DDBI(mc), mc->mc_pg[mc->mc_top]->mp_pgno,
+		NUMKEYS(mc->mc_pg[mc->mc_top]), mc->mc_top);
 
 	if (PAGEFILL(mc->mc_txn->mt_env, mc->mc_pg[mc->mc_top]) >= thresh &&
 		NUMKEYS(mc->mc_pg[mc->mc_top]) >= minkeys) {
@@ -9761,6 +10427,7 @@ mdb_page_split(MDB_cursor *mc, MDB_val *newkey, MDB_val *newdata, pgno_t newpgno
 	DPRINTF(("-----> splitting %s page %"Yu" and adding [%s] at index %i/%i",
 	    IS_LEAF(mp) ? "leaf" : "branch", mp->mp_pgno,
 	    DKEY(newkey), mc->mc_ki[mc->mc_top], nkeys));
+	MDB_PROBE4(page_split, DDBI(mc), mp->mp_pgno, nkeys, mc->mc_top);
 
 	/* Create a right sibling. */
 	if ((rc = mdb_page_new(mc, mp->mp_flags, 1, &rp)))
@@ -10889,8 +11556,9 @@ int mdb_dbi_open(MDB_txn *txn, const char *name, unsigned int flags, MDB_dbi *db
 	MDB_dbi i;
 	MDB_cursor mc;
 	MDB_db dummy;
+	MDB_env *env = txn->mt_env;
 	int rc, dbflag, exact;
-	unsigned int unused = 0, seq;
+	unsigned int unused, seq;
 	char *namedup;
 	size_t len;
 
@@ -10921,21 +11589,28 @@ int mdb_dbi_open(MDB_txn *txn, const char *name, unsigned int flags, MDB_dbi *db
 
 	/* Is the DB already open? */
 	len = strlen(name);
-	for (i=CORE_DBS; i<txn->mt_numdbs; i++) {
-		if (!txn->mt_dbxs[i].md_name.mv_size) {
-			/* Remember this free slot */
-			if (!unused) unused = i;
-			continue;
-		}
-		if (len == txn->mt_dbxs[i].md_name.mv_size &&
-			!strncmp(name, txn->mt_dbxs[i].md_name.mv_data, len)) {
-			*dbi = i;
-			return MDB_SUCCESS;
+	key.mv_size = len;
+	key.mv_data = (void *)name;
+	if ((i = mdb_dbhash_find(env, &key)) != 0) {
+		/* Opened after this txn began, its state is set up lazily.
+		 * The handle is current, unlike ones that existed at begin.
+		 */
+		if (i >= txn->mt_numdbs) {
+			txn->mt_numdbs = i + 1;
+			if (!(txn->mt_flags & MDB_TXN_RDONLY)) {
+				TXN_DBI_FLAGS(txn, i);
+				txn->mt_dbiseqs[i] = env->me_dbiseqs[i];
+			}
 		}
+		*dbi = i;
+		return MDB_SUCCESS;
 	}
 
+	/* Reuse the lowest closed slot, if any */
+	unused = env->me_numfree ? env->me_dbfree[0] : 0;
+
 	/* If no free slot and max hit, fail */
-	if (!unused && txn->mt_numdbs >= txn->mt_env->me_maxdbs)
+	if (!unused && txn->mt_numdbs >= env->me_maxdbs)
 		return MDB_DBS_FULL;
 
 	/* Cannot mix named databases with some mainDB flags */
@@ -10945,8 +11620,6 @@ int mdb_dbi_open(MDB_txn *txn, const char *name, unsigned int flags, MDB_dbi *db
 	/* Find the DB info */
 	dbflag = DB_NEW|DB_VALID|DB_USRVALID;
 	exact = 0;
-	key.mv_size = len;
-	key.mv_data = (void *)name;
 	mdb_cursor_init(&mc, txn, MAIN_DBI, NULL);
 	rc = mdb_cursor_set(&mc, &key, &data, MDB_SET, &exact);
 	if (rc == MDB_SUCCESS) {
@@ -10982,21 +11655,38 @@ int mdb_dbi_open(MDB_txn *txn, const char *name, unsigned int flags, MDB_dbi *db
 	} else {
 		/* Got info, register DBI in this txn */
 		unsigned int slot = unused ? unused : txn->mt_numdbs;
+		if (unused)
+			mdb_dbfree_pop(env);
 		txn->mt_dbxs[slot].md_name.mv_data = namedup;
 		txn->mt_dbxs[slot].md_name.mv_size = len;
 		txn->mt_dbxs[slot].md_rel = NULL;
+		mdb_dbhash_add(env, slot);
+		if (txn->mt_dbstamps[slot] != txn->mt_dbstamp) {
+			mdb_dbi_mark(txn, slot);
+			if (txn->mt_cursors)
+				txn->mt_cursors[slot] = NULL;
+		}
 		txn->mt_dbflags[slot] = dbflag;
 		/* txn-> and env-> are the same in read txns, use
 		 * tmp variable to avoid undefined assignment
 		 */
-		seq = ++txn->mt_env->me_dbiseqs[slot];
+		seq = MDB_DBI_BUMP(env, slot);
 		txn->mt_dbiseqs[slot] = seq;
 
 		memcpy(&txn->mt_dbs[slot], data.mv_data, sizeof(MDB_db));
 		*dbi = slot;
 		mdb_default_cmp(txn, slot);
-		if (!unused) {
-			txn->mt_numdbs++;
+		if (slot >= txn->mt_numdbs) {
+			txn->mt_numdbs = slot + 1;
+		}
+		/* Publish a handle opened by a reader at once, so other read
+		 * txns on its snapshot can use it before it ends. It is still
+		 * closed if this txn aborts.
+		 */
+		if (F_ISSET(txn->mt_flags, MDB_TXN_RDONLY)) {
+			env->me_dbflags[slot] = txn->mt_dbs[slot].md_flags | MDB_VALID;
+			if (env->me_numdbs <= slot)
+				env->me_numdbs = slot + 1;
 		}
 		MDB_TRACE(("%p, %s, %u = %u", txn, name, flags, slot));
 	}
@@ -11022,6 +11712,348 @@ mdb_stat(MDB_txn *txn, MDB_dbi dbi, MDB_stat *arg)
 	return mdb_stat0(txn->mt_env, &txn->mt_dbs[dbi], arg);
 }
 
+/** A subtree waiting to be walked by #mdb_env_walk() */
+typedef struct mdb_walktask {
+	pgno_t		wt_pgno;	/**< root of the subtree */
+	unsigned int	wt_depth;	/**< its depth in its tree */
+	int			wt_flags;	/**< #F_DUPDATA for a sorted-duplicate sub-DB */
+	MDB_dbi		wt_dbi;		/**< DB handle, or ~0 for an unopened named DB */
+	MDB_val		wt_name;	/**< name of a named DB */
+} mdb_walktask;
+
+/** Work queue shared by the threads of #mdb_env_walk() */
+typedef struct mdb_walkq {
+	pthread_mutex_t	wq_mutex;
+	pthread_cond_t	wq_cond;	/**< signalled on new tasks and when idle */
+	mdb_walktask	*wq_tasks;
+	unsigned int	wq_len;		/**< queued tasks */
+	unsigned int	wq_size;	/**< allocated tasks */
+	unsigned int	wq_want;	/**< split subtrees while fewer are queued */
+	int			wq_busy;	/**< threads walking a task */
+	int			wq_error;
+} mdb_walkq;
+
+/** State of one walking thread */
+typedef struct mdb_walker {
+	MDB_cursor	wk_mc;		/**< fetches pages, #mc_dbi is the walked DB */
+	MDB_walk_func	*wk_func;
+	void		*wk_ctx;
+	mdb_walkq	*wk_q;		/**< queue of a parallel walk, or NULL */
+	MDB_val		wk_name;	/**< name of the walked DB */
+	int			wk_env;		/**< walk the named DBs found in the main DB too */
+	int			wk_thread;	/**< index of this thread */
+} mdb_walker;
+
+static int mdb_walk0(mdb_walker *wk, mdb_walktask *wt);
+
+#ifndef _WIN32
+/** Queue a subtree for another thread.
+ * @param[in] q the queue.
+ * @param[in] wt the subtree.
+ * @param[in] force queue it even if enough work is queued.
+ * @return 1 if queued, 0 if the caller should walk it itself.
+ */
+static int
+mdb_walk_push(mdb_walkq *q, mdb_walktask *wt, int force)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&q->wq_mutex);
+	if (force || q->wq_len < q->wq_want) {
+		if (q->wq_len == q->wq_size) {
+			unsigned int size = q->wq_size ? q->wq_size * 2 : 64;
+			mdb_walktask *tasks = realloc(q->wq_tasks, size * sizeof(mdb_walktask));
+			if (!tasks)
+				goto done;
+			q->wq_tasks = tasks;
+			q->wq_size = size;
+		}
+		q->wq_tasks[q->wq_len++] = *wt;
+		pthread_cond_signal(&q->wq_cond);
+		rc = 1;
+	}
+done:
+	pthread_mutex_unlock(&q->wq_mutex);
+	return rc;
+}
+
+	/** Worker thread of #mdb_env_walk(). */
+static THREAD_RET ESECT CALL_CONV
+mdb_walk_thread(void *arg)
+{
+	mdb_walker *wk = arg;
+	mdb_walkq *q = wk->wk_q;
+	mdb_walktask wt;
+	int rc;
+
+	pthread_mutex_lock(&q->wq_mutex);
+	for (;;) {
+		while (!q->wq_len && q->wq_busy && !q->wq_error)
+			pthread_cond_wait(&q->wq_cond, &q->wq_mutex);
+		/* Done when nothing is queued and nobody can queue more */
+		if (!q->wq_len || q->wq_error)
+			break;
+		wt = q->wq_tasks[--q->wq_len];
+		q->wq_busy++;
+		pthread_mutex_unlock(&q->wq_mutex);
+		rc = mdb_walk0(wk, &wt);
+		pthread_mutex_lock(&q->wq_mutex);
+		q->wq_busy--;
+		if (rc && !q->wq_error)
+			q->wq_error = rc;
+		if (!q->wq_busy || rc)
+			pthread_cond_broadcast(&q->wq_cond);
+	}
+	pthread_mutex_unlock(&q->wq_mutex);
+	return (THREAD_RET)0;
+}
+#endif
+
+/** Find the handle of a named DB, if it is open in the environment.
+ * @return the handle, or ~0.
+ */
+static MDB_dbi
+mdb_walk_dbi(MDB_env *env, MDB_val *name)
+{
+	MDB_dbi i = mdb_dbhash_find(env, name);
+
+	return (i && i < env->me_numdbs) ? i : (MDB_dbi)~0;
+}
+
+/** Report a page and everything below it to a walk callback.
+ * Subtrees may be handed to other threads of a parallel walk, so
+ * pages are not always reported after their children there.
+ * @param[in] wk the walking thread.
+ * @param[in] wt the page to walk.
+ * @return 0 on success, non-zero on failure.
+ */
+static int
+mdb_walk0(mdb_walker *wk, mdb_walktask *wt)
+{
+	MDB_cursor *mc = &wk->wk_mc;
+	MDB_env *env = mc->mc_txn->mt_env;
+	MDB_walkpage wp = {0};
+	MDB_page *mp, *omp;
+	MDB_node *ni;
+	mdb_walktask sub;
+	unsigned int i, n;
+	pgno_t pg;
+	int rc;
+
+	if (wt->wt_depth >= CURSOR_STACK)
+		return MDB_CORRUPTED;
+	mc->mc_dbi = wt->wt_dbi;
+	wk->wk_name = wt->wt_name;
+	rc = mdb_page_get(mc, wt->wt_pgno, &mp, NULL);
+	if (rc)
+		return rc;
+	n = NUMKEYS(mp);
+
+	if (IS_BRANCH(mp)) {
+		sub = *wt;
+		sub.wt_depth++;
+		for (i=0; i<n; i++) {
+			sub.wt_pgno = NODEPGNO(NODEPTR(mp, i));
+#ifndef _WIN32
+			if (wk->wk_q && mdb_walk_push(wk->wk_q, &sub, 0))
+				continue;
+#endif
+			rc = mdb_walk0(wk, &sub);
+			if (rc)
+				return rc;
+		}
+	} else if (!IS_LEAF2(mp)) {
+		for (i=0; i<n; i++) {
+			ni = NODEPTR(mp, i);
+			if (ni->mn_flags & F_BIGDATA) {
+				MDB_walkpage ow = {0};
+				memcpy(&pg, NODEDATA(ni), sizeof(pg));
+				rc = mdb_page_get(mc, pg, &omp, NULL);
+				if (rc)
+					return rc;
+				wp.mw_bigdata++;
+				ow.mw_pgno = pg;
+				ow.mw_dbi = wt->wt_dbi;
+				ow.mw_name = wt->wt_name;
+				ow.mw_thread = wk->wk_thread;
+				ow.mw_type = MDB_WALK_OVERFLOW;
+				ow.mw_depth = wt->wt_depth+1;
+				ow.mw_subdb = (wt->wt_flags & F_DUPDATA) != 0;
+				ow.mw_pages = omp->mp_pages;
+				ow.mw_nkeys = 1;
+				ow.mw_used = PAGEHDRSZ + NODEDSZ(ni);
+				ow.mw_size = (size_t)omp->mp_pages * env->me_psize;
+				rc = wk->wk_func(&ow, wk->wk_ctx);
+			} else if (ni->mn_flags & F_SUBDATA) {
+				MDB_db db;
+				memcpy(&db, NODEDATA(ni), sizeof(db));
+				sub.wt_pgno = db.md_root;
+				sub.wt_depth = 0;
+				if (ni->mn_flags & F_DUPDATA) {
+					wp.mw_subdbs++;
+					sub.wt_flags = F_DUPDATA;
+					sub.wt_dbi = wt->wt_dbi;
+					sub.wt_name = wt->wt_name;
+				} else if (wk->wk_env) {
+					/* A named DB, it is not part of the main DB's tree */
+					sub.wt_flags = 0;
+					sub.wt_name.mv_size = NODEKSZ(ni);
+					sub.wt_name.mv_data = NODEKEY(ni);
+					sub.wt_dbi = mdb_walk_dbi(env, &sub.wt_name);
+				} else {
+					continue;
+				}
+				if (db.md_root == P_INVALID)
+					continue;
+#ifndef _WIN32
+				if (wk->wk_q && mdb_walk_push(wk->wk_q, &sub, !(ni->mn_flags & F_DUPDATA)))
+					continue;
+#endif
+				rc = mdb_walk0(wk, &sub);
+				mc->mc_dbi = wt->wt_dbi;
+				wk->wk_name = wt->wt_name;
+			} else if (ni->mn_flags & F_DUPDATA) {
+				wp.mw_subpages++;
+				wp.mw_subpage_used += NODEDSZ(ni);
+			}
+			if (rc)
+				return rc;
+		}
+	}
+
+	wp.mw_pgno = wt->wt_pgno;
+	wp.mw_dbi = wt->wt_dbi;
+	wp.mw_name = wt->wt_name;
+	wp.mw_thread = wk->wk_thread;
+	wp.mw_type = IS_BRANCH(mp) ? MDB_WALK_BRANCH :
+		IS_LEAF2(mp) ? MDB_WALK_LEAF2 : MDB_WALK_LEAF;
+	wp.mw_depth = wt->wt_depth;
+	wp.mw_subdb = (wt->wt_flags & F_DUPDATA) != 0;
+	wp.mw_pages = 1;
+	wp.mw_nkeys = n;
+	wp.mw_size = env->me_psize;
+	wp.mw_used = env->me_psize - SIZELEFT(mp);
+	if (IS_LEAF2(mp))
+		wp.mw_used = PAGEHDRSZ + n * mp->mp_pad;
+	return wk->wk_func(&wp, wk->wk_ctx);
+}
+
+int ESECT
+mdb_dbi_walk(MDB_txn *txn, MDB_dbi dbi, MDB_walk_func *func, void *ctx)
+{
+	mdb_walker wk;
+	mdb_walktask wt = {0};
+	MDB_xcursor mx;
+
+	if (!func || !TXN_DBI_EXIST(txn, dbi, DB_VALID))
+		return EINVAL;
+
+	if (txn->mt_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	memset(&wk, 0, sizeof(wk));
+	/* cursor_init also reads the root of a stale DB */
+	mdb_cursor_init(&wk.wk_mc, txn, dbi, &mx);
+	if (txn->mt_dbs[dbi].md_root == P_INVALID)
+		return MDB_SUCCESS;
+	wk.wk_func = func;
+	wk.wk_ctx = ctx;
+	wt.wt_pgno = txn->mt_dbs[dbi].md_root;
+	wt.wt_dbi = dbi;
+	if (dbi >= CORE_DBS)
+		wt.wt_name = txn->mt_dbxs[dbi].md_name;
+	return mdb_walk0(&wk, &wt);
+}
+
+int ESECT
+mdb_env_walk(MDB_env *env, MDB_txn *txn, MDB_walk_func *func, void *ctx, int nthreads)
+{
+	mdb_walker *wk;
+	mdb_walktask wt = {0};
+	MDB_dbi dbi;
+	int i, rc;
+
+	if (!env || !txn || txn->mt_env != env || !func)
+		return EINVAL;
+
+	if (txn->mt_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+#ifdef _WIN32
+	/* Windows events lack broadcast, walk in the caller's thread */
+	nthreads = 1;
+#endif
+	if (nthreads < 1)
+		nthreads = 1;
+	wk = calloc(nthreads, sizeof(mdb_walker));
+	if (!wk)
+		return ENOMEM;
+	for (i=0; i<nthreads; i++) {
+		wk[i].wk_mc.mc_txn = txn;
+		wk[i].wk_mc.mc_flags = txn->mt_flags & (C_ORIG_RDONLY|C_WRITEMAP);
+		wk[i].wk_func = func;
+		wk[i].wk_ctx = ctx;
+		wk[i].wk_env = 1;
+		wk[i].wk_thread = i;
+	}
+
+	if (nthreads == 1) {
+		for (dbi=0, rc=0; dbi<CORE_DBS && !rc; dbi++) {
+			if (txn->mt_dbs[dbi].md_root == P_INVALID)
+				continue;
+			wt.wt_pgno = txn->mt_dbs[dbi].md_root;
+			wt.wt_dbi = dbi;
+			rc = mdb_walk0(wk, &wt);
+		}
+	}
+#ifndef _WIN32
+	else {
+		mdb_walkq q = {0};
+		pthread_t *thr;
+
+		if ((rc = pthread_mutex_init(&q.wq_mutex, NULL)) != 0)
+			goto done;
+		if ((rc = pthread_cond_init(&q.wq_cond, NULL)) != 0) {
+			pthread_mutex_destroy(&q.wq_mutex);
+			goto done;
+		}
+		/* Keep a few subtrees queued per thread, so none stays idle */
+		q.wq_want = nthreads * 4;
+		for (dbi=0; dbi<CORE_DBS; dbi++) {
+			if (txn->mt_dbs[dbi].md_root == P_INVALID)
+				continue;
+			wt.wt_pgno = txn->mt_dbs[dbi].md_root;
+			wt.wt_dbi = dbi;
+			if (!mdb_walk_push(&q, &wt, 1))
+				q.wq_error = ENOMEM;
+		}
+		thr = malloc(nthreads * sizeof(pthread_t));
+		if (!thr)
+			q.wq_error = ENOMEM;
+		for (i=0; thr && i<nthreads; i++) {
+			wk[i].wk_q = &q;
+			if ((rc = THREAD_CREATE(thr[i], mdb_walk_thread, &wk[i])) != 0) {
+				pthread_mutex_lock(&q.wq_mutex);
+				q.wq_error = rc;
+				pthread_cond_broadcast(&q.wq_cond);
+				pthread_mutex_unlock(&q.wq_mutex);
+				break;
+			}
+		}
+		while (--i >= 0)
+			THREAD_FINISH(thr[i]);
+		rc = q.wq_error;
+		free(thr);
+		free(q.wq_tasks);
+		pthread_cond_destroy(&q.wq_cond);
+		pthread_mutex_destroy(&q.wq_mutex);
+	}
+done:
+#endif
+	free(wk);
+	return rc;
+}
+
 void mdb_dbi_close(MDB_env *env, MDB_dbi dbi)
 {
 	char *ptr;
@@ -11031,10 +12063,11 @@ void mdb_dbi_close(MDB_env *env, MDB_dbi dbi)
 	/* If there was no name, this was already closed */
 	if (ptr) {
 		MDB_TRACE(("%p, %u", env, dbi));
+		mdb_dbi_release(env, dbi);
 		env->me_dbxs[dbi].md_name.mv_data = NULL;
 		env->me_dbxs[dbi].md_name.mv_size = 0;
 		env->me_dbflags[dbi] = 0;
-		env->me_dbiseqs[dbi]++;
+		MDB_DBI_BUMP(env, dbi);
 		free(ptr);
 	}
 }
@@ -11048,6 +12081,20 @@ int mdb_dbi_flags(MDB_txn *txn, MDB_dbi dbi, unsigned int *flags)
 	return MDB_SUCCESS;
 }
 
+int mdb_dbi_dirty(MDB_txn *txn, MDB_dbi dbi, int *dirty)
+{
+	if (!dirty || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
+		return EINVAL;
+	if (F_ISSET(txn->mt_flags, MDB_TXN_RDONLY))
+		*dirty = 0;
+	else if (dbi < CORE_DBS)
+		*dirty = txn->mt_u.dirty_list[0].mid ||
+			(txn->mt_flags & (MDB_TXN_DIRTY|MDB_TXN_SPILLS));
+	else
+		*dirty = (txn->mt_dbflags[dbi] & DB_DIRTY) != 0;
+	return MDB_SUCCESS;
+}
+
 /** Add all the DB's pages to the free list.
  * @param[in] mc Cursor on the DB to free.
  * @param[in] subs non-Zero to check for sub-DBs in this DB.
@@ -11173,6 +12220,7 @@ int mdb_drop(MDB_txn *txn, MDB_dbi dbi, int del)
 		return rc;
 
 	MDB_TRACE(("%u, %d", dbi, del));
+	txn->mt_env->me_wgen++;
 	rc = mdb_drop0(mc, mc->mc_db->md_flags & MDB_DUPSORT);
 	/* Invalidate the dropped DB's cursors */
 	for (m2 = txn->mt_cursors[dbi]; m2; m2 = m2->mc_next)
@@ -11206,6 +12254,61 @@ leave:
 	return rc;
 }
 
+int mdb_dbi_swap(MDB_txn *txn, MDB_dbi a, MDB_dbi b)
+{
+	MDB_cursor *m2;
+	MDB_db db;
+	MDB_dbi dbi[2];
+	int i;
+
+	if (a < CORE_DBS || b < CORE_DBS ||
+		!TXN_DBI_EXIST(txn, a, DB_USRVALID) || !TXN_DBI_EXIST(txn, b, DB_USRVALID))
+		return EINVAL;
+
+	if (F_ISSET(txn->mt_flags, MDB_TXN_RDONLY))
+		return EACCES;
+
+	if (txn->mt_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	if (TXN_DBI_CHANGED(txn, a) || TXN_DBI_CHANGED(txn, b))
+		return MDB_BAD_DBI;
+
+	if (a == b)
+		return MDB_SUCCESS;
+
+	dbi[0] = a;
+	dbi[1] = b;
+	for (i=0; i<2; i++) {
+		if (txn->mt_dbflags[dbi[i]] & DB_STALE) {
+			MDB_cursor mc;
+			MDB_xcursor mx;
+			/* Stale, must read the DB's root. cursor_init does it for us. */
+			mdb_cursor_init(&mc, txn, dbi[i], &mx);
+		}
+	}
+	if ((txn->mt_dbs[a].md_flags ^ txn->mt_dbs[b].md_flags) & PERSISTENT_FLAGS)
+		return MDB_INCOMPATIBLE;
+
+	MDB_TRACE(("%u, %u", a, b));
+	txn->mt_env->me_wgen++;
+	db = txn->mt_dbs[a];
+	txn->mt_dbs[a] = txn->mt_dbs[b];
+	txn->mt_dbs[b] = db;
+
+	/* The records are written to the main DB at commit */
+	for (i=0; i<2; i++) {
+		txn->mt_dbflags[dbi[i]] |= DB_DIRTY;
+		for (m2 = txn->mt_cursors[dbi[i]]; m2; m2 = m2->mc_next) {
+			m2->mc_flags &= ~(C_INITIALIZED|C_EOF);
+			if (m2->mc_xcursor)
+				m2->mc_xcursor->mx_cursor.mc_flags &= ~(C_INITIALIZED|C_EOF);
+		}
+	}
+	txn->mt_flags |= MDB_TXN_DIRTY;
+	return MDB_SUCCESS;
+}
+
 int mdb_set_compare(MDB_txn *txn, MDB_dbi dbi, MDB_cmp_func *cmp)
 {
 	if (!TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
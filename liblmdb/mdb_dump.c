@@ -18,11 +18,14 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
 #include "lmdb.h"
 
 #define Yu	MDB_PRIy(u)
 
 #define PRINT	1
+#define BINARY	2
+#define CHECKSUM	4
 static int mode;
 
 typedef struct flagbit {
@@ -89,6 +92,288 @@ static void byte(MDB_val *v)
 	putchar('\n');
 }
 
+/*	Binary format, see also mdb_load.c:
+ *
+ *	file:	"MDBDUMPB" u32 version u32 flags u64 mapsize
+ *		u32 maxreaders u32 psize u32 nstreams, then records
+ *	record:	u8 type u8 pad[3] u32 stream u32 len u32 crc, payload[len]
+ *
+ *	All integers are little-endian. Every DB is one stream, its 'H'
+ *	record (u32 flags, name) precedes any of its 'D' blocks, which
+ *	hold varint klen, varint dlen, key, data for each record in
+ *	cursor order. 'E' (u64 count) closes a stream and 'Z' the file.
+ *	The crc is a CRC-32 of the payload, or 0 without -c.
+ */
+#define BMAGIC	"MDBDUMPB"
+#define BVERSION	1
+#define BF_CRC	1
+#define BHDRSIZE	16
+#define BBLOCK	(1024*1024)
+
+typedef struct bstream {
+	MDB_cursor *mc;
+	unsigned int id;
+	unsigned int flags;
+	char *name;
+	int rc;
+} bstream;
+
+static bstream *bstreams;
+static unsigned int nbstreams, bnext;
+static pthread_mutex_t bmutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int crctab[256];
+
+static void crcinit(void)
+{
+	unsigned int c;
+	int i, j;
+
+	for (i=0; i<256; i++) {
+		c = i;
+		for (j=0; j<8; j++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crctab[i] = c;
+	}
+}
+
+static unsigned int crc32(const unsigned char *p, size_t len)
+{
+	unsigned int c = 0xffffffff;
+
+	while (len--)
+		c = crctab[(c ^ *p++) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffff;
+}
+
+static unsigned char *put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+	return p + 4;
+}
+
+static unsigned char *put64(unsigned char *p, mdb_size_t v)
+{
+	p = put32(p, (unsigned int)(v & 0xffffffff));
+	return put32(p, (unsigned int)((unsigned long long)v >> 32));
+}
+
+static unsigned char *putvar(unsigned char *p, size_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/* Write one record. buf has BHDRSIZE bytes of room before the payload.
+ * Records from concurrent streams are serialized on bmutex.
+ */
+static int bwrite(int type, unsigned int stream, unsigned char *buf, size_t len)
+{
+	unsigned char *p = buf;
+	int rc = MDB_SUCCESS;
+
+	*p++ = type; *p++ = 0; *p++ = 0; *p++ = 0;
+	p = put32(p, stream);
+	p = put32(p, (unsigned int)len);
+	put32(p, mode & CHECKSUM ? crc32(buf + BHDRSIZE, len) : 0);
+
+	pthread_mutex_lock(&bmutex);
+	if (fwrite(buf, 1, BHDRSIZE + len, stdout) != BHDRSIZE + len)
+		rc = errno ? errno : EIO;
+	pthread_mutex_unlock(&bmutex);
+	return rc;
+}
+
+static int bheader(MDB_env *env, MDB_stat *ms)
+{
+	unsigned char buf[36], *p = buf;
+	MDB_envinfo info;
+	int rc;
+
+	rc = mdb_env_info(env, &info);
+	if (rc) return rc;
+
+	memcpy(p, BMAGIC, 8); p += 8;
+	p = put32(p, BVERSION);
+	p = put32(p, mode & CHECKSUM ? BF_CRC : 0);
+	p = put64(p, info.me_mapsize);
+	p = put32(p, info.me_maxreaders);
+	p = put32(p, ms->ms_psize);
+	p = put32(p, nbstreams);
+	if (fwrite(buf, 1, p - buf, stdout) != (size_t)(p - buf))
+		return errno ? errno : EIO;
+	return MDB_SUCCESS;
+}
+
+static int bdumpdesc(bstream *bs)
+{
+	size_t len = bs->name ? strlen(bs->name) : 0;
+	unsigned char *buf = malloc(BHDRSIZE + 4 + len);
+	int rc;
+
+	if (!buf)
+		return ENOMEM;
+	put32(buf + BHDRSIZE, bs->flags);
+	if (len)
+		memcpy(buf + BHDRSIZE + 4, bs->name, len);
+	rc = bwrite('H', bs->id, buf, 4 + len);
+	free(buf);
+	return rc;
+}
+
+/* Dump one stream in blocks of about BBLOCK bytes */
+static int bdumpit(bstream *bs)
+{
+	MDB_val key, data;
+	unsigned char *buf, *p, *end;
+	size_t size = BHDRSIZE + BBLOCK, need;
+	mdb_size_t count = 0;
+	int rc;
+
+	buf = malloc(size);
+	if (!buf)
+		return ENOMEM;
+	p = buf + BHDRSIZE;
+	end = buf + size;
+
+	while ((rc = mdb_cursor_get(bs->mc, &key, &data, MDB_NEXT)) == MDB_SUCCESS) {
+		if (gotsig) {
+			rc = EINTR;
+			break;
+		}
+		need = 20 + key.mv_size + data.mv_size;
+		if (p + need > end && p > buf + BHDRSIZE) {
+			rc = bwrite('D', bs->id, buf, p - buf - BHDRSIZE);
+			if (rc)
+				break;
+			p = buf + BHDRSIZE;
+		}
+		if (p + need > end) {
+			/* a single record larger than a block */
+			size_t off = p - buf;
+			unsigned char *nbuf = realloc(buf, BHDRSIZE + need);
+			if (!nbuf) {
+				rc = ENOMEM;
+				break;
+			}
+			buf = nbuf;
+			p = buf + off;
+			end = buf + BHDRSIZE + need;
+		}
+		p = putvar(p, key.mv_size);
+		p = putvar(p, data.mv_size);
+		memcpy(p, key.mv_data, key.mv_size);
+		p += key.mv_size;
+		memcpy(p, data.mv_data, data.mv_size);
+		p += data.mv_size;
+		count++;
+	}
+	if (rc == MDB_NOTFOUND) {
+		rc = MDB_SUCCESS;
+		if (p > buf + BHDRSIZE)
+			rc = bwrite('D', bs->id, buf, p - buf - BHDRSIZE);
+		if (!rc) {
+			put64(buf + BHDRSIZE, count);
+			rc = bwrite('E', bs->id, buf, 8);
+		}
+	}
+	free(buf);
+	return rc;
+}
+
+static void *bdump_thread(void *arg)
+{
+	unsigned int i;
+
+	for (;;) {
+		pthread_mutex_lock(&bmutex);
+		i = bnext++;
+		pthread_mutex_unlock(&bmutex);
+		if (i >= nbstreams)
+			break;
+		bstreams[i].rc = bdumpit(&bstreams[i]);
+	}
+	return NULL;
+}
+
+/* Add a DB to the binary dump. The cursor is opened here, in the
+ * main thread, so that the workers only ever read through their
+ * own cursors and never touch the shared read-only txn itself.
+ */
+static int badd(MDB_txn *txn, MDB_dbi dbi, char *name)
+{
+	bstream *bs;
+	int rc;
+
+	bs = realloc(bstreams, (nbstreams + 1) * sizeof(bstream));
+	if (!bs)
+		return ENOMEM;
+	bstreams = bs;
+	bs += nbstreams;
+	memset(bs, 0, sizeof(*bs));
+	rc = mdb_dbi_flags(txn, dbi, &bs->flags);
+	if (rc) return rc;
+	rc = mdb_cursor_open(txn, dbi, &bs->mc);
+	if (rc) return rc;
+	if (name && !(bs->name = strdup(name))) {
+		mdb_cursor_close(bs->mc);
+		return ENOMEM;
+	}
+	bs->id = nbstreams++;
+	return MDB_SUCCESS;
+}
+
+/* Dump all added DBs from one snapshot, using up to nthreads workers */
+static int bdumpall(MDB_txn *txn, int nthreads)
+{
+	pthread_t *tids;
+	MDB_stat ms;
+	unsigned int i;
+	int n, rc;
+
+	rc = mdb_env_stat(mdb_txn_env(txn), &ms);
+	if (rc) return rc;
+	if (mode & CHECKSUM)
+		crcinit();
+	rc = bheader(mdb_txn_env(txn), &ms);
+	for (i=0; !rc && i<nbstreams; i++)
+		rc = bdumpdesc(&bstreams[i]);
+	if (rc) return rc;
+
+	if (nthreads > (int)nbstreams)
+		nthreads = nbstreams;
+	tids = malloc(nthreads * sizeof(pthread_t));
+	if (!tids)
+		return ENOMEM;
+	for (n=0; n<nthreads; n++) {
+		if (pthread_create(&tids[n], NULL, bdump_thread, NULL))
+			break;
+	}
+	if (!n)
+		bdump_thread(NULL);
+	while (n--)
+		pthread_join(tids[n], NULL);
+	free(tids);
+
+	for (i=0; i<nbstreams; i++) {
+		if (!rc)
+			rc = bstreams[i].rc;
+		mdb_cursor_close(bstreams[i].mc);
+		free(bstreams[i].name);
+	}
+	free(bstreams);
+	if (!rc) {
+		unsigned char buf[BHDRSIZE];
+		rc = bwrite('Z', 0, buf, 0);
+	}
+	if (!rc && fflush(stdout))
+		rc = errno ? errno : EIO;
+	return rc;
+}
+
 /* Dump in BDB-compatible format */
 static int dumpit(MDB_txn *txn, MDB_dbi dbi, char *name)
 {
@@ -153,7 +438,7 @@ static int dumpit(MDB_txn *txn, MDB_dbi dbi, char *name)
 
 static void usage(char *prog)
 {
-	fprintf(stderr, "usage: %s [-V] [-f output] [-l] [-n] [-p] [-v] [-a|-s subdb] dbpath\n", prog);
+	fprintf(stderr, "usage: %s [-V] [-f output] [-l] [-n] [-p] [-v] [-b [-c] [-j threads]] [-a|-s subdb] dbpath\n", prog);
 	exit(EXIT_FAILURE);
 }
 
@@ -167,6 +452,7 @@ int main(int argc, char *argv[])
 	char *envname;
 	char *subname = NULL;
 	int alldbs = 0, envflags = 0, list = 0;
+	int nthreads = 4;
 
 	if (argc < 2) {
 		usage(prog);
@@ -178,10 +464,13 @@ int main(int argc, char *argv[])
 	 * -p: use printable characters
 	 * -f: write to file instead of stdout
 	 * -v: use previous snapshot
+	 * -b: use binary format
+	 * -c: checksum binary blocks
+	 * -j: number of binary dump threads
 	 * -V: print version and exit
 	 * (default) dump only the main DB
 	 */
-	while ((i = getopt(argc, argv, "af:lnps:vV")) != EOF) {
+	while ((i = getopt(argc, argv, "abcf:j:lnps:vV")) != EOF) {
 		switch(i) {
 		case 'V':
 			printf("%s\n", MDB_VERSION_STRING);
@@ -211,6 +500,17 @@ int main(int argc, char *argv[])
 		case 'p':
 			mode |= PRINT;
 			break;
+		case 'b':
+			mode |= BINARY;
+			break;
+		case 'c':
+			mode |= CHECKSUM;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1)
+				usage(prog);
+			break;
 		case 's':
 			if (alldbs)
 				usage(prog);
@@ -223,6 +523,8 @@ int main(int argc, char *argv[])
 
 	if (optind != argc - 1)
 		usage(prog);
+	if ((mode & (BINARY|PRINT)) == (BINARY|PRINT))
+		usage(prog);
 
 #ifdef SIGPIPE
 	signal(SIGPIPE, dumpsig);
@@ -241,7 +543,8 @@ int main(int argc, char *argv[])
 	}
 
 	if (alldbs || subname) {
-		mdb_env_set_maxdbs(env, 2);
+		/* binary dumps keep every DB open at once */
+		mdb_env_set_maxdbs(env, mode & BINARY ? 32767 : 2);
 	}
 
 	rc = mdb_env_open(env, envname, envflags | MDB_RDONLY, 0664);
@@ -286,6 +589,12 @@ int main(int argc, char *argv[])
 				if (list) {
 					printf("%s\n", str);
 					list++;
+				} else if (mode & BINARY) {
+					rc = badd(txn, db2, str);
+					free(str);
+					if (rc)
+						break;
+					continue;
 				} else {
 					rc = dumpit(txn, db2, str);
 					if (rc)
@@ -302,7 +611,13 @@ int main(int argc, char *argv[])
 			rc = MDB_NOTFOUND;
 		} else if (rc == MDB_NOTFOUND) {
 			rc = MDB_SUCCESS;
+			if ((mode & BINARY) && !list)
+				rc = bdumpall(txn, nthreads);
 		}
+	} else if (mode & BINARY) {
+		rc = badd(txn, dbi, subname);
+		if (!rc)
+			rc = bdumpall(txn, 1);
 	} else {
 		rc = dumpit(txn, dbi, subname);
 	}
@@ -21,6 +21,7 @@
 
 #define PRINT	1
 #define NOHDR	2
+#define BINARY	4
 static int mode;
 
 static char *subname = NULL;
@@ -276,10 +277,337 @@ badend:
 
 static void usage(void)
 {
-	fprintf(stderr, "usage: %s [-V] [-a] [-f input] [-n] [-s name] [-N] [-T] dbpath\n", prog);
+	fprintf(stderr, "usage: %s [-V] [-a] [-b [-B batch]] [-f input] [-n] [-s name] [-N] [-T] dbpath\n", prog);
 	exit(EXIT_FAILURE);
 }
 
+/* Binary format written by mdb_dump -b, see mdb_dump.c */
+#define BMAGIC	"MDBDUMPB"
+#define BVERSION	1
+#define BF_CRC	1
+#define BHDRSIZE	16
+
+typedef struct bstream {
+	MDB_dbi dbi;
+	MDB_cursor *mc;
+	unsigned int flags;
+	int append;
+	int done;
+	MDB_val prevk;
+	mdb_size_t count;
+} bstream;
+
+static mdb_size_t boffset;
+static unsigned int crctab[256];
+
+static void crcinit(void)
+{
+	unsigned int c;
+	int i, j;
+
+	for (i=0; i<256; i++) {
+		c = i;
+		for (j=0; j<8; j++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crctab[i] = c;
+	}
+}
+
+static unsigned int crc32(const unsigned char *p, size_t len)
+{
+	unsigned int c = 0xffffffff;
+
+	while (len--)
+		c = crctab[(c ^ *p++) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffff;
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static mdb_size_t get64(const unsigned char *p)
+{
+	return get32(p) | (mdb_size_t)((unsigned long long)get32(p + 4) << 32);
+}
+
+static int getvar(unsigned char **pp, unsigned char *end, size_t *v)
+{
+	unsigned char *p = *pp;
+	int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (size_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*pp = p;
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+static int bread(void *buf, size_t len)
+{
+	if (fread(buf, 1, len, stdin) != len) {
+		fprintf(stderr, "%s: offset %"Yu": unexpected end of input\n",
+			prog, boffset);
+		return EOF;
+	}
+	boffset += len;
+	return 0;
+}
+
+/* Reopen the cursors of all unfinished streams in a new txn */
+static int bcursors(MDB_txn *txn, bstream *bs, unsigned int n)
+{
+	MDB_val k, d;
+	unsigned int i;
+	int rc;
+
+	for (i=0; i<n; i++) {
+		if (!bs[i].mc)
+			continue;
+		rc = mdb_cursor_open(txn, bs[i].dbi, &bs[i].mc);
+		if (rc) {
+			fprintf(stderr, "mdb_cursor_open failed, error %d %s\n", rc, mdb_strerror(rc));
+			return rc;
+		}
+		/* MDB_CURRENT|MDB_APPENDDUP needs a positioned cursor */
+		if (bs[i].append && (bs[i].flags & MDB_DUPSORT))
+			mdb_cursor_get(bs[i].mc, &k, &d, MDB_LAST);
+	}
+	return MDB_SUCCESS;
+}
+
+/* Load a binary dump. Records of each stream arrive in cursor order,
+ * so empty DBs are filled with MDB_APPEND/MDB_APPENDDUP, and commits
+ * happen only every batch records.
+ */
+static int bload(MDB_env *env, char *envname, int envflags, int putflags, mdb_size_t batch)
+{
+	unsigned char hdr[36], *buf = NULL, *p, *end;
+	size_t size = 0, len;
+	unsigned int i, bflags, nstreams, id;
+	bstream *bs;
+	MDB_txn *txn = NULL;
+	MDB_val key, data;
+	mdb_size_t pending = 0;
+	int rc, type;
+
+	if (bread(hdr, sizeof(hdr)))
+		return EIO;
+	if (memcmp(hdr, BMAGIC, 8) || get32(hdr + 8) > BVERSION) {
+		fprintf(stderr, "%s: unsupported binary dump\n", prog);
+		return EINVAL;
+	}
+	bflags = get32(hdr + 12);
+	info.me_mapsize = get64(hdr + 16);
+	info.me_maxreaders = get32(hdr + 24);
+	nstreams = get32(hdr + 32);
+	if (subname && nstreams > 1) {
+		fprintf(stderr, "%s: -s needs a dump of a single database\n", prog);
+		return EINVAL;
+	}
+	if (bflags & BF_CRC)
+		crcinit();
+
+	if (info.me_maxreaders)
+		mdb_env_set_maxreaders(env, info.me_maxreaders);
+	if (info.me_mapsize)
+		mdb_env_set_mapsize(env, info.me_mapsize);
+	mdb_env_set_maxdbs(env, nstreams + 1);
+	rc = mdb_env_open(env, envname, envflags, 0664);
+	if (rc) {
+		fprintf(stderr, "mdb_env_open failed, error %d %s\n", rc, mdb_strerror(rc));
+		return rc;
+	}
+
+	bs = calloc(nstreams ? nstreams : 1, sizeof(bstream));
+	if (!bs)
+		return ENOMEM;
+	rc = mdb_txn_begin(env, NULL, 0, &txn);
+	if (rc) {
+		fprintf(stderr, "mdb_txn_begin failed, error %d %s\n", rc, mdb_strerror(rc));
+		goto leave;
+	}
+
+	for (;;) {
+		if (bread(hdr, BHDRSIZE)) {
+			rc = EIO;
+			break;
+		}
+		type = hdr[0];
+		id = get32(hdr + 4);
+		len = get32(hdr + 8);
+		if (type == 'Z')
+			break;
+		if (id >= nstreams) {
+			fprintf(stderr, "%s: offset %"Yu": invalid stream %u\n", prog, boffset, id);
+			rc = EINVAL;
+			break;
+		}
+		if (len > size) {
+			free(buf);
+			size = len;
+			buf = malloc(size);
+			if (!buf) {
+				rc = ENOMEM;
+				break;
+			}
+		}
+		if (len && bread(buf, len)) {
+			rc = EIO;
+			break;
+		}
+		if ((bflags & BF_CRC) && crc32(buf, len) != get32(hdr + 12)) {
+			fprintf(stderr, "%s: offset %"Yu": checksum mismatch\n", prog, boffset - len);
+			rc = EINVAL;
+			break;
+		}
+		p = buf;
+		end = buf + len;
+
+		if (type == 'H') {
+			MDB_stat ms;
+			char *name = NULL;
+			if (len < 4) {
+				rc = EINVAL;
+				break;
+			}
+			bs[id].flags = get32(p);
+			if (len > 4) {
+				name = malloc(len - 4 + 1);
+				if (!name) {
+					rc = ENOMEM;
+					break;
+				}
+				memcpy(name, p + 4, len - 4);
+				name[len - 4] = '\0';
+			}
+			rc = mdb_dbi_open(txn, subname ? subname : name, bs[id].flags|MDB_CREATE, &bs[id].dbi);
+			free(name);
+			if (rc) {
+				fprintf(stderr, "mdb_dbi_open failed, error %d %s\n", rc, mdb_strerror(rc));
+				break;
+			}
+			rc = mdb_stat(txn, bs[id].dbi, &ms);
+			if (rc)
+				break;
+			/* appending is only valid into an empty DB */
+			bs[id].append = !ms.ms_entries;
+			bs[id].prevk.mv_data = malloc(mdb_env_get_maxkeysize(env));
+			if (!bs[id].prevk.mv_data) {
+				rc = ENOMEM;
+				break;
+			}
+			rc = mdb_cursor_open(txn, bs[id].dbi, &bs[id].mc);
+			if (rc)
+				break;
+		} else if (type == 'D') {
+			bstream *b = &bs[id];
+			if (!b->mc || b->done) {
+				fprintf(stderr, "%s: offset %"Yu": data for unknown stream %u\n", prog, boffset, id);
+				rc = EINVAL;
+				break;
+			}
+			while (p < end) {
+				int appflag = 0;
+				if (getvar(&p, end, &key.mv_size) || getvar(&p, end, &data.mv_size) ||
+					key.mv_size > (size_t)(end - p) || data.mv_size > (size_t)(end - p - key.mv_size)) {
+					fprintf(stderr, "%s: offset %"Yu": corrupt block\n", prog, boffset);
+					rc = EINVAL;
+					break;
+				}
+				key.mv_data = p;
+				p += key.mv_size;
+				data.mv_data = p;
+				p += data.mv_size;
+				if (b->append) {
+					appflag = MDB_APPEND;
+					if (b->flags & MDB_DUPSORT) {
+						if (b->prevk.mv_size == key.mv_size && !memcmp(b->prevk.mv_data, key.mv_data, key.mv_size))
+							appflag = MDB_CURRENT|MDB_APPENDDUP;
+						else if (key.mv_size <= (size_t)mdb_env_get_maxkeysize(env)) {
+							memcpy(b->prevk.mv_data, key.mv_data, key.mv_size);
+							b->prevk.mv_size = key.mv_size;
+						}
+					}
+				}
+				rc = mdb_cursor_put(b->mc, &key, &data, putflags|appflag);
+				if (rc == MDB_KEYEXIST && putflags) {
+					rc = MDB_SUCCESS;
+					continue;
+				}
+				if (rc) {
+					fprintf(stderr, "%s: offset %"Yu": mdb_cursor_put failed, error %d %s\n",
+						prog, boffset, rc, mdb_strerror(rc));
+					break;
+				}
+				b->count++;
+				if (++pending >= batch) {
+					rc = mdb_txn_commit(txn);
+					txn = NULL;
+					if (rc) {
+						fprintf(stderr, "%s: offset %"Yu": txn_commit: %s\n",
+							prog, boffset, mdb_strerror(rc));
+						break;
+					}
+					rc = mdb_txn_begin(env, NULL, 0, &txn);
+					if (rc) {
+						fprintf(stderr, "mdb_txn_begin failed, error %d %s\n", rc, mdb_strerror(rc));
+						break;
+					}
+					rc = bcursors(txn, bs, nstreams);
+					if (rc)
+						break;
+					pending = 0;
+				}
+			}
+			if (rc)
+				break;
+		} else if (type == 'E') {
+			if (len < 8 || get64(p) != bs[id].count) {
+				if (!putflags) {
+					fprintf(stderr, "%s: offset %"Yu": stream %u: record count mismatch\n",
+						prog, boffset, id);
+					rc = EINVAL;
+					break;
+				}
+			}
+			mdb_cursor_close(bs[id].mc);
+			bs[id].mc = NULL;
+			bs[id].done = 1;
+		} else {
+			fprintf(stderr, "%s: offset %"Yu": unknown record type %d\n", prog, boffset, type);
+			rc = EINVAL;
+			break;
+		}
+	}
+
+	if (!rc) {
+		rc = mdb_txn_commit(txn);
+		txn = NULL;
+		if (rc)
+			fprintf(stderr, "%s: txn_commit: %s\n", prog, mdb_strerror(rc));
+	}
+	if (!rc && (envflags & MDB_NOSYNC)) {
+		rc = mdb_env_sync(env, 1);
+		if (rc)
+			fprintf(stderr, "mdb_env_sync failed, error %d %s\n", rc, mdb_strerror(rc));
+	}
+leave:
+	if (txn)
+		mdb_txn_abort(txn);
+	for (i=0; i<nstreams; i++)
+		free(bs[i].prevk.mv_data);
+	free(bs);
+	free(buf);
+	return rc;
+}
+
 static int greater(const MDB_val *a, const MDB_val *b)
 {
 	return 1;
@@ -295,6 +623,7 @@ int main(int argc, char *argv[])
 	char *envname;
 	int envflags = MDB_NOSYNC, putflags = 0;
 	int dohdr = 0, append = 0;
+	mdb_size_t bbatch = 100000;
 	MDB_val prevk;
 
 	prog = argv[0];
@@ -304,6 +633,8 @@ int main(int argc, char *argv[])
 	}
 
 	/* -a: append records in input order
+	 * -b: read binary format
+	 * -B: records per commit in binary mode
 	 * -f: load file instead of stdin
 	 * -n: use NOSUBDIR flag on env_open
 	 * -s: load into named subDB
@@ -312,7 +643,7 @@ int main(int argc, char *argv[])
 	 * -T: read plaintext
 	 * -V: print version and exit
 	 */
-	while ((i = getopt(argc, argv, "af:ns:NQTV")) != EOF) {
+	while ((i = getopt(argc, argv, "abB:f:ns:NQTV")) != EOF) {
 		switch(i) {
 		case 'V':
 			printf("%s\n", MDB_VERSION_STRING);
@@ -321,6 +652,14 @@ int main(int argc, char *argv[])
 		case 'a':
 			append = 1;
 			break;
+		case 'b':
+			mode |= BINARY;
+			break;
+		case 'B':
+			bbatch = strtoull(optarg, NULL, 0);
+			if (!bbatch)
+				usage();
+			break;
 		case 'f':
 			if (freopen(optarg, "r", stdin) == NULL) {
 				fprintf(stderr, "%s: %s: reopen: %s\n",
@@ -350,11 +689,13 @@ int main(int argc, char *argv[])
 
 	if (optind != argc - 1)
 		usage();
+	if ((mode & BINARY) && (mode & NOHDR || append))
+		usage();
 
 	dbuf.mv_size = 4096;
 	dbuf.mv_data = malloc(dbuf.mv_size);
 
-	if (!(mode & NOHDR))
+	if (!(mode & (NOHDR|BINARY)))
 		readhdr();
 
 	envname = argv[optind];
@@ -364,6 +705,11 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	if (mode & BINARY) {
+		rc = bload(env, envname, envflags, putflags, bbatch);
+		goto env_close;
+	}
+
 	mdb_env_set_maxdbs(env, 2);
 
 	if (info.me_maxreaders)
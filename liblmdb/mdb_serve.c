@@ -0,0 +1,844 @@
+/* mdb_serve.c - memory-mapped database RPC server */
+/*
+ * Copyright 2011-2021 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+
+/* Serves get/put/del/range/batch on one database over a Unix domain
+ * socket, so processes on the same host can share an environment
+ * without each mapping it and taking reader slots.
+ *
+ * Protocol, all integers little-endian:
+ *
+ *	request:  u32 len, u32 id, u8 op, body		(len counts id onwards)
+ *	response: u32 len, u32 id, i32 rc, body
+ *
+ *	GET	body: u32 klen, key
+ *		reply: u32 vlen, value
+ *	PUT	body: u32 klen, key, u32 vlen, value
+ *	DEL	body: u32 klen, key
+ *	RANGE	body: u32 limit, u32 flen, from, u32 tlen, to
+ *		keys from <= k < to (empty "to": no bound), at most limit
+ *		reply: u32 n, n * (u32 klen, key, u32 vlen, value)
+ *	BATCH	body: u32 n, n * (u8 del, u32 klen, key, u32 vlen, value)
+ *		applied all or nothing
+ *
+ * rc is an LMDB/errno code, 0 on success. Requests may be pipelined;
+ * replies carry the request id and may come back out of order, but a
+ * read on a connection waits for that connection's earlier writes.
+ * A connection with MAXJOBS requests in flight or MAXOUT bytes of
+ * replies not yet sent is not read from until the client catches up.
+ *
+ * One thread runs the epoll loop. Reads go to a pool of reader threads,
+ * each keeping a read txn that is reset and renewed per request. Writes
+ * go to a single writer thread that applies everything queued in one
+ * txn (group commit) before replying.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "lmdb.h"
+
+enum { OP_GET = 1, OP_PUT, OP_DEL, OP_RANGE, OP_BATCH };
+
+#define MAXFRAME	(64 << 20)
+#define MAXRANGE	100000
+#define MAXEVENTS	64
+#define MAXJOBS	1024
+#define MAXOUT	(16 << 20)
+
+typedef struct conn {
+	int fd;
+	int dead;		/* closed by the loop, freed when refs drops to 0 */
+	int refs;		/* loop + queued jobs + ready list */
+	unsigned long wseq;	/* writes received */
+	unsigned long wdone;	/* writes committed, in order */
+	int ready;		/* on the ready list */
+	int jobs;		/* requests parsed and not yet answered */
+	int paused;		/* backlogged, input left unread (loop only) */
+	pthread_mutex_t mu;
+	char *in;
+	size_t inlen, insize;
+	char *out;
+	size_t outoff, outlen, outsize;
+	struct job *held;	/* reads waiting for this conn's earlier writes */
+	struct job **heldtail;
+	struct conn *next;	/* ready list */
+} conn;
+
+typedef struct job {
+	conn *c;
+	uint32_t id;
+	int op;
+	char *body;
+	size_t len;
+	unsigned long need;	/* held read: wdone it waits for */
+	struct job *next;
+} job;
+
+typedef struct queue {
+	pthread_mutex_t mu;
+	pthread_cond_t cv;
+	job *head, **tail;
+	int stop;
+} queue;
+
+static MDB_env *env;
+static MDB_dbi dbi;
+static queue readq, writeq;
+static volatile sig_atomic_t stopping;
+static int wakefd;
+static pthread_mutex_t readymu = PTHREAD_MUTEX_INITIALIZER;
+static conn *readylist;
+
+static void
+sighandle(int sig)
+{
+	stopping = 1;
+}
+
+static uint32_t
+get32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+	return u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+static void
+put32(char *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void
+queue_init(queue *q)
+{
+	pthread_mutex_init(&q->mu, NULL);
+	pthread_cond_init(&q->cv, NULL);
+	q->head = NULL;
+	q->tail = &q->head;
+	q->stop = 0;
+}
+
+static void
+queue_push(queue *q, job *j)
+{
+	pthread_mutex_lock(&q->mu);
+	j->next = NULL;
+	*q->tail = j;
+	q->tail = &j->next;
+	pthread_cond_signal(&q->cv);
+	pthread_mutex_unlock(&q->mu);
+}
+
+/* Take everything queued (all), or one job. NULL once stopped and drained. */
+static job *
+queue_pop(queue *q, int all)
+{
+	job *j;
+
+	pthread_mutex_lock(&q->mu);
+	while (!q->head && !q->stop)
+		pthread_cond_wait(&q->cv, &q->mu);
+	j = q->head;
+	if (j) {
+		if (all) {
+			q->head = NULL;
+			q->tail = &q->head;
+		} else {
+			q->head = j->next;
+			if (!q->head)
+				q->tail = &q->head;
+			j->next = NULL;
+		}
+	}
+	pthread_mutex_unlock(&q->mu);
+	return j;
+}
+
+static void
+queue_stop(queue *q)
+{
+	pthread_mutex_lock(&q->mu);
+	q->stop = 1;
+	pthread_cond_broadcast(&q->cv);
+	pthread_mutex_unlock(&q->mu);
+}
+
+static void
+conn_free(conn *c)
+{
+	pthread_mutex_destroy(&c->mu);
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+/* Drop a reference, with c->mu held; frees and returns 1 on the last one */
+static int
+conn_unref(conn *c)
+{
+	if (--c->refs == 0) {
+		pthread_mutex_unlock(&c->mu);
+		conn_free(c);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+grow(char **buf, size_t *size, size_t need)
+{
+	size_t n = *size ? *size : 4096;
+	char *p;
+
+	if (need <= *size)
+		return 0;
+	while (n < need)
+		n *= 2;
+	p = realloc(*buf, n);
+	if (!p)
+		return ENOMEM;
+	*buf = p;
+	*size = n;
+	return 0;
+}
+
+/* Reply buffer being built by a worker */
+typedef struct reply {
+	char *buf;
+	size_t len, size;
+	int rc;
+} reply;
+
+static int
+reply_put(reply *r, const void *p, size_t n)
+{
+	if (!r->rc && !(r->rc = grow(&r->buf, &r->size, r->len + n))) {
+		memcpy(r->buf + r->len, p, n);
+		r->len += n;
+	}
+	return r->rc;
+}
+
+static int
+reply_val(reply *r, const MDB_val *v)
+{
+	char n[4];
+
+	put32(n, (uint32_t)v->mv_size);
+	reply_put(r, n, 4);
+	return reply_put(r, v->mv_data, v->mv_size);
+}
+
+/* Append a reply frame to the connection, release the job's reference
+ * and put the connection on the ready list for the loop to flush.
+ */
+static void
+respond(job *j, int rc, const char *body, size_t len)
+{
+	conn *c = j->c;
+	char hdr[12];
+	int wake = 0;
+
+	put32(hdr, (uint32_t)(8 + len));
+	put32(hdr + 4, j->id);
+	put32(hdr + 8, (uint32_t)rc);
+	pthread_mutex_lock(&c->mu);
+	c->jobs--;
+	if (!c->dead && !grow(&c->out, &c->outsize, c->outlen + 12 + len)) {
+		memcpy(c->out + c->outlen, hdr, 12);
+		if (len)
+			memcpy(c->out + c->outlen + 12, body, len);
+		c->outlen += 12 + len;
+	}
+	if (!c->ready) {
+		c->ready = 1;
+		wake = 1;
+	} else if (conn_unref(c)) {
+		free(j->body);
+		free(j);
+		return;
+	}
+	pthread_mutex_unlock(&c->mu);
+	if (wake) {
+		uint64_t one = 1;
+		ssize_t n;
+		pthread_mutex_lock(&readymu);
+		c->next = readylist;
+		readylist = c;
+		pthread_mutex_unlock(&readymu);
+		n = write(wakefd, &one, sizeof(one));
+		(void)n;
+	}
+	free(j->body);
+	free(j);
+}
+
+/* Parse a length-prefixed value out of a request body */
+static int
+take(char **p, char *end, MDB_val *v)
+{
+	uint32_t n;
+
+	if (end - *p < 4)
+		return EINVAL;
+	n = get32(*p);
+	*p += 4;
+	if ((size_t)(end - *p) < n)
+		return EINVAL;
+	v->mv_size = n;
+	v->mv_data = *p;
+	*p += n;
+	return 0;
+}
+
+static void
+do_read(job *j, MDB_txn *txn)
+{
+	char *p = j->body, *end = j->body + j->len;
+	reply r = { NULL, 0, 0, 0 };
+	MDB_val key, data, to;
+	MDB_cursor *mc;
+	uint32_t limit = 0, n = 0;
+	char cnt[4];
+	int rc;
+
+	if (j->op == OP_GET) {
+		rc = take(&p, end, &key);
+		if (!rc)
+			rc = mdb_get(txn, dbi, &key, &data);
+		if (!rc)
+			rc = reply_val(&r, &data);
+	} else {
+		rc = end - p < 4 ? EINVAL : 0;
+		if (!rc) {
+			limit = get32(p);
+			p += 4;
+			if (limit == 0 || limit > MAXRANGE)
+				limit = MAXRANGE;
+			rc = take(&p, end, &key);
+		}
+		if (!rc)
+			rc = take(&p, end, &to);
+		if (!rc)
+			rc = reply_put(&r, cnt, 4);
+		if (!rc)
+			rc = mdb_cursor_open(txn, dbi, &mc);
+		if (!rc) {
+			rc = mdb_cursor_get(mc, &key, &data, key.mv_size ? MDB_SET_RANGE : MDB_FIRST);
+			for (; !rc && n < limit; rc = mdb_cursor_get(mc, &key, &data, MDB_NEXT)) {
+				if (to.mv_size && mdb_cmp(txn, dbi, &key, &to) >= 0)
+					break;
+				if ((rc = reply_val(&r, &key)) || (rc = reply_val(&r, &data)))
+					break;
+				n++;
+			}
+			if (rc == MDB_NOTFOUND || !rc)
+				rc = r.rc;
+			mdb_cursor_close(mc);
+		}
+		if (!rc)
+			put32(r.buf, n);
+	}
+	respond(j, rc, rc ? NULL : r.buf, rc ? 0 : r.len);
+	free(r.buf);
+}
+
+static void *
+reader(void *arg)
+{
+	MDB_txn *txn = NULL;
+	job *j;
+	int rc;
+
+	while ((j = queue_pop(&readq, 0))) {
+		rc = txn ? mdb_txn_renew(txn) : mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+		if (rc) {
+			respond(j, rc, NULL, 0);
+			continue;
+		}
+		do_read(j, txn);
+		mdb_txn_reset(txn);
+	}
+	if (txn)
+		mdb_txn_abort(txn);
+	return NULL;
+}
+
+/* Apply one write request inside txn; a batch gets its own nested txn */
+static int
+do_write(job *j, MDB_txn *txn)
+{
+	char *p = j->body, *end = j->body + j->len;
+	MDB_val key, data;
+	MDB_txn *bt;
+	uint32_t n;
+	int rc, del;
+
+	if (j->op == OP_PUT) {
+		if (!(rc = take(&p, end, &key)) && !(rc = take(&p, end, &data)))
+			rc = mdb_put(txn, dbi, &key, &data, 0);
+		return rc;
+	}
+	if (j->op == OP_DEL) {
+		if (!(rc = take(&p, end, &key)))
+			rc = mdb_del(txn, dbi, &key, NULL);
+		return rc;
+	}
+	if (end - p < 4)
+		return EINVAL;
+	n = get32(p);
+	p += 4;
+	if ((rc = mdb_txn_begin(env, txn, 0, &bt)))
+		return rc;
+	while (!rc && n--) {
+		if (p >= end) {
+			rc = EINVAL;
+			break;
+		}
+		del = *p++;
+		if ((rc = take(&p, end, &key)) || (rc = take(&p, end, &data)))
+			break;
+		if (del) {
+			rc = mdb_del(bt, dbi, &key, NULL);
+			if (rc == MDB_NOTFOUND)
+				rc = 0;
+		} else {
+			rc = mdb_put(bt, dbi, &key, &data, 0);
+		}
+	}
+	if (rc) {
+		mdb_txn_abort(bt);
+		return rc;
+	}
+	return mdb_txn_commit(bt);
+}
+
+/* Count one of a connection's writes as committed and release the
+ * reads that were only waiting for writes up to it.
+ */
+static void
+release_held(conn *c)
+{
+	job *h = NULL, **tail = &h, *j;
+
+	pthread_mutex_lock(&c->mu);
+	c->wdone++;
+	while ((j = c->held) && j->need <= c->wdone) {
+		c->held = j->next;
+		j->next = NULL;
+		*tail = j;
+		tail = &j->next;
+	}
+	if (!c->held)
+		c->heldtail = &c->held;
+	pthread_mutex_unlock(&c->mu);
+	while (h) {
+		j = h->next;
+		queue_push(&readq, h);
+		h = j;
+	}
+}
+
+static void *
+writer(void *arg)
+{
+	job *batch, *j, *next;
+	MDB_txn *txn;
+	int rc, *rcs, n, i;
+
+	while ((batch = queue_pop(&writeq, 1))) {
+		for (n = 0, j = batch; j; j = j->next)
+			n++;
+		rcs = calloc(n, sizeof(int));
+		rc = rcs ? mdb_txn_begin(env, NULL, 0, &txn) : ENOMEM;
+		if (!rc) {
+			MDB_txn *op;
+			for (i = 0, j = batch; j; j = j->next, i++) {
+				/* each request gets a nested txn so a failure undoes only itself */
+				if (!(rcs[i] = mdb_txn_begin(env, txn, 0, &op))) {
+					rcs[i] = do_write(j, op);
+					if (rcs[i])
+						mdb_txn_abort(op);
+					else
+						rcs[i] = mdb_txn_commit(op);
+				}
+			}
+			rc = mdb_txn_commit(txn);
+		}
+		for (i = 0, j = batch; j; j = next, i++) {
+			next = j->next;
+			/* the job's reference keeps the connection alive until respond() */
+			release_held(j->c);
+			respond(j, rc ? rc : rcs[i], NULL, 0);
+		}
+		free(rcs);
+	}
+	return NULL;
+}
+
+static void
+conn_close(int ep, conn *c)
+{
+	job *h;
+
+	epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	pthread_mutex_lock(&c->mu);
+	c->dead = 1;
+	h = c->held;
+	c->held = NULL;
+	pthread_mutex_unlock(&c->mu);
+	while (h) {
+		job *next = h->next;
+		h->next = NULL;
+		queue_push(&readq, h);
+		h = next;
+	}
+	pthread_mutex_lock(&c->mu);
+	if (!conn_unref(c))
+		pthread_mutex_unlock(&c->mu);
+}
+
+/* Write out what the workers have queued. Returns -1 if the peer is gone */
+static int
+conn_flush(conn *c)
+{
+	ssize_t n;
+	int rc = 0;
+
+	pthread_mutex_lock(&c->mu);
+	while (c->outoff < c->outlen) {
+		n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				rc = -1;
+			break;
+		}
+		c->outoff += n;
+	}
+	if (c->outoff == c->outlen)
+		c->outoff = c->outlen = 0;
+	pthread_mutex_unlock(&c->mu);
+	return rc;
+}
+
+/* Too many requests in flight or too much unsent output */
+static int
+conn_busy(conn *c)
+{
+	int busy;
+
+	pthread_mutex_lock(&c->mu);
+	busy = c->jobs >= MAXJOBS || c->outlen - c->outoff >= MAXOUT;
+	pthread_mutex_unlock(&c->mu);
+	return busy;
+}
+
+/* Turn complete frames in the input buffer into jobs, until busy */
+static int
+conn_parse(conn *c)
+{
+	size_t off = 0, len;
+	job *j;
+
+	while (c->inlen - off >= 9 && !conn_busy(c)) {
+		len = get32(c->in + off);
+		if (len < 5 || len > MAXFRAME)
+			return -1;
+		if (c->inlen - off < 4 + len)
+			break;
+		j = malloc(sizeof(job));
+		if (!j)
+			return -1;
+		j->c = c;
+		j->id = get32(c->in + off + 4);
+		j->op = (unsigned char)c->in[off + 8];
+		j->len = len - 5;
+		j->body = malloc(j->len ? j->len : 1);
+		j->next = NULL;
+		if (!j->body) {
+			free(j);
+			return -1;
+		}
+		memcpy(j->body, c->in + off + 9, j->len);
+		off += 4 + len;
+
+		pthread_mutex_lock(&c->mu);
+		c->refs++;
+		c->jobs++;
+		if (j->op == OP_PUT || j->op == OP_DEL || j->op == OP_BATCH) {
+			c->wseq++;
+			pthread_mutex_unlock(&c->mu);
+			queue_push(&writeq, j);
+		} else if (j->op == OP_GET || j->op == OP_RANGE) {
+			if (c->wdone < c->wseq) {
+				j->need = c->wseq;
+				*c->heldtail = j;
+				c->heldtail = &j->next;
+				pthread_mutex_unlock(&c->mu);
+			} else {
+				pthread_mutex_unlock(&c->mu);
+				queue_push(&readq, j);
+			}
+		} else {
+			pthread_mutex_unlock(&c->mu);
+			respond(j, EINVAL, NULL, 0);
+		}
+	}
+	memmove(c->in, c->in + off, c->inlen - off);
+	c->inlen -= off;
+	return 0;
+}
+
+/* Read and parse until the socket is drained, or stop while the
+ * connection is busy. Epoll is edge-triggered, so a paused connection
+ * is read again by the loop once its output drains. Returns -1 if the
+ * peer is gone or sent garbage.
+ */
+static int
+conn_read(conn *c)
+{
+	ssize_t got;
+
+	for (;;) {
+		if (conn_parse(c))
+			return -1;
+		c->paused = conn_busy(c);
+		if (c->paused)
+			return 0;
+		if (grow(&c->in, &c->insize, c->inlen + 65536))
+			return -1;
+		got = recv(c->fd, c->in + c->inlen, c->insize - c->inlen, 0);
+		if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR))
+			return -1;
+		if (got < 0)
+			return 0;
+		c->inlen += got;
+	}
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-V] [-n] [-r readers] [-m mapsize] [-s subdb] -l socket dbpath\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, rc, ep, lfd, nreaders = 4;
+	int envflags = 0;
+	char *prog = argv[0], *envname, *subname = NULL, *sockname = NULL;
+	size_t mapsize = 0;
+	pthread_t *readers, wthread;
+	struct sockaddr_un sa;
+	struct epoll_event ev, evs[MAXEVENTS];
+	MDB_txn *txn;
+	struct sigaction sig;
+
+	/* -l: listen on this Unix socket path
+	 * -r: number of reader threads
+	 * -m: map size to set
+	 * -s: serve the named subDB
+	 * -n: use NOSUBDIR flag on env_open
+	 * -V: print version and exit
+	 */
+	while ((i = getopt(argc, argv, "Vl:m:nr:s:")) != EOF) {
+		switch(i) {
+		case 'V':
+			printf("%s\n", MDB_VERSION_STRING);
+			exit(0);
+			break;
+		case 'l':
+			sockname = optarg;
+			break;
+		case 'm':
+			mapsize = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			envflags |= MDB_NOSUBDIR;
+			break;
+		case 'r':
+			nreaders = atoi(optarg);
+			if (nreaders < 1)
+				usage(prog);
+			break;
+		case 's':
+			subname = optarg;
+			break;
+		default:
+			usage(prog);
+		}
+	}
+
+	if (optind != argc - 1 || !sockname)
+		usage(prog);
+	envname = argv[optind];
+
+	memset(&sig, 0, sizeof(sig));
+	sig.sa_handler = sighandle;
+	sigaction(SIGINT, &sig, NULL);
+	sigaction(SIGTERM, &sig, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	rc = mdb_env_create(&env);
+	if (rc) {
+		fprintf(stderr, "mdb_env_create failed, error %d %s\n", rc, mdb_strerror(rc));
+		return EXIT_FAILURE;
+	}
+	mdb_env_set_maxreaders(env, nreaders + 2);
+	if (subname)
+		mdb_env_set_maxdbs(env, 2);
+	if (mapsize)
+		mdb_env_set_mapsize(env, mapsize);
+	rc = mdb_env_open(env, envname, envflags | MDB_NOTLS, 0664);
+	if (rc) {
+		fprintf(stderr, "mdb_env_open failed, error %d %s\n", rc, mdb_strerror(rc));
+		goto env_close;
+	}
+	rc = mdb_txn_begin(env, NULL, 0, &txn);
+	if (!rc) {
+		rc = mdb_dbi_open(txn, subname, subname ? MDB_CREATE : 0, &dbi);
+		if (rc)
+			mdb_txn_abort(txn);
+		else
+			rc = mdb_txn_commit(txn);
+	}
+	if (rc) {
+		fprintf(stderr, "mdb_dbi_open failed, error %d %s\n", rc, mdb_strerror(rc));
+		goto env_close;
+	}
+
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(sockname) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", prog);
+		rc = EXIT_FAILURE;
+		goto env_close;
+	}
+	strcpy(sa.sun_path, sockname);
+	unlink(sockname);
+	if (lfd < 0 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) || listen(lfd, 64)) {
+		fprintf(stderr, "%s: %s: %s\n", prog, sockname, strerror(errno));
+		rc = EXIT_FAILURE;
+		goto env_close;
+	}
+	fcntl(lfd, F_SETFL, O_NONBLOCK);
+
+	ep = epoll_create1(0);
+	wakefd = eventfd(0, EFD_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+	ev.data.ptr = &wakefd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, wakefd, &ev);
+
+	queue_init(&readq);
+	queue_init(&writeq);
+	readers = malloc(nreaders * sizeof(pthread_t));
+	for (i = 0; i < nreaders; i++)
+		pthread_create(&readers[i], NULL, reader, NULL);
+	pthread_create(&wthread, NULL, writer, NULL);
+
+	while (!stopping) {
+		int n = epoll_wait(ep, evs, MAXEVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			conn *c = evs[i].data.ptr;
+			if (!c) {
+				int fd;
+				while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+					c = calloc(1, sizeof(conn));
+					if (!c) {
+						close(fd);
+						continue;
+					}
+					fcntl(fd, F_SETFL, O_NONBLOCK);
+					c->fd = fd;
+					c->refs = 1;
+					c->heldtail = &c->held;
+					pthread_mutex_init(&c->mu, NULL);
+					ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+					ev.data.ptr = c;
+					epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+				}
+			} else if ((void *)c == &wakefd) {
+				uint64_t cnt;
+				ssize_t got;
+				conn *r;
+				got = read(wakefd, &cnt, sizeof(cnt));
+				(void)got;
+				pthread_mutex_lock(&readymu);
+				r = readylist;
+				readylist = NULL;
+				pthread_mutex_unlock(&readymu);
+				while (r) {
+					conn *next = r->next;
+					pthread_mutex_lock(&r->mu);
+					r->ready = 0;
+					pthread_mutex_unlock(&r->mu);
+					/* a paused conn may read again; on error leave the
+					 * close to its own hangup event, which may already be
+					 * in this batch
+					 */
+					if (!r->dead && !conn_flush(r) && r->paused && conn_read(r))
+						shutdown(r->fd, SHUT_RDWR);
+					pthread_mutex_lock(&r->mu);
+					if (!conn_unref(r))
+						pthread_mutex_unlock(&r->mu);
+					r = next;
+				}
+			} else {
+				int bad = 0;
+				if (evs[i].events & EPOLLOUT)
+					bad = conn_flush(c);
+				if (!bad && (c->paused || (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))))
+					bad = conn_read(c);
+				/* a hung-up client that stays backlogged would never be read again */
+				if (!bad && c->paused && (evs[i].events & (EPOLLHUP | EPOLLERR)))
+					bad = 1;
+				if (bad)
+					conn_close(ep, c);
+			}
+		}
+	}
+
+	queue_stop(&readq);
+	queue_stop(&writeq);
+	for (i = 0; i < nreaders; i++)
+		pthread_join(readers[i], NULL);
+	pthread_join(wthread, NULL);
+	free(readers);
+	close(lfd);
+	unlink(sockname);
+	rc = 0;
+
+env_close:
+	mdb_env_close(env);
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -13,6 +13,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include "lmdb.h"
@@ -32,9 +33,282 @@ static void prstat(MDB_stat *ms)
 	printf("  Entries: %"Yu"\n",        ms->ms_entries);
 }
 
+#define FILLS	10		/* fill-factor buckets of 10% */
+#define SIZES	33		/* log2 size buckets */
+
+typedef struct sizes {
+	mdb_size_t count, total, min, max;
+	mdb_size_t hist[SIZES];
+} sizes;
+
+typedef struct analysis {
+	unsigned int psize;
+	mdb_size_t pages[MDB_WALK_OVERFLOW+1];
+	mdb_size_t used[MDB_WALK_OVERFLOW+1];
+	mdb_size_t fill[MDB_WALK_OVERFLOW][FILLS];
+	mdb_size_t ovvalues, ovslack;
+	mdb_size_t subpages, subpage_used, subdbs, subdb_pages;
+	sizes keys, vals;
+} analysis;
+
+static int log2b(mdb_size_t v)
+{
+	int b = 0;
+	while (v > 1 && b < SIZES-1) {
+		v >>= 1;
+		b++;
+	}
+	return b;
+}
+
+static void addsize(sizes *sz, mdb_size_t v)
+{
+	if (!sz->count || v < sz->min)
+		sz->min = v;
+	if (v > sz->max)
+		sz->max = v;
+	sz->count++;
+	sz->total += v;
+	sz->hist[log2b(v)]++;
+}
+
+static void prsizes(const char *what, sizes *sz)
+{
+	int i;
+
+	if (!sz->count)
+		return;
+	printf("  %s: min %"Yu", avg %.1f, max %"Yu"\n", what,
+		sz->min, (double)sz->total / sz->count, sz->max);
+	for (i=0; i<SIZES; i++) {
+		if (sz->hist[i])
+			printf("    %10"Yu" - %-10"Yu" %"Yu"\n",
+				i ? (mdb_size_t)1 << i : 0, ((mdb_size_t)2 << i) - 1, sz->hist[i]);
+	}
+}
+
+static int analyze_page(const MDB_walkpage *wp, void *ctx)
+{
+	analysis *an = ctx;
+	int f;
+
+	an->pages[wp->mw_type] += wp->mw_pages;
+	an->used[wp->mw_type] += wp->mw_used;
+	if (wp->mw_type == MDB_WALK_OVERFLOW) {
+		an->ovvalues++;
+		an->ovslack += wp->mw_size - wp->mw_used;
+	} else {
+		f = wp->mw_used * FILLS / wp->mw_size;
+		an->fill[wp->mw_type][f < FILLS ? f : FILLS-1]++;
+	}
+	if (wp->mw_subdb)
+		an->subdb_pages += wp->mw_pages;
+	an->subpages += wp->mw_subpages;
+	an->subpage_used += wp->mw_subpage_used;
+	an->subdbs += wp->mw_subdbs;
+	return 0;
+}
+
+static void prfill(const char *what, analysis *an, int type)
+{
+	int i;
+
+	if (!an->pages[type])
+		return;
+	printf("  %s fill: avg %.1f%%\n", what,
+		100.0 * an->used[type] / ((double)an->pages[type] * an->psize));
+	for (i=0; i<FILLS; i++)
+		if (an->fill[type][i])
+			printf("    %3d%% - %3d%% %"Yu"\n", i * 100 / FILLS, (i+1) * 100 / FILLS, an->fill[type][i]);
+}
+
+/* Page analysis of one DB by one thread of mdb_env_walk() */
+typedef struct walkdb {
+	MDB_dbi dbi;		/* core DB, or ~0 for a named DB */
+	MDB_val name;
+	analysis an;
+} walkdb;
+
+typedef struct walkthr {
+	walkdb *dbs;
+	int ndbs;
+} walkthr;
+
+static walkthr *walked;
+static int nwalked;
+
+static int analyze_env_page(const MDB_walkpage *wp, void *ctx)
+{
+	walkthr *wt = (walkthr *)ctx + wp->mw_thread;
+	MDB_dbi dbi = wp->mw_name.mv_size ? (MDB_dbi)~0 : wp->mw_dbi;
+	walkdb *db;
+	int i;
+
+	for (i=0; i<wt->ndbs; i++) {
+		db = &wt->dbs[i];
+		if (db->dbi == dbi && db->name.mv_size == wp->mw_name.mv_size &&
+			!memcmp(db->name.mv_data, wp->mw_name.mv_data, wp->mw_name.mv_size))
+			return analyze_page(wp, &db->an);
+	}
+	db = realloc(wt->dbs, (wt->ndbs + 1) * sizeof(walkdb));
+	if (!db)
+		return ENOMEM;
+	wt->dbs = db;
+	db += wt->ndbs;
+	memset(db, 0, sizeof(*db));
+	db->dbi = dbi;
+	db->name.mv_size = wp->mw_name.mv_size;
+	db->name.mv_data = malloc(wp->mw_name.mv_size + 1);
+	if (!db->name.mv_data)
+		return ENOMEM;
+	memcpy(db->name.mv_data, wp->mw_name.mv_data, wp->mw_name.mv_size);
+	wt->ndbs++;
+	return analyze_page(wp, &db->an);
+}
+
+/* Walk the pages of all DBs at once with nthreads threads */
+static int analyze_env(MDB_env *env, MDB_txn *txn, int nthreads)
+{
+	walked = calloc(nthreads, sizeof(walkthr));
+	if (!walked)
+		return ENOMEM;
+	nwalked = nthreads;
+	return mdb_env_walk(env, txn, analyze_env_page, walked, nthreads);
+}
+
+/* Add up the page analysis of a DB from all walking threads */
+static void analyze_merge(analysis *an, MDB_dbi dbi, MDB_val *name)
+{
+	analysis *a2;
+	int i, j, t, f;
+
+	for (t=0; t<nwalked; t++) {
+		for (i=0; i<walked[t].ndbs; i++) {
+			walkdb *db = &walked[t].dbs[i];
+			if (name ? db->name.mv_size != name->mv_size ||
+				memcmp(db->name.mv_data, name->mv_data, name->mv_size) :
+				db->dbi != dbi)
+				continue;
+			a2 = &db->an;
+			for (j=0; j<=MDB_WALK_OVERFLOW; j++) {
+				an->pages[j] += a2->pages[j];
+				an->used[j] += a2->used[j];
+				if (j < MDB_WALK_OVERFLOW)
+					for (f=0; f<FILLS; f++)
+						an->fill[j][f] += a2->fill[j][f];
+			}
+			an->ovvalues += a2->ovvalues;
+			an->ovslack += a2->ovslack;
+			an->subpages += a2->subpages;
+			an->subpage_used += a2->subpage_used;
+			an->subdbs += a2->subdbs;
+			an->subdb_pages += a2->subdb_pages;
+		}
+	}
+}
+
+/* Walk all pages of a DB and all its records, print how well the
+ * space is used. The pages of named DBs come from analyze_env()
+ * when all DBs are analyzed.
+ */
+static int analyze(MDB_txn *txn, MDB_dbi dbi, MDB_val *name)
+{
+	analysis an = {0};
+	MDB_cursor *cursor;
+	MDB_val key, data;
+	MDB_stat ms;
+	int rc;
+
+	rc = mdb_stat(txn, dbi, &ms);
+	if (rc) return rc;
+	an.psize = ms.ms_psize;
+	if (walked) {
+		analyze_merge(&an, dbi, name);
+	} else {
+		rc = mdb_dbi_walk(txn, dbi, analyze_page, &an);
+		if (rc) return rc;
+	}
+
+	rc = mdb_cursor_open(txn, dbi, &cursor);
+	if (rc) return rc;
+	while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
+		addsize(&an.keys, key.mv_size);
+		addsize(&an.vals, data.mv_size);
+	}
+	mdb_cursor_close(cursor);
+	if (rc != MDB_NOTFOUND)
+		return rc;
+
+	prfill("Branch", &an, MDB_WALK_BRANCH);
+	prfill("Leaf", &an, MDB_WALK_LEAF);
+	prfill("Fixed-size leaf", &an, MDB_WALK_LEAF2);
+	prsizes("Key sizes", &an.keys);
+	prsizes("Value sizes", &an.vals);
+	if (an.ovvalues)
+		printf("  Overflow values: %"Yu", pages %"Yu", slack %"Yu" bytes (%.1f%%)\n",
+			an.ovvalues, an.pages[MDB_WALK_OVERFLOW], an.ovslack,
+			100.0 * an.ovslack / ((double)an.pages[MDB_WALK_OVERFLOW] * an.psize));
+	if (an.subpages || an.subdbs)
+		printf("  Duplicates: %"Yu" keys in sub-pages (%"Yu" bytes), %"Yu" keys in sub-DBs (%"Yu" pages)\n",
+			an.subpages, an.subpage_used, an.subdbs, an.subdb_pages);
+	return MDB_SUCCESS;
+}
+
+static int cmppg(const void *a, const void *b)
+{
+	mdb_size_t x = *(const mdb_size_t *)a, y = *(const mdb_size_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Print the lengths of runs of consecutive free pages */
+static int analyze_free(MDB_txn *txn)
+{
+	MDB_cursor *cursor;
+	MDB_val key, data;
+	mdb_size_t *pgs = NULL, *iptr, n = 0, max = 0, i, run, runs = 0, longest = 0;
+	sizes rl = {0};
+	int rc;
+
+	rc = mdb_cursor_open(txn, 0, &cursor);
+	if (rc) return rc;
+	while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
+		iptr = data.mv_data;
+		if (n + *iptr > max) {
+			mdb_size_t *p2;
+			max = (n + *iptr) * 2;
+			p2 = realloc(pgs, max * sizeof(mdb_size_t));
+			if (!p2) {
+				rc = ENOMEM;
+				break;
+			}
+			pgs = p2;
+		}
+		memcpy(pgs + n, iptr + 1, *iptr * sizeof(mdb_size_t));
+		n += *iptr;
+	}
+	mdb_cursor_close(cursor);
+	if (rc != MDB_NOTFOUND) {
+		free(pgs);
+		return rc;
+	}
+
+	qsort(pgs, n, sizeof(mdb_size_t), cmppg);
+	for (i=0; i<n; i += run) {
+		for (run=1; i+run < n && pgs[i+run] == pgs[i] + run; run++) ;
+		addsize(&rl, run);
+		runs++;
+		if (run > longest)
+			longest = run;
+	}
+	free(pgs);
+	printf("Free page runs: %"Yu" pages in %"Yu" runs, longest %"Yu"\n", n, runs, longest);
+	prsizes("Run lengths", &rl);
+	return MDB_SUCCESS;
+}
+
 static void usage(char *prog)
 {
-	fprintf(stderr, "usage: %s [-V] [-n] [-e] [-r[r]] [-f[f[f]]] [-v] [-a|-s subdb] dbpath\n", prog);
+	fprintf(stderr, "usage: %s [-V] [-n] [-e] [-r[r]] [-f[f[f]]] [-v] [-A [-j threads]] [-a|-s subdb] dbpath\n", prog);
 	exit(EXIT_FAILURE);
 }
 
@@ -50,6 +324,7 @@ int main(int argc, char *argv[])
 	char *envname;
 	char *subname = NULL;
 	int alldbs = 0, envinfo = 0, envflags = 0, freinfo = 0, rdrinfo = 0;
+	int analysis = 0, nthreads = 4;
 
 	if (argc < 2) {
 		usage(prog);
@@ -62,11 +337,21 @@ int main(int argc, char *argv[])
 	 * -r: print reader info
 	 * -n: use NOSUBDIR flag on env_open
 	 * -v: use previous snapshot
+	 * -A: analyze page fill and record sizes
+	 * -j: number of threads to analyze all DBs with
 	 * -V: print version and exit
 	 * (default) print stat of only the main DB
 	 */
-	while ((i = getopt(argc, argv, "Vaefnrs:v")) != EOF) {
+	while ((i = getopt(argc, argv, "VAaefj:nrs:v")) != EOF) {
 		switch(i) {
+		case 'A':
+			analysis++;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1)
+				usage(prog);
+			break;
 		case 'V':
 			printf("%s\n", MDB_VERSION_STRING);
 			exit(0);
@@ -204,6 +489,14 @@ int main(int argc, char *argv[])
 		printf("  Free pages: %"Yu"\n", pages);
 	}
 
+	if (analysis) {
+		rc = analyze_free(txn);
+		if (rc) {
+			fprintf(stderr, "free page analysis failed, error %d %s\n", rc, mdb_strerror(rc));
+			goto txn_abort;
+		}
+	}
+
 	rc = mdb_open(txn, subname, 0, &dbi);
 	if (rc) {
 		fprintf(stderr, "mdb_open failed, error %d %s\n", rc, mdb_strerror(rc));
@@ -217,6 +510,20 @@ int main(int argc, char *argv[])
 	}
 	printf("Status of %s\n", subname ? subname : "Main DB");
 	prstat(&mst);
+	if (analysis && alldbs) {
+		rc = analyze_env(env, txn, nthreads);
+		if (rc) {
+			fprintf(stderr, "mdb_env_walk failed, error %d %s\n", rc, mdb_strerror(rc));
+			goto txn_abort;
+		}
+	}
+	if (analysis) {
+		rc = analyze(txn, dbi, NULL);
+		if (rc) {
+			fprintf(stderr, "analysis failed, error %d %s\n", rc, mdb_strerror(rc));
+			goto txn_abort;
+		}
+	}
 
 	if (alldbs) {
 		MDB_cursor *cursor;
@@ -246,6 +553,13 @@ int main(int argc, char *argv[])
 				goto txn_abort;
 			}
 			prstat(&mst);
+			if (analysis) {
+				rc = analyze(txn, db2, &key);
+				if (rc) {
+					fprintf(stderr, "analysis failed, error %d %s\n", rc, mdb_strerror(rc));
+					goto txn_abort;
+				}
+			}
 			mdb_close(env, db2);
 		}
 		mdb_cursor_close(cursor);
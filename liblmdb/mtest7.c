@@ -0,0 +1,229 @@
+/* mtest7.c - memory-mapped database tester/toy */
+/*
+ * Copyright 2011-2021 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+
+/* Tests for mdb_serve: start it on ./testdb, then drive it as a client
+ * with pipelined requests.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "lmdb.h"
+
+#define SOCK	"./testdb/serve.sock"
+#define N	200
+
+enum { OP_GET = 1, OP_PUT, OP_DEL, OP_RANGE, OP_BATCH };
+
+#define CHECK(test, msg) ((test) ? (void)0 : ((void)fprintf(stderr, \
+	"%s:%d: %s\n", __FILE__, __LINE__, msg), kill(pid, SIGTERM), abort()))
+
+static pid_t pid;
+static char out[1 << 20];
+static size_t outlen;
+
+static void
+put32(char *p, uint32_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static uint32_t
+get32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+	return u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+static void
+add(const void *p, size_t n)
+{
+	memcpy(out + outlen, p, n);
+	outlen += n;
+}
+
+static void
+addval(const char *s, size_t n)
+{
+	char len[4];
+	put32(len, (uint32_t)n);
+	add(len, 4);
+	add(s, n);
+}
+
+/* Queue a request; body already appended after begin() */
+static size_t
+begin(uint32_t id, int op)
+{
+	char hdr[9];
+	size_t at = outlen;
+
+	put32(hdr + 4, id);
+	hdr[8] = op;
+	add(hdr, 9);
+	return at;
+}
+
+static void
+end(size_t at)
+{
+	put32(out + at, (uint32_t)(outlen - at - 4));
+}
+
+static void
+flush(int fd)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < outlen) {
+		n = write(fd, out + off, outlen - off);
+		CHECK(n > 0, "write");
+		off += n;
+	}
+	outlen = 0;
+}
+
+static void
+readn(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, buf, len);
+		CHECK(n > 0, "read");
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Read one reply; returns its rc and leaves the body in *body */
+static int
+reply(int fd, uint32_t *id, char **body, size_t *len)
+{
+	char hdr[12];
+
+	readn(fd, hdr, 4);
+	*len = get32(hdr) - 8;
+	readn(fd, hdr + 4, 8);
+	*id = get32(hdr + 4);
+	*body = malloc(*len + 1);
+	readn(fd, *body, *len);
+	return (int)get32(hdr + 8);
+}
+
+int main(int argc,char * argv[])
+{
+	struct sockaddr_un sa;
+	int fd, i, rc, status, seen[3 * N + 3];
+	char key[32], val[32], *body;
+	uint32_t id;
+	size_t at, len;
+
+	pid = fork();
+	if (pid == 0) {
+		execl("./mdb_serve", "mdb_serve", "-r", "3", "-l", SOCK, "./testdb", (char *)NULL);
+		_exit(127);
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, SOCK);
+	for (i = 0; i < 500; i++) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (!connect(fd, (struct sockaddr *)&sa, sizeof(sa)))
+			break;
+		close(fd);
+		usleep(10000);
+	}
+	CHECK(i < 500, "connect");
+
+	/* pipeline N puts, then N gets that must see them, in one write */
+	for (i = 0; i < N; i++) {
+		at = begin(i, OP_PUT);
+		sprintf(key, "serve%05d", i);
+		sprintf(val, "value %d", i);
+		addval(key, strlen(key));
+		addval(val, strlen(val));
+		end(at);
+	}
+	for (i = 0; i < N; i++) {
+		at = begin(N + i, OP_GET);
+		sprintf(key, "serve%05d", i);
+		addval(key, strlen(key));
+		end(at);
+	}
+	/* a batch deleting the first ten keys, then a range over the rest */
+	at = begin(2 * N, OP_BATCH);
+	put32(val, 11);
+	add(val, 4);
+	for (i = 0; i < 10; i++) {
+		sprintf(key, "serve%05d", i);
+		add("\1", 1);
+		addval(key, strlen(key));
+		addval("", 0);
+	}
+	add("\0", 1);
+	addval("serve99999", 10);
+	addval("last", 4);
+	end(at);
+	at = begin(2 * N + 1, OP_RANGE);
+	put32(val, 0);
+	add(val, 4);
+	addval("serve", 5);
+	addval("servf", 5);
+	end(at);
+	at = begin(2 * N + 2, OP_GET);
+	addval("serve00003", 10);
+	end(at);
+	flush(fd);
+
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < 2 * N + 3; i++) {
+		rc = reply(fd, &id, &body, &len);
+		CHECK(id < 2 * N + 3 && !seen[id], "reply id");
+		seen[id] = 1;
+		if (id < N) {
+			CHECK(rc == 0, "put");
+		} else if (id < 2 * N) {
+			/* the batch behind may already have deleted the first ten */
+			sprintf(val, "value %d", id - N);
+			CHECK(rc == 0 || (id < N + 10 && rc == MDB_NOTFOUND), "get");
+			CHECK(rc || (get32(body) == strlen(val) && !memcmp(body + 4, val, strlen(val))),
+				"get value");
+		} else if (id == 2 * N) {
+			CHECK(rc == 0, "batch");
+		} else if (id == 2 * N + 1) {
+			char *p = body + 4;
+			uint32_t n = get32(body), k;
+			CHECK(rc == 0 && n == N - 10 + 1, "range count");
+			k = get32(p);
+			CHECK(k == 10 && !memcmp(p + 4, "serve00010", 10), "range first");
+		} else {
+			CHECK(rc == MDB_NOTFOUND, "get deleted");
+		}
+		free(body);
+	}
+	printf("mdb_serve answered %d pipelined requests\n", 2 * N + 3);
+
+	close(fd);
+	kill(pid, SIGTERM);
+	CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+		"mdb_serve exit");
+	return 0;
+}
@@ -0,0 +1,83 @@
+/* mtest8.c - memory-mapped database tester/toy */
+/*
+ * Copyright 2011-2021 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+
+/* Tests for named DB handle reuse: closed slots are reused lowest first,
+ * and a write txn sees a DB closed and reopened after it began as changed
+ * even if it had not used that DB yet.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lmdb.h"
+
+#define E(expr) CHECK((rc = (expr)) == MDB_SUCCESS, #expr)
+#define RES(err, expr) ((rc = expr) == (err) || (CHECK(!rc, #expr), 0))
+#define CHECK(test, msg) ((test) ? (void)0 : ((void)fprintf(stderr, \
+	"%s:%d: %s: %s\n", __FILE__, __LINE__, msg, mdb_strerror(rc)), abort()))
+
+int main(int argc,char * argv[])
+{
+	int rc;
+	MDB_env *env;
+	MDB_dbi a, b, c, d;
+	MDB_val key, data;
+	MDB_txn *txn, *rtxn;
+
+	E(mdb_env_create(&env));
+	E(mdb_env_set_mapsize(env, 10485760));
+	E(mdb_env_set_maxdbs(env, 8));
+	E(mdb_env_open(env, "./testdb/dbi.mdb", MDB_NOSUBDIR|MDB_NOSYNC, 0664));
+
+	key.mv_size = 1;
+	key.mv_data = "k";
+	data.mv_size = 1;
+	data.mv_data = "v";
+
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_dbi_open(txn, "a", MDB_CREATE, &a));
+	E(mdb_dbi_open(txn, "b", MDB_CREATE, &b));
+	E(mdb_dbi_open(txn, "c", MDB_CREATE, &c));
+	E(mdb_put(txn, a, &key, &data, 0));
+	E(mdb_txn_commit(txn));
+
+	/* Free slots a and c, newest last: the next open takes the lowest */
+	mdb_dbi_close(env, a);
+	mdb_dbi_close(env, c);
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_dbi_open(txn, "d", MDB_CREATE, &d));
+	CHECK(d == a, "lowest closed slot reused");
+	E(mdb_txn_commit(txn));
+
+	/* "a" is closed and reopened by a read txn after the writer began */
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	mdb_dbi_close(env, d);
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &rtxn));
+	E(mdb_dbi_open(rtxn, "a", 0, &a));
+	CHECK(a == d, "reopened in the freed slot");
+	E(mdb_txn_commit(rtxn));
+	RES(MDB_BAD_DBI, mdb_get(txn, a, &key, &data));
+	CHECK(rc == MDB_BAD_DBI, "reopened DB seen as changed");
+	mdb_txn_abort(txn);
+
+	/* A writer that begins after the reopen can use the handle */
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_get(txn, a, &key, &data));
+	E(mdb_put(txn, b, &key, &data, 0));
+	E(mdb_txn_commit(txn));
+
+	mdb_env_close(env);
+	printf("dbi reuse ok\n");
+
+	return 0;
+}
@@ -29,9 +29,17 @@ success, or sometimes nothing at all.
 #include <lualib.h>
 
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/signal.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "liblmdb/lmdb.h"
 
@@ -40,35 +48,259 @@ success, or sometimes nothing at all.
 #define LUA_LMDB_TXN    "LMDB.Txn"
 #define LUA_LMDB_DBI    "LMDB.Dbi"
 #define LUA_LMDB_CURSOR "LMDB.Cursor"
+#define LUA_LMDB_SHARDS "LMDB.Shards"
+#define LUA_LMDB_SHARDSCAN "LMDB.ShardScan"
+#define LUA_LMDB_SCHEMA "LMDB.Schema"
+#define LUA_LMDB_RECORD "LMDB.Record"
+
+// 热点键统计: count-min sketch + top-K 小顶堆
+#define LMDB_HOT_DEPTH 4
+#define LMDB_HOT_WIDTH 2048
+
+typedef struct
+{
+  uint64_t hash;
+  uint32_t count;
+  size_t   klen;
+  char    *key;
+} lmdb_hotkey;
+
+// 堆中的键另有一张开放寻址表按哈希找到堆下标, 表长为不小于 2k 的 2 的幂
+typedef struct
+{
+  uint32_t    sketch[LMDB_HOT_DEPTH][LMDB_HOT_WIDTH];
+  int         k;     // heap capacity
+  int         n;     // heap size
+  int        *pos;   // 哈希 -> 堆下标加一, 0 表示空位; 与堆在同一块内存中
+  size_t      mask;  // 表长减一
+  lmdb_hotkey heap[1];
+} lmdb_hotkeys;
+
+// 二级索引: 索引库为 DUPSORT, 键为从值中提取的部分, 值为主键
+typedef struct lmdb_index
+{
+  struct lmdb_dbx   *target;  // 索引库的扩展状态
+  size_t             offset;  // 按字节范围提取
+  size_t             size;    // 0 表示到值末尾
+  int                sep;     // 字段分隔符, -1 时按字节范围提取
+  int                field;   // 字段序号, 从 1 开始
+  MDB_txn           *txn;     // 注册它而尚未提交的写事务, 提交后为 NULL
+  struct lmdb_index *next;
+} lmdb_index;
+
+// 解码缓存: 按键保存解码后的 Lua 值, 值放在编解码表的数组部分, 下标为槽号加一.
+// 每项标记解码时快照中本库的版本, 按 CLOCK 在字节预算内淘汰
+typedef struct
+{
+  char      *key;   // NULL 表示空槽
+  size_t     klen;
+  size_t     size;  // 记账字节数: 键长加编码后的值长
+  uint64_t   hash;
+  mdb_size_t tag;   // 本库最后一次修改的事务号
+  int        used;  // CLOCK 访问位
+  int        next;  // 同一桶中的下一项, -1 结束
+} lmdb_dcentry;
+
+typedef struct
+{
+  size_t       budget;
+  size_t       bytes;
+  int          n;       // 槽数, 也是桶数
+  int          hand;
+  int         *bucket;
+  lmdb_dcentry slot[1];
+} lmdb_dcache;
+
+// 时间序列一个序列的写缓冲
+typedef struct
+{
+  uint64_t series;
+  int64_t  last;     // 已写入或缓冲的最后时间
+  int      haslast;
+  int      n, cap;
+  int      flushed;  // 前 flushed 个点已在 ftxn 中写成块, 提交后才移出缓冲
+  MDB_txn *ftxn;
+  int64_t *ts;
+  double  *val;
+} lmdb_tsbuf;
+
+// 序列号到缓冲区的开放寻址哈希表
+typedef struct
+{
+  size_t       n, cap;
+  lmdb_tsbuf **slot;
+} lmdb_ts;
+
+// 定长记录中的一个字段
+typedef struct
+{
+  size_t offset, width;
+  int    type, be;
+} lmdb_sfield;
+
+// 定长记录的布局, 字段名到序号的表保存在注册表中
+typedef struct
+{
+  size_t      size;
+  int         n;
+  int         names;
+  lmdb_sfield field[1];
+} lmdb_schema;
+
+// 数据库扩展状态, 按库名保存在环境中, 跨事务有效. 句柄关闭或槽位给了别的库都不影响它,
+// 要用到别的库的 dbi 时按库名在事务中重新取得
+typedef struct lmdb_dbx
+{
+  char         *name;     // 主库为 NULL
+  lmdb_hotkeys *hot;
+  lmdb_index   *index;    // 本库上的二级索引
+  struct lmdb_dbx *primary;  // 本库作为索引时对应的主库, NULL 表示不是索引
+  int           codec;    // 编解码表在注册表中的引用, 0 表示没有
+  lmdb_dcache  *cache;
+  mdb_size_t    touched;  // 已知最后一次修改本库的提交
+  mdb_size_t    pending;  // 正在提交且修改了本库的事务
+  int           ttl;      // 有带过期时间的键为 1, 没有为 -1, 0 表示尚未检查
+  mdb_size_t    ttl_txn;  // 查得 -1 时所在事务的事务号, 其他事务要重查
+  lmdb_ts      *ts;       // 时间序列的写缓冲
+  lmdb_schema  *schema;   // 绑定的记录布局
+  int           schema_ref;
+} lmdb_dbx;
+
+// 慢操作日志: 超过阈值的操作记入环形缓冲区
+#define LMDB_SLOW_KEYLEN 16
+
+typedef struct
+{
+  const char *op;
+  char       *dbi;
+  char        key[LMDB_SLOW_KEYLEN];
+  size_t      klen;
+  uint64_t    khash;
+  double      usec;
+  mdb_size_t  txnid;
+  long        majflt;  // -1 when not detected
+  int         spilled;  // -1 when not detected
+} lmdb_slowop;
+
+typedef struct
+{
+  double      threshold;  // usec
+  int         detail;
+  int         size;
+  int         next;
+  mdb_size_t  count;
+  lmdb_slowop ring[1];
+} lmdb_slowlog;
+
+typedef struct
+{
+  struct timespec ts;
+  long            majflt;
+  mdb_size_t      spill;
+} lmdb_slowclock;
+
+// 共享快照: 多个只读事务对象共用一个 MDB_txn 和一个读者槽, 按引用计数释放
+typedef struct lmdb_snap
+{
+  MDB_txn          *txn;     // 环境关闭后为 NULL
+  int               refs;    // 使用中的句柄数
+  int               cached;  // 是环境缓存的快照, 无人使用时只 reset 以便 renew
+  struct timespec   born;    // 快照开始的时间
+  struct lmdb_snap *next;    // 环境上尚未结束的快照
+} lmdb_snap;
 
 // 环境对象
 typedef struct
 {
-  MDB_env *env;
+  MDB_env      *env;
+  lmdb_dbx    **dbx;      // 库名到扩展状态的开放寻址表
+  size_t        ndbx, capdbx;
+  lmdb_slowlog *slow;
+  lmdb_snap    *snap;     // 最近的共享快照
+  lmdb_snap    *snaps;    // 全部尚未结束的快照, 含被新快照替下而仍有人用的
+  mdb_size_t    known;    // 此前的提交都已记账
+  mdb_size_t    foreign;  // 最后一次不知改了哪些库的提交
 } lmdb_env;
 
 // 事务对象
 typedef struct
 {
-  MDB_txn *txn;
-  int      env_ref;
+  MDB_txn   *txn;
+  int        env_ref;
+  lmdb_env  *env;
+  lmdb_snap *snap;  // 共享快照的句柄, 否则为 NULL
 } lmdb_txn;
 
 // 数据库句柄
 typedef struct
 {
-  MDB_dbi  dbi;
-  MDB_txn *txn;
-  int      txn_ref;
+  MDB_dbi   dbi;
+  MDB_txn  *txn;
+  int       txn_ref;
+  lmdb_env *env;
+  lmdb_dbx *dbx;
 } lmdb_dbi;
 
+// 记录视图: 持有 dbi 与布局的引用, 字段在访问时才解码
+typedef struct
+{
+  int          dbi_ref, schema_ref;
+  lmdb_dbi    *dbi;
+  lmdb_schema *schema;
+  size_t       klen;
+  char         key[1];
+} lmdb_record;
+
 // 游标对象
 typedef struct
 {
   MDB_cursor *cursor;
   int         dbi_ref;
+  lmdb_dbi   *dbi;
 } lmdb_cursor;
 
+// 分片存储: 按键哈希分布到多个环境, 每个分片有自己的写锁
+#define LMDB_SHARD_MAX    256
+#define LMDB_SHARD_MARKER 9  // 提交标记键长: 协调分片号 + 8 字节事务号
+#define LMDB_SHARD_OWNER  4  // 重做记录开头的写入进程号
+
+typedef struct
+{
+  MDB_env       *env;
+  MDB_txn       *rtxn;     // 复位后留待下次续用的只读事务
+  MDB_dbi        data;     // 用户数据
+  MDB_dbi        redo;     // 作为协调分片时的原子批次重做记录
+  MDB_dbi        applied;  // 已提交的原子批次标记
+  unsigned char *stale;    // 下次写入时顺带删除的标记
+  size_t         nstale;
+} lmdb_shard;
+
+typedef struct
+{
+  int         n;
+  lmdb_shard *shard;  // 关闭后为 NULL
+} lmdb_shards;
+
+typedef struct
+{
+  int     shard;
+  int     del;
+  MDB_val key, val;
+} lmdb_shardop;
+
+// 一个分片上的批量写入任务
+typedef struct
+{
+  lmdb_shard   *shard;
+  lmdb_shardop *ops;
+  size_t        nops;
+  MDB_val       redo;    // 非空时写入重做记录, 并取得事务号作为批次号
+  int           marker;  // 写入提交标记
+  int           coord;   // 协调分片
+  mdb_size_t    id;      // 批次号
+  int           rc;
+} lmdb_shardjob;
+
 static int
 lmdb_pushstat(lua_State *L, MDB_stat *stat)
 {
@@ -106,701 +338,5639 @@ lmdb_checkvalue(lua_State *L, int idx)
   return val;
 }
 
-/***
-@section lmdb
-*/
-/***
-Get version of lmdb
-@function version
-@treturn string version string
-@treturn integer major
-@treturn integer minor
-@treturn integer patch
-*/
-static int
-lmdb_version(lua_State *L)
+// 同 lmdb_checkvalue, 数字转换出的字符串追加到 anchor 处的表中, 值出栈后仍然有效
+static MDB_val
+lmdb_checkanchored(lua_State *L, int idx, int anchor)
 {
-  int         major, minor, patch;
-  const char *version = mdb_version(&major, &minor, &patch);
+  int     num = lua_type(L, idx) == LUA_TNUMBER;
+  MDB_val val = lmdb_checkvalue(L, idx);
 
-  lua_pushstring(L, version);
-  lua_pushinteger(L, major);
-  lua_pushinteger(L, minor);
-  lua_pushinteger(L, patch);
-  return 4;
-};
+  if (num) {
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, anchor, (int)lua_objlen(L, anchor) + 1);
+  }
+  return val;
+}
 
-/***
-Convert errno integer to error message
-@function strerror
-@tparam integer code errno number
-@treturn string error message
-*/
-static int
-lmdb_strerror(lua_State *L)
+static uint64_t
+lmdb_hash(const MDB_val *val)
 {
-  int         err = luaL_checkinteger(L, 1);
-  const char *msg = mdb_strerror(err);
-  lua_pushstring(L, msg);
-  return 1;
-}
+  const unsigned char *p = (const unsigned char *)val->mv_data;
+  uint64_t             h = 14695981039346656037ULL;  // FNV-1a
+  size_t               i;
 
-/***
-options for open api
+  for (i = 0; i < val->mv_size; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
 
-@field maxreaders[opt=1] maximum number of readers allowed
-@field flags flags for `mdb_env_open`
-@field mode mode The UNIX permissions to set on created files and semaphores,
-default 0664
-@field mapsize[opt=4M] mapsize for `mdb_env_set_mapsize`, default 4MB
-@table options
-*/
-/***
-Open a lmdb file
-@function open
-@tparam string path the path to the LMDB file
-@tparam[opt] table options the options to use when creating or opening the LMDB
-file
-@treturn[1] env object
-@return[2] fail
-@see options
-*/
-static int
-lmdb_open(lua_State *L)
+static uint64_t
+lmdb_dbx_hash(const char *name)
 {
-  const char  *path = luaL_checkstring(L, 1);
-  unsigned int flags;
-  mdb_mode_t   mode;
-  size_t       size;
-  int          ret, maxreaders;
-  lmdb_env    *env;
+  MDB_val v;
+  v.mv_data = (void *)(name ? name : "");
+  v.mv_size = name ? strlen(name) + 1 : 0;
+  return lmdb_hash(&v) * 0x9E3779B97F4A7C15ULL;
+}
 
-  if (lua_gettop(L) == 1) lua_newtable(L);
-  luaL_checktype(L, 2, LUA_TTABLE);
+// 取得库名 (主库为 NULL) 对应的扩展状态, create 时不存在则新建
+static lmdb_dbx *
+lmdb_env_dbx(lmdb_env *env, const char *name, int create)
+{
+  lmdb_dbx *dbx;
+  size_t    i, mask;
 
-  lua_getfield(L, 2, "flags");
-  flags = luaL_optinteger(L, -1, MDB_FIXEDMAP | MDB_CREATE);
-  lua_pop(L, 1);
+  if (env->capdbx) {
+    mask = env->capdbx - 1;
+    for (i = lmdb_dbx_hash(name) & mask; (dbx = env->dbx[i]) != NULL; i = (i + 1) & mask)
+      if (name ? dbx->name && strcmp(dbx->name, name) == 0 : dbx->name == NULL) return dbx;
+  }
+  if (!create) return NULL;
+
+  if (env->ndbx * 2 >= env->capdbx) {
+    size_t     cap = env->capdbx ? env->capdbx * 2 : 16, j;
+    lmdb_dbx **slot = (lmdb_dbx **)calloc(cap, sizeof(lmdb_dbx *));
+    if (slot == NULL) return NULL;
+    for (j = 0; j < env->capdbx; j++) {
+      if (env->dbx[j] == NULL) continue;
+      for (i = lmdb_dbx_hash(env->dbx[j]->name) & (cap - 1); slot[i]; i = (i + 1) & (cap - 1))
+        ;
+      slot[i] = env->dbx[j];
+    }
+    free(env->dbx);
+    env->dbx = slot;
+    env->capdbx = cap;
+  }
+  dbx = (lmdb_dbx *)calloc(1, sizeof(lmdb_dbx));
+  if (dbx == NULL) return NULL;
+  if (name && (dbx->name = strdup(name)) == NULL) {
+    free(dbx);
+    return NULL;
+  }
+  mask = env->capdbx - 1;
+  for (i = lmdb_dbx_hash(name) & mask; env->dbx[i]; i = (i + 1) & mask)
+    ;
+  env->dbx[i] = dbx;
+  env->ndbx++;
+  return dbx;
+}
 
-  lua_getfield(L, 2, "mode");
-  mode = luaL_optinteger(L, -1, 0664);
-  lua_pop(L, 1);
+// 在事务中取得库的 dbi. 句柄可能已关闭, 槽位也可能给了别的库, 按库名打开
+static int
+lmdb_dbx_dbi(MDB_txn *txn, const lmdb_dbx *dbx, MDB_dbi *dbi)
+{
+  return mdb_dbi_open(txn, dbx->name, 0, dbi);
+}
 
-  lua_getfield(L, 2, "mapsize");
-  size = luaL_optinteger(L, -1, 4 * 1024 * 1024);  // 默认 4MB
-  lua_pop(L, 1);
+static void
+lmdb_hotkeys_free(lmdb_hotkeys *hot)
+{
+  int i;
+  if (hot == NULL) return;
+  for (i = 0; i < hot->n; i++) free(hot->heap[i].key);
+  free(hot);
+}
 
-  lua_getfield(L, 2, "maxreaders");
-  maxreaders = luaL_optinteger(L, -1, 1);  // 默认 1
-  lua_pop(L, 1);
+static void
+lmdb_dcache_free(lmdb_dcache *c)
+{
+  int i;
+  if (c == NULL) return;
+  for (i = 0; i < c->n; i++) free(c->slot[i].key);
+  free(c);
+}
 
-  env = (lmdb_env *)lua_newuserdata(L, sizeof(lmdb_env));
-  if (env == NULL) {
-    return lmdb_pusherror(L, ENOMEM);
+static void
+lmdb_ts_free(lmdb_ts *ts)
+{
+  size_t i;
+  if (ts == NULL) return;
+  for (i = 0; i < ts->cap; i++) {
+    if (ts->slot[i] == NULL) continue;
+    free(ts->slot[i]->ts);
+    free(ts->slot[i]->val);
+    free(ts->slot[i]);
   }
+  free(ts->slot);
+  free(ts);
+}
 
-  ret = mdb_env_create(&env->env);
-  if (ret != MDB_SUCCESS) {
-    return lmdb_pusherror(L, ret);
+// 写事务结束时处理它写成块的点: 提交了就移出缓冲, 否则重新算作未写入.
+// 与 lmdb_index_settle 一样, 每条结束路径都要调用
+static void
+lmdb_ts_settle(lmdb_env *env, MDB_txn *txn, int committed)
+{
+  lmdb_tsbuf *b;
+  size_t      i, j;
+
+  for (i = 0; i < env->capdbx; i++) {
+    if (env->dbx[i] == NULL || env->dbx[i]->ts == NULL) continue;
+    for (j = 0; j < env->dbx[i]->ts->cap; j++) {
+      b = env->dbx[i]->ts->slot[j];
+      if (b == NULL || b->flushed == 0 || b->ftxn != txn) continue;
+      if (committed) {
+        b->n -= b->flushed;
+        memmove(b->ts, b->ts + b->flushed, b->n * sizeof(int64_t));
+        memmove(b->val, b->val + b->flushed, b->n * sizeof(double));
+      }
+      b->flushed = 0;
+      b->ftxn = NULL;
+    }
   }
+}
 
-  ret = mdb_env_set_maxreaders(env->env, maxreaders);
-  if (ret != MDB_SUCCESS) {
-    return lmdb_pusherror(L, ret);
+static void
+lmdb_slowlog_free(lmdb_slowlog *slow)
+{
+  int i;
+  if (slow == NULL) return;
+  for (i = 0; i < slow->size; i++) free(slow->ring[i].dbi);
+  free(slow);
+}
+
+// 释放共享快照的一个引用. 最后一个引用释放读者槽, 缓存的快照留待 renew
+static void
+lmdb_snap_release(lmdb_env *env, lmdb_snap *snap)
+{
+  lmdb_snap **pp;
+
+  if (--snap->refs > 0) return;
+  if (snap->cached) {
+    mdb_txn_reset(snap->txn);
+    return;
   }
+  if (snap->txn) {
+    mdb_txn_abort(snap->txn);
+    for (pp = &env->snaps; *pp != snap; pp = &(*pp)->next)
+      ;
+    *pp = snap->next;
+  }
+  free(snap);
+}
 
-  ret = mdb_env_set_mapsize(env->env, size);
-  if (ret != MDB_SUCCESS) {
-    return lmdb_pusherror(L, ret);
+static void
+lmdb_env_freedbx(lmdb_env *env)
+{
+  size_t i;
+  for (i = 0; i < env->capdbx; i++) {
+    if (env->dbx[i]) {
+      lmdb_index *ix, *next;
+      for (ix = env->dbx[i]->index; ix; ix = next) {
+        next = ix->next;
+        free(ix);
+      }
+      lmdb_hotkeys_free(env->dbx[i]->hot);
+      lmdb_dcache_free(env->dbx[i]->cache);
+      lmdb_ts_free(env->dbx[i]->ts);
+      free(env->dbx[i]->name);
+      free(env->dbx[i]);
+    }
   }
+  free(env->dbx);
+  env->dbx = NULL;
+  env->ndbx = env->capdbx = 0;
+  lmdb_slowlog_free(env->slow);
+  env->slow = NULL;
+}
 
-  ret = mdb_env_open(env->env, path, flags, mode);
-  if (ret != MDB_SUCCESS) {
-    return lmdb_pusherror(L, ret);
+static long
+lmdb_majflt(void)
+{
+  struct rusage ru;
+#ifdef RUSAGE_THREAD
+  if (getrusage(RUSAGE_THREAD, &ru) == 0) return ru.ru_majflt;
+#else
+  if (getrusage(RUSAGE_SELF, &ru) == 0) return ru.ru_majflt;
+#endif
+  return -1;
+}
+
+static mdb_size_t
+lmdb_spilled(MDB_txn *txn)
+{
+  MDB_txnstat info;
+  if (txn && mdb_txn_info(txn, &info) == MDB_SUCCESS) return info.mi_spill_pages;
+  return 0;
+}
+
+// 操作开始计时, 未开启慢日志时无开销
+static inline void
+lmdb_slow_begin(lmdb_env *env, lmdb_slowclock *clk, MDB_txn *txn)
+{
+  if (env == NULL || env->slow == NULL) return;
+  if (env->slow->detail) {
+    clk->majflt = lmdb_majflt();
+    clk->spill = lmdb_spilled(txn);
   }
+  clock_gettime(CLOCK_MONOTONIC, &clk->ts);
+}
 
-  luaL_getmetatable(L, LUA_LMDB_ENV);
-  lua_setmetatable(L, -2);
+static void
+lmdb_slow_record(lmdb_env       *env,
+                 lmdb_slowclock *clk,
+                 double          usec,
+                 const char     *op,
+                 lmdb_dbx       *dbx,
+                 mdb_size_t      txnid,
+                 MDB_txn        *txn,
+                 const MDB_val  *key)
+{
+  lmdb_slowlog *slow = env->slow;
+  lmdb_slowop  *rec = &slow->ring[slow->next];
+
+  rec->op = op;
+  free(rec->dbi);
+  rec->dbi = dbx && dbx->name ? strdup(dbx->name) : NULL;
+  rec->klen = key ? key->mv_size : 0;
+  rec->khash = key ? lmdb_hash(key) : 0;
+  if (key) {
+    memcpy(rec->key, key->mv_data, rec->klen < LMDB_SLOW_KEYLEN ? rec->klen : LMDB_SLOW_KEYLEN);
+  }
+  rec->usec = usec;
+  rec->txnid = txnid;
+  rec->majflt = -1;
+  rec->spilled = -1;
+  if (slow->detail) {
+    long majflt = lmdb_majflt();
+    if (majflt >= 0 && clk->majflt >= 0) rec->majflt = majflt - clk->majflt;
+    if (txn) rec->spilled = lmdb_spilled(txn) != clk->spill;
+  }
 
-  return 1;
+  slow->next = (slow->next + 1) % slow->size;
+  slow->count++;
 }
 
-/***
-A env class
+// 操作结束, 超过阈值时记录上下文; txn 为 NULL 表示事务已结束
+static inline void
+lmdb_slow_end(lmdb_env       *env,
+              lmdb_slowclock *clk,
+              const char     *op,
+              lmdb_dbx       *dbx,
+              mdb_size_t      txnid,
+              MDB_txn        *txn,
+              const MDB_val  *key)
+{
+  struct timespec now;
+  double          usec;
+
+  if (env == NULL || env->slow == NULL) return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  usec = (now.tv_sec - clk->ts.tv_sec) * 1e6 + (now.tv_nsec - clk->ts.tv_nsec) / 1e3;
+  if (usec >= env->slow->threshold) {
+    lmdb_slow_record(env, clk, usec, op, dbx, txnid, txn, key);
+  }
+}
 
-@type env
-*/
+// 哈希为 h 的堆元素在表中的位置, 不在堆中时为它该放的空位
+static int *
+lmdb_hotkeys_find(lmdb_hotkeys *hot, uint64_t h)
+{
+  size_t i = (size_t)h & hot->mask;
+  while (hot->pos[i] && hot->heap[hot->pos[i] - 1].hash != h) i = (i + 1) & hot->mask;
+  return &hot->pos[i];
+}
 
-/***
-Close an opened LMDB file
-@function close
-@tparam env handle of env to close
-*/
-static int
-lmdb_close(lua_State *L)
+// 从表中去掉 h, 后面同一探测链上的项前移补位
+static void
+lmdb_hotkeys_unmap(lmdb_hotkeys *hot, uint64_t h)
 {
-  lmdb_env *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
-  if (env->env) {
-    void *ctx = mdb_env_get_userctx(env->env);
-    if (ctx) {
-      int ref = (int)(intptr_t)ctx;
-      luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  size_t i = (size_t)(lmdb_hotkeys_find(hot, h) - hot->pos), j = i, home;
+
+  hot->pos[i] = 0;
+  for (;;) {
+    j = (j + 1) & hot->mask;
+    if (hot->pos[j] == 0) break;
+    home = (size_t)hot->heap[hot->pos[j] - 1].hash & hot->mask;
+    if (((j - home) & hot->mask) >= ((j - i) & hot->mask)) {
+      hot->pos[i] = hot->pos[j];
+      hot->pos[j] = 0;
+      i = j;
     }
-    mdb_env_close(env->env);
-    env->env = NULL;
   }
-  return 0;
 }
 
-struct msg_ctx
+// 交换两个堆元素, 先找到两者在表中的位置再搬动
+static void
+lmdb_hotkeys_swap(lmdb_hotkeys *hot, int i, int j)
 {
-  lua_State *L;
-  int        ref;
-};
+  int        *a = lmdb_hotkeys_find(hot, hot->heap[i].hash);
+  int        *b = lmdb_hotkeys_find(hot, hot->heap[j].hash);
+  lmdb_hotkey tmp = hot->heap[i];
+
+  hot->heap[i] = hot->heap[j];
+  hot->heap[j] = tmp;
+  *a = j + 1;
+  *b = i + 1;
+}
 
-static int
-lmdb_msg(const char *msg, void *ctx)
+static void
+lmdb_hotkeys_sift(lmdb_hotkeys *hot, int i)
 {
-  struct msg_ctx *mctx = (struct msg_ctx *)ctx;
-  lua_State      *L = mctx->L;
-  int             ret;
+  for (;;) {
+    int l = 2 * i + 1, r = l + 1, m = i;
+    if (l < hot->n && hot->heap[l].count < hot->heap[m].count) m = l;
+    if (r < hot->n && hot->heap[r].count < hot->heap[m].count) m = r;
+    if (m == i) break;
+    lmdb_hotkeys_swap(hot, i, m);
+    i = m;
+  }
+}
 
-  lua_rawgeti(L, LUA_REGISTRYINDEX, mctx->ref);
-  lua_pushstring(L, msg);
-  ret = lua_pcall(L, 1, 1, 0);
-  if (ret == 0) {
-    return 0;
-  } else {
-    fprintf(stderr, "error in reader_list: %s\n", lua_tostring(L, -1));
-    lua_pop(L, 1);
+// 记录一次键访问: 更新 sketch, 估计值进入 top-K 时替换堆顶
+static void
+lmdb_hotkeys_touch(lmdb_hotkeys *hot, const MDB_val *key)
+{
+  uint64_t h = lmdb_hash(key);
+  uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1, est = UINT32_MAX;
+  int     *p;
+  int      d, i;
+
+  for (d = 0; d < LMDB_HOT_DEPTH; d++) {
+    uint32_t *c = &hot->sketch[d][(h1 + d * h2) % LMDB_HOT_WIDTH];
+    if (*c < UINT32_MAX) (*c)++;
+    if (*c < est) est = *c;
   }
 
-  return -1;
-};
+  p = lmdb_hotkeys_find(hot, h);
+  if (*p) {
+    i = *p - 1;
+    hot->heap[i].count = est;
+    lmdb_hotkeys_sift(hot, i);
+    return;
+  }
+
+  if (hot->n < hot->k) {
+    i = hot->n;
+    hot->heap[i].key = NULL;
+    hot->heap[i].klen = 0;
+  } else if (est > hot->heap[0].count) {
+    i = 0;
+  } else {
+    return;
+  }
+
+  if (hot->heap[i].klen < key->mv_size || hot->heap[i].key == NULL) {
+    char *k = (char *)realloc(hot->heap[i].key, key->mv_size + 1);
+    if (k == NULL) return;
+    hot->heap[i].key = k;
+  }
+  if (i == hot->n) {
+    hot->n++;
+  } else {
+    lmdb_hotkeys_unmap(hot, hot->heap[i].hash);
+    p = lmdb_hotkeys_find(hot, h);
+  }
+  *p = i + 1;
+  memcpy(hot->heap[i].key, key->mv_data, key->mv_size);
+  hot->heap[i].klen = key->mv_size;
+  hot->heap[i].hash = h;
+  hot->heap[i].count = est;
+  if (i == 0) {
+    lmdb_hotkeys_sift(hot, 0);
+  } else {
+    // 新元素上浮
+    while (i > 0 && hot->heap[(i - 1) / 2].count > hot->heap[i].count) {
+      lmdb_hotkeys_swap(hot, i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+  }
+}
+
+#define LMDB_HOT_TOUCH(dbi, key)                                                                   \
+  if ((dbi)->dbx && (dbi)->dbx->hot) lmdb_hotkeys_touch((dbi)->dbx->hot, (key))
+
+static lmdb_dcache *
+lmdb_dcache_new(size_t budget, int n)
+{
+  lmdb_dcache *c;
+  int          i;
+
+  c = (lmdb_dcache *)calloc(1, sizeof(lmdb_dcache) + (n - 1) * sizeof(lmdb_dcentry) + n * sizeof(int));
+  if (c == NULL) return NULL;
+  c->budget = budget;
+  c->n = n;
+  c->bucket = (int *)(c->slot + n);
+  for (i = 0; i < n; i++) c->bucket[i] = -1;
+  return c;
+}
+
+static int
+lmdb_dcache_find(lmdb_dcache *c, const MDB_val *key, uint64_t h)
+{
+  int i;
+  for (i = c->bucket[h % c->n]; i >= 0; i = c->slot[i].next) {
+    lmdb_dcentry *e = &c->slot[i];
+    if (e->hash == h && e->klen == key->mv_size && memcmp(e->key, key->mv_data, e->klen) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// 移除一项, t 为编解码表在栈上的位置
+static void
+lmdb_dcache_drop(lua_State *L, int t, lmdb_dcache *c, int i)
+{
+  lmdb_dcentry *e = &c->slot[i];
+  int          *p = &c->bucket[e->hash % c->n];
+
+  while (*p != i) p = &c->slot[*p].next;
+  *p = e->next;
+  free(e->key);
+  e->key = NULL;
+  c->bytes -= e->size;
+  lua_pushnil(L);
+  lua_rawseti(L, t, i + 1);
+}
+
+// 为新项取得一个槽, 按 CLOCK 淘汰直到预算够用; 放不下时返回 -1.
+// 值由调用方存入编解码表
+static int
+lmdb_dcache_insert(lua_State *L, int t, lmdb_dcache *c, const MDB_val *key, uint64_t h, size_t size,
+                   mdb_size_t tag)
+{
+  lmdb_dcentry *e;
+  char         *k;
+  int           i = -1;
+
+  if (size > c->budget) return -1;
+  k = (char *)malloc(key->mv_size ? key->mv_size : 1);
+  if (k == NULL) return -1;
+  while (i < 0 || c->bytes + size > c->budget) {
+    e = &c->slot[c->hand];
+    if (e->key && e->used) {
+      e->used = 0;
+    } else {
+      if (e->key) lmdb_dcache_drop(L, t, c, c->hand);
+      if (i < 0) i = c->hand;
+    }
+    c->hand = (c->hand + 1) % c->n;
+  }
+  e = &c->slot[i];
+  memcpy(k, key->mv_data, key->mv_size);
+  e->key = k;
+  e->klen = key->mv_size;
+  e->size = size;
+  e->hash = h;
+  e->tag = tag;
+  e->used = 0;
+  e->next = c->bucket[h % c->n];
+  c->bucket[h % c->n] = i;
+  c->bytes += size;
+  return i;
+}
+
+// 事务快照中本库的版本, 即最后一次修改它的提交; 写事务或无法确定时返回 0.
+// 本环境的提交按库记账, 其它进程或环境对象的提交视为修改了所有库
+static mdb_size_t
+lmdb_dbx_version(lmdb_env *env, lmdb_dbx *dbx, MDB_txn *txn)
+{
+  MDB_envinfo info;
+  mdb_size_t  id = mdb_txn_id(txn), v;
+
+  if (mdb_env_info(env->env, &info) != MDB_SUCCESS || id > info.me_last_txnid) return 0;
+  if (id > env->known) env->foreign = env->known = id;
+  v = dbx->touched > env->foreign ? dbx->touched : env->foreign;
+  return v <= id ? v : 0;
+}
+
+// 提交前记下写事务修改了哪些带缓存的库, 返回是否为写事务
+static int
+lmdb_env_precommit(lmdb_env *env, MDB_txn *txn)
+{
+  MDB_envinfo info;
+  mdb_size_t  id = mdb_txn_id(txn);
+  MDB_dbi     dbi;
+  size_t      i;
+  int         dirty;
+
+  if (mdb_env_info(env->env, &info) != MDB_SUCCESS || id <= info.me_last_txnid) return 0;
+  for (i = 0; i < env->capdbx; i++) {
+    if (env->dbx[i] && env->dbx[i]->cache && lmdb_dbx_dbi(txn, env->dbx[i], &dbi) == MDB_SUCCESS &&
+        mdb_dbi_dirty(txn, dbi, &dirty) == MDB_SUCCESS && dirty)
+      env->dbx[i]->pending = id;
+  }
+  return 1;
+}
+
+// 写事务提交成功后记账. 嵌套事务不落盘, 与其它提交交错时留给读方当作外来提交
+static void
+lmdb_env_committed(lmdb_env *env, mdb_size_t id)
+{
+  MDB_envinfo info;
+  size_t      i;
+
+  if (mdb_env_info(env->env, &info) != MDB_SUCCESS || info.me_last_txnid != id || id <= env->known)
+    return;
+  if (id > env->known + 1) env->foreign = id - 1;
+  env->known = id;
+  for (i = 0; i < env->capdbx; i++) {
+    if (env->dbx[i] && env->dbx[i]->pending == id) env->dbx[i]->touched = id;
+  }
+}
+
+// 从值中提取索引键, 字段不存在或为空时返回 0
+static int
+lmdb_index_extract(const lmdb_index *ix, const MDB_val *val, MDB_val *out)
+{
+  const char *p = (const char *)val->mv_data, *end = p + val->mv_size;
+  int         field;
+
+  if (ix->sep < 0) {
+    if (ix->offset >= val->mv_size) return 0;
+    if (ix->size && ix->size > val->mv_size - ix->offset) return 0;
+    out->mv_data = (void *)(p + ix->offset);
+    out->mv_size = ix->size ? ix->size : val->mv_size - ix->offset;
+    return 1;
+  }
+  for (field = 1; field < ix->field; field++) {
+    p = memchr(p, ix->sep, end - p);
+    if (p == NULL) return 0;
+    p++;
+  }
+  out->mv_data = (void *)p;
+  p = memchr(p, ix->sep, end - p);
+  out->mv_size = (p ? p : end) - (const char *)out->mv_data;
+  return out->mv_size > 0;
+}
+
+// 索引在 txn 中是否生效: 已提交的注册, 或 txn 自己尚未提交的注册.
+// txn 重新注册过的索引库, 旧的注册在 txn 中让位给新的
+static int
+lmdb_index_active(const lmdb_dbx *dbx, const lmdb_index *ix, MDB_txn *txn)
+{
+  const lmdb_index *p;
+
+  if (ix->txn) return ix->txn == txn;
+  for (p = dbx->index; p; p = p->next)
+    if (p->txn == txn && p->target == ix->target) return 0;
+  return 1;
+}
+
+// 写事务结束时处理它注册的索引: 提交了就生效并顶替同一索引库的旧注册, 否则丢弃.
+// 顶级写事务共用同一个 MDB_txn, 每条结束路径都要调用
+static void
+lmdb_index_settle(lmdb_env *env, MDB_txn *txn, int committed)
+{
+  lmdb_index *ix, **pp, **qq;
+  lmdb_dbx   *dbx;
+  size_t      i;
+
+  for (i = 0; i < env->capdbx; i++) {
+    if ((dbx = env->dbx[i]) == NULL) continue;
+    for (pp = &dbx->index; *pp;) {
+      ix = *pp;
+      if (ix->txn != txn) {
+        pp = &ix->next;
+        continue;
+      }
+      if (!committed) {
+        lmdb_dbx   *target = ix->target;
+        lmdb_index *p;
+        *pp = ix->next;
+        free(ix);
+        for (p = dbx->index; p && p->target != target; p = p->next)
+          ;
+        if (p == NULL && target->primary == dbx) target->primary = NULL;
+        continue;
+      }
+      ix->txn = NULL;
+      ix->target->primary = dbx;
+      for (qq = &dbx->index; *qq;) {
+        if (*qq != ix && (*qq)->txn == NULL && (*qq)->target == ix->target) {
+          lmdb_index *old = *qq;
+          *qq = old->next;
+          free(old);
+        } else {
+          qq = &(*qq)->next;
+        }
+      }
+      pp = &dbx->index;
+    }
+  }
+}
+
+// 写入或删除主库记录并维护其二级索引, val 为 NULL 时删除.
+// 旧索引键先复制到栈上, 之后的写入可能使映射中的旧值失效.
+// 写主库前先检查新索引键不超过键长上限, 此后的写入只会因空间不足之类失败,
+// LMDB 会把整个事务标为出错, 不会提交一个缺了索引项的记录
+static int
+lmdb_index_write(lua_State *L, lmdb_dbi *dbi, MDB_val *key, MDB_val *val, unsigned int flags)
+{
+  lmdb_index *ix;
+  MDB_val     old, o, n;
+  int         top = lua_gettop(L), i, rc;
+
+  if (val && (flags & MDB_RESERVE)) return EINVAL;
+  for (ix = dbi->dbx->index; val && ix; ix = ix->next)
+    if (lmdb_index_active(dbi->dbx, ix, dbi->txn) && lmdb_index_extract(ix, val, &n) &&
+        n.mv_size > (size_t)mdb_env_get_maxkeysize(dbi->env->env))
+      return MDB_BAD_VALSIZE;
+  rc = mdb_get(dbi->txn, dbi->dbi, key, &old);
+  if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) return rc;
+  for (ix = dbi->dbx->index; ix; ix = ix->next) {
+    luaL_checkstack(L, 1, NULL);
+    if (rc == MDB_SUCCESS && lmdb_index_active(dbi->dbx, ix, dbi->txn) && lmdb_index_extract(ix, &old, &o))
+      lua_pushlstring(L, (const char *)o.mv_data, o.mv_size);
+    else
+      lua_pushnil(L);
+  }
+
+  rc = val ? mdb_put(dbi->txn, dbi->dbi, key, val, flags) : mdb_del(dbi->txn, dbi->dbi, key, NULL);
+  for (ix = dbi->dbx->index, i = top + 1; ix && rc == MDB_SUCCESS; ix = ix->next, i++) {
+    MDB_dbi d;
+    int     has_new;
+    if (!lmdb_index_active(dbi->dbx, ix, dbi->txn)) continue;
+    rc = lmdb_dbx_dbi(dbi->txn, ix->target, &d);
+    if (rc != MDB_SUCCESS) break;
+    has_new = val && lmdb_index_extract(ix, val, &n);
+    if (lua_isstring(L, i)) {
+      o.mv_data = (void *)lua_tolstring(L, i, &o.mv_size);
+      if (has_new && n.mv_size == o.mv_size && memcmp(n.mv_data, o.mv_data, n.mv_size) == 0)
+        continue;
+      rc = mdb_del(dbi->txn, d, &o, key);
+      if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+    }
+    if (has_new && rc == MDB_SUCCESS) rc = mdb_put(dbi->txn, d, &n, key, 0);
+  }
+  lua_settop(L, top);
+  return rc;
+}
+
+// 过期键: 截止时间为毫秒级 Unix 时间. 两个环境级的库记录所有带过期时间的键:
+// 截止时间索引按时间排序, 供批量清理; 截止时间表供读取时检查
+#define LMDB_TTL_INDEX   "__ttl"      // 截止时间 -> 库名\0键, INTEGERKEY | DUPSORT
+#define LMDB_TTL_EXPIRES "__expires"  // 库名\0键 -> 截止时间
+
+static mdb_size_t
+lmdb_ttl_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (mdb_size_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 在栈顶压入过期表中的键, 主库的库名为空串
+static MDB_val
+lmdb_ttl_ref(lua_State *L, lmdb_dbx *dbx, const MDB_val *key)
+{
+  MDB_val ref;
+  lua_pushstring(L, dbx->name ? dbx->name : "");
+  lua_pushlstring(L, "", 1);
+  lua_pushlstring(L, (const char *)key->mv_data, key->mv_size);
+  lua_concat(L, 3);
+  ref.mv_data = (void *)lua_tolstring(L, -1, &ref.mv_size);
+  return ref;
+}
+
+// 本库是否有带过期时间的键. 没有的结论只在查到它的快照内有效, 别的进程或句柄
+// 随后可能写入带过期时间的键, 换了事务号就重查一次截止时间表
+static int
+lmdb_ttl_used(lua_State *L, lmdb_dbi *dbi)
+{
+  MDB_dbi     ex;
+  MDB_cursor *cur;
+  MDB_val     prefix = { 0, "" }, k, v;
+  mdb_size_t  id = mdb_txn_id(dbi->txn);
+
+  if (dbi->dbx->ttl == 0 || (dbi->dbx->ttl < 0 && dbi->dbx->ttl_txn != id)) {
+    dbi->dbx->ttl = -1;
+    dbi->dbx->ttl_txn = id;
+    if (mdb_dbi_open(dbi->txn, LMDB_TTL_EXPIRES, 0, &ex) == MDB_SUCCESS &&
+        mdb_cursor_open(dbi->txn, ex, &cur) == MDB_SUCCESS) {
+      k = prefix = lmdb_ttl_ref(L, dbi->dbx, &prefix);
+      if (mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE) == MDB_SUCCESS && k.mv_size >= prefix.mv_size &&
+          memcmp(k.mv_data, prefix.mv_data, prefix.mv_size) == 0)
+        dbi->dbx->ttl = 1;
+      lua_pop(L, 1);
+      mdb_cursor_close(cur);
+    }
+  }
+  return dbi->dbx->ttl > 0;
+}
+
+// 键的截止时间在过期表中的位置
+typedef struct
+{
+  MDB_dbi ix, ex;
+  MDB_val ref;  // 库名\0键, 字符串在栈顶
+} lmdb_ttlref;
+
+// 在写入键之前打开过期表并检查库名\0键不超过键长上限, 成功时在栈顶压入 ref.
+// 此后改写过期表只会因空间不足之类失败, LMDB 会把整个事务标为出错, 不会提交
+// 一个没有截止时间的值. 不设截止时间时, 过期表不存在或 ref 过长都表示键没有截止时间,
+// 返回 MDB_NOTFOUND
+static int
+lmdb_ttl_prepare(lua_State *L, lmdb_dbi *dbi, const MDB_val *key, int create, lmdb_ttlref *t)
+{
+  int rc = mdb_dbi_open(dbi->txn, LMDB_TTL_EXPIRES, create ? MDB_CREATE : 0, &t->ex);
+  if (rc == MDB_SUCCESS)
+    rc = mdb_dbi_open(dbi->txn, LMDB_TTL_INDEX, MDB_CREATE | MDB_INTEGERKEY | MDB_DUPSORT, &t->ix);
+  if (rc != MDB_SUCCESS) return rc;
+  t->ref = lmdb_ttl_ref(L, dbi->dbx, key);
+  if (t->ref.mv_size > (size_t)mdb_env_get_maxkeysize(dbi->env->env)) {
+    lua_pop(L, 1);
+    return create ? MDB_BAD_VALSIZE : MDB_NOTFOUND;
+  }
+  return MDB_SUCCESS;
+}
+
+// 设置或清除 (deadline 为 0) 键的截止时间, 在键所在的写事务中
+static int
+lmdb_ttl_set(lmdb_dbi *dbi, const lmdb_ttlref *t, mdb_size_t deadline)
+{
+  MDB_dbi    ix = t->ix, ex = t->ex;
+  MDB_val    ref = t->ref, d, old;
+  mdb_size_t at;
+  int        rc;
+
+  rc = mdb_get(dbi->txn, ex, &ref, &old);
+  if (rc == MDB_SUCCESS && old.mv_size == sizeof(at)) {
+    memcpy(&at, old.mv_data, sizeof(at));
+    d.mv_data = &at;
+    d.mv_size = sizeof(at);
+    rc = mdb_del(dbi->txn, ix, &d, &ref);
+    if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+    if (rc == MDB_SUCCESS && deadline == 0) rc = mdb_del(dbi->txn, ex, &ref, NULL);
+  }
+  if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+  if (rc == MDB_SUCCESS && deadline) {
+    d.mv_data = &deadline;
+    d.mv_size = sizeof(deadline);
+    rc = mdb_put(dbi->txn, ex, &ref, &d, 0);
+    if (rc == MDB_SUCCESS) rc = mdb_put(dbi->txn, ix, &d, &ref, 0);
+    if (rc == MDB_SUCCESS) dbi->dbx->ttl = 1;
+  }
+  return rc;
+}
+
+// 键已过期时返回 MDB_NOTFOUND
+static int
+lmdb_ttl_check(lua_State *L, lmdb_dbi *dbi, const MDB_val *key)
+{
+  MDB_dbi    ex;
+  MDB_val    ref, d;
+  mdb_size_t at;
+  int        rc;
+
+  if (!lmdb_ttl_used(L, dbi) || mdb_dbi_open(dbi->txn, LMDB_TTL_EXPIRES, 0, &ex) != MDB_SUCCESS)
+    return MDB_SUCCESS;
+  ref = lmdb_ttl_ref(L, dbi->dbx, key);
+  rc = mdb_get(dbi->txn, ex, &ref, &d);
+  lua_pop(L, 1);
+  if (rc != MDB_SUCCESS || d.mv_size != sizeof(at)) return MDB_SUCCESS;
+  memcpy(&at, d.mv_data, sizeof(at));
+  return at <= lmdb_ttl_now() ? MDB_NOTFOUND : MDB_SUCCESS;
+}
+
+/***
+@section lmdb
+*/
+/***
+Get version of lmdb
+@function version
+@treturn string version string
+@treturn integer major
+@treturn integer minor
+@treturn integer patch
+*/
+static int
+lmdb_version(lua_State *L)
+{
+  int         major, minor, patch;
+  const char *version = mdb_version(&major, &minor, &patch);
+
+  lua_pushstring(L, version);
+  lua_pushinteger(L, major);
+  lua_pushinteger(L, minor);
+  lua_pushinteger(L, patch);
+  return 4;
+};
+
+/***
+Convert errno integer to error message
+@function strerror
+@tparam integer code errno number
+@treturn string error message
+*/
+static int
+lmdb_strerror(lua_State *L)
+{
+  int         err = luaL_checkinteger(L, 1);
+  const char *msg = mdb_strerror(err);
+  lua_pushstring(L, msg);
+  return 1;
+}
+
+/***
+options for open api
+
+@field maxreaders[opt=1] maximum number of readers allowed
+@field flags flags for `mdb_env_open`
+@field mode mode The UNIX permissions to set on created files and semaphores,
+default 0664
+@field mapsize[opt=4M] mapsize for `mdb_env_set_mapsize`, default 4MB
+@field maxdbs[opt=0] maximum number of named databases, for `mdb_env_set_maxdbs`
+@table options
+*/
+/***
+Open a lmdb file
+@function open
+@tparam string path the path to the LMDB file
+@tparam[opt] table options the options to use when creating or opening the LMDB
+file
+@treturn[1] env object
+@return[2] fail
+@see options
+*/
+static int
+lmdb_open(lua_State *L)
+{
+  const char  *path = luaL_checkstring(L, 1);
+  unsigned int flags;
+  mdb_mode_t   mode;
+  size_t       size;
+  int          ret, maxreaders, maxdbs;
+  lmdb_env    *env;
+
+  if (lua_gettop(L) == 1) lua_newtable(L);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  lua_getfield(L, 2, "flags");
+  flags = luaL_optinteger(L, -1, MDB_FIXEDMAP | MDB_CREATE);
+  lua_pop(L, 1);
+
+  lua_getfield(L, 2, "mode");
+  mode = luaL_optinteger(L, -1, 0664);
+  lua_pop(L, 1);
+
+  lua_getfield(L, 2, "mapsize");
+  size = luaL_optinteger(L, -1, 4 * 1024 * 1024);  // 默认 4MB
+  lua_pop(L, 1);
+
+  lua_getfield(L, 2, "maxreaders");
+  maxreaders = luaL_optinteger(L, -1, 1);  // 默认 1
+  lua_pop(L, 1);
+
+  lua_getfield(L, 2, "maxdbs");
+  maxdbs = luaL_optinteger(L, -1, 0);  // 默认只有主数据库
+  lua_pop(L, 1);
+
+  env = (lmdb_env *)lua_newuserdata(L, sizeof(lmdb_env));
+  if (env == NULL) {
+    return lmdb_pusherror(L, ENOMEM);
+  }
+  env->dbx = NULL;
+  env->ndbx = env->capdbx = 0;
+  env->slow = NULL;
+  env->snap = NULL;
+  env->snaps = NULL;
+  env->known = 0;
+  env->foreign = 0;
+
+  ret = mdb_env_create(&env->env);
+  if (ret != MDB_SUCCESS) {
+    return lmdb_pusherror(L, ret);
+  }
+
+  ret = mdb_env_set_maxreaders(env->env, maxreaders);
+  if (ret != MDB_SUCCESS) {
+    return lmdb_pusherror(L, ret);
+  }
+
+  ret = mdb_env_set_mapsize(env->env, size);
+  if (ret != MDB_SUCCESS) {
+    return lmdb_pusherror(L, ret);
+  }
+
+  if (maxdbs > 0) {
+    ret = mdb_env_set_maxdbs(env->env, maxdbs);
+    if (ret != MDB_SUCCESS) {
+      return lmdb_pusherror(L, ret);
+    }
+  }
+
+  ret = mdb_env_open(env->env, path, flags, mode);
+  if (ret != MDB_SUCCESS) {
+    return lmdb_pusherror(L, ret);
+  }
+
+  luaL_getmetatable(L, LUA_LMDB_ENV);
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+// 倒排表: 一个 DUPSORT 键下的全部值, 按 dup 顺序遍历.
+// 作为驱动表顺序读取, DUPFIXED 时按页批量读取; 作为探测表时只向前跳转
+typedef struct
+{
+  lmdb_dbi   *dbi;
+  MDB_cursor *cursor;
+  MDB_val     key;
+  MDB_val     val;    // 当前值
+  MDB_val     batch;  // 批量读取的当前页
+  size_t      size;   // DUPFIXED 的值长度, 0 表示逐个读取
+  size_t      next;   // 批量页中下一个值的偏移
+  mdb_size_t  count;
+  int         state;  // 0 刚定位, 1 遍历中, -1 已读完
+} lmdb_posting;
+
+// 读取下一个值, 读完时返回 MDB_NOTFOUND
+static int
+lmdb_posting_next(lmdb_posting *p)
+{
+  int rc;
+
+  if (p->state < 0) return MDB_NOTFOUND;
+  if (p->size && p->next < p->batch.mv_size) {
+    p->val.mv_data = (char *)p->batch.mv_data + p->next;
+    p->next += p->size;
+    return MDB_SUCCESS;
+  }
+  if (p->size) {
+    rc = mdb_cursor_get(p->cursor, &p->key, &p->batch, p->state ? MDB_NEXT_MULTIPLE : MDB_GET_MULTIPLE);
+    p->state = 1;
+    if (rc == MDB_SUCCESS) {
+      p->next = 0;
+      return lmdb_posting_next(p);
+    }
+  } else if (p->state == 0) {
+    p->state = 1;
+    return MDB_SUCCESS;
+  } else {
+    rc = mdb_cursor_get(p->cursor, &p->key, &p->val, MDB_NEXT_DUP);
+  }
+  if (rc == MDB_NOTFOUND) p->state = -1;
+  return rc;
+}
+
+// 跳到第一个不小于 target 的值
+static int
+lmdb_posting_seek(lmdb_posting *p, const MDB_val *target)
+{
+  MDB_val key = p->key;
+  int     rc;
+
+  p->val = *target;
+  rc = mdb_cursor_get(p->cursor, &key, &p->val, MDB_GET_BOTH_RANGE);
+  if (rc == MDB_NOTFOUND) p->state = -1;
+  return rc;
+}
+
+static int
+lmdb_posting_cmp(lmdb_posting *p, const MDB_val *a, const MDB_val *b)
+{
+  return mdb_dcmp(p->dbi->txn, p->dbi->dbi, a, b);
+}
+
+// 解析 { {dbi, key}, ... } 并定位全部游标, 结果数组在栈顶
+static lmdb_posting *
+lmdb_posting_open(lua_State *L, int *n, int *rc)
+{
+  lmdb_posting *p;
+  unsigned int  flags, flags0 = 0;
+  int           i;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  *n = (int)lua_objlen(L, 1);
+  luaL_argcheck(L, *n > 0, 1, "no terms");
+  p = (lmdb_posting *)lua_newuserdata(L, *n * sizeof(lmdb_posting));
+  memset(p, 0, *n * sizeof(lmdb_posting));
+  for (i = 0; i < *n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    luaL_argcheck(L, lua_istable(L, -1), 1, "term must be {dbi, key}");
+    lua_rawgeti(L, -1, 1);
+    p[i].dbi = (lmdb_dbi *)luaL_checkudata(L, -1, LUA_LMDB_DBI);
+    lua_rawgeti(L, -2, 2);
+    luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1, "term key must be a string");
+    p[i].key.mv_data = (void *)lua_tolstring(L, -1, &p[i].key.mv_size);
+    // 键字符串由参数表引用, 弹出后仍然有效
+    lua_pop(L, 3);
+    luaL_argcheck(L, p[i].dbi->txn == p[0].dbi->txn, 1, "terms must share a transaction");
+  }
+
+  for (i = 0, *rc = MDB_SUCCESS; i < *n && *rc == MDB_SUCCESS; i++) {
+    *rc = mdb_dbi_flags(p[i].dbi->txn, p[i].dbi->dbi, &flags);
+    if (*rc != MDB_SUCCESS) break;
+    if (i == 0) flags0 = flags;
+    if (!(flags & MDB_DUPSORT) ||
+        (flags & (MDB_INTEGERDUP | MDB_REVERSEDUP)) != (flags0 & (MDB_INTEGERDUP | MDB_REVERSEDUP))) {
+      *rc = MDB_INCOMPATIBLE;
+      break;
+    }
+    *rc = mdb_cursor_open(p[i].dbi->txn, p[i].dbi->dbi, &p[i].cursor);
+    if (*rc != MDB_SUCCESS) break;
+    *rc = mdb_cursor_get(p[i].cursor, &p[i].key, &p[i].val, MDB_SET);
+    if (*rc == MDB_SUCCESS) *rc = mdb_cursor_count(p[i].cursor, &p[i].count);
+    if (*rc == MDB_NOTFOUND) {
+      p[i].state = -1;
+      *rc = MDB_SUCCESS;
+    }
+    // 单个值不在子库中, GET_MULTIPLE 取不到
+    if ((flags & MDB_DUPFIXED) && p[i].count > 1) p[i].size = p[i].val.mv_size;
+  }
+  return p;
+}
+
+static void
+lmdb_posting_close(lmdb_posting *p, int n)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    if (p[i].cursor) mdb_cursor_close(p[i].cursor);
+    p[i].cursor = NULL;
+  }
+}
+
+#define LMDB_POSTING_EMIT(L, v, i)                                                                 \
+  do {                                                                                             \
+    lua_pushlstring(L, (const char *)(v)->mv_data, (v)->mv_size);                                  \
+    lua_rawseti(L, -2, ++(i));                                                                     \
+  } while (0)
+
+/***
+Intersect posting lists.
+
+Each term names the duplicates of one key in a `DUPSORT` database; all terms
+must share a transaction and the duplicate sort order. The shortest list
+drives, the others skip ahead with `GET_BOTH_RANGE`, and `DUPFIXED` lists are
+read a page at a time.
+
+@function intersect
+@tparam table terms `{ {dbi, key}, ... }`
+@treturn[1] table the values present under every term, in sort order
+@return[2] fail
+@usage
+  local docs = lmdb.intersect{ {terms, "lua"}, {terms, "lmdb"} }
+*/
+static int
+lmdb_intersect(lua_State *L)
+{
+  int           n, rc, i, j, k = 0, have_lo = 0;
+  lmdb_posting *p = lmdb_posting_open(L, &n, &rc), *drv, tmp;
+  MDB_val       lo;
+
+  // 最短的表作为驱动表, 其余只作探测, 不批量读取
+  for (i = 1; i < n; i++) {
+    if (p[i].count < p[0].count) {
+      tmp = p[0];
+      p[0] = p[i];
+      p[i] = tmp;
+    }
+  }
+  for (i = 1; i < n; i++) p[i].size = 0;
+  drv = &p[0];
+  lua_newtable(L);
+  for (i = 0; i < n && rc == MDB_SUCCESS; i++)
+    if (p[i].state < 0) rc = MDB_NOTFOUND;
+
+  while (rc == MDB_SUCCESS) {
+    if (have_lo && !drv->size) {
+      rc = lmdb_posting_seek(drv, &lo);
+      drv->state = 1;
+    } else {
+      rc = lmdb_posting_next(drv);
+    }
+    if (rc != MDB_SUCCESS) break;
+    if (have_lo && lmdb_posting_cmp(drv, &drv->val, &lo) < 0) continue;
+    have_lo = 0;
+    for (j = 1; j < n; j++) {
+      int c = lmdb_posting_cmp(drv, &p[j].val, &drv->val);
+      if (c < 0) {
+        rc = lmdb_posting_seek(&p[j], &drv->val);
+        if (rc != MDB_SUCCESS) break;
+        c = lmdb_posting_cmp(drv, &p[j].val, &drv->val);
+      }
+      if (c > 0) {
+        lo = p[j].val;
+        have_lo = 1;
+        break;
+      }
+    }
+    if (rc == MDB_SUCCESS && !have_lo) LMDB_POSTING_EMIT(L, &drv->val, k);
+  }
+  lmdb_posting_close(p, n);
+  if (rc != MDB_NOTFOUND) return lmdb_pusherror(L, rc);
+  return 1;
+}
+
+/***
+Merge posting lists.
+
+Takes the same terms as `intersect`.
+
+@function union
+@tparam table terms `{ {dbi, key}, ... }`
+@treturn[1] table the values present under any term, in sort order, once each
+@return[2] fail
+*/
+static int
+lmdb_union(lua_State *L)
+{
+  int           n, rc, i, k = 0;
+  lmdb_posting *p = lmdb_posting_open(L, &n, &rc), *min;
+
+  lua_newtable(L);
+  for (i = 0; i < n && rc == MDB_SUCCESS; i++) {
+    rc = lmdb_posting_next(&p[i]);
+    if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+  }
+  while (rc == MDB_SUCCESS) {
+    for (i = 0, min = NULL; i < n; i++) {
+      if (p[i].state >= 0 && (min == NULL || lmdb_posting_cmp(min, &p[i].val, &min->val) < 0))
+        min = &p[i];
+    }
+    if (min == NULL) break;
+    LMDB_POSTING_EMIT(L, &min->val, k);
+    // 先推进其余相等的表, 最后推进 min 本身, 比较时 min->val 仍然有效
+    for (i = 0; i < n && rc == MDB_SUCCESS; i++) {
+      if (&p[i] != min && p[i].state >= 0 && lmdb_posting_cmp(min, &p[i].val, &min->val) == 0) {
+        rc = lmdb_posting_next(&p[i]);
+        if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+      }
+    }
+    if (rc == MDB_SUCCESS) {
+      rc = lmdb_posting_next(min);
+      if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+    }
+  }
+  lmdb_posting_close(p, n);
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  return 1;
+}
+
+/***
+Subtract posting lists.
+
+Takes the same terms as `intersect`.
+
+@function difference
+@tparam table terms `{ {dbi, key}, ... }`
+@treturn[1] table the values under the first term and under none of the
+others, in sort order
+@return[2] fail
+*/
+static int
+lmdb_difference(lua_State *L)
+{
+  int           n, rc, i, j, k = 0;
+  lmdb_posting *p = lmdb_posting_open(L, &n, &rc);
+
+  for (i = 1; i < n; i++) p[i].size = 0;
+  lua_newtable(L);
+  while (rc == MDB_SUCCESS && (rc = lmdb_posting_next(&p[0])) == MDB_SUCCESS) {
+    for (j = 1; j < n && rc == MDB_SUCCESS; j++) {
+      if (p[j].state < 0) continue;
+      if (lmdb_posting_cmp(p, &p[j].val, &p[0].val) < 0) {
+        rc = lmdb_posting_seek(&p[j], &p[0].val);
+        if (rc == MDB_NOTFOUND) {
+          rc = MDB_SUCCESS;
+          continue;
+        }
+      }
+      if (rc == MDB_SUCCESS && lmdb_posting_cmp(p, &p[j].val, &p[0].val) == 0) break;
+    }
+    if (rc == MDB_SUCCESS && j == n) LMDB_POSTING_EMIT(L, &p[0].val, k);
+  }
+  lmdb_posting_close(p, n);
+  if (rc != MDB_NOTFOUND) return lmdb_pusherror(L, rc);
+  return 1;
+}
+
+// 压缩位图: 一个键的 u32 集合按高 16 位分块, 每块存为 键 + 2 字节大端块号.
+// 块内基数小于 4096 时存有序 u16 数组, 否则存 8192 字节位图, 以长度区分.
+// 数组项和位图的 64 位字都按小端存储, 与主机字节序无关
+#define LMDB_BM_BYTES     8192
+#define LMDB_BM_WORDS     (LMDB_BM_BYTES / 8)
+#define LMDB_BM_ARRAY_MAX 4095
+#define LMDB_BM_KEYMAX    512
+
+static uint16_t
+lmdb_bm_get16(const unsigned char *p)
+{
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static void
+lmdb_bm_put16(unsigned char *p, uint16_t v)
+{
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+}
+
+static uint64_t
+lmdb_bm_get64(const unsigned char *p)
+{
+  uint64_t w = 0;
+  int      i;
+  for (i = 7; i >= 0; i--) w = w << 8 | p[i];
+  return w;
+}
+
+static void
+lmdb_bm_put64(unsigned char *p, uint64_t w)
+{
+  int i;
+  for (i = 0; i < 8; i++, w >>= 8) p[i] = (unsigned char)w;
+}
+
+static void
+lmdb_bm_load(uint64_t *bits, const MDB_val *val)
+{
+  const unsigned char *p = (const unsigned char *)val->mv_data;
+  size_t               i;
+  uint16_t             v;
+
+  if (val->mv_size == LMDB_BM_BYTES) {
+    for (i = 0; i < LMDB_BM_WORDS; i++) bits[i] = lmdb_bm_get64(p + i * 8);
+    return;
+  }
+  memset(bits, 0, LMDB_BM_BYTES);
+  for (i = 0; i + 2 <= val->mv_size; i += 2) {
+    v = lmdb_bm_get16(p + i);
+    bits[v >> 6] |= (uint64_t)1 << (v & 63);
+  }
+}
+
+static int
+lmdb_bm_count(const uint64_t *bits)
+{
+  int i, n = 0;
+  for (i = 0; i < LMDB_BM_WORDS; i++) n += __builtin_popcountll(bits[i]);
+  return n;
+}
+
+static mdb_size_t
+lmdb_bm_card(const MDB_val *val)
+{
+  uint64_t w;
+  size_t   i;
+  int      n = 0;
+
+  if (val->mv_size != LMDB_BM_BYTES) return val->mv_size / 2;
+  for (i = 0; i < LMDB_BM_BYTES; i += 8) {
+    memcpy(&w, (const char *)val->mv_data + i, 8);
+    n += __builtin_popcountll(w);
+  }
+  return n;
+}
+
+// 按基数选择容器编码到 buf, 返回字节数
+static size_t
+lmdb_bm_store(const uint64_t *bits, int card, unsigned char *buf)
+{
+  size_t n = 0;
+  int    w;
+
+  if (card > LMDB_BM_ARRAY_MAX) {
+    for (w = 0; w < LMDB_BM_WORDS; w++) lmdb_bm_put64(buf + w * 8, bits[w]);
+    return LMDB_BM_BYTES;
+  }
+  for (w = 0; w < LMDB_BM_WORDS; w++) {
+    uint64_t x = bits[w];
+    while (x) {
+      lmdb_bm_put16(buf + n, (uint16_t)(w * 64 + __builtin_ctzll(x)));
+      n += 2;
+      x &= x - 1;
+    }
+  }
+  return n;
+}
+
+static int
+lmdb_bm_check(lmdb_dbi *dbi, const MDB_val *key)
+{
+  unsigned int flags;
+  int          rc;
+
+  if (key->mv_size + 2 > LMDB_BM_KEYMAX) return MDB_BAD_VALSIZE;
+  rc = mdb_dbi_flags(dbi->txn, dbi->dbi, &flags);
+  if (rc == MDB_SUCCESS && (flags & (MDB_DUPSORT | MDB_REVERSEKEY | MDB_INTEGERKEY)))
+    rc = MDB_INCOMPATIBLE;
+  return rc;
+}
+
+static void
+lmdb_bm_key(char *buf, const MDB_val *key, unsigned int chunk, MDB_val *out)
+{
+  memcpy(buf, key->mv_data, key->mv_size);
+  buf[key->mv_size] = (char)(chunk >> 8);
+  buf[key->mv_size + 1] = (char)chunk;
+  out->mv_data = buf;
+  out->mv_size = key->mv_size + 2;
+}
+
+// 定位到 key 的第一个块号不小于 chunk 的块
+static int
+lmdb_bm_seek(MDB_cursor *cursor, const MDB_val *key, unsigned int chunk, unsigned int *found, MDB_val *val)
+{
+  char    buf[LMDB_BM_KEYMAX];
+  MDB_val k;
+  int     rc;
+
+  if (chunk > 0xffff) return MDB_NOTFOUND;
+  lmdb_bm_key(buf, key, chunk, &k);
+  for (rc = mdb_cursor_get(cursor, &k, val, MDB_SET_RANGE); rc == MDB_SUCCESS;
+       rc = mdb_cursor_get(cursor, &k, val, MDB_NEXT)) {
+    const unsigned char *p = (const unsigned char *)k.mv_data;
+    if (k.mv_size < key->mv_size || memcmp(p, key->mv_data, key->mv_size) != 0) return MDB_NOTFOUND;
+    if (k.mv_size == key->mv_size + 2) {
+      *found = (p[key->mv_size] << 8) | p[key->mv_size + 1];
+      return MDB_SUCCESS;
+    }
+  }
+  return rc;
+}
+
+// 位图集合运算的一个操作数
+typedef struct
+{
+  lmdb_dbi    *dbi;
+  MDB_cursor  *cursor;
+  MDB_val      key;
+  MDB_val      val;    // 当前块
+  unsigned int chunk;  // 当前块号
+  int          done;
+} lmdb_bmterm;
+
+static int
+lmdb_bmterm_seek(lmdb_bmterm *t, unsigned int chunk)
+{
+  int rc = lmdb_bm_seek(t->cursor, &t->key, chunk, &t->chunk, &t->val);
+  if (rc == MDB_NOTFOUND) t->done = 1;
+  return rc == MDB_NOTFOUND ? MDB_SUCCESS : rc;
+}
+
+// 解析 { {dbi, key}, ... } 并打开游标, 数组留在栈上
+static lmdb_bmterm *
+lmdb_bmterm_open(lua_State *L, int *n, int *rc)
+{
+  lmdb_bmterm *t;
+  int          i;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  *n = (int)lua_objlen(L, 1);
+  luaL_argcheck(L, *n > 0, 1, "no terms");
+  t = (lmdb_bmterm *)lua_newuserdata(L, *n * sizeof(lmdb_bmterm));
+  memset(t, 0, *n * sizeof(lmdb_bmterm));
+  for (i = 0; i < *n; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    luaL_argcheck(L, lua_istable(L, -1), 1, "term must be {dbi, key}");
+    lua_rawgeti(L, -1, 1);
+    t[i].dbi = (lmdb_dbi *)luaL_checkudata(L, -1, LUA_LMDB_DBI);
+    lua_rawgeti(L, -2, 2);
+    luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1, "term key must be a string");
+    t[i].key.mv_data = (void *)lua_tolstring(L, -1, &t[i].key.mv_size);
+    // 键字符串由参数表引用, 弹出后仍然有效
+    lua_pop(L, 3);
+    luaL_argcheck(L, t[i].dbi->txn == t[0].dbi->txn, 1, "terms must share a transaction");
+  }
+  for (i = 0, *rc = MDB_SUCCESS; i < *n && *rc == MDB_SUCCESS; i++) {
+    *rc = lmdb_bm_check(t[i].dbi, &t[i].key);
+    if (*rc == MDB_SUCCESS) *rc = mdb_cursor_open(t[i].dbi->txn, t[i].dbi->dbi, &t[i].cursor);
+    if (*rc == MDB_SUCCESS) *rc = lmdb_bmterm_seek(&t[i], 0);
+  }
+  return t;
+}
+
+// 运算结果: 写入目标键时先按块号收集到表中, 否则直接展开为 id 数组
+static void
+lmdb_bm_emit(lua_State *L, int dest, const uint64_t *bits, int card, unsigned int chunk,
+             unsigned char *buf, lua_Integer *k)
+{
+  int w;
+
+  if (dest) {
+    size_t n = lmdb_bm_store(bits, card, buf);
+    lua_pushlstring(L, (const char *)buf, n);
+    lua_rawseti(L, -2, chunk + 1);
+    *k += card;
+    return;
+  }
+  for (w = 0; w < LMDB_BM_WORDS; w++) {
+    uint64_t x = bits[w];
+    while (x) {
+      lua_pushinteger(L, ((lua_Integer)chunk << 16) | (w * 64 + __builtin_ctzll(x)));
+      lua_rawseti(L, -2, ++(*k));
+      x &= x - 1;
+    }
+  }
+}
+
+// 用栈顶的块表替换目标键的全部块
+static int
+lmdb_bm_save(lua_State *L, lmdb_dbi *dbi, MDB_val *key)
+{
+  char         buf[LMDB_BM_KEYMAX];
+  MDB_cursor  *cursor;
+  MDB_val      k, v;
+  unsigned int chunk;
+  int          rc = lmdb_bm_check(dbi, key);
+
+  if (rc == MDB_SUCCESS) rc = mdb_cursor_open(dbi->txn, dbi->dbi, &cursor);
+  if (rc != MDB_SUCCESS) return rc;
+  while ((rc = lmdb_bm_seek(cursor, key, 0, &chunk, &v)) == MDB_SUCCESS) {
+    rc = mdb_cursor_del(cursor, 0);
+    if (rc != MDB_SUCCESS) break;
+  }
+  mdb_cursor_close(cursor);
+  if (rc != MDB_NOTFOUND) return rc;
+
+  rc = MDB_SUCCESS;
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    lmdb_bm_key(buf, key, (unsigned int)lua_tointeger(L, -2) - 1, &k);
+    v.mv_data = (void *)lua_tolstring(L, -1, &v.mv_size);
+    lua_pop(L, 1);
+    if (rc == MDB_SUCCESS) rc = mdb_put(dbi->txn, dbi->dbi, &k, &v, 0);
+  }
+  return rc;
+}
+
+static int
+lmdb_bitmap_op(lua_State *L, int isand)
+{
+  int            n, rc, i, dest = !lua_isnoneornil(L, 2);
+  lmdb_dbi      *ddbi = dest ? (lmdb_dbi *)luaL_checkudata(L, 2, LUA_LMDB_DBI) : NULL;
+  MDB_val        dkey;
+  lmdb_bmterm   *t;
+  uint64_t      *acc, *tmp;
+  unsigned char *buf;
+  lua_Integer    k = 0;
+
+  if (dest) dkey = lmdb_checkvalue(L, 3);
+  acc = (uint64_t *)lua_newuserdata(L, 2 * LMDB_BM_BYTES + LMDB_BM_BYTES);
+  tmp = acc + LMDB_BM_WORDS;
+  buf = (unsigned char *)(tmp + LMDB_BM_WORDS);
+  t = lmdb_bmterm_open(L, &n, &rc);
+  lua_newtable(L);
+
+  while (rc == MDB_SUCCESS) {
+    unsigned int chunk = 0x10000;
+    int          card, w, all = 1;
+
+    // 交集: 各操作数追到同一块号; 并集: 取最小块号
+    for (i = 0; i < n; i++) {
+      if (t[i].done) {
+        all = 0;
+        continue;
+      }
+      if (chunk == 0x10000 || (isand ? t[i].chunk > chunk : t[i].chunk < chunk)) chunk = t[i].chunk;
+    }
+    if (chunk == 0x10000 || (isand && !all)) break;
+    if (isand) {
+      for (i = 0; i < n && rc == MDB_SUCCESS; i++) {
+        if (t[i].chunk < chunk) rc = lmdb_bmterm_seek(&t[i], chunk);
+        if (t[i].done || t[i].chunk != chunk) all = 0;
+      }
+      if (!all) continue;
+    }
+
+    memset(acc, isand ? 0xff : 0, LMDB_BM_BYTES);
+    for (i = 0; i < n; i++) {
+      if (t[i].done || t[i].chunk != chunk) continue;
+      lmdb_bm_load(tmp, &t[i].val);
+      for (w = 0; w < LMDB_BM_WORDS; w++) acc[w] = isand ? acc[w] & tmp[w] : acc[w] | tmp[w];
+    }
+    card = lmdb_bm_count(acc);
+    if (card) lmdb_bm_emit(L, dest, acc, card, chunk, buf, &k);
+    for (i = 0; i < n && rc == MDB_SUCCESS; i++) {
+      if (!t[i].done && t[i].chunk == chunk) rc = lmdb_bmterm_seek(&t[i], chunk + 1);
+    }
+  }
+  for (i = 0; i < n; i++)
+    if (t[i].cursor) mdb_cursor_close(t[i].cursor);
+  if (rc == MDB_SUCCESS && dest) {
+    rc = lmdb_bm_save(L, ddbi, &dkey);
+    lua_pushinteger(L, k);
+  }
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  return 1;
+}
+
+/***
+Intersect compressed bitmaps.
+
+Each term names the id set stored with `dbi:bitmap_add` under one key. The
+sets are combined a 65536-id chunk at a time, skipping chunks missing from
+any term.
+
+@function bitmap_and
+@tparam table terms `{ {dbi, key}, ... }`
+@tparam[opt] dbi dest database to store the result in, replacing `dkey`
+@tparam[opt] string dkey key to store the result under
+@treturn[1] table|integer the ids in ascending order, or the number of ids
+stored when `dest` is given
+@return[2] fail
+*/
+static int
+lmdb_bitmap_and(lua_State *L)
+{
+  return lmdb_bitmap_op(L, 1);
+}
+
+/***
+Merge compressed bitmaps.
+
+Takes the same arguments as `bitmap_and`.
+
+@function bitmap_or
+@tparam table terms `{ {dbi, key}, ... }`
+@tparam[opt] dbi dest database to store the result in, replacing `dkey`
+@tparam[opt] string dkey key to store the result under
+@treturn[1] table|integer the ids in ascending order, or the number of ids
+stored when `dest` is given
+@return[2] fail
+*/
+static int
+lmdb_bitmap_or(lua_State *L)
+{
+  return lmdb_bitmap_op(L, 0);
+}
+
+// 打开分片 i 的环境和库, 检查分片数与创建时一致
+static int
+lmdb_shard_open(lmdb_shard *s, const char *dir, int i, int n, unsigned int flags,
+                mdb_mode_t mode, size_t mapsize, int maxreaders)
+{
+  char     path[4096], meta[32];
+  MDB_txn *txn;
+  MDB_dbi  main;
+  MDB_val  key, val;
+  int      rc;
+
+  snprintf(path, sizeof(path), "%s/%03d", dir, i);
+  if (mkdir(path, (mode & 0777) | 0111) != 0 && errno != EEXIST) return errno;
+  if ((rc = mdb_env_create(&s->env)) != MDB_SUCCESS) return rc;
+  if ((rc = mdb_env_set_maxdbs(s->env, 3)) != MDB_SUCCESS) return rc;
+  if ((rc = mdb_env_set_maxreaders(s->env, maxreaders)) != MDB_SUCCESS) return rc;
+  if ((rc = mdb_env_set_mapsize(s->env, mapsize)) != MDB_SUCCESS) return rc;
+  if ((rc = mdb_env_open(s->env, path, flags | MDB_NOTLS, mode)) != MDB_SUCCESS) return rc;
+
+  if ((rc = mdb_txn_begin(s->env, NULL, 0, &txn)) != MDB_SUCCESS) return rc;
+  snprintf(meta, sizeof(meta), "%d/%d", i, n);
+  key.mv_data = "__shards";
+  key.mv_size = 8;
+  rc = mdb_dbi_open(txn, NULL, 0, &main);
+  if (rc == MDB_SUCCESS) rc = mdb_get(txn, main, &key, &val);
+  if (rc == MDB_SUCCESS && (val.mv_size != strlen(meta) || memcmp(val.mv_data, meta, val.mv_size)))
+    rc = MDB_INCOMPATIBLE;
+  if (rc == MDB_NOTFOUND) {
+    val.mv_data = meta;
+    val.mv_size = strlen(meta);
+    rc = mdb_put(txn, main, &key, &val, 0);
+  }
+  if (rc == MDB_SUCCESS) rc = mdb_dbi_open(txn, "data", MDB_CREATE, &s->data);
+  if (rc == MDB_SUCCESS) rc = mdb_dbi_open(txn, "__redo", MDB_CREATE, &s->redo);
+  if (rc == MDB_SUCCESS) rc = mdb_dbi_open(txn, "__applied", MDB_CREATE, &s->applied);
+  if (rc != MDB_SUCCESS) {
+    mdb_txn_abort(txn);
+    return rc;
+  }
+  return mdb_txn_commit(txn);
+}
+
+static void
+lmdb_shards_free(lmdb_shards *st)
+{
+  int i;
+
+  if (st->shard == NULL) return;
+  for (i = 0; i < st->n; i++) {
+    if (st->shard[i].rtxn) mdb_txn_abort(st->shard[i].rtxn);
+    if (st->shard[i].env) mdb_env_close(st->shard[i].env);
+    free(st->shard[i].stale);
+  }
+  free(st->shard);
+  st->shard = NULL;
+}
+
+static lmdb_shards *
+lmdb_checkshards(lua_State *L, int idx)
+{
+  lmdb_shards *st = (lmdb_shards *)luaL_checkudata(L, idx, LUA_LMDB_SHARDS);
+  luaL_argcheck(L, st->shard != NULL, idx, "sharded store is closed");
+  return st;
+}
+
+static int
+lmdb_shard_of(const lmdb_shards *st, const MDB_val *key)
+{
+  return (int)(lmdb_hash(key) % (uint64_t)st->n);
+}
+
+// 提交标记的键: 协调分片号加上协调事务号 (大端)
+static void
+lmdb_shard_marker(unsigned char *buf, int c, mdb_size_t id, MDB_val *key)
+{
+  int i;
+
+  buf[0] = (unsigned char)c;
+  for (i = 0; i < 8; i++) buf[1 + i] = (unsigned char)((uint64_t)id >> (56 - 8 * i));
+  key->mv_data = buf;
+  key->mv_size = LMDB_SHARD_MARKER;
+}
+
+// 重做记录中的一条写操作: 分片号, 是否删除, 键长, 值长, 键, 值
+static size_t
+lmdb_shard_encode(unsigned char *p, const lmdb_shardop *op)
+{
+  uint32_t klen = (uint32_t)op->key.mv_size, vlen = (uint32_t)op->val.mv_size;
+
+  if (p) {
+    p[0] = (unsigned char)op->shard;
+    p[1] = (unsigned char)op->del;
+    memcpy(p + 2, &klen, 4);
+    memcpy(p + 6, &vlen, 4);
+    memcpy(p + 10, op->key.mv_data, klen);
+    if (vlen) memcpy(p + 10 + klen, op->val.mv_data, vlen);
+  }
+  return 10 + (size_t)klen + vlen;
+}
+
+static size_t
+lmdb_shard_decode(const unsigned char *p, const unsigned char *e, lmdb_shardop *op)
+{
+  uint32_t klen, vlen;
+
+  if (e - p < 10) return 0;
+  memcpy(&klen, p + 2, 4);
+  memcpy(&vlen, p + 6, 4);
+  if ((size_t)(e - p) - 10 < (size_t)klen + vlen) return 0;
+  op->shard = p[0];
+  op->del = p[1];
+  op->key.mv_data = (void *)(p + 10);
+  op->key.mv_size = klen;
+  op->val.mv_data = (void *)(p + 10 + klen);
+  op->val.mv_size = vlen;
+  return 10 + (size_t)klen + vlen;
+}
+
+// 在一个分片上开始写事务, 写入 ops, 附带提交标记或重做记录, 然后提交.
+// 整个过程在同一线程内完成, 可由工作线程执行
+static void *
+lmdb_shard_apply(void *arg)
+{
+  lmdb_shardjob *job = (lmdb_shardjob *)arg;
+  lmdb_shard    *s = job->shard;
+  MDB_txn       *txn;
+  MDB_val        k, v;
+  unsigned char  buf[LMDB_SHARD_MARKER];
+  size_t         i;
+  int            rc;
+
+  job->rc = mdb_txn_begin(s->env, NULL, 0, &txn);
+  if (job->rc != MDB_SUCCESS) return NULL;
+  rc = MDB_SUCCESS;
+  for (i = 0; i < s->nstale && rc == MDB_SUCCESS; i += LMDB_SHARD_MARKER) {
+    k.mv_data = s->stale + i;
+    k.mv_size = LMDB_SHARD_MARKER;
+    rc = mdb_del(txn, s->applied, &k, NULL);
+    if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+  }
+  for (i = 0; i < job->nops && rc == MDB_SUCCESS; i++) {
+    lmdb_shardop *op = job->ops + i;
+    if (op->del) {
+      rc = mdb_del(txn, s->data, &op->key, NULL);
+      if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+    } else {
+      rc = mdb_put(txn, s->data, &op->key, &op->val, 0);
+    }
+  }
+  if (rc == MDB_SUCCESS && job->redo.mv_size) {
+    job->id = mdb_txn_id(txn);
+    lmdb_shard_marker(buf, job->coord, job->id, &k);
+    k.mv_data = buf + 1;
+    k.mv_size = 8;
+    rc = mdb_put(txn, s->redo, &k, &job->redo, 0);
+  } else if (rc == MDB_SUCCESS && job->marker) {
+    lmdb_shard_marker(buf, job->coord, job->id, &k);
+    v.mv_data = buf;
+    v.mv_size = 0;
+    rc = mdb_put(txn, s->applied, &k, &v, 0);
+  }
+  if (rc != MDB_SUCCESS) {
+    mdb_txn_abort(txn);
+  } else {
+    rc = mdb_txn_commit(txn);
+    if (rc == MDB_SUCCESS) s->nstale = 0;
+  }
+  job->rc = rc;
+  return NULL;
+}
+
+// 并行执行多个分片任务, 最后一个在当前线程执行
+static int
+lmdb_shard_run(lmdb_shardjob *jobs, int n)
+{
+  pthread_t tid[LMDB_SHARD_MAX];
+  int       started[LMDB_SHARD_MAX];
+  int       i, rc = MDB_SUCCESS;
+
+  for (i = 0; i < n - 1; i++)
+    started[i] = pthread_create(&tid[i], NULL, lmdb_shard_apply, jobs + i) == 0;
+  for (i = 0; i < n - 1; i++)
+    if (!started[i]) lmdb_shard_apply(jobs + i);
+  if (n > 0) lmdb_shard_apply(jobs + n - 1);
+  for (i = 0; i < n; i++) {
+    if (i < n - 1 && started[i]) pthread_join(tid[i], NULL);
+    if (rc == MDB_SUCCESS) rc = jobs[i].rc;
+  }
+  return rc;
+}
+
+// 重做记录的写入进程已退出. 进程仍在时批次可能正在其他分片上提交, 不能代为重放
+static int
+lmdb_shard_orphan(const MDB_val *redo)
+{
+  int32_t pid;
+
+  if (redo->mv_size < LMDB_SHARD_OWNER) return 1;
+  memcpy(&pid, redo->mv_data, LMDB_SHARD_OWNER);
+  return kill((pid_t)pid, 0) != 0 && errno == ESRCH;
+}
+
+// 补完未写完的原子批次: 按协调分片上的重做记录重放缺少提交标记的分片,
+// 删除重做记录后再清理已无记录对应的标记. oc 为负时处理写入进程已退出的全部记录,
+// 否则只处理协调分片 oc 上的批次 oid
+static int
+lmdb_shards_recover(lmdb_shards *st, int oc, mdb_size_t oid)
+{
+  MDB_cursor *cur;
+  MDB_txn    *txn, *jtxn;
+  MDB_val     k, v, mk, mv;
+  int         c, j, rc = MDB_SUCCESS;
+
+  for (c = 0; c < st->n && rc == MDB_SUCCESS; c++) {
+    lmdb_shard *s = st->shard + c;
+    if (oc >= 0 && c != oc) continue;
+    if ((rc = mdb_txn_begin(s->env, NULL, 0, &txn)) != MDB_SUCCESS) break;
+    rc = mdb_cursor_open(txn, s->redo, &cur);
+    while (rc == MDB_SUCCESS && (rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT)) == MDB_SUCCESS) {
+      const unsigned char *p, *b, *e = (const unsigned char *)v.mv_data + v.mv_size;
+      unsigned char        buf[LMDB_SHARD_MARKER];
+      mdb_size_t           id = 0;
+      lmdb_shardop         op;
+      size_t               len;
+      int                  i;
+
+      for (i = 0; i < 8 && (size_t)i < k.mv_size; i++) id = id << 8 | ((unsigned char *)k.mv_data)[i];
+      if (oc >= 0 ? id != oid : !lmdb_shard_orphan(&v)) continue;
+      b = v.mv_size < LMDB_SHARD_OWNER ? e : (const unsigned char *)v.mv_data + LMDB_SHARD_OWNER;
+      lmdb_shard_marker(buf, c, id, &mk);
+      for (j = 0; j < st->n && rc == MDB_SUCCESS; j++) {
+        lmdb_shard *t = st->shard + j;
+        int         replay = 0;
+        if (j == c) continue;
+        for (p = b; (len = lmdb_shard_decode(p, e, &op)); p += len)
+          replay |= op.shard == j;
+        if (!replay) continue;
+        if ((rc = mdb_txn_begin(t->env, NULL, 0, &jtxn)) != MDB_SUCCESS) break;
+        rc = mdb_get(jtxn, t->applied, &mk, &mv);
+        if (rc == MDB_NOTFOUND) {
+          rc = MDB_SUCCESS;
+          for (p = b; rc == MDB_SUCCESS && (len = lmdb_shard_decode(p, e, &op)); p += len) {
+            if (op.shard != j) continue;
+            if (op.del) {
+              rc = mdb_del(jtxn, t->data, &op.key, NULL);
+              if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+            } else {
+              rc = mdb_put(jtxn, t->data, &op.key, &op.val, 0);
+            }
+          }
+          mv.mv_data = buf;
+          mv.mv_size = 0;
+          if (rc == MDB_SUCCESS) rc = mdb_put(jtxn, t->applied, &mk, &mv, 0);
+        }
+        if (rc == MDB_SUCCESS)
+          rc = mdb_txn_commit(jtxn);
+        else
+          mdb_txn_abort(jtxn);
+      }
+      if (rc == MDB_SUCCESS) rc = mdb_cursor_del(cur, 0);
+    }
+    if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+    if (rc == MDB_SUCCESS)
+      rc = mdb_txn_commit(txn);
+    else
+      mdb_txn_abort(txn);
+  }
+
+  for (j = 0; j < st->n && rc == MDB_SUCCESS; j++) {
+    lmdb_shard *t = st->shard + j;
+    if ((rc = mdb_txn_begin(t->env, NULL, 0, &jtxn)) != MDB_SUCCESS) break;
+    rc = mdb_cursor_open(jtxn, t->applied, &cur);
+    while (rc == MDB_SUCCESS && (rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT)) == MDB_SUCCESS) {
+      unsigned char *m = (unsigned char *)k.mv_data;
+      c = m[0];
+      if (k.mv_size != LMDB_SHARD_MARKER || c >= st->n) continue;
+      mk.mv_data = m + 1;
+      mk.mv_size = 8;
+      if ((rc = mdb_txn_begin(st->shard[c].env, NULL, MDB_RDONLY, &txn)) != MDB_SUCCESS) break;
+      rc = mdb_get(txn, st->shard[c].redo, &mk, &mv);
+      mdb_txn_abort(txn);
+      if (rc == MDB_NOTFOUND) rc = mdb_cursor_del(cur, 0);
+    }
+    if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+    if (rc == MDB_SUCCESS)
+      rc = mdb_txn_commit(jtxn);
+    else
+      mdb_txn_abort(jtxn);
+  }
+  return rc;
+}
+
+/***
+Open a sharded store.
+
+Keys are spread by hash over `nshards` environments kept in `dir/000`,
+`dir/001`, ..., each with its own write lock, so writers working on
+different shards, from different threads or processes, commit in parallel.
+A store must always be opened with the same shard count. Unfinished atomic
+batches whose writing process has exited are completed here.
+
+`options` are those of `lmdb.open` and apply to every shard; `mapsize` is per
+shard and `maxreaders` defaults to 126.
+
+@function open_sharded
+@tparam string dir the directory holding the shards
+@tparam integer nshards number of shards, 1 to 256
+@tparam[opt] table options
+@treturn[1] shards
+@return[2] fail
+@see options
+*/
+static int
+lmdb_open_sharded(lua_State *L)
+{
+  const char  *dir = luaL_checkstring(L, 1);
+  int          n = (int)luaL_checkinteger(L, 2);
+  unsigned int flags;
+  mdb_mode_t   mode;
+  size_t       size;
+  int          maxreaders, rc, i;
+  lmdb_shards *st;
+
+  luaL_argcheck(L, n >= 1 && n <= LMDB_SHARD_MAX, 2, "nshards must be 1 to 256");
+  if (lua_isnoneornil(L, 3)) {
+    lua_settop(L, 2);
+    lua_newtable(L);
+  }
+  luaL_checktype(L, 3, LUA_TTABLE);
+  lua_getfield(L, 3, "flags");
+  flags = luaL_optinteger(L, -1, 0);
+  lua_getfield(L, 3, "mode");
+  mode = luaL_optinteger(L, -1, 0664);
+  lua_getfield(L, 3, "mapsize");
+  size = luaL_optinteger(L, -1, 4 * 1024 * 1024);
+  lua_getfield(L, 3, "maxreaders");
+  maxreaders = luaL_optinteger(L, -1, 126);
+  lua_pop(L, 4);
+
+  st = (lmdb_shards *)lua_newuserdata(L, sizeof(lmdb_shards));
+  st->n = n;
+  st->shard = (lmdb_shard *)calloc(n, sizeof(lmdb_shard));
+  if (st->shard == NULL) return lmdb_pusherror(L, ENOMEM);
+  luaL_getmetatable(L, LUA_LMDB_SHARDS);
+  lua_setmetatable(L, -2);
+
+  rc = mkdir(dir, (mode & 0777) | 0111) != 0 && errno != EEXIST ? errno : MDB_SUCCESS;
+  for (i = 0; i < n && rc == MDB_SUCCESS; i++)
+    rc = lmdb_shard_open(st->shard + i, dir, i, n, flags, mode, size, maxreaders);
+  if (rc == MDB_SUCCESS) rc = lmdb_shards_recover(st, -1, 0);
+  if (rc != MDB_SUCCESS) {
+    lmdb_shards_free(st);
+    return lmdb_pusherror(L, rc);
+  }
+  return 1;
+}
+
+// 读取 idx 处表的 name 字段, 为 nil 时改取第 n 个元素
+static void
+lmdb_getfield2(lua_State *L, int idx, const char *name, int n)
+{
+  lua_getfield(L, idx, name);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_rawgeti(L, idx, n);
+  }
+}
+
+// 栈顶字符串在 lst 中的序号, 出错时归到第 narg 个参数
+static int
+lmdb_optfield(lua_State *L, int narg, const char *def, const char *const lst[])
+{
+  const char *name = luaL_optstring(L, -1, def);
+  int         i;
+
+  for (i = 0; lst[i]; i++)
+    if (strcmp(lst[i], name) == 0) return i;
+  return luaL_argerror(L, narg, lua_pushfstring(L, "invalid option '%s'", name));
+}
+
+enum { LMDB_FIELD_INT, LMDB_FIELD_UINT, LMDB_FIELD_FLOAT, LMDB_FIELD_BYTES };
+
+// 读取 v 中 offset 处宽 width 字节的整数 (0 为余下全部), 返回实际宽度, 不合法时为 0
+static size_t
+lmdb_field_read(const MDB_val *v, size_t offset, size_t width, int be, uint64_t *out)
+{
+  const unsigned char *p = (const unsigned char *)v->mv_data + offset;
+  size_t               w = width, i;
+  uint64_t             u = 0;
+
+  if (v->mv_size < offset) return 0;
+  if (w == 0) w = v->mv_size - offset;
+  if (v->mv_size - offset < w || (w != 1 && w != 2 && w != 4 && w != 8)) return 0;
+  if (be) {
+    for (i = 0; i < w; i++) u = u << 8 | p[i];
+  } else if (w == 8) {
+    memcpy(&u, p, 8);
+  } else if (w == 4) {
+    uint32_t x;
+    memcpy(&x, p, 4);
+    u = x;
+  } else if (w == 2) {
+    uint16_t x;
+    memcpy(&x, p, 2);
+    u = x;
+  } else {
+    u = p[0];
+  }
+  *out = u;
+  return w;
+}
+
+// 读取 v 中的记录字段压栈, 记录太短时返回 0
+static int
+lmdb_sfield_push(lua_State *L, const lmdb_sfield *f, const MDB_val *v)
+{
+  const char *p = (const char *)v->mv_data + f->offset;
+  uint64_t    u;
+
+  if (v->mv_size < f->offset + f->width) return 0;
+  if (f->type == LMDB_FIELD_BYTES) {
+    size_t n = f->width;
+    while (n > 0 && p[n - 1] == 0) n--;
+    lua_pushlstring(L, p, n);
+    return 1;
+  }
+  lmdb_field_read(v, f->offset, f->width, f->be, &u);
+  if (f->type == LMDB_FIELD_FLOAT) {
+    if (f->width == 4) {
+      uint32_t x = (uint32_t)u;
+      float    d;
+      memcpy(&d, &x, 4);
+      lua_pushnumber(L, d);
+    } else {
+      double d;
+      memcpy(&d, &u, 8);
+      lua_pushnumber(L, d);
+    }
+  } else {
+    if (f->type == LMDB_FIELD_INT && f->width < 8 && (u >> (f->width * 8 - 1)) & 1)
+      u |= ~(uint64_t)0 << (f->width * 8);
+    lua_pushinteger(L, (lua_Integer)u);
+  }
+  return 1;
+}
+
+// 把 idx 处的 Lua 值写入 base 处记录的字段
+static void
+lmdb_sfield_store(lua_State *L, const lmdb_sfield *f, unsigned char *base, int idx)
+{
+  unsigned char *p = base + f->offset;
+  uint64_t       u;
+  size_t         i;
+
+  if (f->type == LMDB_FIELD_BYTES) {
+    size_t      n;
+    const char *s = lua_type(L, idx) == LUA_TSTRING ? lua_tolstring(L, idx, &n) : NULL;
+    if (s == NULL) luaL_error(L, "string expected for bytes field");
+    if (n > f->width) luaL_error(L, "string too long for field");
+    memcpy(p, s, n);
+    memset(p + n, 0, f->width - n);
+    return;
+  }
+  if (f->type == LMDB_FIELD_FLOAT) {
+    int    ok;
+    double d = lua_tonumberx(L, idx, &ok);
+    if (!ok) luaL_error(L, "number expected for float field");
+    if (f->width == 4) {
+      float    x = (float)d;
+      uint32_t w;
+      memcpy(&w, &x, 4);
+      u = w;
+    } else {
+      memcpy(&u, &d, 8);
+    }
+  } else {
+    int ok;
+    u = (uint64_t)lua_tointegerx(L, idx, &ok);
+    if (!ok) luaL_error(L, "integer expected for integer field");
+  }
+  if (f->be) {
+    for (i = 0; i < f->width; i++) p[i] = (unsigned char)(u >> (8 * (f->width - 1 - i)));
+  } else if (f->width == 8) {
+    memcpy(p, &u, 8);
+  } else if (f->width == 4) {
+    uint32_t x = (uint32_t)u;
+    memcpy(p, &x, 4);
+  } else if (f->width == 2) {
+    uint16_t x = (uint16_t)u;
+    memcpy(p, &x, 2);
+  } else {
+    p[0] = (unsigned char)u;
+  }
+}
+
+// 按 idx 处的名字查找字段, 不存在时返回 NULL
+static const lmdb_sfield *
+lmdb_schema_field(lua_State *L, const lmdb_schema *sc, int idx)
+{
+  lua_Integer i = -1;
+
+  if (idx < 0) idx = lua_gettop(L) + idx + 1;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, sc->names);
+  lua_pushvalue(L, idx);
+  lua_rawget(L, -2);
+  if (lua_isnumber(L, -1)) i = lua_tointeger(L, -1);
+  lua_pop(L, 2);
+  return i >= 0 && i < sc->n ? &sc->field[i] : NULL;
+}
+
+/***
+Declare the layout of fixed-size records.
+
+Each field is `{name, type, width, offset=, be=}`, `type` being one of
+`int`, `uint`, `float` or `bytes`. Integers are 1, 2, 4 or 8 bytes wide and
+floats 4 or 8, both defaulting to 8; `bytes` fields hold strings of up to
+`width` bytes, zero padded. Fields follow one another unless `offset` is
+given, and the record is as long as its furthest field. Bind a schema to a
+database with `dbi:bind()`.
+
+@function schema
+@tparam table fields the fields, in order
+@treturn schema
+*/
+static int
+lmdb_schema_new(lua_State *L)
+{
+  static const char *const types[] = { "int", "uint", "float", "bytes", NULL };
+  lmdb_schema *sc;
+  int          n, i;
+  size_t       at = 0;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  n = (int)lua_objlen(L, 1);
+  luaL_argcheck(L, n > 0, 1, "no fields");
+  sc = (lmdb_schema *)lua_newuserdata(L, sizeof(lmdb_schema) + (n - 1) * sizeof(lmdb_sfield));
+  sc->n = n;
+  sc->size = 0;
+  sc->names = LUA_NOREF;
+  luaL_getmetatable(L, LUA_LMDB_SCHEMA);
+  lua_setmetatable(L, -2);
+  lua_newtable(L);
+  for (i = 0; i < n; i++) {
+    lmdb_sfield *f = &sc->field[i];
+    lua_Integer  off, width;
+
+    lua_rawgeti(L, 1, i + 1);
+    luaL_argcheck(L, lua_istable(L, 4), 1, "field must be a table");
+    lmdb_getfield2(L, 4, "name", 1);
+    luaL_argcheck(L, lua_type(L, 5) == LUA_TSTRING, 1, "field name must be a string");
+    lmdb_getfield2(L, 4, "type", 2);
+    f->type = lmdb_optfield(L, 1, "int", types);
+    lmdb_getfield2(L, 4, "width", 3);
+    width = luaL_optinteger(L, -1, f->type == LMDB_FIELD_BYTES ? 0 : 8);
+    lua_getfield(L, 4, "offset");
+    off = luaL_optinteger(L, -1, (lua_Integer)at);
+    lua_getfield(L, 4, "be");
+    f->be = lua_toboolean(L, -1);
+    if (f->type == LMDB_FIELD_BYTES)
+      luaL_argcheck(L, width > 0, 1, "bytes width must be positive");
+    else if (f->type == LMDB_FIELD_FLOAT)
+      luaL_argcheck(L, width == 4 || width == 8, 1, "float width must be 4 or 8");
+    else
+      luaL_argcheck(L, width == 1 || width == 2 || width == 4 || width == 8, 1,
+                    "width must be 1, 2, 4 or 8");
+    luaL_argcheck(L, off >= 0, 1, "offset must not be negative");
+    f->offset = (size_t)off;
+    f->width = (size_t)width;
+    at = f->offset + f->width;
+    if (at > sc->size) sc->size = at;
+
+    lua_pushvalue(L, 5);
+    lua_rawget(L, 3);
+    luaL_argcheck(L, lua_isnil(L, -1), 1, "duplicate field name");
+    lua_pushvalue(L, 5);
+    lua_pushinteger(L, i);
+    lua_rawset(L, 3);
+    lua_settop(L, 3);
+  }
+  sc->names = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+// 空间填充曲线键: d 维坐标 (2 到 8 维, 每维 64 / d 位) 编成 8 字节大端键,
+// 字节序即曲线顺序. 每组 d 位中第一维在最高位
+#define LMDB_CURVE_MAXDIM 8
+
+static uint64_t
+lmdb_curve_interleave(const uint64_t *x, int d, int bits)
+{
+  uint64_t z = 0;
+  int      i, j;
+  for (i = bits - 1; i >= 0; i--)
+    for (j = 0; j < d; j++) z = z << 1 | ((x[j] >> i) & 1);
+  return z;
+}
+
+static void
+lmdb_curve_split(uint64_t z, int d, int bits, uint64_t *x)
+{
+  int i, j;
+  for (j = 0; j < d; j++) x[j] = 0;
+  for (i = bits - 1; i >= 0; i--)
+    for (j = 0; j < d; j++) x[j] |= ((z >> (i * d + d - 1 - j)) & 1) << i;
+}
+
+// 坐标与 Hilbert 索引的转置形式互换 (J. Skilling, 2004)
+static void
+lmdb_hilbert_transpose(uint64_t *x, int d, int bits)
+{
+  uint64_t m = (uint64_t)1 << (bits - 1), p, q, t;
+  int      i;
+
+  for (q = m; q > 1; q >>= 1) {
+    p = q - 1;
+    for (i = 0; i < d; i++) {
+      if (x[i] & q) {
+        x[0] ^= p;
+      } else {
+        t = (x[0] ^ x[i]) & p;
+        x[0] ^= t;
+        x[i] ^= t;
+      }
+    }
+  }
+  for (i = 1; i < d; i++) x[i] ^= x[i - 1];
+  t = 0;
+  for (q = m; q > 1; q >>= 1)
+    if (x[d - 1] & q) t ^= q - 1;
+  for (i = 0; i < d; i++) x[i] ^= t;
+}
+
+static void
+lmdb_hilbert_axes(uint64_t *x, int d, int bits)
+{
+  uint64_t n = (uint64_t)2 << (bits - 1), p, q, t;
+  int      i;
+
+  t = x[d - 1] >> 1;
+  for (i = d - 1; i > 0; i--) x[i] ^= x[i - 1];
+  x[0] ^= t;
+  for (q = 2; q != n; q <<= 1) {
+    p = q - 1;
+    for (i = d - 1; i >= 0; i--) {
+      if (x[i] & q) {
+        x[0] ^= p;
+      } else {
+        t = (x[0] ^ x[i]) & p;
+        x[0] ^= t;
+        x[i] ^= t;
+      }
+    }
+  }
+}
+
+static void
+lmdb_curve_key(unsigned char *k, uint64_t z)
+{
+  int i;
+  for (i = 0; i < 8; i++) k[i] = (unsigned char)(z >> (56 - 8 * i));
+}
+
+static uint64_t
+lmdb_curve_unkey(const unsigned char *k)
+{
+  uint64_t z = 0;
+  int      i;
+  for (i = 0; i < 8; i++) z = z << 8 | k[i];
+  return z;
+}
+
+// 读取 idx 处的一个坐标, 须在 [0, 2^bits) 内
+static uint64_t
+lmdb_curve_coord(lua_State *L, int idx, int arg, int bits)
+{
+  int         ok;
+  lua_Integer v = lua_tointegerx(L, idx, &ok);
+
+  luaL_argcheck(L, ok, arg, "integer coordinates expected");
+  luaL_argcheck(L, v >= 0 && (bits == 64 || (uint64_t)v >> bits == 0), arg,
+                "coordinate out of range");
+  return (uint64_t)v;
+}
+
+// 读取从 1 起的全部参数作坐标, 返回维数
+static int
+lmdb_curve_args(lua_State *L, uint64_t *x)
+{
+  int d = lua_gettop(L), j;
+
+  luaL_argcheck(L, d >= 2 && d <= LMDB_CURVE_MAXDIM, 1, "2 to 8 coordinates expected");
+  for (j = 0; j < d; j++) x[j] = lmdb_curve_coord(L, j + 1, j + 1, 64 / d);
+  return d;
+}
+
+// 读取键与维数, 键的前 8 字节为曲线码
+static uint64_t
+lmdb_curve_checkkey(lua_State *L, int *d)
+{
+  MDB_val key = lmdb_checkvalue(L, 1);
+
+  *d = (int)luaL_checkinteger(L, 2);
+  luaL_argcheck(L, key.mv_size >= 8, 1, "key shorter than 8 bytes");
+  luaL_argcheck(L, *d >= 2 && *d <= LMDB_CURVE_MAXDIM, 2, "2 to 8 dimensions expected");
+  return lmdb_curve_unkey((const unsigned char *)key.mv_data);
+}
+
+/***
+Encode a point as a Z-order (Morton) key.
+
+The coordinates' bits are interleaved, so points near each other in space
+tend to be near each other in key order, and `dbi:box_scan` can query boxes.
+Each of `d` coordinates is an integer below `2^(64 // d)`: 32 bits for 2
+dimensions, 21 for 3. Scale or offset other values into that range first.
+
+@function morton
+@tparam integer ... 2 to 8 coordinates
+@treturn string 8 byte key
+*/
+static int
+lmdb_morton(lua_State *L)
+{
+  uint64_t      x[LMDB_CURVE_MAXDIM];
+  unsigned char k[8];
+  int           d = lmdb_curve_args(L, x);
+
+  lmdb_curve_key(k, lmdb_curve_interleave(x, d, 64 / d));
+  lua_pushlstring(L, (const char *)k, 8);
+  return 1;
+}
+
+/***
+Decode a Z-order key.
+@function morton_decode
+@tparam string key a key made by `morton`, anything after 8 bytes is ignored
+@tparam integer d number of dimensions
+@treturn integer ... the coordinates
+*/
+static int
+lmdb_morton_decode(lua_State *L)
+{
+  uint64_t x[LMDB_CURVE_MAXDIM], z;
+  int      d, j;
+
+  z = lmdb_curve_checkkey(L, &d);
+  lmdb_curve_split(z, d, 64 / d, x);
+  for (j = 0; j < d; j++) lua_pushinteger(L, (lua_Integer)x[j]);
+  return d;
+}
+
+/***
+Encode a point as a Hilbert curve key.
+
+Coordinates are as for `morton`. The Hilbert curve never jumps, so it keeps
+neighbours closer together in key order than Z-order does, but
+`dbi:box_scan` works only on Z-order keys.
+
+@function hilbert
+@tparam integer ... 2 to 8 coordinates
+@treturn string 8 byte key
+*/
+static int
+lmdb_hilbert(lua_State *L)
+{
+  uint64_t      x[LMDB_CURVE_MAXDIM];
+  unsigned char k[8];
+  int           d = lmdb_curve_args(L, x);
+
+  lmdb_hilbert_transpose(x, d, 64 / d);
+  lmdb_curve_key(k, lmdb_curve_interleave(x, d, 64 / d));
+  lua_pushlstring(L, (const char *)k, 8);
+  return 1;
+}
+
+/***
+Decode a Hilbert curve key.
+@function hilbert_decode
+@tparam string key a key made by `hilbert`, anything after 8 bytes is ignored
+@tparam integer d number of dimensions
+@treturn integer ... the coordinates
+*/
+static int
+lmdb_hilbert_decode(lua_State *L)
+{
+  uint64_t x[LMDB_CURVE_MAXDIM], z;
+  int      d, j;
+
+  z = lmdb_curve_checkkey(L, &d);
+  lmdb_curve_split(z, d, 64 / d, x);
+  lmdb_hilbert_axes(x, d, 64 / d);
+  for (j = 0; j < d; j++) lua_pushinteger(L, (lua_Integer)x[j]);
+  return d;
+}
+
+/***
+A env class
+
+@type env
+*/
+
+/***
+Close an opened LMDB file
+@function close
+@tparam env handle of env to close
+*/
+static int
+lmdb_close(lua_State *L)
+{
+  lmdb_env *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  if (env->env) {
+    void   *ctx = mdb_env_get_userctx(env->env);
+    size_t  i;
+    if (ctx) {
+      int ref = (int)(intptr_t)ctx;
+      luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    }
+    for (i = 0; i < env->capdbx; i++) {
+      if (env->dbx[i] && env->dbx[i]->codec) luaL_unref(L, LUA_REGISTRYINDEX, env->dbx[i]->codec);
+      if (env->dbx[i] && env->dbx[i]->schema) luaL_unref(L, LUA_REGISTRYINDEX, env->dbx[i]->schema_ref);
+    }
+    // 仍在使用的快照句柄只剩引用计数, 事务随环境一起结束
+    while (env->snaps) {
+      lmdb_snap *snap = env->snaps;
+      env->snaps = snap->next;
+      mdb_txn_abort(snap->txn);
+      snap->txn = NULL;
+      snap->cached = 0;
+      if (snap->refs == 0) free(snap);
+    }
+    env->snap = NULL;
+    mdb_env_close(env->env);
+    env->env = NULL;
+    lmdb_env_freedbx(env);
+  }
+  return 0;
+}
+
+struct msg_ctx
+{
+  lua_State *L;
+  int        ref;
+};
+
+static int
+lmdb_msg(const char *msg, void *ctx)
+{
+  struct msg_ctx *mctx = (struct msg_ctx *)ctx;
+  lua_State      *L = mctx->L;
+  int             ret;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mctx->ref);
+  lua_pushstring(L, msg);
+  ret = lua_pcall(L, 1, 1, 0);
+  if (ret == 0) {
+    return 0;
+  } else {
+    fprintf(stderr, "error in reader_list: %s\n", lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+
+  return -1;
+};
+
+/***
+Dump the entries in the reader lock table.
+@function reader_list
+
+@tparam function callback(message)
+@treturn[1] env self
+@return[2] fail
+*/
+static int
+lmdb_reader_list(lua_State *L)
+{
+  lmdb_env      *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  struct msg_ctx ctx;
+  int            ret;
+
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+
+  lua_pushvalue(L, 2);
+  ctx.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  ctx.L = L;
+
+  ret = mdb_reader_list(env->env, lmdb_msg, &ctx);
+  luaL_unref(L, LUA_REGISTRYINDEX, ctx.ref);
+
+  if (ret == MDB_SUCCESS) {
+    lua_pushvalue(L, 1);
+    return 1;
+  }
+  return lmdb_pusherror(L, ret);
+}
+
+/***
+Check for stale entries in the reader lock table.
+@function reader_check
+
+@treturn[1] integer dead integer of stale slots that were cleared
+@return[2] fail
+*/
+static int
+lmdb_reader_check(lua_State *L)
+{
+  lmdb_env *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  int       dead = 0;
+
+  int ret = mdb_reader_check(env->env, &dead);
+
+  if (ret == MDB_SUCCESS) {
+    lua_pushinteger(L, dead);
+    return 1;
+  }
+  return lmdb_pusherror(L, ret);
+}
+
+/***
+Copy an LMDB environment to the specified path.
+@function copy
+@tparam string path path copy to
+@treturn[1] env self
+@return[2] fail
+*/
+
+static int
+lmdb_copy(lua_State *L)
+{
+  lmdb_env   *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  const char *path = luaL_checkstring(L, 2);
+  int         ret = EINVAL;
+  if (env->env) {
+    ret = mdb_env_copy(env->env, path);
+    lua_pushvalue(L, 1);
+    return 1;
+  }
+  return lmdb_pusherror(L, ret);
+}
+
+/***
+Flush the data buffers to disk.
+
+@function sync
+@tparam boolean force if true, force a synchronous flush.
+@treturn[1] env self
+@return[2] fail
+*/
+static int
+lmdb_sync(lua_State *L)
+{
+  lmdb_env *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  int       force = lua_toboolean(L, 2);
+
+  int ret = EINVAL;
+  if (env->env) {
+    ret = mdb_env_sync(env->env, force);
+    lua_pushvalue(L, 1);
+    return 1;
+  }
+  return lmdb_pusherror(L, ret);
+}
+
+/***
+Get environment associated property, include `flags`, `path`, `fd`,
+`mapsize`, `maxreaders`, `maxkeysize`.
+
+@function get
+@tparam string item The property to get
+@return[1] value
+  - integer for `flags`
+  - string for `path`
+  - integer for `fd`
+  - integer for `mapsize`
+  - integer for `maxreaders`
+  - integer for `maxkeysize`
+@return[2] fail
+*/
+static int
+lmdb_get_property(lua_State *L)
+{
+  lmdb_env   *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  const char *item = luaL_checkstring(L, 2);
+  int         ret = EINVAL;
+
+  if (!env->env) {
+    return lmdb_pusherror(L, EINVAL);
+  }
+
+  if (strcmp(item, "flags") == 0) {
+    unsigned int flags;
+    ret = mdb_env_get_flags(env->env, &flags);
+    if (ret == MDB_SUCCESS) {
+      lua_pushinteger(L, flags);
+      return 1;
+    }
+  } else if (strcmp(item, "path") == 0) {
+    const char *path = NULL;
+
+    ret = mdb_env_get_path(env->env, &path);
+    if (ret == MDB_SUCCESS) {
+      lua_pushstring(L, path);
+      return 1;
+    }
+  } else if (strcmp(item, "fd") == 0) {
+    mdb_filehandle_t fd = 0;
+
+    ret = mdb_env_get_fd(env->env, &fd);
+    if (ret == MDB_SUCCESS) {
+      lua_pushinteger(L, fd);
+      return 1;
+    }
+  } else if (strcmp(item, "maxreaders") == 0) {
+    unsigned int maxreaders;
+
+    ret = mdb_env_get_maxreaders(env->env, &maxreaders);
+    if (ret == MDB_SUCCESS) {
+      lua_pushinteger(L, maxreaders);
+      return 1;
+    }
+  } else if (strcmp(item, "maxkeysize") == 0) {
+    lua_pushinteger(L, mdb_env_get_maxkeysize(env->env));
+    return 1;
+  } else if (strcmp(item, "userctx") == 0) {
+    int   ref;
+    void *ctx = mdb_env_get_userctx(env->env);
+    if (ctx == NULL) {
+      lua_pushnil(L);
+      return 1;
+    }
+    ref = (int)(intptr_t)ctx;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    return 1;
+  } else {
+    luaL_error(L, "unknown property: %s", item);
+  }
+
+  return lmdb_pusherror(L, ret);
+}
+
+/***
+Set environment associated property, include `flags`, `mapsize`, `maxreaders`,
+`maxdbs`, `userctx`, `heatmap`, `slowlog`.
+
+@function set
+@tparam string item The property to set
+@param ...
+  - integer for `flags`
+  - string for `path`
+  - integer for `fd`
+  - integer for `mapsize`
+  - integer for `maxreaders`
+  - integer for `maxkeysize`
+  - integer for `heatmap`, sample one in N page accesses, 0 to disable
+  - number for `slowlog`, threshold in microseconds, negative to disable,
+  and an optional table `{size=128, detail=false}`. With `detail` page
+  faults and spills are detected too, at the cost of extra calls per op.
+@treturn[1] env self
+@return[2] fail
+*/
+
+static int
+lmdb_set_property(lua_State *L)
+{
+  lmdb_env   *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  const char *item = luaL_checkstring(L, 2);
+  int         ret = EINVAL;
+  luaL_checkany(L, 3);
+
+  if (strcmp(item, "flags") == 0) {
+    unsigned int flags = luaL_checkinteger(L, 3);
+    luaL_checkany(L, 4);
+    int onoff = lua_toboolean(L, 4);
+
+    ret = mdb_env_set_flags(env->env, flags, onoff);
+
+    if (ret == MDB_SUCCESS) {
+      lua_pushvalue(L, 1);
+      return 1;
+    }
+  } else if (strcmp(item, "mapsize") == 0) {
+    mdb_size_t size = luaL_checkinteger(L, 3);
+    ret = mdb_env_set_mapsize(env->env, size);
+    if (ret == MDB_SUCCESS) {
+      lua_pushvalue(L, 1);
+      return 1;
+    }
+  } else if (strcmp(item, "maxreaders") == 0) {
+    unsigned int maxreaders = luaL_checkinteger(L, 3);
+    ret = mdb_env_set_maxreaders(env->env, maxreaders);
+    if (ret == MDB_SUCCESS) {
+      lua_pushvalue(L, 1);
+      return 1;
+    }
+  } else if (strcmp(item, "maxdbs") == 0) {
+    unsigned int maxdbs = luaL_checkinteger(L, 3);
+    ret = mdb_env_set_maxdbs(env->env, maxdbs);
+    if (ret == MDB_SUCCESS) {
+      lua_pushvalue(L, 1);
+      return 1;
+    }
+  } else if (strcmp(item, "userctx") == 0) {
+    int ref;
+    lua_pushvalue(L, 3);
+    ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    ret = mdb_env_set_userctx(env->env, (void *)(intptr_t)ref);
+    if (ret == MDB_SUCCESS) {
+      lua_pushvalue(L, 1);
+      return 1;
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  } else if (strcmp(item, "slowlog") == 0) {
+    double        threshold = luaL_checknumber(L, 3);
+    int           size = 128, detail = 0;
+    lmdb_slowlog *slow = NULL;
+
+    if (lua_istable(L, 4)) {
+      lua_getfield(L, 4, "size");
+      size = luaL_optinteger(L, -1, size);
+      lua_getfield(L, 4, "detail");
+      detail = lua_toboolean(L, -1);
+      lua_pop(L, 2);
+    }
+    luaL_argcheck(L, size > 0, 4, "size must be positive");
+
+    if (threshold >= 0) {
+      slow = (lmdb_slowlog *)calloc(1, sizeof(lmdb_slowlog) + (size - 1) * sizeof(lmdb_slowop));
+      if (slow == NULL) {
+        return lmdb_pusherror(L, ENOMEM);
+      }
+      slow->threshold = threshold;
+      slow->detail = detail;
+      slow->size = size;
+    }
+    lmdb_slowlog_free(env->slow);
+    env->slow = slow;
+    lua_pushvalue(L, 1);
+    return 1;
+  } else if (strcmp(item, "heatmap") == 0) {
+    lua_Integer rate = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, rate >= 0 && rate <= UINT_MAX, 3, "rate must be 0 to UINT_MAX");
+    ret = mdb_env_set_heatmap(env->env, (unsigned int)rate);
+    if (ret == MDB_SUCCESS) {
+      lua_pushvalue(L, 1);
+      return 1;
+    }
+  } else {
+    luaL_error(L, "unknown property: %s", item);
+  }
+
+  return lmdb_pusherror(L, ret);
+}
+
+static void
+lmdb_pushcounts(lua_State *L, const mdb_size_t *counts, int n)
+{
+  int i;
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_pushinteger(L, counts[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+}
+
+static void
+lmdb_pushheatmap(lua_State *L, MDB_heatmap *hm)
+{
+  lua_newtable(L);
+  lua_pushinteger(L, hm->mh_samples);
+  lua_setfield(L, -2, "samples");
+  lua_pushinteger(L, hm->mh_type[MDB_HEAT_ROOT]);
+  lua_setfield(L, -2, "root");
+  lua_pushinteger(L, hm->mh_type[MDB_HEAT_BRANCH]);
+  lua_setfield(L, -2, "branch");
+  lua_pushinteger(L, hm->mh_type[MDB_HEAT_LEAF]);
+  lua_setfield(L, -2, "leaf");
+  lua_pushinteger(L, hm->mh_type[MDB_HEAT_OVERFLOW]);
+  lua_setfield(L, -2, "overflow");
+  lmdb_pushcounts(L, hm->mh_level, MDB_HEAT_LEVELS);
+  lua_setfield(L, -2, "levels");
+  lmdb_pushcounts(L, hm->mh_bucket, MDB_HEAT_BUCKETS);
+  lua_setfield(L, -2, "buckets");
+}
+
+/***
+Return sampled page accesses, enable sampling with `env:set("heatmap", n)`.
+
+Each heatmap counts samples by page kind (`root`, `branch`, `leaf`,
+`overflow`), by tree level (`levels[1]` is the root) and by page number,
+with the map split into `#buckets` equal ranges.
+
+@function heatmap
+@tparam[opt] dbi dbi only return the heatmap of this database
+@treturn[1] table heatmap of `dbi`, or a table of heatmaps keyed by dbi number
+for every database with samples
+@return[2] fail
+*/
+static int
+lmdb_heatmap(lua_State *L)
+{
+  lmdb_env   *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  MDB_heatmap hm;
+  MDB_dbi     i;
+  int         ret;
+
+  if (!lua_isnoneornil(L, 2)) {
+    lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 2, LUA_LMDB_DBI);
+    ret = mdb_env_heatmap(env->env, dbi->dbi, &hm);
+    if (ret != MDB_SUCCESS) {
+      return lmdb_pusherror(L, ret);
+    }
+    lmdb_pushheatmap(L, &hm);
+    return 1;
+  }
+
+  lua_newtable(L);
+  for (i = 0; mdb_env_heatmap(env->env, i, &hm) == MDB_SUCCESS; i++) {
+    if (hm.mh_samples) {
+      lmdb_pushheatmap(L, &hm);
+      lua_rawseti(L, -2, i);
+    }
+  }
+  return 1;
+}
+
+/***
+Return the slow operations recorded since `env:set("slowlog", usec)`.
+
+Each record has `op` (`get`, `put`, `del`, `cursor_get`, `cursor_put`,
+`cursor_del`, `commit`), `dbi` (database name, absent for the main
+database), `key` (up to 16 bytes prefix), `key_size`, `key_hash`, `usec`,
+`txnid`, and, in detail mode, `majflt` and `spilled`.
+
+@function slowlog
+@tparam[opt=false] boolean reset clear the log after reading it
+@treturn[1] table array of records, oldest first
+@treturn[1] integer total number of slow operations seen
+@return[2] fail
+*/
+static int
+lmdb_slowlog_get(lua_State *L)
+{
+  lmdb_env     *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  lmdb_slowlog *slow = env->slow;
+  int           i, n, first;
+
+  if (slow == NULL) {
+    return lmdb_pusherror(L, EINVAL);
+  }
+
+  n = slow->count < (mdb_size_t)slow->size ? (int)slow->count : slow->size;
+  first = (slow->next - n + slow->size) % slow->size;
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lmdb_slowop *rec = &slow->ring[(first + i) % slow->size];
+    lua_newtable(L);
+    lua_pushstring(L, rec->op);
+    lua_setfield(L, -2, "op");
+    if (rec->dbi) {
+      lua_pushstring(L, rec->dbi);
+      lua_setfield(L, -2, "dbi");
+    }
+    if (rec->op[0] != 'c' || rec->op[1] != 'o') {  // commit has no key
+      lua_pushlstring(L, rec->key, rec->klen < LMDB_SLOW_KEYLEN ? rec->klen : LMDB_SLOW_KEYLEN);
+      lua_setfield(L, -2, "key");
+      lua_pushinteger(L, rec->klen);
+      lua_setfield(L, -2, "key_size");
+      lua_pushinteger(L, (lua_Integer)rec->khash);
+      lua_setfield(L, -2, "key_hash");
+    }
+    lua_pushnumber(L, rec->usec);
+    lua_setfield(L, -2, "usec");
+    lua_pushinteger(L, rec->txnid);
+    lua_setfield(L, -2, "txnid");
+    if (rec->majflt >= 0) {
+      lua_pushinteger(L, rec->majflt);
+      lua_setfield(L, -2, "majflt");
+    }
+    if (rec->spilled >= 0) {
+      lua_pushboolean(L, rec->spilled);
+      lua_setfield(L, -2, "spilled");
+    }
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_pushinteger(L, slow->count);
+
+  if (lua_toboolean(L, 2)) {
+    slow->next = 0;
+    slow->count = 0;
+  }
+  return 2;
+}
+
+/***
+Return statistics about the LMDB environment.
+
+@function stat
+@treturn[1] table the statistics
+@return[2] fail
+*/
+static int
+lmdb_stat(lua_State *L)
+{
+  lmdb_env *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  int       ret = EINVAL;
+  if (env->env) {
+    MDB_stat stat;
+    ret = mdb_env_stat(env->env, &stat);
+    if (ret == MDB_SUCCESS) {
+      return lmdb_pushstat(L, &stat);
+    }
+  }
+  return lmdb_pusherror(L, ret);
+}
+
+/***
+Return information about the LMDB environment.
+
+@function info
+@treturn[1] table the information
+@return[2] fail
+*/
+static int
+lmdb_info(lua_State *L)
+{
+  lmdb_env *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  int       ret = EINVAL;
+  if (env->env) {
+    MDB_envinfo info;
+    ret = mdb_env_info(env->env, &info);
+    if (ret == MDB_SUCCESS) {
+      lua_newtable(L);
+      lua_pushinteger(L, info.me_mapsize);
+      lua_setfield(L, -2, "mapsize");
+      lua_pushinteger(L, info.me_last_pgno);
+      lua_setfield(L, -2, "last_pgno");
+      lua_pushinteger(L, info.me_last_txnid);
+      lua_setfield(L, -2, "last_txnid");
+      lua_pushinteger(L, info.me_maxreaders);
+      lua_setfield(L, -2, "maxreaders");
+      lua_pushinteger(L, info.me_numreaders);
+      lua_setfield(L, -2, "numreaders");
+      return 1;
+    }
+  }
+  return lmdb_pusherror(L, ret);
+}
+
+/***
+Create a transaction for use with the environment.
+
+@function begin
+@tparam[opt] txn parent
+@tparam[opt=0] integer flags the flags for the transaction
+@treturn txn the transaction object
+@return[2] fail
+*/
+static int
+lmdb_txn_begin(lua_State *L)
+{
+  lmdb_env *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  MDB_txn  *parent = (lua_isuserdata(L, 2) ? (MDB_txn *)luaL_checkudata(L, 2, LUA_LMDB_TXN) : NULL);
+  unsigned int flags = parent ? luaL_optinteger(L, 3, 0) : luaL_optinteger(L, 2, 0);
+  lmdb_txn    *txn = (lmdb_txn *)lua_newuserdata(L, sizeof(lmdb_txn));
+  int          ret = mdb_txn_begin(env->env, parent, flags, &txn->txn);
+  if (ret != MDB_SUCCESS) {
+    return lmdb_pusherror(L, ret);
+  }
+  luaL_getmetatable(L, LUA_LMDB_TXN);
+  lua_setmetatable(L, -2);
+
+  lua_pushvalue(L, 1);
+  txn->env_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  txn->env = env;
+  txn->snap = NULL;
+  return 1;
+}
+
+/***
+Return a handle to the environment's shared read snapshot.
+
+All handles returned by this function share one read-only transaction,
+and so one reader slot, so any number of coroutines may open databases
+and cursors on it at the same time. A snapshot in use is handed out
+again while it is still the latest one, or while it is younger than
+`max_age` seconds; otherwise a fresh one is taken. Each handle holds a
+reference, dropped by `txn:commit()`, `txn:abort()` or garbage
+collection, and the reader slot is released with the last reference.
+Handles cannot be reset or renewed.
+
+When a fresh snapshot cannot get a reader slot, because the table is
+full or because this thread already holds one without `MDB_NOTLS`, the
+current snapshot is handed out again, stale or not.
+
+@function snapshot
+@tparam[opt=0] number max_age how stale, in seconds, a snapshot in use
+may be
+@treturn[1] txn the transaction handle
+@return[2] fail
+*/
+static int
+lmdb_env_snapshot(lua_State *L)
+{
+  lmdb_env       *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  double          max_age = luaL_optnumber(L, 2, 0);
+  lmdb_snap      *snap = env->snap;
+  lmdb_txn       *txn;
+  struct timespec now;
+  int             ret;
+
+  luaL_argcheck(L, env->env != NULL, 1, "environment closed");
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (snap == NULL) {
+    snap = (lmdb_snap *)malloc(sizeof(lmdb_snap));
+    if (snap == NULL) {
+      return lmdb_pusherror(L, ENOMEM);
+    }
+    ret = mdb_txn_begin(env->env, NULL, MDB_RDONLY, &snap->txn);
+    if (ret != MDB_SUCCESS) {
+      free(snap);
+      return lmdb_pusherror(L, ret);
+    }
+    snap->refs = 0;
+    snap->cached = 1;
+    snap->born = now;
+    snap->next = env->snaps;
+    env->snaps = env->snap = snap;
+  } else if (snap->refs == 0) {
+    ret = mdb_txn_renew(snap->txn);
+    if (ret != MDB_SUCCESS) {
+      return lmdb_pusherror(L, ret);
+    }
+    snap->born = now;
+  } else {
+    MDB_envinfo info;
+    double      age = (now.tv_sec - snap->born.tv_sec) + (now.tv_nsec - snap->born.tv_nsec) / 1e9;
+
+    mdb_env_info(env->env, &info);
+    if (mdb_txn_id(snap->txn) != info.me_last_txnid && age > max_age) {
+      lmdb_snap *fresh = (lmdb_snap *)malloc(sizeof(lmdb_snap));
+      if (fresh == NULL) {
+        return lmdb_pusherror(L, ENOMEM);
+      }
+      ret = mdb_txn_begin(env->env, NULL, MDB_RDONLY, &fresh->txn);
+      if (ret == MDB_SUCCESS) {
+        fresh->refs = 0;
+        fresh->cached = 1;
+        fresh->born = now;
+        fresh->next = env->snaps;
+        snap->cached = 0;  // 旧快照随最后一个句柄结束
+        env->snaps = env->snap = snap = fresh;
+      } else {
+        free(fresh);
+        if (ret != MDB_BAD_RSLOT && ret != MDB_READERS_FULL) {
+          return lmdb_pusherror(L, ret);
+        }
+      }
+    }
+  }
+
+  txn = (lmdb_txn *)lua_newuserdata(L, sizeof(lmdb_txn));
+  luaL_getmetatable(L, LUA_LMDB_TXN);
+  lua_setmetatable(L, -2);
+  snap->refs++;
+  txn->txn = snap->txn;
+  txn->snap = snap;
+  txn->env = env;
+  lua_pushvalue(L, 1);
+  txn->env_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+/***
+Delete expired keys, earliest deadline first.
+
+Keys put with a `ttl` are found through the deadline-ordered `__ttl`
+database, so the cost is proportional to the number of expired keys, not
+to the size of the databases. Deletes run in write transactions of `batch`
+keys each and keep secondary indexes up to date. This must not be called
+while the thread has a write transaction open.
+
+@function purge_expired
+@tparam[opt] table opts `budget` maximum number of keys to delete (default
+all that are due) and `batch` keys per transaction (default 1000)
+@treturn[1] integer the number of keys deleted
+@return[2] fail
+*/
+static int
+lmdb_env_purge_expired(lua_State *L)
+{
+  lmdb_env   *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
+  lua_Integer budget = -1, batch = 1000, purged = 0, n;
+  mdb_size_t  now = lmdb_ttl_now(), at;
+  int         rc = MDB_SUCCESS, write;
+
+  luaL_argcheck(L, env->env != NULL, 1, "environment closed");
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "budget");
+    budget = luaL_optinteger(L, -1, -1);
+    lua_getfield(L, 2, "batch");
+    batch = luaL_optinteger(L, -1, 1000);
+    lua_pop(L, 2);
+    luaL_argcheck(L, batch > 0, 2, "batch must be positive");
+  }
+
+  do {
+    MDB_txn    *txn;
+    MDB_cursor *cur;
+    MDB_dbi     ix, ex;
+    MDB_val     k, v;
+
+    n = 0;
+    rc = mdb_txn_begin(env->env, NULL, 0, &txn);
+    if (rc != MDB_SUCCESS) break;
+    rc = mdb_dbi_open(txn, LMDB_TTL_INDEX, 0, &ix);
+    if (rc == MDB_SUCCESS) rc = mdb_dbi_open(txn, LMDB_TTL_EXPIRES, 0, &ex);
+    if (rc == MDB_SUCCESS) rc = mdb_cursor_open(txn, ix, &cur);
+    if (rc != MDB_SUCCESS) {
+      mdb_txn_abort(txn);
+      if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+      break;
+    }
+    rc = mdb_cursor_get(cur, &k, &v, MDB_FIRST);
+    while (rc == MDB_SUCCESS && n < batch && (budget < 0 || purged + n < budget)) {
+      char     ref[512];
+      size_t   len = v.mv_size;
+      char    *name;
+      MDB_val  key, r;
+      lmdb_dbi dbi;
+
+      memcpy(&at, k.mv_data, sizeof(at));
+      if (at > now) break;
+      // 页面在后面的删除中可能被复制, 先取出库名和键
+      if (len >= sizeof(ref) || (name = memchr(v.mv_data, 0, len)) == NULL) {
+        rc = MDB_CORRUPTED;
+        break;
+      }
+      memcpy(ref, v.mv_data, len);
+      r.mv_data = ref;
+      r.mv_size = len;
+      key.mv_data = ref + (name - (char *)v.mv_data) + 1;
+      key.mv_size = len - ((char *)key.mv_data - ref);
+      rc = mdb_dbi_open(txn, ref[0] ? ref : NULL, 0, &dbi.dbi);
+      if (rc == MDB_SUCCESS) {
+        dbi.txn = txn;
+        dbi.txn_ref = LUA_NOREF;
+        dbi.env = env;
+        dbi.dbx = lmdb_env_dbx(env, ref[0] ? ref : NULL, 0);
+        rc = dbi.dbx && dbi.dbx->index ? lmdb_index_write(L, &dbi, &key, NULL, 0)
+                                       : mdb_del(txn, dbi.dbi, &key, NULL);
+      }
+      if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+      if (rc == MDB_SUCCESS) rc = mdb_del(txn, ex, &r, NULL);
+      if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+      if (rc == MDB_SUCCESS) rc = mdb_cursor_del(cur, 0);
+      if (rc == MDB_SUCCESS) {
+        n++;
+        rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT);
+      }
+    }
+    mdb_cursor_close(cur);
+    if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) {
+      mdb_txn_abort(txn);
+      break;
+    }
+    at = mdb_txn_id(txn);
+    write = lmdb_env_precommit(env, txn);
+    rc = mdb_txn_commit(txn);
+    if (rc != MDB_SUCCESS) break;
+    if (write) lmdb_env_committed(env, at);
+    purged += n;
+  } while (n == batch && (budget < 0 || purged < budget));
+
+  if (rc != MDB_SUCCESS) {
+    return lmdb_pusherror(L, rc);
+  }
+  lua_pushinteger(L, purged);
+  return 1;
+}
+
+/***
+A txn class
+
+@type txn
+*/
+
+/***
+Return the transaction's ID.
+
+This returns the identifier associated with this transaction. For a
+read-only transaction, this corresponds to the snapshot being read;
+concurrent readers will frequently have the same transaction ID.
+
+@function id
+@treturn integer the transaction ID
+*/
+static int
+lmdb_txn_id(lua_State *L)
+{
+  lmdb_txn *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
+  lua_pushinteger(L, mdb_txn_id(txn->txn));
+  return 1;
+}
+
+/***
+Return live state of the transaction.
+
+For a write transaction this reports how many more pages may be dirtied
+before `MDB_TXN_FULL`, and how big the commit has grown so far, so bulk
+jobs can size their batches adaptively.
+
+@function info
+@treturn[1] table the information, include `txnid`, `snapshot`, `next_pgno`,
+`dirty_room`, `dirty_pages`, `loose_pages`, `spill_pages`, `reclaim_pages`
+@return[2] fail
+*/
+static int
+lmdb_txn_info(lua_State *L)
+{
+  lmdb_txn   *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
+  MDB_txnstat info;
+  int         ret = mdb_txn_info(txn->txn, &info);
+  if (ret != MDB_SUCCESS) {
+    return lmdb_pusherror(L, ret);
+  }
+
+  lua_newtable(L);
+  lua_pushinteger(L, info.mi_txnid);
+  lua_setfield(L, -2, "txnid");
+  lua_pushinteger(L, info.mi_snapshot);
+  lua_setfield(L, -2, "snapshot");
+  lua_pushinteger(L, info.mi_next_pgno);
+  lua_setfield(L, -2, "next_pgno");
+  lua_pushinteger(L, info.mi_dirty_room);
+  lua_setfield(L, -2, "dirty_room");
+  lua_pushinteger(L, info.mi_dirty_pages);
+  lua_setfield(L, -2, "dirty_pages");
+  lua_pushinteger(L, info.mi_loose_pages);
+  lua_setfield(L, -2, "loose_pages");
+  lua_pushinteger(L, info.mi_spill_pages);
+  lua_setfield(L, -2, "spill_pages");
+  lua_pushinteger(L, info.mi_reclaim_pages);
+  lua_setfield(L, -2, "reclaim_pages");
+  return 1;
+}
+
+/***
+Exchange the contents of two databases.
+
+Both databases must belong to this write transaction and have the same
+flags. Afterwards each handle refers to what the other one held, and
+once committed new snapshots see the switch atomically. This is how a
+dataset rebuilt in a scratch database is published under its live name;
+the old contents may then be emptied with `dbi:drop()` at leisure.
+Databases with secondary indexes, or used as one, cannot be swapped, since
+the index would still describe the old contents; this fails with
+`MDB_INCOMPATIBLE`.
+
+@function swap
+@tparam dbi a a database
+@tparam dbi b another database
+@treturn[1] lmdb.txn self
+@return[2] fail
+*/
+static int
+lmdb_txn_swap(lua_State *L)
+{
+  lmdb_txn *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
+  lmdb_dbi *a = (lmdb_dbi *)luaL_checkudata(L, 2, LUA_LMDB_DBI);
+  lmdb_dbi *b = (lmdb_dbi *)luaL_checkudata(L, 3, LUA_LMDB_DBI);
+  int       ret;
+
+  luaL_argcheck(L, a->txn == txn->txn, 2, "dbi of another transaction");
+  luaL_argcheck(L, b->txn == txn->txn, 3, "dbi of another transaction");
+  if (a->dbx->index || a->dbx->primary || b->dbx->index || b->dbx->primary) {
+    return lmdb_pusherror(L, MDB_INCOMPATIBLE);
+  }
+  ret = mdb_dbi_swap(txn->txn, a->dbi, b->dbi);
+  if (ret != MDB_SUCCESS) {
+    return lmdb_pusherror(L, ret);
+  }
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+static void
+lmdb_txn_close(lua_State *L, lmdb_txn *txn)
+{
+  if (txn->txn) {
+    if (txn->snap) {
+      lmdb_snap_release(txn->env, txn->snap);
+      txn->snap = NULL;
+    }
+    txn->txn = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, txn->env_ref);
+    txn->env_ref = LUA_NOREF;
+  }
+}
+
+/***
+Commit all the operations of a transaction into the database.
+
+The transaction handle is freed. It and its cursors must not be used
+again after this call, except with #cursor:renew(). For a handle from
+`env:snapshot()` this only drops its reference.
+
+@function commit
+@treturn[1] boolean
+@return[2] fail
+*/
+static int
+lmdb_txn_commit(lua_State *L)
+{
+  lmdb_txn      *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
+  mdb_size_t     txnid = mdb_txn_id(txn->txn);
+  lmdb_slowclock clk;
+  int            ret, write;
+
+  if (txn->snap) {
+    lmdb_txn_close(L, txn);
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  write = lmdb_env_precommit(txn->env, txn->txn);
+  lmdb_slow_begin(txn->env, &clk, NULL);
+  ret = mdb_txn_commit(txn->txn);
+  lmdb_slow_end(txn->env, &clk, "commit", NULL, txnid, NULL, NULL);
+  lmdb_index_settle(txn->env, txn->txn, write && ret == MDB_SUCCESS);
+  lmdb_ts_settle(txn->env, txn->txn, write && ret == MDB_SUCCESS);
+  if (ret == MDB_SUCCESS) {
+    if (write) lmdb_env_committed(txn->env, txnid);
+    lua_pushboolean(L, 1);
+    lmdb_txn_close(L, txn);
+    return 1;
+  }
+  return lmdb_pusherror(L, ret);
+}
+
+/***
+Abandon all the operations of the transaction instead of saving them.
+
+For a handle from `env:snapshot()` this only drops its reference.
+@function abort
+*/
+static int
+lmdb_txn_abort(lua_State *L)
+{
+  lmdb_txn *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
+  if (txn->snap == NULL && txn->txn) {
+    mdb_txn_abort(txn->txn);
+    lmdb_index_settle(txn->env, txn->txn, 0);
+    lmdb_ts_settle(txn->env, txn->txn, 0);
+  }
+  lmdb_txn_close(L, txn);
+  return 0;
+}
+
+// 只回收共享快照的引用, 普通事务仍需显式提交或放弃
+static int
+lmdb_txn_gc(lua_State *L)
+{
+  lmdb_txn *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
+  if (txn->snap) lmdb_txn_close(L, txn);
+  return 0;
+}
+
+/***
+Reset a read-only transaction.
+@function reset
+@treturn lmdb.txn self
+*/
+static int
+lmdb_txn_reset(lua_State *L)
+{
+  lmdb_txn *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
+  luaL_argcheck(L, txn->snap == NULL, 1, "shared snapshot");
+  mdb_txn_reset(txn->txn);
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+/***
+Renew a read-only transaction.
+@function renew
+
+@treturn[1] lmdb.txn self
+@return[2] fail
+*/
+static int
+lmdb_txn_renew(lua_State *L)
+{
+  lmdb_txn *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
+  int       ret;
+
+  luaL_argcheck(L, txn->snap == NULL, 1, "shared snapshot");
+  ret = mdb_txn_renew(txn->txn);
+  if (ret == MDB_SUCCESS) {
+    lua_pushvalue(L, 1);
+    return 1;
+  }
+  return lmdb_pusherror(L, ret);
+}
+
+/***
+Open a database in the environment.
+@function dbi_open
+@tparam[opt] string name The name of the database to open.
+Default only a single database in the environment
+@tparam[opt=0] integer flags The flags for the database
+@treturn[1] dbi
+@return[2] fail
+*/
+static int
+lmdb_dbi_open(lua_State *L)
+{
+  lmdb_txn    *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
+  const char  *name = luaL_optstring(L, 2, NULL);
+  unsigned int flags = luaL_optinteger(L, 3, 0);
+
+  lmdb_dbi *dbi = (lmdb_dbi *)lua_newuserdata(L, sizeof(lmdb_dbi));
+
+  int ret = mdb_dbi_open(txn->txn, name, flags, &dbi->dbi);
+  if (ret != MDB_SUCCESS) {
+    return lmdb_pusherror(L, ret);
+  }
+  dbi->env = txn->env;
+  dbi->dbx = lmdb_env_dbx(txn->env, name, 1);
+  if (dbi->dbx == NULL) {
+    return lmdb_pusherror(L, ENOMEM);
+  }
+
+  luaL_getmetatable(L, LUA_LMDB_DBI);
+  lua_setmetatable(L, -2);
+
+  lua_pushvalue(L, 1);
+  dbi->txn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  dbi->txn = txn->txn;
+
+  return 1;
+}
+
+/***
+A dbi class.
+@type dbi
+*/
+
+/***
+Retrieve statistics for a database.
+@function stat
+@treturn[1] table the statistics
+@return[2] fail
+*/
+static int
+lmdb_dbi_stat(lua_State *L)
+{
+  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  MDB_stat  stat;
+  int       ret = mdb_stat(dbi->txn, dbi->dbi, &stat);
+  if (ret == MDB_SUCCESS) {
+    return lmdb_pushstat(L, &stat);
+  }
+  return lmdb_pusherror(L, ret);
+}
+
+/***
+Retrieve the DB flags for a database handle.
+@function flags
+@treturn[1] integer the flags
+@return[2] fail
+*/
+static int
+lmdb_dbi_flags(lua_State *L)
+{
+  lmdb_dbi    *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  unsigned int flags;
+  int          ret = mdb_dbi_flags(dbi->txn, dbi->dbi, &flags);
+  if (ret == MDB_SUCCESS) {
+    lua_pushinteger(L, flags);
+    return 1;
+  }
+  return lmdb_pusherror(L, ret);
+}
+
+/***
+Drop the DB flags
+@function drop
+@tparam[opt] bool delete true to delete the database, false to empty it
+@treturn[1] dbi self
+@return[2] fail
+*/
+static int
+lmdb_dbi_drop(lua_State *L)
+{
+  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  int      del = luaL_optinteger(L, 2, 0);
+  int      ret = mdb_drop(dbi->txn, dbi->dbi, del);
+  if (ret == MDB_SUCCESS) {
+    lua_pushvalue(L, 1);
+    return 1;
+  }
+  return lmdb_pusherror(L, ret);
+}
+
+static int
+lmdb_dbi_close(lua_State *L)
+{
+  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  if (dbi->dbi) {
+    lmdb_txn *txn;
+    lmdb_env *env;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dbi->txn_ref);
+    txn = (lmdb_txn *)luaL_checkudata(L, -1, LUA_LMDB_TXN);
+    lua_pop(L, 1);
+
+    if (txn->txn) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, txn->env_ref);
+      env = (lmdb_env *)luaL_checkudata(L, -1, LUA_LMDB_ENV);
+      lua_pop(L, 1);
+      mdb_dbi_close(env->env, dbi->dbi);
+    }
+
+    dbi->dbi = 0;
+    luaL_unref(L, LUA_REGISTRYINDEX, dbi->txn_ref);
+    dbi->txn_ref = LUA_NOREF;
+  }
+  return 0;
+}
+
+// 经编解码表读取并解码, 快照中本库的版本与缓存项一致时直接返回缓存的值
+static int
+lmdb_codec_get(lua_State *L, lmdb_dbi *dbi, MDB_val *key)
+{
+  lmdb_dbx      *dbx = dbi->dbx;
+  lmdb_dcache   *c = dbx->cache;
+  mdb_size_t     tag = c ? lmdb_dbx_version(dbi->env, dbx, dbi->txn) : 0;
+  uint64_t       h = 0;
+  MDB_val        val;
+  lmdb_slowclock clk;
+  int            t, i, rc;
+
+  rc = lmdb_ttl_check(L, dbi, key);
+  if (rc != MDB_SUCCESS) {
+    LMDB_HOT_TOUCH(dbi, key);
+    return lmdb_pusherror(L, rc);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, dbx->codec);
+  t = lua_gettop(L);
+  if (tag) {
+    h = lmdb_hash(key);
+    i = lmdb_dcache_find(c, key, h);
+    if (i >= 0 && c->slot[i].tag == tag) {
+      c->slot[i].used = 1;
+      LMDB_HOT_TOUCH(dbi, key);
+      lua_rawgeti(L, t, i + 1);
+      return 1;
+    }
+    if (i >= 0) lmdb_dcache_drop(L, t, c, i);
+  }
+
+  lmdb_slow_begin(dbi->env, &clk, dbi->txn);
+  rc = mdb_get(dbi->txn, dbi->dbi, key, &val);
+  lmdb_slow_end(dbi->env, &clk, "get", dbx, mdb_txn_id(dbi->txn), dbi->txn, key);
+  LMDB_HOT_TOUCH(dbi, key);
+  if (rc != MDB_SUCCESS) {
+    return lmdb_pusherror(L, rc);
+  }
+  lua_getfield(L, t, "decode");
+  lua_pushlstring(L, (const char *)val.mv_data, val.mv_size);
+  if (lua_isnil(L, -2)) return 1;
+  lua_pushlstring(L, (const char *)key->mv_data, key->mv_size);
+  lua_call(L, 2, 1);
+  if (tag) {
+    i = lmdb_dcache_insert(L, t, c, key, h, key->mv_size + val.mv_size + sizeof(lmdb_dcentry), tag);
+    if (i >= 0) {
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, t, i + 1);
+    }
+  }
+  return 1;
+}
+
+/***
+Get items from a database.
+
+With a codec set by `dbi:codec()` the value is returned decoded.
+@function get
+
+@tparam string key the key to get
+@treturn[1] string value
+@return[2] fail
+*/
+static int
+lmdb_get(lua_State *L)
+{
+  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  MDB_val key = lmdb_checkvalue(L, 2);
+  MDB_val val;
+  lmdb_slowclock clk;
+
+  if (dbi->dbx && dbi->dbx->codec) {
+    return lmdb_codec_get(L, dbi, &key);
+  }
+  lmdb_slow_begin(dbi->env, &clk, dbi->txn);
+  int rc = mdb_get(dbi->txn, dbi->dbi, &key, &val);
+  lmdb_slow_end(dbi->env, &clk, "get", dbi->dbx, mdb_txn_id(dbi->txn), dbi->txn, &key);
+  LMDB_HOT_TOUCH(dbi, &key);
+  if (rc == MDB_SUCCESS && dbi->dbx) rc = lmdb_ttl_check(L, dbi, &key);
+  if (rc == MDB_SUCCESS) {
+    lua_pushlstring(L, (const char *)val.mv_data, val.mv_size);
+    return 1;
+  }
+  return lmdb_pusherror(L, rc);
+}
+
+#define LMDB_GETBATCH_MAXTHREADS 64
+#define LMDB_GETBATCH_MINSLICE   32  // 每个线程至少分到的键数
+
+// get_batch 的一个分片: 工作线程在与调用方相同的快照上查找一段键
+typedef struct
+{
+  MDB_env       *env;
+  MDB_dbi        dbi;
+  mdb_size_t     txnid;  // 调用方快照
+  const MDB_val *keys;
+  MDB_val       *vals;   // mv_data 为 NULL 表示不存在
+  size_t         n;
+  int            done;   // 0 时由调用方线程补做
+} lmdb_getslice;
+
+static void *
+lmdb_getslice_run(void *arg)
+{
+  lmdb_getslice *s = (lmdb_getslice *)arg;
+  MDB_txn       *txn;
+  size_t         i;
+  int            rc;
+
+  if (mdb_txn_begin(s->env, NULL, MDB_RDONLY, &txn) != MDB_SUCCESS) return NULL;
+  if (mdb_txn_id(txn) == s->txnid) {
+    for (i = 0, rc = MDB_SUCCESS; i < s->n && (rc == MDB_SUCCESS || rc == MDB_NOTFOUND); i++) {
+      MDB_val key = s->keys[i];
+      rc = mdb_get(txn, s->dbi, &key, s->vals + i);
+      if (rc == MDB_NOTFOUND) s->vals[i].mv_data = NULL;
+    }
+    // 页面由调用方的事务保持在同一快照, 结束本事务后值指针仍然有效
+    s->done = rc == MDB_SUCCESS || rc == MDB_NOTFOUND;
+  }
+  mdb_txn_abort(txn);
+  return NULL;
+}
+
+/***
+Look up many keys, overlapping page faults across threads.
+
+The keys are split among `opts.threads` (default 4) threads, each reading
+the same snapshot as this transaction with its own read transaction, so
+when the data is not in memory their page faults are served in parallel.
+Keys a thread could not serve, because this is a write transaction, a
+commit moved the latest snapshot on, or no reader slot was free, are looked
+up here instead; the result is the same either way. Give the environment
+`maxreaders` above `threads` for the threads to get their slots.
+
+@function get_batch
+@tparam table keys an array of keys
+@tparam[opt] table opts
+@treturn[1] table the values in key order, `false` for missing keys
+@treturn[1] integer how many of the keys the threads looked up
+@return[2] fail
+*/
+static int
+lmdb_dbi_get_batch(lua_State *L)
+{
+  lmdb_dbi      *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  lmdb_getslice  slice[LMDB_GETBATCH_MAXTHREADS];
+  pthread_t      tid[LMDB_GETBATCH_MAXTHREADS];
+  int            started[LMDB_GETBATCH_MAXTHREADS];
+  MDB_val       *keys, *vals;
+  MDB_envinfo    info;
+  lmdb_slowclock clk;
+  size_t         n, i, j, served = 0;
+  int            nthreads = 4, t, rc = MDB_SUCCESS;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "threads");
+    nthreads = (int)luaL_optinteger(L, -1, nthreads);
+    lua_pop(L, 1);
+    luaL_argcheck(L, nthreads >= 1 && nthreads <= LMDB_GETBATCH_MAXTHREADS, 3,
+                  "threads must be 1 to 64");
+  }
+  lua_settop(L, 3);
+  lua_newtable(L);
+  n = lua_objlen(L, 2);
+  keys = (MDB_val *)lua_newuserdata(L, 2 * (n ? n : 1) * sizeof(MDB_val));
+  vals = keys + n;
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    keys[i] = lmdb_checkanchored(L, -1, 4);
+    lua_pop(L, 1);
+  }
+
+  lmdb_slow_begin(dbi->env, &clk, dbi->txn);
+  if ((size_t)nthreads > n / LMDB_GETBATCH_MINSLICE) nthreads = (int)(n / LMDB_GETBATCH_MINSLICE);
+  if (nthreads < 1) nthreads = 1;
+  // 写事务的未提交数据对其他线程不可见, 只能在本线程查找
+  if (nthreads > 1 && (mdb_env_info(dbi->env->env, &info) != MDB_SUCCESS ||
+                       mdb_txn_id(dbi->txn) > info.me_last_txnid))
+    nthreads = 1;
+  for (t = 0, j = 0; t < nthreads; t++) {
+    slice[t].env = dbi->env->env;
+    slice[t].dbi = dbi->dbi;
+    slice[t].txnid = mdb_txn_id(dbi->txn);
+    slice[t].keys = keys + j;
+    slice[t].vals = vals + j;
+    slice[t].n = n / nthreads + ((size_t)t < n % nthreads);
+    slice[t].done = 0;
+    j += slice[t].n;
+  }
+  for (t = 1; t < nthreads; t++)
+    started[t] = pthread_create(&tid[t], NULL, lmdb_getslice_run, slice + t) == 0;
+  // 第一段由本线程在调用方事务中查找, 其余分片未完成的也在 join 后补做
+  for (t = 0; t < nthreads && rc == MDB_SUCCESS; t++) {
+    if (t > 0 && started[t]) pthread_join(tid[t], NULL);
+    if (slice[t].done) {
+      served += slice[t].n;
+      continue;
+    }
+    for (i = 0; i < slice[t].n && rc == MDB_SUCCESS; i++) {
+      MDB_val key = slice[t].keys[i];
+      rc = mdb_get(dbi->txn, dbi->dbi, &key, slice[t].vals + i);
+      if (rc == MDB_NOTFOUND) {
+        slice[t].vals[i].mv_data = NULL;
+        rc = MDB_SUCCESS;
+      }
+    }
+  }
+  for (; t < nthreads; t++)
+    if (started[t]) pthread_join(tid[t], NULL);
+  lmdb_slow_end(dbi->env, &clk, "get_batch", dbi->dbx, mdb_txn_id(dbi->txn), dbi->txn, NULL);
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+
+  lua_createtable(L, (int)n, 0);
+  for (i = 0; i < n; i++) {
+    LMDB_HOT_TOUCH(dbi, keys + i);
+    if (vals[i].mv_data && dbi->dbx && lmdb_ttl_check(L, dbi, keys + i) == MDB_SUCCESS)
+      lua_pushlstring(L, (const char *)vals[i].mv_data, vals[i].mv_size);
+    else
+      lua_pushboolean(L, 0);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_pushinteger(L, (lua_Integer)served);
+  return 2;
+}
+
+/***
+Store items into a database.
+
+With a codec set by `dbi:codec()` that has `encode`, the value is encoded
+first.
+
+With `ttl` the key expires that many seconds from now: `get`, `get_batch`
+and `record` no longer return it, and `env:purge_expired()` deletes it.
+Cursors, `aggregate` and other scans still see it until it is purged.
+Putting the key again
+without `ttl`, or deleting it, clears the expiry. Expiry times are kept in
+the `__ttl` and `__expires` databases, so `maxdbs` must leave room for them.
+@function put
+@tparam string key the key to set
+@tparam string value the value to set
+@tparam[opt=0] integer|table flags the flags, or a table with `flags` and
+`ttl` (seconds)
+@treturn[1] dbi self
+@return[2] fail
+*/
+static int
+lmdb_put(lua_State *L)
+{
+  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  MDB_val key = lmdb_checkvalue(L, 2);
+  MDB_val val;
+  unsigned int flags = 0;
+  mdb_size_t deadline = 0;
+  lmdb_slowclock clk;
+  lmdb_ttlref t;
+
+  if (lua_istable(L, 4)) {
+    lua_getfield(L, 4, "flags");
+    flags = luaL_optinteger(L, -1, 0);
+    lua_getfield(L, 4, "ttl");
+    if (!lua_isnil(L, -1)) {
+      lua_Number ttl = luaL_checknumber(L, -1);
+      luaL_argcheck(L, ttl > 0, 4, "ttl must be positive");
+      deadline = lmdb_ttl_now() + (mdb_size_t)(ttl * 1000 + 0.5);
+    }
+    lua_pop(L, 2);
+  } else {
+    flags = luaL_optinteger(L, 4, 0);
+  }
+
+  if (dbi->dbx && dbi->dbx->codec) {
+    int top = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dbi->dbx->codec);
+    lua_getfield(L, -1, "encode");
+    if (!lua_isnil(L, -1)) {
+      lua_pushvalue(L, 3);
+      lua_call(L, 1, 1);
+      lua_replace(L, 3);
+    }
+    lua_settop(L, top);
+  }
+  val = lmdb_checkvalue(L, 3);
+  lmdb_slow_begin(dbi->env, &clk, dbi->txn);
+  int rc = MDB_SUCCESS, top = lua_gettop(L), ttl = dbi->dbx && (deadline || lmdb_ttl_used(L, dbi));
+  if (ttl) {
+    rc = lmdb_ttl_prepare(L, dbi, &key, deadline != 0, &t);
+    if (rc == MDB_NOTFOUND) ttl = 0, rc = MDB_SUCCESS;
+  }
+  if (rc == MDB_SUCCESS)
+    rc = dbi->dbx && dbi->dbx->index ? lmdb_index_write(L, dbi, &key, &val, flags)
+                                     : mdb_put(dbi->txn, dbi->dbi, &key, &val, flags);
+  if (ttl && rc == MDB_SUCCESS) rc = lmdb_ttl_set(dbi, &t, deadline);
+  lua_settop(L, top);
+  lmdb_slow_end(dbi->env, &clk, "put", dbi->dbx, mdb_txn_id(dbi->txn), dbi->txn, &key);
+  LMDB_HOT_TOUCH(dbi, &key);
+  if (rc == MDB_SUCCESS) {
+    lua_pushvalue(L, 1);
+    return 1;
+  }
+
+  return lmdb_pusherror(L, rc);
+}
+
+/***
+Delete items from a database.
+@function del
+@tparam string key the key to del
+@tparam string value the value to set
+@treturn[1] dbi self
+@return[2] fail
+*/
+static int
+lmdb_del(lua_State *L)
+{
+  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  MDB_val key = lmdb_checkvalue(L, 2);
+  lmdb_slowclock clk;
+  lmdb_ttlref t;
+
+  lmdb_slow_begin(dbi->env, &clk, dbi->txn);
+  int rc = MDB_SUCCESS, top = lua_gettop(L), ttl = dbi->dbx && lmdb_ttl_used(L, dbi);
+  if (ttl) {
+    rc = lmdb_ttl_prepare(L, dbi, &key, 0, &t);
+    if (rc == MDB_NOTFOUND) ttl = 0, rc = MDB_SUCCESS;
+  }
+  if (rc == MDB_SUCCESS)
+    rc = dbi->dbx && dbi->dbx->index ? lmdb_index_write(L, dbi, &key, NULL, 0)
+                                     : mdb_del(dbi->txn, dbi->dbi, &key, NULL);
+  if (ttl && rc == MDB_SUCCESS) rc = lmdb_ttl_set(dbi, &t, 0);
+  lua_settop(L, top);
+  lmdb_slow_end(dbi->env, &clk, "del", dbi->dbx, mdb_txn_id(dbi->txn), dbi->txn, &key);
+  LMDB_HOT_TOUCH(dbi, &key);
+  if (rc == MDB_SUCCESS) {
+    lua_pushvalue(L, 1);
+    return 1;
+  }
+
+  return lmdb_pusherror(L, rc);
+}
+
+/***
+Maintain a secondary index of this database.
+
+The index database must be opened with `DUPSORT`; it maps the part of each
+value picked by `spec` to the primary keys holding it. Existing records are
+indexed now, and `put` and `del` on this database keep the index up to date
+in the same transaction. Writes through a cursor do not. The registration
+belongs to the database name within this environment handle, so closing and
+reopening either dbi handle keeps it.
+
+`spec` picks either a byte range of the value, `{offset=0, size=4}` (`size`
+omitted or 0 for the rest of the value), or a delimited field,
+`{sep=",", field=2}` with fields counted from 1. Records without that part
+are not indexed.
+
+@function add_index
+@tparam dbi index the index database
+@tparam table spec how to extract the index key from a value
+@treturn[1] dbi self
+@return[2] fail
+*/
+static int
+lmdb_dbi_add_index(lua_State *L)
+{
+  lmdb_dbi    *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  lmdb_dbi    *idx = (lmdb_dbi *)luaL_checkudata(L, 2, LUA_LMDB_DBI);
+  lmdb_index   spec, *ix;
+  MDB_cursor  *cursor;
+  MDB_val      key, val, n;
+  unsigned int flags;
+  int          rc;
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  memset(&spec, 0, sizeof(spec));
+  spec.target = idx->dbx;
+  spec.sep = -1;
+  lua_getfield(L, 3, "sep");
+  if (!lua_isnil(L, -1)) {
+    size_t      len;
+    const char *sep = luaL_checklstring(L, -1, &len);
+    luaL_argcheck(L, len == 1, 3, "sep must be a single character");
+    spec.sep = (unsigned char)sep[0];
+  }
+  lua_getfield(L, 3, "field");
+  spec.field = luaL_optinteger(L, -1, 1);
+  lua_getfield(L, 3, "offset");
+  spec.offset = luaL_optinteger(L, -1, 0);
+  lua_getfield(L, 3, "size");
+  spec.size = luaL_optinteger(L, -1, 0);
+  lua_pop(L, 4);
+  luaL_argcheck(L, spec.field > 0, 3, "field must be positive");
+
+  if (dbi->dbx == NULL || idx->dbx == NULL || idx->dbx == dbi->dbx) return lmdb_pusherror(L, EINVAL);
+  rc = mdb_dbi_flags(dbi->txn, idx->dbi, &flags);
+  if (rc == MDB_SUCCESS && !(flags & MDB_DUPSORT)) rc = MDB_INCOMPATIBLE;
+  if (rc == MDB_SUCCESS) rc = mdb_dbi_flags(dbi->txn, dbi->dbi, &flags);
+  if (rc == MDB_SUCCESS && (flags & MDB_DUPSORT)) rc = MDB_INCOMPATIBLE;
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+
+  rc = mdb_cursor_open(dbi->txn, dbi->dbi, &cursor);
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  while ((rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT)) == MDB_SUCCESS) {
+    if (lmdb_index_extract(&spec, &val, &n)) {
+      rc = mdb_put(dbi->txn, idx->dbi, &n, &key, 0);
+      if (rc != MDB_SUCCESS) break;
+    }
+  }
+  mdb_cursor_close(cursor);
+  if (rc != MDB_NOTFOUND) return lmdb_pusherror(L, rc);
+
+  // 注册到事务提交时才生效, 事务放弃则丢弃
+  spec.txn = dbi->txn;
+  for (ix = dbi->dbx->index; ix && (ix->target != spec.target || ix->txn != spec.txn); ix = ix->next)
+    ;
+  if (ix == NULL) {
+    ix = (lmdb_index *)malloc(sizeof(lmdb_index));
+    if (ix == NULL) return lmdb_pusherror(L, ENOMEM);
+    spec.next = dbi->dbx->index;
+    dbi->dbx->index = ix;
+  } else {
+    spec.next = ix->next;
+  }
+  *ix = spec;
+  idx->dbx->primary = dbi->dbx;
+  lua_pushvalue(L, 1);
+  return 1;
+}
+
+/***
+Look up primary records through an index.
+
+Called on an index database set up with `add_index`.
+
+@function lookup
+@tparam string value the index key
+@treturn[1] table the primary values, in primary key order
+@treturn[1] table the matching primary keys
+@return[2] fail
+*/
+static int
+lmdb_dbi_lookup(lua_State *L)
+{
+  lmdb_dbi      *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  MDB_val        key = lmdb_checkvalue(L, 2);
+  MDB_val        pkey, val;
+  MDB_cursor    *cursor;
+  MDB_cursor_op  op = MDB_SET;
+  MDB_dbi        primary;
+  int            rc, i = 0;
+
+  if (dbi->dbx == NULL || dbi->dbx->primary == NULL) return lmdb_pusherror(L, EINVAL);
+  rc = lmdb_dbx_dbi(dbi->txn, dbi->dbx->primary, &primary);
+  if (rc == MDB_SUCCESS) rc = mdb_cursor_open(dbi->txn, dbi->dbi, &cursor);
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+
+  lua_newtable(L);
+  lua_newtable(L);
+  while ((rc = mdb_cursor_get(cursor, &key, &pkey, op)) == MDB_SUCCESS) {
+    op = MDB_NEXT_DUP;
+    rc = mdb_get(dbi->txn, primary, &pkey, &val);
+    if (rc == MDB_NOTFOUND) continue;
+    if (rc != MDB_SUCCESS) break;
+    i++;
+    lua_pushlstring(L, (const char *)val.mv_data, val.mv_size);
+    lua_rawseti(L, -3, i);
+    lua_pushlstring(L, (const char *)pkey.mv_data, pkey.mv_size);
+    lua_rawseti(L, -2, i);
+  }
+  mdb_cursor_close(cursor);
+  if (rc != MDB_NOTFOUND) return lmdb_pusherror(L, rc);
+  return 2;
+}
+
+static int
+lmdb_u32_cmp(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// 读取参数中的一个 id 或 id 数组, 排序后按块批量更新
+static int
+lmdb_bitmap_update(lua_State *L, int add)
+{
+  lmdb_dbi      *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  MDB_val        key = lmdb_checkvalue(L, 2), k, v;
+  size_t         n, i, j;
+  uint32_t      *ids;
+  uint64_t      *bits;
+  unsigned char *buf;
+  char           kbuf[LMDB_BM_KEYMAX];
+  int            rc;
+
+  n = lua_istable(L, 3) ? lua_objlen(L, 3) : 1;
+  // 位图按 8 字节对齐, n 为奇数时 ids 后留 4 字节空隙
+  ids = (uint32_t *)lua_newuserdata(L, (n + (n & 1)) * sizeof(uint32_t) + 2 * LMDB_BM_BYTES);
+  bits = (uint64_t *)(ids + n + (n & 1));
+  buf = (unsigned char *)(bits + LMDB_BM_WORDS);
+  for (i = 0; i < n; i++) {
+    lua_Integer id;
+    if (lua_istable(L, 3)) {
+      lua_rawgeti(L, 3, i + 1);
+      id = luaL_checkinteger(L, -1);
+      lua_pop(L, 1);
+    } else {
+      id = luaL_checkinteger(L, 3);
+    }
+    luaL_argcheck(L, id >= 0 && id <= 0xffffffff, 3, "id out of range");
+    ids[i] = (uint32_t)id;
+  }
+  qsort(ids, n, sizeof(uint32_t), lmdb_u32_cmp);
+
+  rc = lmdb_bm_check(dbi, &key);
+  for (i = 0; i < n && rc == MDB_SUCCESS; i = j) {
+    unsigned int chunk = ids[i] >> 16;
+    int          card;
+
+    lmdb_bm_key(kbuf, &key, chunk, &k);
+    rc = mdb_get(dbi->txn, dbi->dbi, &k, &v);
+    if (rc == MDB_SUCCESS) {
+      lmdb_bm_load(bits, &v);
+    } else if (rc == MDB_NOTFOUND) {
+      memset(bits, 0, LMDB_BM_BYTES);
+    } else {
+      break;
+    }
+    for (j = i; j < n && ids[j] >> 16 == chunk; j++) {
+      uint16_t lo = (uint16_t)ids[j];
+      if (add)
+        bits[lo >> 6] |= (uint64_t)1 << (lo & 63);
+      else
+        bits[lo >> 6] &= ~((uint64_t)1 << (lo & 63));
+    }
+    card = lmdb_bm_count(bits);
+    if (card == 0) {
+      rc = mdb_del(dbi->txn, dbi->dbi, &k, NULL);
+      if (rc == MDB_NOTFOUND) rc = MDB_SUCCESS;
+    } else {
+      v.mv_data = buf;
+      v.mv_size = lmdb_bm_store(bits, card, buf);
+      rc = mdb_put(dbi->txn, dbi->dbi, &k, &v, 0);
+    }
+  }
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  lua_pushvalue(L, 1);
+  return 1;
+}
 
 /***
-Dump the entries in the reader lock table.
-@function reader_list
+Add ids to a compressed bitmap.
 
-@tparam function callback(message)
-@treturn[1] env self
+A bitmap keeps a set of 32-bit ids under `key`, split into one record per
+65536-id chunk: a sorted array while the chunk is sparse, a plain bitmap
+once it holds 4096 ids or more. Use a database without `DUPSORT`,
+`INTEGERKEY` or `REVERSEKEY`, best one holding only bitmaps, since chunk
+records are stored as `key` followed by a 2-byte chunk number.
+
+@function bitmap_add
+@tparam string key the bitmap
+@tparam integer|table ids an id or an array of ids
+@treturn[1] dbi self
 @return[2] fail
 */
 static int
-lmdb_reader_list(lua_State *L)
+lmdb_dbi_bitmap_add(lua_State *L)
 {
-  lmdb_env      *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
-  struct msg_ctx ctx;
-  int            ret;
+  return lmdb_bitmap_update(L, 1);
+}
 
-  luaL_checktype(L, 2, LUA_TFUNCTION);
+/***
+Remove ids from a compressed bitmap.
+@function bitmap_remove
+@tparam string key the bitmap
+@tparam integer|table ids an id or an array of ids
+@treturn[1] dbi self
+@return[2] fail
+*/
+static int
+lmdb_dbi_bitmap_remove(lua_State *L)
+{
+  return lmdb_bitmap_update(L, 0);
+}
 
-  lua_pushvalue(L, 2);
-  ctx.ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  ctx.L = L;
+/***
+Test an id in a compressed bitmap.
+@function bitmap_contains
+@tparam string key the bitmap
+@tparam integer id
+@treturn[1] boolean
+@return[2] fail
+*/
+static int
+lmdb_dbi_bitmap_contains(lua_State *L)
+{
+  lmdb_dbi   *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  MDB_val     key = lmdb_checkvalue(L, 2), k, v;
+  lua_Integer id = luaL_checkinteger(L, 3);
+  char        kbuf[LMDB_BM_KEYMAX];
+  uint16_t    lo = (uint16_t)id, x;
+  int         rc, found = 0;
+
+  luaL_argcheck(L, id >= 0 && id <= 0xffffffff, 3, "id out of range");
+  rc = lmdb_bm_check(dbi, &key);
+  if (rc == MDB_SUCCESS) {
+    lmdb_bm_key(kbuf, &key, (unsigned int)(id >> 16), &k);
+    rc = mdb_get(dbi->txn, dbi->dbi, &k, &v);
+  }
+  if (rc == MDB_SUCCESS && v.mv_size == LMDB_BM_BYTES) {
+    uint64_t w = lmdb_bm_get64((const unsigned char *)v.mv_data + (lo >> 6) * 8);
+    found = (w >> (lo & 63)) & 1;
+  } else if (rc == MDB_SUCCESS) {
+    size_t l = 0, h = v.mv_size / 2;
+    while (l < h) {
+      size_t m = (l + h) / 2;
+      x = lmdb_bm_get16((const unsigned char *)v.mv_data + 2 * m);
+      if (x < lo)
+        l = m + 1;
+      else
+        h = m;
+    }
+    if (l < v.mv_size / 2) {
+      x = lmdb_bm_get16((const unsigned char *)v.mv_data + 2 * l);
+      found = x == lo;
+    }
+  } else if (rc != MDB_NOTFOUND) {
+    return lmdb_pusherror(L, rc);
+  }
+  lua_pushboolean(L, found);
+  return 1;
+}
 
-  ret = mdb_reader_list(env->env, lmdb_msg, &ctx);
-  luaL_unref(L, LUA_REGISTRYINDEX, ctx.ref);
+/***
+Count the ids in a compressed bitmap.
+@function bitmap_count
+@tparam string key the bitmap
+@treturn[1] integer
+@return[2] fail
+*/
+static int
+lmdb_dbi_bitmap_count(lua_State *L)
+{
+  lmdb_dbi    *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  MDB_val      key = lmdb_checkvalue(L, 2), v;
+  MDB_cursor  *cursor;
+  unsigned int chunk;
+  mdb_size_t   n = 0;
+  int          rc = lmdb_bm_check(dbi, &key);
+
+  if (rc == MDB_SUCCESS) rc = mdb_cursor_open(dbi->txn, dbi->dbi, &cursor);
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  for (rc = lmdb_bm_seek(cursor, &key, 0, &chunk, &v); rc == MDB_SUCCESS;
+       rc = lmdb_bm_seek(cursor, &key, chunk + 1, &chunk, &v))
+    n += lmdb_bm_card(&v);
+  mdb_cursor_close(cursor);
+  if (rc != MDB_NOTFOUND) return lmdb_pusherror(L, rc);
+  lua_pushinteger(L, n);
+  return 1;
+}
 
-  if (ret == MDB_SUCCESS) {
-    lua_pushvalue(L, 1);
-    return 1;
+// 时间序列: 每个序列的点先在内存中缓冲, 满一块后压缩写入, 键为 8 字节大端序列号
+// + 8 字节块起始时间 (符号位取反的大端, 保持有序). 块头为点数, 首末时间和首个值,
+// 其后时间按二阶差分, 值按与前值异或编码
+#define LMDB_TS_BLOCK  256
+#define LMDB_TS_HEADER (4 + 8 + 8 + 8)
+#define LMDB_TS_MAXBIT 152  // 每点最多位数: 时间 4 + 64, 值 2 + 5 + 6 + 64
+
+typedef struct
+{
+  unsigned char *p;
+  size_t         len;
+  size_t         bit;
+} lmdb_bits;
+
+static void
+lmdb_bits_put(lmdb_bits *b, uint64_t v, int n)
+{
+  while (n > 0) {
+    int off = b->bit & 7, take = 8 - off;
+    if (take > n) take = n;
+    b->p[b->bit >> 3] |= (unsigned char)(((v >> (n - take)) & ((1u << take) - 1)) << (8 - off - take));
+    b->bit += take;
+    n -= take;
   }
-  return lmdb_pusherror(L, ret);
+}
+
+// 读取 n 位, 越界时返回 -1
+static int
+lmdb_bits_get(lmdb_bits *b, int n, uint64_t *v)
+{
+  *v = 0;
+  if (b->bit + n > b->len * 8) return -1;
+  while (n > 0) {
+    int off = b->bit & 7, take = 8 - off;
+    if (take > n) take = n;
+    *v = (*v << take) | ((b->p[b->bit >> 3] >> (8 - off - take)) & ((1u << take) - 1));
+    b->bit += take;
+    n -= take;
+  }
+  return 0;
+}
+
+static void
+lmdb_ts_key(unsigned char *k, uint64_t series, int64_t ts)
+{
+  uint64_t t = (uint64_t)ts ^ ((uint64_t)1 << 63);
+  int      i;
+  for (i = 0; i < 8; i++) {
+    k[i] = (unsigned char)(series >> (56 - 8 * i));
+    k[8 + i] = (unsigned char)(t >> (56 - 8 * i));
+  }
+}
+
+static void
+lmdb_ts_unkey(const unsigned char *k, uint64_t *series, int64_t *ts)
+{
+  uint64_t s = 0, t = 0;
+  int      i;
+  for (i = 0; i < 8; i++) {
+    s = s << 8 | k[i];
+    t = t << 8 | k[8 + i];
+  }
+  *series = s;
+  *ts = (int64_t)(t ^ ((uint64_t)1 << 63));
+}
+
+// 编码 n 个点到 out, 返回字节数. out 须有 LMDB_TS_HEADER + n * LMDB_TS_MAXBIT / 8 + 8 字节并已清零
+static size_t
+lmdb_ts_encode(const int64_t *ts, const double *val, int n, unsigned char *out)
+{
+  lmdb_bits b = { out + LMDB_TS_HEADER, 0, 0 };
+  uint64_t  prev, cur, x;
+  int64_t   delta = 0, dod;
+  uint32_t  count = (uint32_t)n;
+  int       i, lead, trail, plead = -1, ptrail = 0;
+
+  memcpy(out, &count, 4);
+  memcpy(out + 4, &ts[0], 8);
+  memcpy(out + 12, &ts[n - 1], 8);
+  memcpy(out + 20, &val[0], 8);
+  memcpy(&prev, &val[0], 8);
+  for (i = 1; i < n; i++) {
+    dod = (ts[i] - ts[i - 1]) - delta;
+    delta = ts[i] - ts[i - 1];
+    if (dod == 0) {
+      lmdb_bits_put(&b, 0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+      lmdb_bits_put(&b, 2, 2);
+      lmdb_bits_put(&b, (uint64_t)(dod + 63), 7);
+    } else if (dod >= -255 && dod <= 256) {
+      lmdb_bits_put(&b, 6, 3);
+      lmdb_bits_put(&b, (uint64_t)(dod + 255), 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+      lmdb_bits_put(&b, 14, 4);
+      lmdb_bits_put(&b, (uint64_t)(dod + 2047), 12);
+    } else {
+      lmdb_bits_put(&b, 15, 4);
+      lmdb_bits_put(&b, (uint64_t)dod, 64);
+    }
+
+    memcpy(&cur, &val[i], 8);
+    x = cur ^ prev;
+    prev = cur;
+    if (x == 0) {
+      lmdb_bits_put(&b, 0, 1);
+      continue;
+    }
+    lead = __builtin_clzll(x);
+    trail = __builtin_ctzll(x);
+    if (lead > 31) lead = 31;
+    if (plead >= 0 && lead >= plead && trail >= ptrail) {
+      lmdb_bits_put(&b, 2, 2);
+      lmdb_bits_put(&b, x >> ptrail, 64 - plead - ptrail);
+    } else {
+      lmdb_bits_put(&b, 3, 2);
+      lmdb_bits_put(&b, (uint64_t)lead, 5);
+      lmdb_bits_put(&b, (uint64_t)((64 - lead - trail) & 63), 6);
+      lmdb_bits_put(&b, x >> trail, 64 - lead - trail);
+      plead = lead;
+      ptrail = trail;
+    }
+  }
+  return LMDB_TS_HEADER + (b.bit + 7) / 8;
+}
+
+// 解码一块中 [from, to) 内的点, 依次压入栈顶两个表; 块损坏时返回 MDB_CORRUPTED
+static int
+lmdb_ts_decode(lua_State *L, const MDB_val *v, int64_t from, int64_t to, lua_Integer *k)
+{
+  const unsigned char *p = (const unsigned char *)v->mv_data;
+  lmdb_bits            b;
+  uint32_t             count, i;
+  int64_t              ts, delta = 0;
+  uint64_t             bits, x, tag;
+  double               d;
+  int                  plead = 0, psig = 0;
+
+  if (v->mv_size < LMDB_TS_HEADER) return MDB_CORRUPTED;
+  memcpy(&count, p, 4);
+  memcpy(&ts, p + 4, 8);
+  memcpy(&bits, p + 20, 8);
+  b.p = (unsigned char *)p + LMDB_TS_HEADER;
+  b.len = v->mv_size - LMDB_TS_HEADER;
+  b.bit = 0;
+  for (i = 0; i < count; i++) {
+    if (i > 0) {
+      int64_t dod;
+      if (lmdb_bits_get(&b, 1, &tag)) return MDB_CORRUPTED;
+      if (tag == 0) {
+        dod = 0;
+      } else {
+        int n = 1;
+        while (n < 4 && lmdb_bits_get(&b, 1, &tag) == 0 && tag) n++;
+        if (lmdb_bits_get(&b, n == 1 ? 7 : n == 2 ? 9 : n == 3 ? 12 : 64, &x)) return MDB_CORRUPTED;
+        dod = n == 1 ? (int64_t)x - 63 : n == 2 ? (int64_t)x - 255 : n == 3 ? (int64_t)x - 2047 : (int64_t)x;
+      }
+      delta += dod;
+      ts += delta;
+
+      if (lmdb_bits_get(&b, 1, &tag)) return MDB_CORRUPTED;
+      if (tag) {
+        if (lmdb_bits_get(&b, 1, &tag)) return MDB_CORRUPTED;
+        if (tag) {
+          uint64_t lead, sig;
+          if (lmdb_bits_get(&b, 5, &lead) || lmdb_bits_get(&b, 6, &sig)) return MDB_CORRUPTED;
+          plead = (int)lead;
+          psig = sig ? (int)sig : 64;
+          if (plead + psig > 64) return MDB_CORRUPTED;
+        } else if (psig == 0) {
+          return MDB_CORRUPTED;
+        }
+        if (lmdb_bits_get(&b, psig, &x)) return MDB_CORRUPTED;
+        bits ^= x << (64 - plead - psig);
+      }
+    }
+    if (ts >= to) break;
+    if (ts >= from) {
+      memcpy(&d, &bits, 8);
+      (*k)++;
+      lua_pushinteger(L, ts);
+      lua_rawseti(L, -3, *k);
+      lua_pushnumber(L, d);
+      lua_rawseti(L, -2, *k);
+    }
+  }
+  return MDB_SUCCESS;
+}
+
+// 取得序列的缓冲区, create 时不存在则新建, 并从库中最后一块读出已写入的最后时间
+static lmdb_tsbuf *
+lmdb_ts_series(lmdb_dbi *dbi, uint64_t series, int create)
+{
+  lmdb_ts    *ts = dbi->dbx->ts;
+  lmdb_tsbuf *b;
+  size_t      i, mask;
+
+  if (ts == NULL) {
+    if (!create) return NULL;
+    ts = dbi->dbx->ts = (lmdb_ts *)calloc(1, sizeof(lmdb_ts));
+    if (ts == NULL) return NULL;
+  }
+  if (ts->cap) {
+    mask = ts->cap - 1;
+    for (i = (series * 0x9E3779B97F4A7C15ULL) & mask; ts->slot[i]; i = (i + 1) & mask)
+      if (ts->slot[i]->series == series) return ts->slot[i];
+  }
+  if (!create) return NULL;
+
+  if (ts->n * 2 >= ts->cap) {
+    size_t       cap = ts->cap ? ts->cap * 2 : 16, j;
+    lmdb_tsbuf **slot = (lmdb_tsbuf **)calloc(cap, sizeof(lmdb_tsbuf *));
+    if (slot == NULL) return NULL;
+    for (j = 0; j < ts->cap; j++) {
+      if (ts->slot[j] == NULL) continue;
+      for (i = (ts->slot[j]->series * 0x9E3779B97F4A7C15ULL) & (cap - 1); slot[i]; i = (i + 1) & (cap - 1))
+        ;
+      slot[i] = ts->slot[j];
+    }
+    free(ts->slot);
+    ts->slot = slot;
+    ts->cap = cap;
+  }
+  b = (lmdb_tsbuf *)calloc(1, sizeof(lmdb_tsbuf));
+  if (b == NULL) return NULL;
+  b->series = series;
+  {
+    MDB_cursor   *cursor;
+    MDB_val       k, v;
+    unsigned char kb[16];
+    uint64_t      s;
+    int           rc;
+
+    if (mdb_cursor_open(dbi->txn, dbi->dbi, &cursor) != MDB_SUCCESS) {
+      free(b);
+      return NULL;
+    }
+    lmdb_ts_key(kb, series + 1, INT64_MIN);
+    k.mv_data = kb;
+    k.mv_size = 16;
+    rc = series == UINT64_MAX ? mdb_cursor_get(cursor, &k, &v, MDB_LAST)
+                              : mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE);
+    if (rc == MDB_SUCCESS && series != UINT64_MAX) rc = mdb_cursor_get(cursor, &k, &v, MDB_PREV);
+    if (rc == MDB_NOTFOUND && series != UINT64_MAX) rc = mdb_cursor_get(cursor, &k, &v, MDB_LAST);
+    if (rc == MDB_SUCCESS && k.mv_size == 16 && v.mv_size >= LMDB_TS_HEADER) {
+      lmdb_ts_unkey((const unsigned char *)k.mv_data, &s, &b->last);
+      if (s == series) {
+        memcpy(&b->last, (const char *)v.mv_data + 12, 8);
+        b->haslast = 1;
+      }
+    }
+    mdb_cursor_close(cursor);
+  }
+  mask = ts->cap - 1;
+  for (i = (series * 0x9E3779B97F4A7C15ULL) & mask; ts->slot[i]; i = (i + 1) & mask)
+    ;
+  ts->slot[i] = b;
+  ts->n++;
+  return b;
+}
+
+// 把缓冲中尚未写入的点写成一块, 块键大于库中所有键时用 MDB_APPEND.
+// 写入的点留在缓冲里直到事务提交, 事务放弃时由下次 flush 重写
+static int
+lmdb_ts_flush(lmdb_dbi *dbi, lmdb_tsbuf *b)
+{
+  unsigned char  kb[16], *blk;
+  MDB_val        k, v;
+  int            rc, n = b->n - b->flushed;
+
+  if (n == 0) return MDB_SUCCESS;
+  blk = (unsigned char *)calloc(1, LMDB_TS_HEADER + (size_t)n * LMDB_TS_MAXBIT / 8 + 8);
+  if (blk == NULL) return ENOMEM;
+  lmdb_ts_key(kb, b->series, b->ts[b->flushed]);
+  k.mv_data = kb;
+  k.mv_size = 16;
+  v.mv_data = blk;
+  v.mv_size = lmdb_ts_encode(b->ts + b->flushed, b->val + b->flushed, n, blk);
+  rc = mdb_put(dbi->txn, dbi->dbi, &k, &v, MDB_APPEND);
+  if (rc == MDB_KEYEXIST) rc = mdb_put(dbi->txn, dbi->dbi, &k, &v, 0);
+  free(blk);
+  if (rc == MDB_SUCCESS) {
+    b->flushed = b->n;
+    b->ftxn = dbi->txn;
+  }
+  return rc;
 }
 
 /***
-Check for stale entries in the reader lock table.
-@function reader_check
+Append a point to a time series kept in this database.
+
+Points are buffered in memory per series, in every handle of the database
+in this environment, and written as one compressed block once
+256 of them have gathered, or by `dbi:ts_flush()`. Timestamps
+are delta-of-delta encoded and values XOR encoded against the previous
+one, so regular series take a few bits per point. Timestamps of a series
+must increase. A full buffer is written in this transaction, which then must
+be a write transaction; buffered points not yet flushed live only in this
+process. Written points stay buffered until the transaction commits, so an
+aborted transaction leaves them to be written again.
+
+@function ts_append
+@tparam integer series the series id
+@tparam integer ts the timestamp
+@tparam number value the value
+@treturn[1] dbi self
+@return[2] fail
+*/
+static int
+lmdb_dbi_ts_append(lua_State *L)
+{
+  lmdb_dbi   *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  uint64_t    series = (uint64_t)luaL_checkinteger(L, 2);
+  int64_t     ts = (int64_t)luaL_checkinteger(L, 3);
+  double      val = luaL_checknumber(L, 4);
+  lmdb_tsbuf *b = lmdb_ts_series(dbi, series, 1);
+  int         rc;
+
+  if (b == NULL) {
+    return lmdb_pusherror(L, ENOMEM);
+  }
+  if ((b->haslast && ts <= b->last) || (b->n && ts <= b->ts[b->n - 1])) {
+    return lmdb_pusherror(L, EINVAL);
+  }
+  if (b->n - b->flushed == LMDB_TS_BLOCK) {
+    rc = lmdb_ts_flush(dbi, b);
+    if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  }
+  if (b->n == b->cap) {
+    int      cap = b->cap ? b->cap * 2 : 8;
+    int64_t *t = (int64_t *)realloc(b->ts, cap * sizeof(int64_t));
+    double  *v;
+    if (t == NULL) return lmdb_pusherror(L, ENOMEM);
+    b->ts = t;
+    v = (double *)realloc(b->val, cap * sizeof(double));
+    if (v == NULL) return lmdb_pusherror(L, ENOMEM);
+    b->val = v;
+    b->cap = cap;
+  }
+  b->ts[b->n] = ts;
+  b->val[b->n] = val;
+  b->n++;
+  b->last = ts;
+  b->haslast = 1;
+  lua_pushvalue(L, 1);
+  return 1;
+}
 
-@treturn[1] integer dead integer of stale slots that were cleared
+/***
+Write buffered time series points as blocks in this write transaction.
+
+If the transaction is aborted the points stay buffered for a later flush.
+
+@function ts_flush
+@tparam[opt] integer series only this series, default all
+@treturn[1] integer the number of points written
 @return[2] fail
 */
 static int
-lmdb_reader_check(lua_State *L)
+lmdb_dbi_ts_flush(lua_State *L)
 {
-  lmdb_env *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
-  int       dead = 0;
+  lmdb_dbi   *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  lmdb_ts    *ts = dbi->dbx->ts;
+  lua_Integer n = 0;
+  size_t      i;
+  int         rc = MDB_SUCCESS;
+
+  if (!lua_isnoneornil(L, 2)) {
+    lmdb_tsbuf *b = lmdb_ts_series(dbi, (uint64_t)luaL_checkinteger(L, 2), 0);
+    if (b) {
+      n = b->n - b->flushed;
+      rc = lmdb_ts_flush(dbi, b);
+    }
+  } else if (ts) {
+    for (i = 0; i < ts->cap && rc == MDB_SUCCESS; i++) {
+      if (ts->slot[i] == NULL) continue;
+      n += ts->slot[i]->n - ts->slot[i]->flushed;
+      rc = lmdb_ts_flush(dbi, ts->slot[i]);
+    }
+  }
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  lua_pushinteger(L, n);
+  return 1;
+}
 
-  int ret = mdb_reader_check(env->env, &dead);
+/***
+Read the points of a time series in `[from, to)`.
+
+Only the blocks overlapping the range are decoded, followed by the points
+still buffered in this process.
+
+@function ts_range
+@tparam integer series the series id
+@tparam[opt] integer from first timestamp, default the oldest
+@tparam[opt] integer to timestamp to stop before, default past the newest
+@treturn[1] table the timestamps
+@treturn[1] table the values
+@return[2] fail
+*/
+static int
+lmdb_dbi_ts_range(lua_State *L)
+{
+  lmdb_dbi     *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  uint64_t      series = (uint64_t)luaL_checkinteger(L, 2), s;
+  int64_t       from = (int64_t)luaL_optinteger(L, 3, INT64_MIN);
+  int64_t       to = (int64_t)luaL_optinteger(L, 4, INT64_MAX), start, last;
+  lmdb_tsbuf   *b = lmdb_ts_series(dbi, series, 0);
+  MDB_cursor   *cursor;
+  MDB_val       k, v;
+  unsigned char kb[16];
+  lua_Integer   n = 0;
+  int           rc, i;
+
+  rc = mdb_cursor_open(dbi->txn, dbi->dbi, &cursor);
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  lua_newtable(L);
+  lua_newtable(L);
+
+  // 起始时间早于 from 的前一块也可能有区间内的点
+  lmdb_ts_key(kb, series, from);
+  k.mv_data = kb;
+  k.mv_size = 16;
+  rc = mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE);
+  if (rc == MDB_SUCCESS || rc == MDB_NOTFOUND) {
+    MDB_cursor_op op = rc == MDB_SUCCESS ? MDB_PREV : MDB_LAST;
+    rc = mdb_cursor_get(cursor, &k, &v, op);
+    if (rc == MDB_SUCCESS && k.mv_size == 16 && v.mv_size >= LMDB_TS_HEADER) {
+      lmdb_ts_unkey((const unsigned char *)k.mv_data, &s, &start);
+      memcpy(&last, (const char *)v.mv_data + 12, 8);
+      if (s == series && last >= from) rc = lmdb_ts_decode(L, &v, from, to, &n);
+    }
+    if (rc == MDB_SUCCESS || rc == MDB_NOTFOUND) {
+      k.mv_data = kb;
+      k.mv_size = 16;
+      rc = mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE);
+    }
+  }
+  while (rc == MDB_SUCCESS && k.mv_size == 16) {
+    lmdb_ts_unkey((const unsigned char *)k.mv_data, &s, &start);
+    if (s != series || start >= to) break;
+    rc = lmdb_ts_decode(L, &v, from, to, &n);
+    if (rc == MDB_SUCCESS) rc = mdb_cursor_get(cursor, &k, &v, MDB_NEXT);
+  }
+  mdb_cursor_close(cursor);
+  if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) return lmdb_pusherror(L, rc);
+
+  // 本事务已写成块的点上面已读过
+  for (i = b && b->ftxn == dbi->txn ? b->flushed : 0; b && i < b->n && b->ts[i] < to; i++) {
+    if (b->ts[i] < from) continue;
+    n++;
+    lua_pushinteger(L, b->ts[i]);
+    lua_rawseti(L, -3, n);
+    lua_pushnumber(L, b->val[i]);
+    lua_rawseti(L, -2, n);
+  }
+  return 2;
+}
+
+// 键区间: from 含, to 不含, prefix 限定前缀
+typedef struct lmdb_range {
+  MDB_val from, to, prefix;
+  int     hasfrom, hasto, hasprefix;
+} lmdb_range;
+
+// 从 idx 处的表读取 from/to/prefix, 字符串由表或 anchor 处的表持有
+static void
+lmdb_range_check(lua_State *L, int idx, lmdb_range *r, int anchor)
+{
+  memset(r, 0, sizeof(*r));
+  lua_getfield(L, idx, "from");
+  if ((r->hasfrom = !lua_isnil(L, -1))) r->from = lmdb_checkanchored(L, -1, anchor);
+  lua_getfield(L, idx, "to");
+  if ((r->hasto = !lua_isnil(L, -1))) r->to = lmdb_checkanchored(L, -1, anchor);
+  lua_getfield(L, idx, "prefix");
+  if ((r->hasprefix = !lua_isnil(L, -1))) r->prefix = lmdb_checkanchored(L, -1, anchor);
+  lua_pop(L, 3);
+}
+
+// 定位到区间内第一个键
+static int
+lmdb_range_first(MDB_cursor *cursor, const lmdb_range *r, MDB_val *key, MDB_val *val)
+{
+  MDB_txn *txn = mdb_cursor_txn(cursor);
+  MDB_dbi  dbi = mdb_cursor_dbi(cursor);
+
+  if (r->hasfrom && (!r->hasprefix || mdb_cmp(txn, dbi, &r->from, &r->prefix) > 0))
+    *key = r->from;
+  else if (r->hasprefix)
+    *key = r->prefix;
+  else
+    return mdb_cursor_get(cursor, key, val, MDB_FIRST);
+  return mdb_cursor_get(cursor, key, val, MDB_SET_RANGE);
+}
+
+// 键是否仍在区间内, 越过后即可停止扫描
+static int
+lmdb_range_in(MDB_cursor *cursor, const lmdb_range *r, const MDB_val *key)
+{
+  if (r->hasprefix && (key->mv_size < r->prefix.mv_size ||
+                       memcmp(key->mv_data, r->prefix.mv_data, r->prefix.mv_size) != 0))
+    return 0;
+  return !r->hasto || mdb_cmp(mdb_cursor_txn(cursor), mdb_cursor_dbi(cursor), key, &r->to) < 0;
+}
+
+enum { LMDB_AGG_COUNT, LMDB_AGG_SUM, LMDB_AGG_MIN, LMDB_AGG_MAX, LMDB_AGG_AVG };
+
+// 聚合状态, 整数字段按 64 位补码累加
+typedef struct lmdb_agg {
+  int        op, field, type, be;
+  size_t     offset, width;
+  mdb_size_t count;
+  uint64_t   isum, imin, imax;
+  double     dsum, dmin, dmax;
+} lmdb_agg;
+
+// 从值中解出字段累加进 a, 值太短或宽度不合法时跳过
+static void
+lmdb_agg_add(lmdb_agg *a, const MDB_val *v)
+{
+  size_t   w;
+  uint64_t u;
+  double   d;
+
+  if ((w = lmdb_field_read(v, a->offset, a->width, a->be, &u)) == 0) return;
+
+  if (a->type == LMDB_FIELD_FLOAT) {
+    if (w == 4) {
+      uint32_t x = (uint32_t)u;
+      float    f;
+      memcpy(&f, &x, 4);
+      d = f;
+    } else if (w == 8) {
+      memcpy(&d, &u, 8);
+    } else {
+      return;
+    }
+    if (a->count == 0 || d < a->dmin) a->dmin = d;
+    if (a->count == 0 || d > a->dmax) a->dmax = d;
+  } else if (a->type == LMDB_FIELD_INT) {
+    if (w < 8 && (u >> (w * 8 - 1)) & 1) u |= ~(uint64_t)0 << (w * 8);
+    d = (double)(int64_t)u;
+    if (a->count == 0 || (int64_t)u < (int64_t)a->imin) a->imin = u;
+    if (a->count == 0 || (int64_t)u > (int64_t)a->imax) a->imax = u;
+  } else {
+    d = (double)u;
+    if (a->count == 0 || u < a->imin) a->imin = u;
+    if (a->count == 0 || u > a->imax) a->imax = u;
+  }
+  a->isum += u;
+  a->dsum += d;
+  a->count++;
+}
+
+// 聚合一个键下的全部重复值, DUPFIXED 时整页读取
+static int
+lmdb_agg_dups(lmdb_agg *a, MDB_cursor *cursor, MDB_val *key, MDB_val *val, int fixed)
+{
+  mdb_size_t n, i;
+  size_t     size = val->mv_size, j;
+  int        rc = mdb_cursor_count(cursor, &n);
+
+  if (rc != MDB_SUCCESS) return rc;
+  if (a->op == LMDB_AGG_COUNT && !a->field) {
+    a->count += n;
+    return MDB_SUCCESS;
+  }
+  if (!fixed || n == 1) {
+    lmdb_agg_add(a, val);
+    for (i = 1; i < n && rc == MDB_SUCCESS; i++) {
+      rc = mdb_cursor_get(cursor, key, val, MDB_NEXT_DUP);
+      if (rc == MDB_SUCCESS) lmdb_agg_add(a, val);
+    }
+    return rc;
+  }
+  for (rc = mdb_cursor_get(cursor, key, val, MDB_GET_MULTIPLE); rc == MDB_SUCCESS;
+       rc = mdb_cursor_get(cursor, key, val, MDB_NEXT_MULTIPLE)) {
+    MDB_val item;
+    item.mv_size = size;
+    for (j = 0; j + size <= val->mv_size; j += size) {
+      item.mv_data = (char *)val->mv_data + j;
+      lmdb_agg_add(a, &item);
+    }
+  }
+  return rc == MDB_NOTFOUND ? MDB_SUCCESS : rc;
+}
+
+/***
+Aggregate the values of a key range in C.
+
+`spec.from` (inclusive), `spec.to` (exclusive) and `spec.prefix` bound the
+scanned keys; all are optional. `spec.op` is one of `"count"` (default),
+`"sum"`, `"min"`, `"max"` or `"avg"`. `spec.field` picks the number out of
+each value, `{offset=0, width=8, type="int", be=false}` or positionally
+`{0, 8, "int"}`: `width` is 1, 2, 4 or 8 bytes (omitted or 0 for the rest of
+the value), `type` is `"int"`, `"uint"` or `"float"` (width 4 or 8), in
+native byte order unless `be` is set. Without `field` the whole value is
+read as a native signed integer, which suits `INTEGERDUP` databases, and a
+plain count needs no decoding at all. Values too short for the field are
+skipped. Every duplicate of a `DUPSORT` key counts.
+
+Integer sums wrap like Lua integers; `avg` is computed in floating point.
+`min`, `max` and `avg` of an empty range are nil.
+
+@function aggregate
+@tparam[opt] table spec
+@treturn[1] number the result
+@treturn[1] integer the number of values aggregated
+@return[2] fail
+*/
+static int
+lmdb_dbi_aggregate(lua_State *L)
+{
+  static const char *const ops[] = { "count", "sum", "min", "max", "avg", NULL };
+  static const char *const types[] = { "int", "uint", "float", NULL };
+  lmdb_dbi    *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  lmdb_range   range;
+  lmdb_agg     a;
+  MDB_cursor  *cursor;
+  MDB_val      key, val;
+  unsigned int flags;
+  int          rc;
+
+  memset(&a, 0, sizeof(a));
+  memset(&range, 0, sizeof(range));
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_newtable(L);
+    lmdb_range_check(L, 2, &range, 3);
+    lua_getfield(L, 2, "op");
+    a.op = lmdb_optfield(L, 2, "count", ops);
+    lua_getfield(L, 2, "field");
+    if ((a.field = !lua_isnil(L, -1))) {
+      int f = lua_gettop(L);
+      luaL_argcheck(L, lua_istable(L, f), 2, "field must be a table");
+      lmdb_getfield2(L, f, "offset", 1);
+      a.offset = (size_t)luaL_optinteger(L, -1, 0);
+      lmdb_getfield2(L, f, "width", 2);
+      a.width = (size_t)luaL_optinteger(L, -1, 0);
+      lmdb_getfield2(L, f, "type", 3);
+      a.type = lmdb_optfield(L, 2, "int", types);
+      lua_getfield(L, f, "be");
+      a.be = lua_toboolean(L, -1);
+      lua_pop(L, 4);
+      luaL_argcheck(L, a.width == 0 || a.width == 1 || a.width == 2 || a.width == 4 || a.width == 8,
+                    2, "width must be 1, 2, 4 or 8");
+      luaL_argcheck(L, a.type != LMDB_FIELD_FLOAT || a.width == 0 || a.width >= 4, 2,
+                    "float width must be 4 or 8");
+    }
+    lua_pop(L, 2);
+  }
+
+  rc = mdb_dbi_flags(dbi->txn, dbi->dbi, &flags);
+  if (rc == MDB_SUCCESS) rc = mdb_cursor_open(dbi->txn, dbi->dbi, &cursor);
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  for (rc = lmdb_range_first(cursor, &range, &key, &val); rc == MDB_SUCCESS;
+       rc = mdb_cursor_get(cursor, &key, &val, (flags & MDB_DUPSORT) ? MDB_NEXT_NODUP : MDB_NEXT)) {
+    if (!lmdb_range_in(cursor, &range, &key)) break;
+    if (flags & MDB_DUPSORT) {
+      rc = lmdb_agg_dups(&a, cursor, &key, &val, flags & MDB_DUPFIXED);
+      if (rc != MDB_SUCCESS) break;
+    } else if (a.op == LMDB_AGG_COUNT && !a.field) {
+      a.count++;
+    } else {
+      lmdb_agg_add(&a, &val);
+    }
+  }
+  mdb_cursor_close(cursor);
+  if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) return lmdb_pusherror(L, rc);
+
+  if (a.op == LMDB_AGG_COUNT) {
+    lua_pushinteger(L, a.count);
+  } else if (a.op == LMDB_AGG_SUM) {
+    if (a.type == LMDB_FIELD_FLOAT)
+      lua_pushnumber(L, a.dsum);
+    else
+      lua_pushinteger(L, (lua_Integer)a.isum);
+  } else if (a.count == 0) {
+    lua_pushnil(L);
+  } else if (a.op == LMDB_AGG_AVG) {
+    lua_pushnumber(L, a.dsum / a.count);
+  } else if (a.type == LMDB_FIELD_FLOAT) {
+    lua_pushnumber(L, a.op == LMDB_AGG_MIN ? a.dmin : a.dmax);
+  } else {
+    lua_pushinteger(L, (lua_Integer)(a.op == LMDB_AGG_MIN ? a.imin : a.imax));
+  }
+  lua_pushinteger(L, a.count);
+  return 2;
+}
+
+// 取 key 的记录副本, 压入可写缓冲区, 至少与布局一样长, 不足部分补零.
+// *old 为原值长度, 记录不存在时为 0
+static int
+lmdb_record_load(lua_State *L, lmdb_dbi *dbi, const lmdb_schema *sc, MDB_val *key,
+                 unsigned char **buf, size_t *old)
+{
+  MDB_val val;
+  size_t  n;
+  int     rc = mdb_get(dbi->txn, dbi->dbi, key, &val);
+
+  if (rc == MDB_NOTFOUND) {
+    val.mv_size = 0;
+    rc = MDB_SUCCESS;
+  }
+  if (rc != MDB_SUCCESS) return rc;
+  *old = val.mv_size;
+  n = val.mv_size > sc->size ? val.mv_size : sc->size;
+  *buf = (unsigned char *)lua_newuserdata(L, n);
+  if (val.mv_size) memcpy(*buf, val.mv_data, val.mv_size);
+  memset(*buf + val.mv_size, 0, n - val.mv_size);
+  return rc;
+}
+
+// 写回改过的记录. 长度不变时经游标预留原值的位置覆盖, 只触及记录所在的页
+static int
+lmdb_record_store(lua_State *L, lmdb_dbi *dbi, MDB_val *key, const unsigned char *buf, size_t size,
+                  size_t old)
+{
+  MDB_cursor *cur;
+  MDB_val     k = *key, v = { size, (void *)buf };
+  int         rc;
+
+  if (dbi->dbx->index) return lmdb_index_write(L, dbi, key, &v, 0);
+  if (size != old) return mdb_put(dbi->txn, dbi->dbi, key, &v, 0);
+  rc = mdb_cursor_open(dbi->txn, dbi->dbi, &cur);
+  if (rc != MDB_SUCCESS) return rc;
+  rc = mdb_cursor_get(cur, &k, &v, MDB_SET);
+  if (rc == MDB_SUCCESS) {
+    v.mv_size = size;
+    rc = mdb_cursor_put(cur, &k, &v, MDB_CURRENT | MDB_RESERVE);
+  }
+  if (rc == MDB_SUCCESS) memcpy(v.mv_data, buf, size);
+  mdb_cursor_close(cur);
+  return rc;
+}
+
+// 按 idx 处的表 (字段名 -> 值) 改写 key 的记录, 记录不存在时新建
+static int
+lmdb_record_update(lua_State *L, lmdb_dbi *dbi, MDB_val *key, int idx)
+{
+  const lmdb_schema *sc = dbi->dbx->schema;
+  unsigned char     *buf;
+  size_t             old;
+  lmdb_slowclock     clk;
+  int                top = lua_gettop(L), rc;
+
+  lmdb_slow_begin(dbi->env, &clk, dbi->txn);
+  rc = lmdb_record_load(L, dbi, sc, key, &buf, &old);
+  if (rc == MDB_SUCCESS) {
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      const lmdb_sfield *f = lmdb_schema_field(L, sc, -2);
+      if (f == NULL)
+        return luaL_error(L, "no field '%s' in schema", lua_type(L, -2) == LUA_TSTRING ? lua_tostring(L, -2) : "?");
+      lmdb_sfield_store(L, f, buf, lua_gettop(L));
+      lua_pop(L, 1);
+    }
+    rc = lmdb_record_store(L, dbi, key, buf, lua_objlen(L, top + 1), old);
+  }
+  lmdb_slow_end(dbi->env, &clk, "put", dbi->dbx, mdb_txn_id(dbi->txn), dbi->txn, key);
+  LMDB_HOT_TOUCH(dbi, key);
+  lua_settop(L, top);
+  return rc;
+}
+
+// 取 dbi 绑定的记录布局, 未绑定时返回 NULL
+static lmdb_schema *
+lmdb_dbi_schema(lmdb_dbi *dbi)
+{
+  return dbi->dbx ? dbi->dbx->schema : NULL;
+}
+
+/***
+Bind a record layout to this database.
+
+Values of a bound database are records laid out by the `lmdb.schema`, which
+`record`, `update`, `incr` and `project` read and write field by field. The
+binding applies to every handle of the database in this environment.
+`DUPSORT` databases cannot be bound, since their values cannot be rewritten
+in place.
+
+@function bind
+@tparam[opt] schema schema omit to unbind
+@treturn[1] dbi self
+@return[2] fail
+*/
+static int
+lmdb_dbi_bind(lua_State *L)
+{
+  lmdb_dbi    *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  lmdb_schema *sc = NULL;
+  lmdb_dbx    *dbx = dbi->dbx;
+  unsigned int flags;
+  int          rc;
 
-  if (ret == MDB_SUCCESS) {
-    lua_pushinteger(L, dead);
-    return 1;
+  if (!lua_isnoneornil(L, 2)) {
+    sc = (lmdb_schema *)luaL_checkudata(L, 2, LUA_LMDB_SCHEMA);
+    rc = mdb_dbi_flags(dbi->txn, dbi->dbi, &flags);
+    if (rc == MDB_SUCCESS && (flags & MDB_DUPSORT)) rc = MDB_INCOMPATIBLE;
+    if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
   }
-  return lmdb_pusherror(L, ret);
+  if (dbx->schema) {
+    luaL_unref(L, LUA_REGISTRYINDEX, dbx->schema_ref);
+    dbx->schema = NULL;
+  }
+  if (sc) {
+    lua_pushvalue(L, 2);
+    dbx->schema_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    dbx->schema = sc;
+  }
+  lua_pushvalue(L, 1);
+  return 1;
 }
 
 /***
-Copy an LMDB environment to the specified path.
-@function copy
-@tparam string path path copy to
-@treturn[1] env self
+Get a view of a record.
+
+Indexing the view by a field name decodes that field from the current value
+of the key, straight from the map; nothing is copied up front, so reading
+two fields of a large record costs two lookups, not a decode of the whole
+value. Fields the stored value is too short for read as nil. Assigning a
+field writes it like `update`. The view is valid for the life of the
+transaction.
+
+@function record
+@tparam string key
+@treturn[1] record
 @return[2] fail
 */
-
 static int
-lmdb_copy(lua_State *L)
+lmdb_dbi_record(lua_State *L)
 {
-  lmdb_env   *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
-  const char *path = luaL_checkstring(L, 2);
-  int         ret = EINVAL;
-  if (env->env) {
-    ret = mdb_env_copy(env->env, path);
-    lua_pushvalue(L, 1);
-    return 1;
+  lmdb_dbi    *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  MDB_val      key = lmdb_checkvalue(L, 2), val;
+  lmdb_schema *sc = lmdb_dbi_schema(dbi);
+  lmdb_record *rec;
+  int          rc;
+
+  if (sc == NULL) {
+    return lmdb_pusherror(L, EINVAL);
   }
-  return lmdb_pusherror(L, ret);
+  rc = mdb_get(dbi->txn, dbi->dbi, &key, &val);
+  if (rc == MDB_SUCCESS) rc = lmdb_ttl_check(L, dbi, &key);
+  LMDB_HOT_TOUCH(dbi, &key);
+  if (rc != MDB_SUCCESS) {
+    return lmdb_pusherror(L, rc);
+  }
+  rec = (lmdb_record *)lua_newuserdata(L, sizeof(lmdb_record) + key.mv_size);
+  rec->dbi_ref = rec->schema_ref = LUA_NOREF;
+  rec->dbi = dbi;
+  rec->schema = sc;
+  rec->klen = key.mv_size;
+  memcpy(rec->key, key.mv_data, key.mv_size);
+  luaL_getmetatable(L, LUA_LMDB_RECORD);
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, 1);
+  rec->dbi_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, dbi->dbx->schema_ref);
+  rec->schema_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
 }
 
 /***
-Flush the data buffers to disk.
+Update fields of a record.
 
-@function sync
-@tparam boolean force if true, force a synchronous flush.
-@treturn[1] env self
+Only the named fields change; the record is copied once, patched and written
+back over the old value, touching the one page that holds it. A missing key
+gets a new zeroed record, and a value shorter than the schema is zero
+padded. The key keeps its expiry time, if any.
+
+@function update
+@tparam string key
+@tparam table fields field names to new values
+@treturn[1] dbi self
 @return[2] fail
 */
 static int
-lmdb_sync(lua_State *L)
+lmdb_dbi_update(lua_State *L)
 {
-  lmdb_env *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
-  int       force = lua_toboolean(L, 2);
+  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  MDB_val   key = lmdb_checkvalue(L, 2);
+  int       rc;
 
-  int ret = EINVAL;
-  if (env->env) {
-    ret = mdb_env_sync(env->env, force);
-    lua_pushvalue(L, 1);
-    return 1;
+  luaL_checktype(L, 3, LUA_TTABLE);
+  if (lmdb_dbi_schema(dbi) == NULL) {
+    return lmdb_pusherror(L, EINVAL);
   }
-  return lmdb_pusherror(L, ret);
+  rc = lmdb_record_update(L, dbi, &key, 3);
+  if (rc != MDB_SUCCESS) {
+    return lmdb_pusherror(L, rc);
+  }
+  lua_pushvalue(L, 1);
+  return 1;
 }
 
 /***
-Get environment associated property, include `flags`, `path`, `fd`,
-`mapsize`, `maxreaders`, `maxkeysize`.
+Add to a numeric field of a record, in place.
 
-@function get
-@tparam string item The property to get
-@return[1] value
-  - integer for `flags`
-  - string for `path`
-  - integer for `fd`
-  - integer for `mapsize`
-  - integer for `maxreaders`
-  - integer for `maxkeysize`
+A missing key gets a new zeroed record first. Integer fields wrap around at
+their width.
+
+@function incr
+@tparam string key
+@tparam string field
+@tparam[opt=1] number delta
+@treturn[1] number the new value
 @return[2] fail
 */
 static int
-lmdb_get_property(lua_State *L)
+lmdb_dbi_incr(lua_State *L)
 {
-  lmdb_env   *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
-  const char *item = luaL_checkstring(L, 2);
-  int         ret = EINVAL;
-
-  if (!env->env) {
+  lmdb_dbi          *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  MDB_val            key = lmdb_checkvalue(L, 2), v;
+  lmdb_schema       *sc = lmdb_dbi_schema(dbi);
+  const lmdb_sfield *f;
+  unsigned char     *buf;
+  size_t             old;
+  lmdb_slowclock     clk;
+  int                rc;
+
+  luaL_checkstring(L, 3);
+  if (sc == NULL) {
     return lmdb_pusherror(L, EINVAL);
   }
-
-  if (strcmp(item, "flags") == 0) {
-    unsigned int flags;
-    ret = mdb_env_get_flags(env->env, &flags);
-    if (ret == MDB_SUCCESS) {
-      lua_pushinteger(L, flags);
-      return 1;
-    }
-  } else if (strcmp(item, "path") == 0) {
-    const char *path = NULL;
-
-    ret = mdb_env_get_path(env->env, &path);
-    if (ret == MDB_SUCCESS) {
-      lua_pushstring(L, path);
-      return 1;
-    }
-  } else if (strcmp(item, "fd") == 0) {
-    mdb_filehandle_t fd = 0;
-
-    ret = mdb_env_get_fd(env->env, &fd);
-    if (ret == MDB_SUCCESS) {
-      lua_pushinteger(L, fd);
-      return 1;
-    }
-  } else if (strcmp(item, "maxreaders") == 0) {
-    unsigned int maxreaders;
-
-    ret = mdb_env_get_maxreaders(env->env, &maxreaders);
-    if (ret == MDB_SUCCESS) {
-      lua_pushinteger(L, maxreaders);
-      return 1;
-    }
-  } else if (strcmp(item, "maxkeysize") == 0) {
-    lua_pushinteger(L, mdb_env_get_maxkeysize(env->env));
-    return 1;
-  } else if (strcmp(item, "userctx") == 0) {
-    int   ref;
-    void *ctx = mdb_env_get_userctx(env->env);
-    if (ctx == NULL) {
-      lua_pushnil(L);
-      return 1;
-    }
-    ref = (int)(intptr_t)ctx;
-    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
-    return 1;
-  } else {
-    luaL_error(L, "unknown property: %s", item);
+  f = lmdb_schema_field(L, sc, 3);
+  luaL_argcheck(L, f != NULL, 3, "no such field");
+  luaL_argcheck(L, f->type != LMDB_FIELD_BYTES, 3, "not a numeric field");
+  if (f->type == LMDB_FIELD_FLOAT)
+    luaL_optnumber(L, 4, 1);
+  else
+    luaL_optinteger(L, 4, 1);
+  lua_settop(L, 4);
+
+  lmdb_slow_begin(dbi->env, &clk, dbi->txn);
+  rc = lmdb_record_load(L, dbi, sc, &key, &buf, &old);
+  if (rc == MDB_SUCCESS) {
+    v.mv_data = buf;
+    v.mv_size = lua_objlen(L, 5);
+    lmdb_sfield_push(L, f, &v);
+    if (f->type == LMDB_FIELD_FLOAT)
+      lua_pushnumber(L, lua_tonumber(L, 6) + luaL_optnumber(L, 4, 1));
+    else
+      lua_pushinteger(L, (lua_Integer)((uint64_t)lua_tointeger(L, 6) +
+                                       (uint64_t)luaL_optinteger(L, 4, 1)));
+    lmdb_sfield_store(L, f, buf, 7);
+    rc = lmdb_record_store(L, dbi, &key, buf, v.mv_size, old);
   }
-
-  return lmdb_pusherror(L, ret);
+  lmdb_slow_end(dbi->env, &clk, "put", dbi->dbx, mdb_txn_id(dbi->txn), dbi->txn, &key);
+  LMDB_HOT_TOUCH(dbi, &key);
+  if (rc != MDB_SUCCESS) {
+    return lmdb_pusherror(L, rc);
+  }
+  lmdb_sfield_push(L, f, &v);
+  return 1;
 }
 
 /***
-Set environment associated property, include `flags`, `mapsize`, `maxreaders`,
-`maxdbs`, `userctx`.
-
-@function set
-@tparam string item The property to set
-@param ...
-  - integer for `flags`
-  - string for `path`
-  - integer for `fd`
-  - integer for `mapsize`
-  - integer for `maxreaders`
-  - integer for `maxkeysize`
-@treturn[1] env self
+Read some fields of the records in a key range.
+
+Only the listed fields are decoded, straight from each value in the map,
+with no Lua string made for the rest of the record. `spec` bounds the keys
+with `from`, `to` and `prefix` as in `cursor:range`.
+
+@function project
+@tparam[opt] table fields field names, omit for all fields
+@tparam[opt] table spec
+@treturn[1] table array of keys
+@treturn[1] table columns, field name to an array of values in key order,
+false where a value is too short for the field
 @return[2] fail
 */
-
 static int
-lmdb_set_property(lua_State *L)
+lmdb_dbi_project(lua_State *L)
 {
-  lmdb_env   *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
-  const char *item = luaL_checkstring(L, 2);
-  int         ret = EINVAL;
-  luaL_checkany(L, 3);
-
-  if (strcmp(item, "flags") == 0) {
-    unsigned int flags = luaL_checkinteger(L, 3);
-    luaL_checkany(L, 4);
-    int onoff = lua_toboolean(L, 4);
-
-    ret = mdb_env_set_flags(env->env, flags, onoff);
-
-    if (ret == MDB_SUCCESS) {
-      lua_pushvalue(L, 1);
-      return 1;
-    }
-  } else if (strcmp(item, "mapsize") == 0) {
-    mdb_size_t size = luaL_checkinteger(L, 3);
-    ret = mdb_env_set_mapsize(env->env, size);
-    if (ret == MDB_SUCCESS) {
-      lua_pushvalue(L, 1);
-      return 1;
-    }
-  } else if (strcmp(item, "maxreaders") == 0) {
-    unsigned int maxreaders = luaL_checkinteger(L, 3);
-    ret = mdb_env_set_maxreaders(env->env, maxreaders);
-    if (ret == MDB_SUCCESS) {
-      lua_pushvalue(L, 1);
-      return 1;
-    }
-  } else if (strcmp(item, "maxdbs") == 0) {
-    unsigned int maxdbs = luaL_checkinteger(L, 3);
-    ret = mdb_env_set_maxdbs(env->env, maxdbs);
-    if (ret == MDB_SUCCESS) {
-      lua_pushvalue(L, 1);
-      return 1;
+  lmdb_dbi           *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  lmdb_schema        *sc = lmdb_dbi_schema(dbi);
+  const lmdb_sfield **cols;
+  lmdb_range          range;
+  MDB_cursor         *cursor;
+  MDB_val             key, val;
+  int                 n, i, row = 0, rc;
+
+  memset(&range, 0, sizeof(range));
+  lua_settop(L, 3);
+  lua_newtable(L);
+  if (!lua_isnil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lmdb_range_check(L, 3, &range, 4);
+  }
+  if (sc == NULL) {
+    return lmdb_pusherror(L, EINVAL);
+  }
+  if (lua_isnil(L, 2)) {
+    n = sc->n;
+    cols = (const lmdb_sfield **)lua_newuserdata(L, n * sizeof(*cols));
+    for (i = 0; i < n; i++) cols[i] = &sc->field[i];
+  } else {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = (int)lua_objlen(L, 2);
+    cols = (const lmdb_sfield **)lua_newuserdata(L, (n ? n : 1) * sizeof(*cols));
+    for (i = 0; i < n; i++) {
+      lua_rawgeti(L, 2, i + 1);
+      cols[i] = lmdb_schema_field(L, sc, -1);
+      luaL_argcheck(L, cols[i] != NULL, 2, "no such field");
+      lua_pop(L, 1);
     }
-  } else if (strcmp(item, "userctx") == 0) {
-    int ref;
-    lua_pushvalue(L, 3);
-    ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    ret = mdb_env_set_userctx(env->env, (void *)(intptr_t)ref);
-    if (ret == MDB_SUCCESS) {
-      lua_pushvalue(L, 1);
-      return 1;
+  }
+  luaL_checkstack(L, n + 4, NULL);
+  lua_newtable(L);  // 6: 键
+  lua_newtable(L);  // 7: 列
+  for (i = 0; i < n; i++) {
+    lua_newtable(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, sc->names);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      if (lua_tointeger(L, -1) == cols[i] - sc->field) {
+        lua_pushvalue(L, -2);
+        lua_pushvalue(L, -5);
+        lua_rawset(L, 7);
+        lua_pop(L, 2);
+        break;
+      }
+      lua_pop(L, 1);
     }
-    luaL_unref(L, LUA_REGISTRYINDEX, ref);
-  } else {
-    luaL_error(L, "unknown property: %s", item);
+    lua_pop(L, 1);
   }
 
-  return lmdb_pusherror(L, ret);
+  rc = mdb_cursor_open(dbi->txn, dbi->dbi, &cursor);
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  for (rc = lmdb_range_first(cursor, &range, &key, &val); rc == MDB_SUCCESS;
+       rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT)) {
+    if (!lmdb_range_in(cursor, &range, &key)) break;
+    row++;
+    lua_pushlstring(L, (const char *)key.mv_data, key.mv_size);
+    lua_rawseti(L, 6, row);
+    for (i = 0; i < n; i++) {
+      if (!lmdb_sfield_push(L, cols[i], &val)) lua_pushboolean(L, 0);
+      lua_rawseti(L, 8 + i, row);
+    }
+  }
+  mdb_cursor_close(cursor);
+  if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) return lmdb_pusherror(L, rc);
+  lua_settop(L, 7);
+  return 2;
 }
 
-/***
-Return statistics about the LMDB environment.
-
-@function stat
-@treturn[1] table the statistics
-@return[2] fail
-*/
+// 曲线码 z 在框外时, 求框内大于 z 的最小码 (BIGMIN, Tropf 与 Herzog 1981).
+// mask[j] 为第 j 维在码中的各位, 没有时返回 0
 static int
-lmdb_stat(lua_State *L)
+lmdb_curve_bigmin(uint64_t z, uint64_t min, uint64_t max, const uint64_t *mask, int d, int bits,
+                  uint64_t *out)
 {
-  lmdb_env *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
-  int       ret = EINVAL;
-  if (env->env) {
-    MDB_stat stat;
-    ret = mdb_env_stat(env->env, &stat);
-    if (ret == MDB_SUCCESS) {
-      return lmdb_pushstat(L, &stat);
+  uint64_t big = 0, b, low;
+  int      i, found = 0;
+
+  for (i = d * bits - 1; i >= 0; i--) {
+    b = (uint64_t)1 << i;
+    low = mask[d - 1 - i % d] & (b - 1);  // 同一维中更低的位
+    switch ((z & b ? 4 : 0) | (min & b ? 2 : 0) | (max & b ? 1 : 0)) {
+    case 1:
+      big = (min | b) & ~low;
+      found = 1;
+      max = (max & ~b) | low;
+      break;
+    case 3:
+      *out = min;
+      return 1;
+    case 4:
+      *out = big;
+      return found;
+    case 5:
+      min = (min | b) & ~low;
+      break;
+    default:
+      break;
     }
   }
-  return lmdb_pusherror(L, ret);
+  return 0;
 }
 
 /***
-Return information about the LMDB environment.
-
-@function info
-@treturn[1] table the information
+Scan the points inside a box, over Z-order keys.
+
+Keys must begin with an 8 byte `lmdb.morton` code of the point; anything
+after it, such as an id keeping several records on one point apart, is
+returned as is. The box is given by its lowest and highest corners, both
+included. The scan walks the key range between the corners' codes, and
+whenever it steps onto a key outside the box it computes the next code
+inside the box and seeks straight to it, so the work follows the number of
+points in the box rather than the length of the range.
+
+@function box_scan
+@tparam table min lowest coordinate in each dimension
+@tparam table max highest coordinate in each dimension
+@tparam[opt] table opts `limit` maximum number of points (default no limit)
+and `values` (default true) to return the values
+@treturn[1] table array of keys in key order
+@treturn[1] table array of values, or nil without `values`
 @return[2] fail
 */
 static int
-lmdb_info(lua_State *L)
+lmdb_dbi_box_scan(lua_State *L)
 {
-  lmdb_env *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
-  int       ret = EINVAL;
-  if (env->env) {
-    MDB_envinfo info;
-    ret = mdb_env_info(env->env, &info);
-    if (ret == MDB_SUCCESS) {
-      lua_newtable(L);
-      lua_pushinteger(L, info.me_mapsize);
-      lua_setfield(L, -2, "mapsize");
-      lua_pushinteger(L, info.me_last_pgno);
-      lua_setfield(L, -2, "last_pgno");
-      lua_pushinteger(L, info.me_last_txnid);
-      lua_setfield(L, -2, "last_txnid");
-      lua_pushinteger(L, info.me_maxreaders);
-      lua_setfield(L, -2, "maxreaders");
-      lua_pushinteger(L, info.me_numreaders);
-      lua_setfield(L, -2, "numreaders");
-      return 1;
+  lmdb_dbi     *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  uint64_t      lo[LMDB_CURVE_MAXDIM], hi[LMDB_CURVE_MAXDIM], mask[LMDB_CURVE_MAXDIM];
+  uint64_t      zmin, zmax, z;
+  unsigned char at[8];
+  lua_Integer   limit = 0, n = 0;
+  MDB_cursor   *cursor;
+  MDB_val       key, val;
+  unsigned int  flags;
+  int           d, bits, j, values = 1, inside, rc;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  d = (int)lua_objlen(L, 2);
+  luaL_argcheck(L, d >= 2 && d <= LMDB_CURVE_MAXDIM, 2, "2 to 8 coordinates expected");
+  luaL_argcheck(L, (int)lua_objlen(L, 3) == d, 3, "dimensions differ from min");
+  bits = 64 / d;
+  for (j = 0; j < d; j++) {
+    lua_rawgeti(L, 2, j + 1);
+    lo[j] = lmdb_curve_coord(L, -1, 2, bits);
+    lua_rawgeti(L, 3, j + 1);
+    hi[j] = lmdb_curve_coord(L, -1, 3, bits);
+    lua_pop(L, 2);
+  }
+  if (!lua_isnoneornil(L, 4)) {
+    luaL_checktype(L, 4, LUA_TTABLE);
+    lua_getfield(L, 4, "limit");
+    limit = luaL_optinteger(L, -1, 0);
+    lua_getfield(L, 4, "values");
+    values = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 2);
+  }
+  lua_settop(L, 4);
+
+  rc = mdb_dbi_flags(dbi->txn, dbi->dbi, &flags);
+  if (rc == MDB_SUCCESS && (flags & (MDB_INTEGERKEY | MDB_REVERSEKEY))) rc = MDB_INCOMPATIBLE;
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  lua_newtable(L);
+  if (values)
+    lua_newtable(L);
+  else
+    lua_pushnil(L);
+  for (j = 0; j < d; j++)
+    if (lo[j] > hi[j]) return 2;
+
+  for (j = 0; j < d; j++) {
+    uint64_t one[LMDB_CURVE_MAXDIM] = { 0 };
+    one[j] = bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+    mask[j] = lmdb_curve_interleave(one, d, bits);
+  }
+  zmin = lmdb_curve_interleave(lo, d, bits);
+  zmax = lmdb_curve_interleave(hi, d, bits);
+
+  rc = mdb_cursor_open(dbi->txn, dbi->dbi, &cursor);
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  lmdb_curve_key(at, zmin);
+  key.mv_data = at;
+  key.mv_size = 8;
+  rc = mdb_cursor_get(cursor, &key, &val, MDB_SET_RANGE);
+  while (rc == MDB_SUCCESS) {
+    if (key.mv_size < 8) {
+      rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT);
+      continue;
+    }
+    z = lmdb_curve_unkey((const unsigned char *)key.mv_data);
+    if (z > zmax) break;
+    for (j = 0, inside = 1; j < d && inside; j++)
+      inside = (z & mask[j]) >= (zmin & mask[j]) && (z & mask[j]) <= (zmax & mask[j]);
+    if (inside) {
+      n++;
+      lua_pushlstring(L, (const char *)key.mv_data, key.mv_size);
+      lua_rawseti(L, 5, n);
+      if (values) {
+        lua_pushlstring(L, (const char *)val.mv_data, val.mv_size);
+        lua_rawseti(L, 6, n);
+      }
+      if (limit > 0 && n >= limit) break;
+      rc = mdb_cursor_get(cursor, &key, &val, MDB_NEXT);
+    } else {
+      if (!lmdb_curve_bigmin(z, zmin, zmax, mask, d, bits, &z)) break;
+      lmdb_curve_key(at, z);
+      key.mv_data = at;
+      key.mv_size = 8;
+      rc = mdb_cursor_get(cursor, &key, &val, MDB_SET_RANGE);
     }
   }
-  return lmdb_pusherror(L, ret);
+  mdb_cursor_close(cursor);
+  if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) return lmdb_pusherror(L, rc);
+  return 2;
 }
 
 /***
-Create a transaction for use with the environment.
-
-@function begin
-@tparam[opt] txn parent
-@tparam[opt=0] integer flags the flags for the transaction
-@treturn txn the transaction object
+Track heavy-hitter keys of this database.
+
+Tracking covers `get`, `put` and `del` through any handle of the database in
+this environment, and survives the transaction. Counts are estimated with a
+count-min sketch, so they may be slightly high but never low.
+
+@function hotkeys_track
+@tparam[opt=16] integer k number of top keys to keep, 0 to stop tracking
+@treturn[1] dbi self
 @return[2] fail
 */
 static int
-lmdb_txn_begin(lua_State *L)
+lmdb_dbi_hotkeys_track(lua_State *L)
 {
-  lmdb_env *env = (lmdb_env *)luaL_checkudata(L, 1, LUA_LMDB_ENV);
-  MDB_txn  *parent = (lua_isuserdata(L, 2) ? (MDB_txn *)luaL_checkudata(L, 2, LUA_LMDB_TXN) : NULL);
-  unsigned int flags = parent ? luaL_optinteger(L, 3, 0) : luaL_optinteger(L, 2, 0);
-  lmdb_txn    *txn = (lmdb_txn *)lua_newuserdata(L, sizeof(lmdb_txn));
-  int          ret = mdb_txn_begin(env->env, parent, flags, &txn->txn);
-  if (ret != MDB_SUCCESS) {
-    return lmdb_pusherror(L, ret);
+  lmdb_dbi     *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  lua_Integer   n = luaL_optinteger(L, 2, 16);
+  lmdb_hotkeys *hot = NULL;
+  size_t        cap = 2;
+  int           k;
+
+  // 先按 lua_Integer 检查, 免得大数截断成 int 后混过去
+  luaL_argcheck(L, n >= 0 && n <= 1024, 2, "k must be 0 to 1024");
+  k = (int)n;
+  if (k > 0) {
+    while (cap < 2 * (size_t)k) cap *= 2;
+    hot = (lmdb_hotkeys *)calloc(1, sizeof(lmdb_hotkeys) + (k - 1) * sizeof(lmdb_hotkey) + cap * sizeof(int));
+    if (hot == NULL) {
+      return lmdb_pusherror(L, ENOMEM);
+    }
+    hot->k = k;
+    hot->pos = (int *)(hot->heap + k);
+    hot->mask = cap - 1;
   }
-  luaL_getmetatable(L, LUA_LMDB_TXN);
-  lua_setmetatable(L, -2);
+  lmdb_hotkeys_free(dbi->dbx->hot);
+  dbi->dbx->hot = hot;
 
   lua_pushvalue(L, 1);
-  txn->env_ref = luaL_ref(L, LUA_REGISTRYINDEX);
   return 1;
 }
 
 /***
-A txn class
-
-@type txn
+Pass values of this database through Lua functions, caching decoded ones.
+
+`decode(value, key)` turns what `get` reads into any Lua value, and
+`encode(value)` turns what `put` is given into a string. Only `get` and
+`put` use the codec; cursors and the other readers see stored bytes. It
+applies to every handle of the database in this environment.
+
+With `cache` set, decoded values are kept in process and `get` returns them
+without reading the database or decoding again, as long as its snapshot sees
+the same version of the database as when the value was decoded. The version
+is the last commit that modified the database; commits through this
+environment are tracked per database, and any other commit found in between
+counts as modifying all of them. Reads in a write transaction bypass the
+cache. Entries are charged their key and encoded value sizes and evicted
+with CLOCK. Cached values are shared between callers, so treat decoded
+tables as read-only.
+
+@function codec
+@tparam[opt] table opts `decode` and `encode` functions, `cache` budget in
+bytes (default 0, no cache) and `entries` maximum number of cached values
+(default `cache / 256`); omit to remove the codec
+@treturn[1] dbi self
+@return[2] fail
 */
+static int
+lmdb_dbi_codec(lua_State *L)
+{
+  lmdb_dbi    *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  lmdb_dbx    *dbx = dbi->dbx;
+  lmdb_dcache *cache = NULL;
+  lua_Integer  budget = 0, n = 0;
+
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_getfield(L, 2, "decode");
+    luaL_argcheck(L, lua_isnil(L, 3) || lua_isfunction(L, 3), 2, "decode must be a function");
+    lua_getfield(L, 2, "encode");
+    luaL_argcheck(L, lua_isnil(L, 4) || lua_isfunction(L, 4), 2, "encode must be a function");
+    lua_getfield(L, 2, "cache");
+    budget = luaL_optinteger(L, 5, 0);
+    lua_getfield(L, 2, "entries");
+    n = budget / 256;
+    n = luaL_optinteger(L, 6, n < 16 ? 16 : n > 65536 ? 65536 : n);
+    luaL_argcheck(L, budget >= 0, 2, "cache out of range");
+    luaL_argcheck(L, n > 0 && n <= (1 << 24), 2, "entries out of range");
+    if (budget > 0) {
+      luaL_argcheck(L, !lua_isnil(L, 3), 2, "cache needs decode");
+      cache = lmdb_dcache_new((size_t)budget, (int)n);
+      if (cache == NULL) {
+        return lmdb_pusherror(L, ENOMEM);
+      }
+    }
+  }
 
-/***
-Return the transaction's ID.
+  if (dbx->codec) {
+    luaL_unref(L, LUA_REGISTRYINDEX, dbx->codec);
+    dbx->codec = 0;
+  }
+  lmdb_dcache_free(dbx->cache);
+  dbx->cache = NULL;
+  if (!lua_isnoneornil(L, 2)) {
+    MDB_envinfo info;
 
-This returns the identifier associated with this transaction. For a
-read-only transaction, this corresponds to the snapshot being read;
-concurrent readers will frequently have the same transaction ID.
+    lua_createtable(L, 0, 2);
+    lua_pushvalue(L, 3);
+    lua_setfield(L, -2, "decode");
+    lua_pushvalue(L, 4);
+    lua_setfield(L, -2, "encode");
+    dbx->codec = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (cache) {
+      // 之前未记账的提交可能改过本库, 从当前版本开始
+      mdb_env_info(dbi->env->env, &info);
+      dbx->touched = info.me_last_txnid;
+      dbx->pending = 0;
+      dbx->cache = cache;
+    }
+  }
 
-@function id
-@treturn integer the transaction ID
-*/
-static int
-lmdb_txn_id(lua_State *L)
-{
-  lmdb_txn *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
-  lua_pushinteger(L, mdb_txn_id(txn->txn));
+  lua_pushvalue(L, 1);
   return 1;
 }
 
-static void
-lmdb_txn_close(lua_State *L, lmdb_txn *txn)
+static int
+lmdb_hotkey_cmp(const void *a, const void *b)
 {
-  if (txn->txn) {
-    txn->txn = NULL;
-    luaL_unref(L, LUA_REGISTRYINDEX, txn->env_ref);
-    txn->env_ref = LUA_NOREF;
-  }
+  const lmdb_hotkey *x = *(const lmdb_hotkey *const *)a;
+  const lmdb_hotkey *y = *(const lmdb_hotkey *const *)b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
 }
 
 /***
-Commit all the operations of a transaction into the database.
-
-The transaction handle is freed. It and its cursors must not be used
-again after this call, except with #cursor:renew().
-
-@function commit
-@treturn[1] boolean
+Return the hottest keys seen since `hotkeys_track`.
+@function hotkeys
+@tparam[opt] integer k maximum number of keys to return
+@treturn[1] table array of `{key=, count=}`, hottest first
 @return[2] fail
 */
 static int
-lmdb_txn_commit(lua_State *L)
+lmdb_dbi_hotkeys(lua_State *L)
 {
-  lmdb_txn *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
-  int       ret = mdb_txn_commit(txn->txn);
-  if (ret == MDB_SUCCESS) {
-    lua_pushboolean(L, 1);
-    lmdb_txn_close(L, txn);
-    return 1;
+  lmdb_dbi     *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  lmdb_hotkeys *hot = dbi->dbx->hot;
+  lmdb_hotkey  *top[1024];
+  lua_Integer   n;
+  int           i, k;
+
+  if (hot == NULL) {
+    return lmdb_pusherror(L, EINVAL);
   }
-  return lmdb_pusherror(L, ret);
+  n = luaL_optinteger(L, 2, hot->n);
+  luaL_argcheck(L, n >= 0, 2, "n must not be negative");
+  k = n > hot->n ? hot->n : (int)n;
+
+  for (i = 0; i < hot->n; i++) top[i] = &hot->heap[i];
+  qsort(top, hot->n, sizeof(top[0]), lmdb_hotkey_cmp);
+
+  lua_createtable(L, k, 0);
+  for (i = 0; i < k; i++) {
+    lua_createtable(L, 0, 2);
+    lua_pushlstring(L, top[i]->key, top[i]->klen);
+    lua_setfield(L, -2, "key");
+    lua_pushinteger(L, top[i]->count);
+    lua_setfield(L, -2, "count");
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
 }
 
 /***
-Abandon all the operations of the transaction instead of saving them.
-@function abort
+Compare two data items according to a particular database.
+@function cmp
+@tparam string first item to compare,
+@tparam string second item to compare
+@treturn integer  < 0 if a < b, 0 if a == b, > 0 if a > b
 */
 static int
-lmdb_txn_abort(lua_State *L)
+lmdb_cmp(lua_State *L)
 {
-  lmdb_txn *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
-  mdb_txn_abort(txn->txn);
-  lmdb_txn_close(L, txn);
-  return 0;
+  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+
+  MDB_val a = lmdb_checkvalue(L, 2);
+  MDB_val b = lmdb_checkvalue(L, 3);
+
+  int rc = mdb_cmp(dbi->txn, dbi->dbi, &a, &b);
+  lua_pushinteger(L, rc);
+  return 1;
 }
 
 /***
-Reset a read-only transaction.
-@function reset
-@treturn lmdb.txn self
+Compare two data items according to a particular database.
+
+@function dcmp
+@tparam string first item to compare,
+@tparam string second item to compare
+@treturn integer  < 0 if a < b, 0 if a == b, > 0 if a > b
 */
 static int
-lmdb_txn_reset(lua_State *L)
+lmdb_dcmp(lua_State *L)
 {
-  lmdb_txn *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
-  mdb_txn_reset(txn->txn);
-  lua_pushvalue(L, 1);
+  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+
+  MDB_val a = lmdb_checkvalue(L, 2);
+  MDB_val b = lmdb_checkvalue(L, 3);
+
+  int rc = mdb_dcmp(dbi->txn, dbi->dbi, &a, &b);
+  lua_pushinteger(L, rc);
   return 1;
 }
 
 /***
-Renew a read-only transaction.
-@function renew
+Create a cursor handle.
+@function cursor_open
 
-@treturn[1] lmdb.txn self
+An untracked cursor is not adjusted by each write in the transaction;
+it re-seeks its last key when used after one, so writes stay cheap with
+many lookup cursors open.
+
+@tparam dbi an dbi handle
+@tparam[opt] table opts `{untracked=true}`
+@treturn[1] cursor
 @return[2] fail
 */
+
 static int
-lmdb_txn_renew(lua_State *L)
+lmdb_cursor_open(lua_State *L)
 {
-  lmdb_txn *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
-  int       ret = mdb_txn_renew(txn->txn);
+  lmdb_dbi    *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  int          untracked = 0;
+  lmdb_cursor *cursor;
+  int          ret;
+
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "untracked");
+    untracked = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  cursor = (lmdb_cursor *)lua_newuserdata(L, sizeof(lmdb_cursor));
+  ret = untracked ? mdb_cursor_open_untracked(dbi->txn, dbi->dbi, &cursor->cursor)
+                  : mdb_cursor_open(dbi->txn, dbi->dbi, &cursor->cursor);
   if (ret == MDB_SUCCESS) {
     lua_pushvalue(L, 1);
+    cursor->dbi_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    cursor->dbi = dbi;
+    luaL_getmetatable(L, LUA_LMDB_CURSOR);
+    lua_setmetatable(L, -2);
     return 1;
   }
   return lmdb_pusherror(L, ret);
 }
 
 /***
-Open a database in the environment.
-@function dbi_open
-@tparam[opt] string name The name of the database to open.
-Default only a single database in the environment
-@tparam[opt=0] integer flags The flags for the database
-@treturn[1] dbi
-@return[2] fail
+A cursor class.
+@type cursor
 */
-static int
-lmdb_dbi_open(lua_State *L)
-{
-  lmdb_txn    *txn = (lmdb_txn *)luaL_checkudata(L, 1, LUA_LMDB_TXN);
-  const char  *name = luaL_optstring(L, 2, NULL);
-  unsigned int flags = luaL_optinteger(L, 3, 0);
-
-  lmdb_dbi *dbi = (lmdb_dbi *)lua_newuserdata(L, sizeof(lmdb_dbi));
-
-  int ret = mdb_dbi_open(txn->txn, name, flags, &dbi->dbi);
-  if (ret != MDB_SUCCESS) {
-    return lmdb_pusherror(L, ret);
-  }
-
-  luaL_getmetatable(L, LUA_LMDB_DBI);
-  lua_setmetatable(L, -2);
-
-  lua_pushvalue(L, 1);
-  dbi->txn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-  dbi->txn = txn->txn;
-
-  return 1;
-}
 
 /***
-A dbi class.
-@type dbi
-*/
+Close a cursor handle.
+@function close
 
-/***
-Retrieve statistics for a database.
-@function stat
-@treturn[1] table the statistics
-@return[2] fail
+@treturn cursor object or error
 */
 static int
-lmdb_dbi_stat(lua_State *L)
+lmdb_cursor_close(lua_State *L)
 {
-  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
-  MDB_stat  stat;
-  int       ret = mdb_stat(dbi->txn, dbi->dbi, &stat);
-  if (ret == MDB_SUCCESS) {
-    return lmdb_pushstat(L, &stat);
+  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
+  if (cursor->cursor) {
+    mdb_cursor_close(cursor->cursor);
+    luaL_unref(L, LUA_REGISTRYINDEX, cursor->dbi_ref);
+    cursor->cursor = NULL;
+    cursor->dbi_ref = LUA_NOREF;
   }
-  return lmdb_pusherror(L, ret);
+
+  return 0;
 }
 
 /***
-Retrieve the DB flags for a database handle.
-@function flags
-@treturn[1] integer the flags
-@return[2] fail
+Renew a cursor handle.
+@function renew
+
+@treturn cursor object or error
 */
 static int
-lmdb_dbi_flags(lua_State *L)
+lmdb_cursor_renew(lua_State *L)
 {
-  lmdb_dbi    *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
-  unsigned int flags;
-  int          ret = mdb_dbi_flags(dbi->txn, dbi->dbi, &flags);
-  if (ret == MDB_SUCCESS) {
-    lua_pushinteger(L, flags);
-    return 1;
+  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
+  lmdb_dbi    *dbi = NULL;
+  int          ret;
+
+  if (cursor->cursor == NULL) {
+    return 0;
   }
-  return lmdb_pusherror(L, ret);
-}
 
-/***
-Drop the DB flags
-@function drop
-@tparam[opt] bool delete true to delete the database, false to empty it
-@treturn[1] dbi self
-@return[2] fail
-*/
-static int
-lmdb_dbi_drop(lua_State *L)
-{
-  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
-  int      del = luaL_optinteger(L, 2, 0);
-  int      ret = mdb_drop(dbi->txn, dbi->dbi, del);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cursor->dbi_ref);
+  dbi = (lmdb_dbi *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  ret = mdb_cursor_renew(dbi->txn, cursor->cursor);
   if (ret == MDB_SUCCESS) {
     lua_pushvalue(L, 1);
     return 1;
@@ -808,73 +5978,99 @@ lmdb_dbi_drop(lua_State *L)
   return lmdb_pusherror(L, ret);
 }
 
+/***
+Return the cursor's transaction handle.
+@function txn
+
+@treturn lmdb.txn
+*/
 static int
-lmdb_dbi_close(lua_State *L)
+lmdb_cursor_txn(lua_State *L)
 {
-  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
-  if (dbi->dbi) {
-    lmdb_txn *txn;
-    lmdb_env *env;
+  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
+  lmdb_dbi    *dbi;
 
-    lua_rawgeti(L, LUA_REGISTRYINDEX, dbi->txn_ref);
-    txn = (lmdb_txn *)luaL_checkudata(L, -1, LUA_LMDB_TXN);
-    lua_pop(L, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cursor->dbi_ref);
+  dbi = (lmdb_dbi *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
 
-    if (txn->txn) {
-      lua_rawgeti(L, LUA_REGISTRYINDEX, txn->env_ref);
-      env = (lmdb_env *)luaL_checkudata(L, -1, LUA_LMDB_ENV);
-      lua_pop(L, 1);
-      mdb_dbi_close(env->env, dbi->dbi);
-    }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, dbi->txn_ref);
+  return 1;
+}
 
-    dbi->dbi = 0;
-    luaL_unref(L, LUA_REGISTRYINDEX, dbi->txn_ref);
-    dbi->txn_ref = LUA_NOREF;
+/***
+Return the cursor's database handle.
+@function dbi
+
+@treturn dbi
+*/
+static int
+lmdb_cursor_dbi(lua_State *L)
+{
+  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
+  if (cursor->cursor == NULL) {
+    return 0;
   }
-  return 0;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cursor->dbi_ref);
+  return 1;
 }
 
 /***
-Get items from a database.
+Retrieve key/val pair by cursor.
 @function get
 
 @tparam string key the key to get
+@treturn[1] string key
 @treturn[1] string value
 @return[2] fail
 */
 static int
-lmdb_get(lua_State *L)
+lmdb_cursor_get(lua_State *L)
 {
-  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
-  MDB_val key = lmdb_checkvalue(L, 2);
-  MDB_val val;
+  lmdb_cursor  *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
+  MDB_cursor_op op = luaL_optinteger(L, 2, MDB_NEXT);
 
-  int rc = mdb_get(dbi->txn, dbi->dbi, &key, &val);
+  MDB_val key, val;
+  lmdb_dbi      *dbi = cursor->dbi;
+  lmdb_slowclock clk;
+
+  lmdb_slow_begin(dbi->env, &clk, dbi->txn);
+  int rc = mdb_cursor_get(cursor->cursor, &key, &val, op);
+  lmdb_slow_end(dbi->env, &clk, "cursor_get", dbi->dbx, mdb_txn_id(dbi->txn), dbi->txn,
+                rc == MDB_SUCCESS ? &key : NULL);
   if (rc == MDB_SUCCESS) {
+    lua_pushlstring(L, (const char *)key.mv_data, key.mv_size);
     lua_pushlstring(L, (const char *)val.mv_data, val.mv_size);
-    return 1;
+    return 2;
   }
   return lmdb_pusherror(L, rc);
 }
 
 /***
-Store items into a database.
+Store key/value pair by cursor.
+
 @function put
 @tparam string key the key to set
 @tparam string value the value to set
 @tparam[opt=0] integer flags
-@treturn[1] dbi self
+@treturn[1] cursor self
 @return[2] fail
 */
 static int
-lmdb_put(lua_State *L)
+lmdb_cursor_put(lua_State *L)
 {
-  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
-  MDB_val key = lmdb_checkvalue(L, 2);
-  MDB_val val = lmdb_checkvalue(L, 3);
+  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
+
+  MDB_val va = lmdb_checkvalue(L, 2);
+  MDB_val vb = lmdb_checkvalue(L, 3);
   unsigned int flags = luaL_optinteger(L, 4, 0);
+  lmdb_dbi      *dbi = cursor->dbi;
+  lmdb_slowclock clk;
 
-  int rc = mdb_put(dbi->txn, dbi->dbi, &key, &val, flags);
+  lmdb_slow_begin(dbi->env, &clk, dbi->txn);
+  int rc = mdb_cursor_put(cursor->cursor, &va, &vb, flags);
+  lmdb_slow_end(dbi->env, &clk, "cursor_put", dbi->dbx, mdb_txn_id(dbi->txn), dbi->txn, &va);
   if (rc == MDB_SUCCESS) {
     lua_pushvalue(L, 1);
     return 1;
@@ -884,20 +6080,23 @@ lmdb_put(lua_State *L)
 }
 
 /***
-Delete items from a database.
+Delete current key/data pair
 @function del
-@tparam string key the key to del
-@tparam string value the value to set
-@treturn[1] dbi self
+@tparam[opt=0] integer flags
+@treturn[1] cursor self
 @return[2] fail
 */
 static int
-lmdb_del(lua_State *L)
+lmdb_cursor_del(lua_State *L)
 {
-  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
-  MDB_val key = lmdb_checkvalue(L, 2);
+  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
+  unsigned int flags = luaL_optinteger(L, 2, 0);
+  lmdb_dbi      *dbi = cursor->dbi;
+  lmdb_slowclock clk;
 
-  int rc = mdb_del(dbi->txn, dbi->dbi, &key, NULL);
+  lmdb_slow_begin(dbi->env, &clk, dbi->txn);
+  int rc = mdb_cursor_del(cursor->cursor, flags);
+  lmdb_slow_end(dbi->env, &clk, "cursor_del", dbi->dbx, mdb_txn_id(dbi->txn), dbi->txn, NULL);
   if (rc == MDB_SUCCESS) {
     lua_pushvalue(L, 1);
     return 1;
@@ -907,302 +6106,916 @@ lmdb_del(lua_State *L)
 }
 
 /***
-Compare two data items according to a particular database.
-@function cmp
-@tparam string first item to compare,
-@tparam string second item to compare
-@treturn integer  < 0 if a < b, 0 if a == b, > 0 if a > b
+Count key/data pairs.
+@function count
+@treturn[1] int
+@return[2] fail
 */
 static int
-lmdb_cmp(lua_State *L)
+lmdb_cursor_count(lua_State *L)
 {
-  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
+  mdb_size_t   count = 0;
 
-  MDB_val a = lmdb_checkvalue(L, 2);
-  MDB_val b = lmdb_checkvalue(L, 3);
+  int rc = mdb_cursor_count(cursor->cursor, &count);
+  if (rc == MDB_SUCCESS) {
+    lua_pushinteger(L, count);
+    return 1;
+  }
 
-  int rc = mdb_cmp(dbi->txn, dbi->dbi, &a, &b);
-  lua_pushinteger(L, rc);
-  return 1;
+  return lmdb_pusherror(L, rc);
 }
 
-/***
-Compare two data items according to a particular database.
 
-@function dcmp
-@tparam string first item to compare,
-@tparam string second item to compare
-@treturn integer  < 0 if a < b, 0 if a == b, > 0 if a > b
+/***
+Get key/data pairs.
+@function pairs
+@treturn iterator
+@usage
+  local cursor = dbi:cursor_open()
+  for key, value in cursor:pairs() do
+    print(key, value)
+  end
 */
-static int
-lmdb_dcmp(lua_State *L)
+static int lmdb_cursor_next(lua_State *L)
 {
-  lmdb_dbi *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
+  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, lua_upvalueindex(1), LUA_LMDB_CURSOR);
+  MDB_val key, val;
+  lmdb_dbi      *dbi = cursor->dbi;
+  lmdb_slowclock clk;
 
-  MDB_val a = lmdb_checkvalue(L, 2);
-  MDB_val b = lmdb_checkvalue(L, 3);
+  lmdb_slow_begin(dbi->env, &clk, dbi->txn);
+  int rc = mdb_cursor_get(cursor->cursor, &key, &val, MDB_NEXT);
+  lmdb_slow_end(dbi->env, &clk, "cursor_get", dbi->dbx, mdb_txn_id(dbi->txn), dbi->txn,
+                rc == MDB_SUCCESS ? &key : NULL);
+  if (rc == MDB_SUCCESS) {
+      lua_pushlstring(L, (const char *)key.mv_data, key.mv_size);
+      lua_pushlstring(L, (const char *)val.mv_data, val.mv_size);
+      return 2;
+  }
+
+  return lmdb_pusherror(L, rc);
+}
+
+static int lmdb_cursor_pairs(lua_State *L)
+{
+  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
+
+  if (cursor->cursor == NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, "Invalid cursor");
+    return 2;
+  }
+
+  lua_pushvalue(L, 1);
+  lua_pushcclosure(L, lmdb_cursor_next, 1);
 
-  int rc = mdb_dcmp(dbi->txn, dbi->dbi, &a, &b);
-  lua_pushinteger(L, rc);
   return 1;
 }
 
+enum { LMDB_FLT_AND, LMDB_FLT_OR, LMDB_FLT_NOT, LMDB_FLT_CMP, LMDB_FLT_ITEM };
+enum { LMDB_FLT_EQ, LMDB_FLT_NE, LMDB_FLT_LT, LMDB_FLT_LE, LMDB_FLT_GT, LMDB_FLT_GE,
+       LMDB_FLT_PREFIX, LMDB_FLT_CONTAINS, LMDB_FLT_IN };
+enum { LMDB_FLT_BYTES, LMDB_FLT_INT, LMDB_FLT_UINT, LMDB_FLT_LEN };
+
+// 编译后的过滤条件, 按前序平铺, span 为子树所占节点数, in 的候选值作为 ITEM 紧随其后
+typedef struct
+{
+  int     kind, span;
+  int     key, op, mode, be;
+  size_t  offset, size;
+  MDB_val cval;
+  int64_t ival;
+} lmdb_filter;
+
+// range 迭代器状态, 过滤条件跟在结构之后
+typedef struct
+{
+  lmdb_range range;
+  int        started;
+  int        nfilter;
+} lmdb_scan;
+
+// 统计 idx 处过滤表编译后所需的节点数
+static int
+lmdb_filter_count(lua_State *L, int idx)
+{
+  int n = 1, i, len;
+
+  if (idx < 0) idx = lua_gettop(L) + idx + 1;
+  luaL_argcheck(L, lua_istable(L, idx), 2, "filter must be a table");
+  luaL_checkstack(L, 4, "filter too deep");
+  lua_rawgeti(L, idx, 1);
+  if (lua_type(L, -1) == LUA_TSTRING) {
+    len = (int)lua_objlen(L, idx);
+    for (i = 2; i <= len; i++) {
+      lua_rawgeti(L, idx, i);
+      n += lmdb_filter_count(L, -1);
+      lua_pop(L, 1);
+    }
+  } else {
+    lua_getfield(L, idx, "value");
+    if (lua_istable(L, -1)) n += (int)lua_objlen(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return n;
+}
+
+// 把 idx 处的常量写进 f, 字符串存入 anchor 表以免被回收
+static void
+lmdb_filter_const(lua_State *L, int idx, lmdb_filter *f, int anchor)
+{
+  if (f->mode == LMDB_FLT_BYTES) {
+    f->cval = lmdb_checkvalue(L, idx);
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, anchor, (int)lua_objlen(L, anchor) + 1);
+  } else {
+    f->ival = luaL_checkinteger(L, idx);
+  }
+}
+
+// 编译 idx 处的过滤表到 f[*n] 起的位置
+static void
+lmdb_filter_compile(lua_State *L, int idx, lmdb_filter *f, int *n, int anchor)
+{
+  static const char *const groups[] = { "and", "or", "not", NULL };
+  static const char *const ops[] = { "eq", "ne", "lt", "le", "gt", "ge",
+                                     "prefix", "contains", "in", NULL };
+  static const char *const types[] = { "int", "uint", NULL };
+  lmdb_filter *node = f + (*n)++;
+  int          i, len;
+
+  if (idx < 0) idx = lua_gettop(L) + idx + 1;
+  memset(node, 0, sizeof(*node));
+  lua_rawgeti(L, idx, 1);
+  if (lua_type(L, -1) == LUA_TSTRING) {
+    node->kind = lmdb_optfield(L, 2, NULL, groups);
+    len = (int)lua_objlen(L, idx);
+    luaL_argcheck(L, node->kind != LMDB_FLT_NOT || len == 2, 2, "not takes one filter");
+    for (i = 2; i <= len; i++) {
+      lua_rawgeti(L, idx, i);
+      lmdb_filter_compile(L, -1, f, n, anchor);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    node->span = (int)(f + *n - node);
+    return;
+  }
+  lua_pop(L, 1);
+
+  node->kind = LMDB_FLT_CMP;
+  lua_getfield(L, idx, "on");
+  node->key = strcmp(luaL_optstring(L, -1, "value"), "key") == 0;
+  lua_getfield(L, idx, "op");
+  node->op = lmdb_optfield(L, 2, "eq", ops);
+  lua_getfield(L, idx, "offset");
+  node->offset = (size_t)luaL_optinteger(L, -1, 0);
+  lua_getfield(L, idx, "be");
+  node->be = lua_toboolean(L, -1);
+  lua_getfield(L, idx, "len");
+  if (lua_toboolean(L, -1)) {
+    node->mode = LMDB_FLT_LEN;
+  } else {
+    lua_getfield(L, idx, "width");
+    if (lua_isnil(L, -1)) {
+      lua_getfield(L, idx, "size");
+      node->size = (size_t)luaL_optinteger(L, -1, 0);
+      lua_pop(L, 1);
+    } else {
+      node->size = (size_t)luaL_checkinteger(L, -1);
+      luaL_argcheck(L, node->size == 1 || node->size == 2 || node->size == 4 || node->size == 8,
+                    2, "width must be 1, 2, 4 or 8");
+      lua_getfield(L, idx, "type");
+      node->mode = LMDB_FLT_INT + lmdb_optfield(L, 2, "int", types);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 5);
+  luaL_argcheck(L, node->mode == LMDB_FLT_BYTES ||
+                       (node->op != LMDB_FLT_PREFIX && node->op != LMDB_FLT_CONTAINS),
+                2, "prefix and contains compare bytes");
+
+  lua_getfield(L, idx, "value");
+  if (node->op == LMDB_FLT_IN) {
+    luaL_argcheck(L, lua_istable(L, -1), 2, "in needs a table of values");
+    len = (int)lua_objlen(L, -1);
+    for (i = 1; i <= len; i++) {
+      lmdb_filter *item = f + (*n)++;
+      *item = *node;
+      item->kind = LMDB_FLT_ITEM;
+      item->span = 1;
+      lua_rawgeti(L, -1, i);
+      lmdb_filter_const(L, -1, item, anchor);
+      lua_pop(L, 1);
+    }
+  } else {
+    lmdb_filter_const(L, -1, node, anchor);
+  }
+  lua_pop(L, 1);
+  node->span = (int)(f + *n - node);
+}
+
+// 字节区间与常量的三路比较, 短者在前
+static int
+lmdb_filter_memcmp(const MDB_val *a, const MDB_val *b)
+{
+  size_t len = a->mv_size < b->mv_size ? a->mv_size : b->mv_size;
+  int    c = memcmp(a->mv_data, b->mv_data, len);
+
+  if (c == 0) c = a->mv_size < b->mv_size ? -1 : a->mv_size > b->mv_size;
+  return c;
+}
+
+// 字段 s (整数时为 u) 与常量 c 按 f 的运算比较, in 视作 eq
+static int
+lmdb_filter_match(const lmdb_filter *f, const lmdb_filter *c, const MDB_val *s, uint64_t u)
+{
+  int r;
+
+  if (f->op == LMDB_FLT_PREFIX)
+    return s->mv_size >= c->cval.mv_size &&
+           memcmp(s->mv_data, c->cval.mv_data, c->cval.mv_size) == 0;
+  if (f->op == LMDB_FLT_CONTAINS) {
+    const char *p = (const char *)s->mv_data, *e = p + s->mv_size;
+    if (c->cval.mv_size == 0) return 1;
+    while ((size_t)(e - p) >= c->cval.mv_size) {
+      p = (const char *)memchr(p, *(const char *)c->cval.mv_data, e - p);
+      if (p == NULL || (size_t)(e - p) < c->cval.mv_size) return 0;
+      if (memcmp(p, c->cval.mv_data, c->cval.mv_size) == 0) return 1;
+      p++;
+    }
+    return 0;
+  }
+
+  if (f->mode == LMDB_FLT_BYTES)
+    r = lmdb_filter_memcmp(s, &c->cval);
+  else if (f->mode == LMDB_FLT_INT)
+    r = (int64_t)u < c->ival ? -1 : (int64_t)u > c->ival;
+  else
+    r = u < (uint64_t)c->ival ? -1 : u > (uint64_t)c->ival;
+  switch (f->op) {
+  case LMDB_FLT_NE: return r != 0;
+  case LMDB_FLT_LT: return r < 0;
+  case LMDB_FLT_LE: return r <= 0;
+  case LMDB_FLT_GT: return r > 0;
+  case LMDB_FLT_GE: return r >= 0;
+  }
+  return r == 0;
+}
+
+// 对一个比较节点求值, 取不到字段时为假
+static int
+lmdb_filter_cmp(const lmdb_filter *f, const MDB_val *v)
+{
+  const lmdb_filter *c;
+  uint64_t           u = 0;
+  MDB_val            s = *v;
+
+  if (f->mode == LMDB_FLT_BYTES) {
+    if (v->mv_size < f->offset) return 0;
+    s.mv_data = (char *)v->mv_data + f->offset;
+    s.mv_size = v->mv_size - f->offset;
+    if (f->size) {
+      if (s.mv_size < f->size) return 0;
+      s.mv_size = f->size;
+    }
+  } else if (f->mode == LMDB_FLT_LEN) {
+    u = v->mv_size;
+  } else {
+    if (lmdb_field_read(v, f->offset, f->size, f->be, &u) == 0) return 0;
+    if (f->mode == LMDB_FLT_INT && f->size < 8 && (u >> (f->size * 8 - 1)) & 1)
+      u |= ~(uint64_t)0 << (f->size * 8);
+  }
+  if (f->op != LMDB_FLT_IN) return lmdb_filter_match(f, f, &s, u);
+  for (c = f + 1; c < f + f->span; c++)
+    if (lmdb_filter_match(f, c, &s, u)) return 1;
+  return 0;
+}
+
+// 对 f 起的子树求值
+static int
+lmdb_filter_eval(const lmdb_filter *f, const MDB_val *key, const MDB_val *val)
+{
+  const lmdb_filter *c, *e = f + f->span;
+
+  switch (f->kind) {
+  case LMDB_FLT_AND:
+    for (c = f + 1; c < e; c += c->span)
+      if (!lmdb_filter_eval(c, key, val)) return 0;
+    return 1;
+  case LMDB_FLT_OR:
+    for (c = f + 1; c < e; c += c->span)
+      if (lmdb_filter_eval(c, key, val)) return 1;
+    return 0;
+  case LMDB_FLT_NOT:
+    return !lmdb_filter_eval(f + 1, key, val);
+  }
+  return lmdb_filter_cmp(f, f->key ? key : val);
+}
+
 /***
-Create a cursor handle.
-@function cursor_open
+Iterate a key range, filtered in C.
 
-@tparam dbi an dbi handle
-@treturn[1] cursor
-@return[2] fail
+`spec.from` (inclusive), `spec.to` (exclusive) and `spec.prefix` bound the
+keys as in `dbi:aggregate`. `spec.filter` is tested on every entry before
+any Lua string is made; only matching entries are returned.
+
+A filter is either a group, `{"and", f1, f2, ...}`, `{"or", ...}` or
+`{"not", f}`, or a comparison:
+
+  {on="value", offset=0, size=n, op="eq", value="x"}
+
+`on` is `"key"` or `"value"` (default). The compared field is the bytes
+from `offset` on, `size` bytes long if given; with `width` (1, 2, 4 or 8) it
+is an integer of `type` `"int"` (default) or `"uint"`, native byte order
+unless `be` is set; with `len=true` it is the length of the key or value.
+`op` is `"eq"` (default), `"ne"`, `"lt"`, `"le"`, `"gt"`, `"ge"`,
+`"prefix"` or `"contains"` (bytes only) or `"in"` with `value` an array of
+candidates. Entries too short for the field do not match.
+
+@function range
+@tparam[opt] table spec
+@treturn iterator
+@usage
+  for k, v in cursor:range{prefix="user:", filter={"and",
+      {op="prefix", value="admin,"}, {len=true, op="gt", value=16}}} do
+    print(k, v)
+  end
 */
+static int
+lmdb_cursor_range_next(lua_State *L)
+{
+  lmdb_cursor   *cursor = (lmdb_cursor *)luaL_checkudata(L, lua_upvalueindex(1), LUA_LMDB_CURSOR);
+  lmdb_scan     *scan = (lmdb_scan *)lua_touserdata(L, lua_upvalueindex(2));
+  lmdb_filter   *filter = scan->nfilter ? (lmdb_filter *)(scan + 1) : NULL;
+  lmdb_dbi      *dbi = cursor->dbi;
+  MDB_val        key, val;
+  lmdb_slowclock clk;
+  int            rc;
+
+  lmdb_slow_begin(dbi->env, &clk, dbi->txn);
+  if (scan->started) {
+    rc = mdb_cursor_get(cursor->cursor, &key, &val, MDB_NEXT);
+  } else {
+    scan->started = 1;
+    rc = lmdb_range_first(cursor->cursor, &scan->range, &key, &val);
+  }
+  for (; rc == MDB_SUCCESS; rc = mdb_cursor_get(cursor->cursor, &key, &val, MDB_NEXT)) {
+    if (!lmdb_range_in(cursor->cursor, &scan->range, &key)) {
+      rc = MDB_NOTFOUND;
+      break;
+    }
+    if (filter == NULL || lmdb_filter_eval(filter, &key, &val)) break;
+  }
+  lmdb_slow_end(dbi->env, &clk, "cursor_get", dbi->dbx, mdb_txn_id(dbi->txn), dbi->txn,
+                rc == MDB_SUCCESS ? &key : NULL);
+  if (rc == MDB_SUCCESS) {
+    lua_pushlstring(L, (const char *)key.mv_data, key.mv_size);
+    lua_pushlstring(L, (const char *)val.mv_data, val.mv_size);
+    return 2;
+  }
+  return lmdb_pusherror(L, rc);
+}
 
 static int
-lmdb_cursor_open(lua_State *L)
+lmdb_cursor_range(lua_State *L)
 {
-  lmdb_dbi    *dbi = (lmdb_dbi *)luaL_checkudata(L, 1, LUA_LMDB_DBI);
-  lmdb_cursor *cursor = (lmdb_cursor *)lua_newuserdata(L, sizeof(lmdb_cursor));
+  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
+  lmdb_scan   *scan;
+  int          n = 0;
 
-  int ret = mdb_cursor_open(dbi->txn, dbi->dbi, &cursor->cursor);
-  if (ret == MDB_SUCCESS) {
-    lua_pushvalue(L, 1);
-    cursor->dbi_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    luaL_getmetatable(L, LUA_LMDB_CURSOR);
-    lua_setmetatable(L, -2);
-    return 1;
+  if (cursor->cursor == NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, "Invalid cursor");
+    return 2;
   }
-  return lmdb_pusherror(L, ret);
+  if (lua_isnoneornil(L, 2)) {
+    lua_settop(L, 1);
+    lua_newtable(L);
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_getfield(L, 2, "filter");
+  if (!lua_isnil(L, -1)) n = lmdb_filter_count(L, -1);
+
+  lua_pushvalue(L, 1);
+  scan = (lmdb_scan *)lua_newuserdata(L, sizeof(lmdb_scan) + n * sizeof(lmdb_filter));
+  memset(scan, 0, sizeof(lmdb_scan));
+  lua_newtable(L);
+  lmdb_range_check(L, 2, &scan->range, lua_gettop(L));
+  if (n) lmdb_filter_compile(L, 3, (lmdb_filter *)(scan + 1), &scan->nfilter, lua_gettop(L));
+  lua_pushcclosure(L, lmdb_cursor_range_next, 3);
+  return 1;
 }
 
 /***
-A cursor class.
-@type cursor
+A sharded store.
+
+`lmdb.open_sharded` spreads keys over several environments by key hash, so
+writers touching different shards do not wait on one write lock.
+
+@type shards
 */
 
 /***
-Close a cursor handle.
-@function close
-
-@treturn cursor object or error
+Get an item.
+@function get
+@tparam string key
+@treturn[1] string value
+@return[2] fail
 */
 static int
-lmdb_cursor_close(lua_State *L)
+lmdb_shards_get(lua_State *L)
 {
-  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
-  if (cursor->cursor) {
-    mdb_cursor_close(cursor->cursor);
-    luaL_unref(L, LUA_REGISTRYINDEX, cursor->dbi_ref);
-    cursor->cursor = NULL;
-    cursor->dbi_ref = LUA_NOREF;
-  }
+  lmdb_shards *st = lmdb_checkshards(L, 1);
+  MDB_val      key = lmdb_checkvalue(L, 2), val;
+  lmdb_shard  *s = st->shard + lmdb_shard_of(st, &key);
+  int          rc;
+
+  if (s->rtxn)
+    rc = mdb_txn_renew(s->rtxn);
+  else
+    rc = mdb_txn_begin(s->env, NULL, MDB_RDONLY, &s->rtxn);
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  rc = mdb_get(s->rtxn, s->data, &key, &val);
+  if (rc == MDB_SUCCESS) lua_pushlstring(L, (const char *)val.mv_data, val.mv_size);
+  mdb_txn_reset(s->rtxn);
+  return rc == MDB_SUCCESS ? 1 : lmdb_pusherror(L, rc);
+}
 
-  return 0;
+// 读取第 idx 个参数中的写操作, 按分片稳定排序, 返回涉及的分片数.
+// 数字键值转换出的字符串存入 anchor 处的表
+static int
+lmdb_shards_checkops(lua_State *L, lmdb_shards *st, int idx, int anchor, lmdb_shardop **ops,
+                     size_t *nops, lmdb_shardjob *jobs)
+{
+  size_t        n = lua_objlen(L, idx), i;
+  size_t        start[LMDB_SHARD_MAX + 1];
+  lmdb_shardop *in, *out;
+  int           s, njob = 0;
+
+  in = (lmdb_shardop *)lua_newuserdata(L, 2 * (n ? n : 1) * sizeof(lmdb_shardop));
+  out = in + n;
+  memset(start, 0, sizeof(start));
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, idx, i + 1);
+    luaL_argcheck(L, lua_istable(L, -1), idx, "each op must be {key[, value]}");
+    lua_rawgeti(L, -1, 1);
+    in[i].key = lmdb_checkanchored(L, -1, anchor);
+    lua_rawgeti(L, -2, 2);
+    in[i].del = lua_isnil(L, -1) || (lua_isboolean(L, -1) && !lua_toboolean(L, -1));
+    if (!in[i].del) in[i].val = lmdb_checkanchored(L, -1, anchor);
+    else in[i].val.mv_size = 0;
+    lua_pop(L, 3);
+    in[i].shard = lmdb_shard_of(st, &in[i].key);
+    start[in[i].shard + 1]++;
+  }
+  for (s = 0; s < st->n; s++) start[s + 1] += start[s];
+  for (s = 0; s < st->n; s++) {
+    if (start[s + 1] == start[s]) continue;
+    memset(jobs + njob, 0, sizeof(lmdb_shardjob));
+    jobs[njob].shard = st->shard + s;
+    jobs[njob].ops = out + start[s];
+    jobs[njob].nops = start[s + 1] - start[s];
+    njob++;
+  }
+  for (i = 0; i < n; i++) out[start[in[i].shard]++] = in[i];
+  *ops = out;
+  *nops = n;
+  return njob;
 }
 
 /***
-Renew a cursor handle.
-@function renew
-
-@treturn cursor object or error
+Apply a batch of writes.
+
+`ops` is an array of `{key, value}` pairs; a pair without a value, or with
+`false`, deletes the key. The shards involved commit in parallel, each from
+its own thread.
+
+With `atomic`, a batch touching several shards is all-or-nothing across
+crashes: the lowest shard commits its part together with a redo record of
+the whole batch before the others commit, and `open_sharded` replays any
+shard that missed its part once the writing process has exited. Readers may still see one shard's part before
+another's.
+
+@function batch
+@tparam table ops
+@tparam[opt=false] boolean atomic
+@treturn[1] shards self
+@return[2] fail
 */
 static int
-lmdb_cursor_renew(lua_State *L)
+lmdb_shards_batch(lua_State *L)
 {
-  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
-  lmdb_dbi    *dbi = NULL;
-  int          ret;
-
-  if (cursor->cursor == NULL) {
-    return 0;
-  }
+  lmdb_shards   *st = lmdb_checkshards(L, 1);
+  lmdb_shardjob  jobs[LMDB_SHARD_MAX];
+  lmdb_shardop  *ops;
+  size_t         nops, i, len = LMDB_SHARD_OWNER;
+  unsigned char *redo, *p;
+  int32_t        pid;
+  int            njob, rc, j;
 
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cursor->dbi_ref);
-  dbi = (lmdb_dbi *)lua_touserdata(L, -1);
-  lua_pop(L, 1);
-  ret = mdb_cursor_renew(dbi->txn, cursor->cursor);
-  if (ret == MDB_SUCCESS) {
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 3);
+  lua_newtable(L);
+  njob = lmdb_shards_checkops(L, st, 2, 4, &ops, &nops, jobs);
+  if (!lua_toboolean(L, 3) || njob < 2) {
+    rc = lmdb_shard_run(jobs, njob);
+    if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
     lua_pushvalue(L, 1);
     return 1;
   }
-  return lmdb_pusherror(L, ret);
+
+  for (i = jobs[0].nops; i < nops; i++) len += lmdb_shard_encode(NULL, ops + i);
+  redo = p = (unsigned char *)lua_newuserdata(L, len);
+  pid = (int32_t)getpid();
+  memcpy(p, &pid, LMDB_SHARD_OWNER);
+  p += LMDB_SHARD_OWNER;
+  for (i = jobs[0].nops; i < nops; i++) p += lmdb_shard_encode(p, ops + i);
+  jobs[0].coord = (int)(jobs[0].shard - st->shard);
+  jobs[0].redo.mv_data = redo;
+  jobs[0].redo.mv_size = len;
+  rc = lmdb_shard_run(jobs, 1);
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+
+  for (j = 1; j < njob; j++) {
+    jobs[j].coord = jobs[0].coord;
+    jobs[j].id = jobs[0].id;
+    jobs[j].marker = 1;
+  }
+  rc = lmdb_shard_run(jobs + 1, njob - 1);
+  if (rc != MDB_SUCCESS) {
+    lmdb_shards_recover(st, jobs[0].coord, jobs[0].id);
+    return lmdb_pusherror(L, rc);
+  }
+
+  // 全部提交后删除重做记录, 各分片的提交标记留到其下次写入时顺带清理
+  {
+    lmdb_shard   *c = jobs[0].shard;
+    unsigned char buf[LMDB_SHARD_MARKER];
+    MDB_txn      *txn;
+    MDB_val       k;
+
+    lmdb_shard_marker(buf, jobs[0].coord, jobs[0].id, &k);
+    k.mv_data = buf + 1;
+    k.mv_size = 8;
+    rc = mdb_txn_begin(c->env, NULL, 0, &txn);
+    if (rc == MDB_SUCCESS) {
+      rc = mdb_del(txn, c->redo, &k, NULL);
+      if (rc == MDB_SUCCESS) rc = mdb_txn_commit(txn);
+      else mdb_txn_abort(txn);
+    }
+    for (j = 1; rc == MDB_SUCCESS && j < njob; j++) {
+      lmdb_shard    *s = jobs[j].shard;
+      unsigned char *stale = (unsigned char *)realloc(s->stale, s->nstale + LMDB_SHARD_MARKER);
+      if (stale == NULL) break;
+      s->stale = stale;
+      memcpy(s->stale + s->nstale, buf, LMDB_SHARD_MARKER);
+      s->nstale += LMDB_SHARD_MARKER;
+    }
+  }
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  lua_pushvalue(L, 1);
+  return 1;
 }
 
 /***
-Return the cursor's transaction handle.
-@function txn
+Store an item, committing at once on its shard.
+@function put
+@tparam string key
+@tparam string value
+@treturn[1] shards self
+@return[2] fail
+*/
+static int
+lmdb_shards_put(lua_State *L)
+{
+  lmdb_shards  *st = lmdb_checkshards(L, 1);
+  lmdb_shardop  op;
+  lmdb_shardjob job;
+  int           rc;
+
+  memset(&job, 0, sizeof(job));
+  op.key = lmdb_checkvalue(L, 2);
+  op.del = lua_isnoneornil(L, 3);
+  op.val.mv_size = 0;
+  if (!op.del) op.val = lmdb_checkvalue(L, 3);
+  op.shard = lmdb_shard_of(st, &op.key);
+  job.shard = st->shard + op.shard;
+  job.ops = &op;
+  job.nops = 1;
+  rc = lmdb_shard_run(&job, 1);
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  lua_pushvalue(L, 1);
+  return 1;
+}
 
-@treturn lmdb.txn
+/***
+Delete an item, committing at once on its shard.
+@function del
+@tparam string key
+@treturn[1] shards self
+@return[2] fail
 */
 static int
-lmdb_cursor_txn(lua_State *L)
+lmdb_shards_del(lua_State *L)
 {
-  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
-  lmdb_dbi    *dbi;
+  lua_settop(L, 2);
+  return lmdb_shards_put(L);
+}
 
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cursor->dbi_ref);
-  dbi = (lmdb_dbi *)lua_touserdata(L, -1);
-  lua_pop(L, 1);
+/***
+Get the shard of a key.
+@function shard
+@tparam string key
+@treturn integer shard number, from 1
+*/
+static int
+lmdb_shards_shard(lua_State *L)
+{
+  lmdb_shards *st = lmdb_checkshards(L, 1);
+  MDB_val      key = lmdb_checkvalue(L, 2);
 
-  lua_rawgeti(L, LUA_REGISTRYINDEX, dbi->txn_ref);
+  lua_pushinteger(L, lmdb_shard_of(st, &key) + 1);
   return 1;
 }
 
-/***
-Return the cursor's database handle.
-@function dbi
+// 合并扫描的状态, 每个分片一个只读事务和游标
+typedef struct
+{
+  MDB_txn    *txn;
+  MDB_cursor *cursor;
+  MDB_val     key, val;
+  int         live;
+} lmdb_shardcur;
+
+typedef struct
+{
+  lmdb_shards  *st;
+  lmdb_range    range;
+  int           last;  // 上次返回的分片, -1 表示尚未开始
+  lmdb_shardcur cur[1];
+} lmdb_shardscan;
 
-@treturn dbi
-*/
 static int
-lmdb_cursor_dbi(lua_State *L)
+lmdb_shardscan_gc(lua_State *L)
 {
-  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
-  if (cursor->cursor == NULL) {
-    return 0;
+  lmdb_shardscan *scan = (lmdb_shardscan *)lua_touserdata(L, 1);
+  int             i;
+
+  if (scan->st->shard == NULL) return 0;  // 存储已关闭, 事务随环境释放
+  for (i = 0; i < scan->st->n; i++) {
+    if (scan->cur[i].cursor) mdb_cursor_close(scan->cur[i].cursor);
+    if (scan->cur[i].txn) mdb_txn_abort(scan->cur[i].txn);
+    scan->cur[i].cursor = NULL;
+    scan->cur[i].txn = NULL;
   }
+  return 0;
+}
 
-  lua_rawgeti(L, LUA_REGISTRYINDEX, cursor->dbi_ref);
-  return 1;
+static int
+lmdb_shardscan_next(lua_State *L)
+{
+  lmdb_shardscan *scan = (lmdb_shardscan *)lua_touserdata(L, lua_upvalueindex(1));
+  lmdb_shards    *st = scan->st;
+  int             i, min = -1, rc = MDB_SUCCESS;
+
+  if (st->shard == NULL) return luaL_error(L, "sharded store is closed");
+  for (i = 0; i < st->n; i++) {
+    lmdb_shardcur *c = scan->cur + i;
+    if (scan->last == -1)
+      rc = lmdb_range_first(c->cursor, &scan->range, &c->key, &c->val);
+    else if (scan->last == i)
+      rc = mdb_cursor_get(c->cursor, &c->key, &c->val, MDB_NEXT);
+    else if (!c->live)
+      continue;
+    else
+      rc = MDB_SUCCESS;
+    if (rc == MDB_SUCCESS && !lmdb_range_in(c->cursor, &scan->range, &c->key)) rc = MDB_NOTFOUND;
+    if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND) return lmdb_pusherror(L, rc);
+    c->live = rc == MDB_SUCCESS;
+    if (c->live && (min < 0 || mdb_cmp(c->txn, st->shard[i].data, &c->key, &scan->cur[min].key) < 0))
+      min = i;
+  }
+  scan->last = min;
+  if (min < 0) {
+    scan->last = -2;
+    return 0;
+  }
+  lua_pushlstring(L, (const char *)scan->cur[min].key.mv_data, scan->cur[min].key.mv_size);
+  lua_pushlstring(L, (const char *)scan->cur[min].val.mv_data, scan->cur[min].val.mv_size);
+  return 2;
 }
 
 /***
-Retrieve key/val pair by cursor.
-@function get
+Iterate all shards in key order.
 
-@tparam string key the key to get
-@treturn[1] string key
-@treturn[1] string value
-@return[2] fail
+Each shard is read from its own snapshot, taken when the iterator is made,
+and the results are merged. `spec` bounds the keys with `from`, `to` and
+`prefix` as in `cursor:range`.
+
+@function pairs
+@tparam[opt] table spec
+@treturn iterator
 */
 static int
-lmdb_cursor_get(lua_State *L)
+lmdb_shards_pairs(lua_State *L)
 {
-  lmdb_cursor  *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
-  MDB_cursor_op op = luaL_optinteger(L, 2, MDB_NEXT);
-
-  MDB_val key, val;
+  lmdb_shards    *st = lmdb_checkshards(L, 1);
+  lmdb_shardscan *scan;
+  int             i, rc = MDB_SUCCESS;
 
-  int rc = mdb_cursor_get(cursor->cursor, &key, &val, op);
-  if (rc == MDB_SUCCESS) {
-    lua_pushlstring(L, (const char *)key.mv_data, key.mv_size);
-    lua_pushlstring(L, (const char *)val.mv_data, val.mv_size);
-    return 2;
+  if (lua_isnoneornil(L, 2)) {
+    lua_settop(L, 1);
+    lua_newtable(L);
   }
-  return lmdb_pusherror(L, rc);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  scan = (lmdb_shardscan *)lua_newuserdata(
+    L, sizeof(lmdb_shardscan) + (st->n - 1) * sizeof(lmdb_shardcur));
+  memset(scan, 0, sizeof(lmdb_shardscan) + (st->n - 1) * sizeof(lmdb_shardcur));
+  scan->st = st;
+  scan->last = -1;
+  luaL_getmetatable(L, LUA_LMDB_SHARDSCAN);
+  lua_setmetatable(L, -2);
+  lua_newtable(L);
+  lmdb_range_check(L, 2, &scan->range, 4);
+  for (i = 0; i < st->n && rc == MDB_SUCCESS; i++) {
+    rc = mdb_txn_begin(st->shard[i].env, NULL, MDB_RDONLY, &scan->cur[i].txn);
+    if (rc == MDB_SUCCESS) rc = mdb_cursor_open(scan->cur[i].txn, st->shard[i].data, &scan->cur[i].cursor);
+  }
+  if (rc != MDB_SUCCESS) return lmdb_pusherror(L, rc);
+  lua_pushvalue(L, 3);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 4);
+  lua_pushcclosure(L, lmdb_shardscan_next, 4);
+  return 1;
 }
 
 /***
-Store key/value pair by cursor.
-
-@function put
-@tparam string key the key to set
-@tparam string value the value to set
-@tparam[opt=0] integer flags
-@treturn[1] cursor self
-@return[2] fail
+Close all shards.
+@function close
 */
 static int
-lmdb_cursor_put(lua_State *L)
+lmdb_shards_close(lua_State *L)
 {
-  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
+  lmdb_shards *st = (lmdb_shards *)luaL_checkudata(L, 1, LUA_LMDB_SHARDS);
+  lmdb_shards_free(st);
+  return 0;
+}
 
-  MDB_val va = lmdb_checkvalue(L, 2);
-  MDB_val vb = lmdb_checkvalue(L, 3);
-  unsigned int flags = luaL_optinteger(L, 4, 0);
+/***
+A schema class.
 
-  int rc = mdb_cursor_put(cursor->cursor, &va, &vb, flags);
-  if (rc == MDB_SUCCESS) {
-    lua_pushvalue(L, 1);
-    return 1;
-  }
+`lmdb.schema` declares the fixed layout of record values; bind one to a
+database with `dbi:bind()`.
 
-  return lmdb_pusherror(L, rc);
-}
+@type schema
+*/
 
 /***
-Delete current key/data pair
-@function del
-@tparam[opt=0] integer flags
-@treturn[1] cursor self
-@return[2] fail
+Encode a record.
+@function pack
+@tparam table fields field names to values, missing fields are zero
+@treturn string the record, `size()` bytes long
 */
 static int
-lmdb_cursor_del(lua_State *L)
+lmdb_schema_pack(lua_State *L)
 {
-  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
-  unsigned int flags = luaL_optinteger(L, 2, 0);
+  lmdb_schema   *sc = (lmdb_schema *)luaL_checkudata(L, 1, LUA_LMDB_SCHEMA);
+  unsigned char *buf;
+  int            i;
 
-  int rc = mdb_cursor_del(cursor->cursor, flags);
-  if (rc == MDB_SUCCESS) {
-    lua_pushvalue(L, 1);
-    return 1;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  buf = (unsigned char *)lua_newuserdata(L, sc->size);
+  memset(buf, 0, sc->size);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, sc->names);
+  lua_pushnil(L);
+  while (lua_next(L, 4)) {
+    lua_pushvalue(L, -2);
+    lua_gettable(L, 2);
+    i = (int)lua_tointeger(L, -2);
+    if (!lua_isnil(L, -1)) lmdb_sfield_store(L, &sc->field[i], buf, lua_gettop(L));
+    lua_pop(L, 2);
   }
-
-  return lmdb_pusherror(L, rc);
+  lua_pushlstring(L, (const char *)buf, sc->size);
+  return 1;
 }
 
 /***
-Count key/data pairs.
-@function count
-@treturn[1] int
-@return[2] fail
+Decode a record.
+@function unpack
+@tparam string value
+@treturn table field names to values, without the fields `value` is too
+short for
 */
 static int
-lmdb_cursor_count(lua_State *L)
+lmdb_schema_unpack(lua_State *L)
 {
-  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
-  mdb_size_t   count = 0;
+  lmdb_schema *sc = (lmdb_schema *)luaL_checkudata(L, 1, LUA_LMDB_SCHEMA);
+  MDB_val      val = lmdb_checkvalue(L, 2);
 
-  int rc = mdb_cursor_count(cursor->cursor, &count);
-  if (rc == MDB_SUCCESS) {
-    lua_pushinteger(L, count);
-    return 1;
+  lua_settop(L, 2);
+  lua_createtable(L, 0, sc->n);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, sc->names);
+  lua_pushnil(L);
+  while (lua_next(L, 4)) {
+    lua_pushvalue(L, -2);
+    if (lmdb_sfield_push(L, &sc->field[lua_tointeger(L, -2)], &val))
+      lua_rawset(L, 3);
+    else
+      lua_pop(L, 1);
+    lua_pop(L, 1);
   }
-
-  return lmdb_pusherror(L, rc);
+  lua_settop(L, 3);
+  return 1;
 }
 
-
 /***
-Get key/data pairs.
-@function pairs
-@treturn iterator
-@usage
-  local cursor = dbi:cursor_open()
-  for key, value in cursor:pairs() do
-    print(key, value)
-  end
+Get the record size.
+@function size
+@treturn integer the end of the furthest field
 */
-static int lmdb_cursor_next(lua_State *L)
+static int
+lmdb_schema_size(lua_State *L)
 {
-  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, lua_upvalueindex(1), LUA_LMDB_CURSOR);
-  MDB_val key, val;
- 
-  int rc = mdb_cursor_get(cursor->cursor, &key, &val, MDB_NEXT);
-  if (rc == MDB_SUCCESS) {
-      lua_pushlstring(L, (const char *)key.mv_data, key.mv_size);
-      lua_pushlstring(L, (const char *)val.mv_data, val.mv_size);
-      return 2;
-  }
-
-  return lmdb_pusherror(L, rc);
+  lmdb_schema *sc = (lmdb_schema *)luaL_checkudata(L, 1, LUA_LMDB_SCHEMA);
+  lua_pushinteger(L, (lua_Integer)sc->size);
+  return 1;
 }
 
-static int lmdb_cursor_pairs(lua_State *L)
+static int
+lmdb_schema_gc(lua_State *L)
 {
-  lmdb_cursor *cursor = (lmdb_cursor *)luaL_checkudata(L, 1, LUA_LMDB_CURSOR);
+  lmdb_schema *sc = (lmdb_schema *)luaL_checkudata(L, 1, LUA_LMDB_SCHEMA);
+  luaL_unref(L, LUA_REGISTRYINDEX, sc->names);
+  sc->names = LUA_NOREF;
+  return 0;
+}
 
-  if (cursor->cursor == NULL) {
-    lua_pushnil(L);
-    lua_pushstring(L, "Invalid cursor");
-    return 2;
-  }
+// 记录视图所在的 dbi, 其事务已结束时报错
+static lmdb_dbi *
+lmdb_record_dbi(lua_State *L, lmdb_record *rec)
+{
+  lmdb_txn *txn;
 
-  lua_pushvalue(L, 1);
-  lua_pushcclosure(L, lmdb_cursor_next, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, rec->dbi->txn_ref);
+  txn = (lmdb_txn *)luaL_testudata(L, -1, LUA_LMDB_TXN);
+  lua_pop(L, 1);
+  if (txn == NULL || txn->txn == NULL) luaL_error(L, "record used outside its transaction");
+  return rec->dbi;
+}
 
+// 记录视图按字段名读取, 每次都从映射中的当前值解码
+static int
+lmdb_record_index(lua_State *L)
+{
+  lmdb_record       *rec = (lmdb_record *)luaL_checkudata(L, 1, LUA_LMDB_RECORD);
+  const lmdb_sfield *f = lmdb_schema_field(L, rec->schema, 2);
+  lmdb_dbi          *dbi = lmdb_record_dbi(L, rec);
+  MDB_val            key = { rec->klen, rec->key }, val;
+  int                rc;
+
+  if (f == NULL) return 0;
+  rc = mdb_get(dbi->txn, dbi->dbi, &key, &val);
+  if (rc != MDB_SUCCESS) return luaL_error(L, "%s", mdb_strerror(rc));
+  if (!lmdb_sfield_push(L, f, &val)) lua_pushnil(L);
   return 1;
 }
 
+// 给记录视图的字段赋值即改写该字段
+static int
+lmdb_record_newindex(lua_State *L)
+{
+  lmdb_record *rec = (lmdb_record *)luaL_checkudata(L, 1, LUA_LMDB_RECORD);
+  lmdb_dbi    *dbi = lmdb_record_dbi(L, rec);
+  MDB_val      key = { rec->klen, rec->key };
+  int          rc;
+
+  luaL_argcheck(L, lmdb_schema_field(L, rec->schema, 2) != NULL, 2, "no such field");
+  if (dbi->dbx->schema != rec->schema) luaL_error(L, "schema of the database changed");
+  lua_settop(L, 3);
+  lua_createtable(L, 0, 1);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 3);
+  lua_rawset(L, 4);
+  rc = lmdb_record_update(L, dbi, &key, 4);
+  if (rc != MDB_SUCCESS) return luaL_error(L, "%s", mdb_strerror(rc));
+  return 0;
+}
+
+static int
+lmdb_record_gc(lua_State *L)
+{
+  lmdb_record *rec = (lmdb_record *)luaL_checkudata(L, 1, LUA_LMDB_RECORD);
+  luaL_unref(L, LUA_REGISTRYINDEX, rec->dbi_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, rec->schema_ref);
+  rec->dbi_ref = rec->schema_ref = LUA_NOREF;
+  return 0;
+}
+
 static void
 auxiliar_newclass(lua_State *L, const char *classname, const luaL_Reg *func)
 {
@@ -1248,6 +7061,8 @@ error:
 // 模块方法列表
 static const luaL_Reg env_methods[] = {
   { "txn_begin",    lmdb_txn_begin    },
+  { "snapshot",     lmdb_env_snapshot },
+  { "purge_expired", lmdb_env_purge_expired },
   { "close",        lmdb_close        },
   { "copy",         lmdb_copy         },
   { "sync",         lmdb_sync         },
@@ -1255,6 +7070,8 @@ static const luaL_Reg env_methods[] = {
   { "set",          lmdb_set_property },
   { "stat",         lmdb_stat         },
   { "info",         lmdb_info         },
+  { "heatmap",      lmdb_heatmap      },
+  { "slowlog",      lmdb_slowlog_get  },
   { "reader_list",  lmdb_reader_list  },
   { "reader_check", lmdb_reader_check },
 
@@ -1268,8 +7085,11 @@ static const luaL_Reg txn_methods[] = {
   { "reset",      lmdb_txn_reset    },
   { "renew",      lmdb_txn_renew    },
   { "id",         lmdb_txn_id       },
+  { "info",       lmdb_txn_info     },
+  { "swap",       lmdb_txn_swap     },
   { "dbi_open",   lmdb_dbi_open     },
 
+  { "__gc",       lmdb_txn_gc       },
   { "__tostring", auxiliar_tostring },
   { NULL,         NULL              }
 };
@@ -1280,11 +7100,31 @@ static const luaL_Reg dbi_methods[] = {
   { "put",        lmdb_put          },
   { "del",        lmdb_del          },
   { "get",        lmdb_get          },
+  { "get_batch",  lmdb_dbi_get_batch },
   { "stat",       lmdb_dbi_stat     },
   { "flags",      lmdb_dbi_flags    },
   { "flags",      lmdb_dbi_drop    },
   { "close",      lmdb_dbi_close },
   { "cursor_open",       lmdb_cursor_open  },
+  { "hotkeys_track", lmdb_dbi_hotkeys_track },
+  { "hotkeys",    lmdb_dbi_hotkeys  },
+  { "add_index",  lmdb_dbi_add_index },
+  { "lookup",     lmdb_dbi_lookup   },
+  { "bitmap_add",      lmdb_dbi_bitmap_add      },
+  { "bitmap_remove",   lmdb_dbi_bitmap_remove   },
+  { "bitmap_contains", lmdb_dbi_bitmap_contains },
+  { "bitmap_count",    lmdb_dbi_bitmap_count    },
+  { "aggregate",  lmdb_dbi_aggregate },
+  { "codec",      lmdb_dbi_codec    },
+  { "ts_append",  lmdb_dbi_ts_append },
+  { "ts_flush",   lmdb_dbi_ts_flush },
+  { "ts_range",   lmdb_dbi_ts_range },
+  { "bind",       lmdb_dbi_bind     },
+  { "record",     lmdb_dbi_record   },
+  { "update",     lmdb_dbi_update   },
+  { "incr",       lmdb_dbi_incr     },
+  { "project",    lmdb_dbi_project  },
+  { "box_scan",   lmdb_dbi_box_scan },
 
   { "__gc",lmdb_dbi_close },
   { "__tostring", auxiliar_tostring },
@@ -1301,17 +7141,64 @@ static const luaL_Reg cursor_methods[] = {
   { "del",        lmdb_cursor_del   },
   { "count",      lmdb_cursor_count },
   { "pairs",      lmdb_cursor_pairs },
+  { "range",      lmdb_cursor_range },
 
   { "__gc",       lmdb_cursor_close },
   { "__tostring", auxiliar_tostring },
   { NULL,         NULL              }
 };
 
+static const luaL_Reg shards_methods[] = {
+  { "get",        lmdb_shards_get   },
+  { "put",        lmdb_shards_put   },
+  { "del",        lmdb_shards_del   },
+  { "batch",      lmdb_shards_batch },
+  { "shard",      lmdb_shards_shard },
+  { "pairs",      lmdb_shards_pairs },
+  { "close",      lmdb_shards_close },
+
+  { "__gc",       lmdb_shards_close },
+  { "__tostring", auxiliar_tostring },
+  { NULL,         NULL              }
+};
+
+static const luaL_Reg schema_methods[] = {
+  { "pack",       lmdb_schema_pack   },
+  { "unpack",     lmdb_schema_unpack },
+  { "size",       lmdb_schema_size   },
+
+  { "__gc",       lmdb_schema_gc     },
+  { "__tostring", auxiliar_tostring  },
+  { NULL,         NULL               }
+};
+
+static const luaL_Reg record_methods[] = {
+  { "__newindex", lmdb_record_newindex },
+  { "__gc",       lmdb_record_gc       },
+  { NULL,         NULL                 }
+};
+
+static const luaL_Reg shardscan_methods[] = {
+  { "__gc",       lmdb_shardscan_gc },
+  { NULL,         NULL              }
+};
+
 // 注册全局函数
 static const luaL_Reg funcs[] = {
   { "version",  lmdb_version  },
   { "strerror", lmdb_strerror },
   { "open",     lmdb_open     },
+  { "intersect",  lmdb_intersect  },
+  { "union",      lmdb_union      },
+  { "difference", lmdb_difference },
+  { "bitmap_and", lmdb_bitmap_and },
+  { "bitmap_or",  lmdb_bitmap_or  },
+  { "open_sharded", lmdb_open_sharded },
+  { "schema",       lmdb_schema_new   },
+  { "morton",         lmdb_morton         },
+  { "morton_decode",  lmdb_morton_decode  },
+  { "hilbert",        lmdb_hilbert        },
+  { "hilbert_decode", lmdb_hilbert_decode },
 
   { NULL,       NULL          }
 };
@@ -1331,6 +7218,15 @@ luaopen_lmdb(lua_State *L)
   auxiliar_newclass(L, LUA_LMDB_TXN, txn_methods);
   auxiliar_newclass(L, LUA_LMDB_DBI, dbi_methods);
   auxiliar_newclass(L, LUA_LMDB_CURSOR, cursor_methods);
+  auxiliar_newclass(L, LUA_LMDB_SHARDS, shards_methods);
+  auxiliar_newclass(L, LUA_LMDB_SHARDSCAN, shardscan_methods);
+  auxiliar_newclass(L, LUA_LMDB_SCHEMA, schema_methods);
+  auxiliar_newclass(L, LUA_LMDB_RECORD, record_methods);
+  // 记录视图按字段名取值, 不经方法表
+  luaL_getmetatable(L, LUA_LMDB_RECORD);
+  lua_pushcfunction(L, lmdb_record_index);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
 
   luaL_newlib(L, funcs);
 
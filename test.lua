@@ -1,7 +1,7 @@
 local lmdb = require("lmdb")
 
 -- 创建环境
-local env = assert(lmdb.open("./var"))
+local env = assert(lmdb.open("./var", {maxdbs = 32}))
 print(env)
 
 -- 开始事务
@@ -21,18 +21,130 @@ assert(value == dbi:get(key))
 assert(dbi:del(key))
 assert(nil == dbi:get(key))
 
+assert(dbi:hotkeys_track(4))
 for i=1, 10 do
   assert(dbi:put("key" .. i, "value" .. i))
 end
+for i=1, 5 do
+  assert(dbi:get("key3") == "value3")
+end
+local hot = assert(dbi:hotkeys(1))
+assert(#hot == 1 and hot[1].key == "key3" and hot[1].count == 6)
+
+local info = assert(txn:info())
+assert(info.txnid == txn:id())
+assert(info.dirty_pages > 0 and info.dirty_room > 0)
+
+local live = assert(txn:dbi_open("live", lmdb.DBI_FLAG.CREATE))
+local nextdb = assert(txn:dbi_open("nextdb", lmdb.DBI_FLAG.CREATE))
+assert(live:put("v", "1") and nextdb:put("v", "2"))
+assert(txn:swap(live, nextdb))
+assert(live:get("v") == "2" and nextdb:get("v") == "1")
+
+local lookup = assert(dbi:cursor_open({untracked = true}))
+assert(lookup:get() == "key1")
+assert(dbi:put("key1a", "value1a"))
+assert(lookup:get() == "key10" and lookup:get() == "key1a")
+assert(dbi:del("key1a"))
+assert(lookup:get() == "key2")
+lookup:close()
+
+local users = assert(txn:dbi_open("users", lmdb.DBI_FLAG.CREATE))
+local by_city = assert(txn:dbi_open("by_city", lmdb.DBI_FLAG.CREATE + lmdb.DBI_FLAG.DUPSORT))
+assert(users:put("u1", "ann,paris"))
+assert(users:add_index(by_city, {sep = ",", field = 2}))
+assert(users:put("u2", "bob,paris") and users:put("u3", "cid,rome"))
+assert(users:put("u1", "ann,oslo") and users:del("u2"))
+local vals, keys = assert(by_city:lookup("rome"))
+assert(#vals == 1 and vals[1] == "cid,rome" and keys[1] == "u3")
+assert(#by_city:lookup("paris") == 0 and by_city:lookup("oslo")[1] == "ann,oslo")
+
+local F = lmdb.DBI_FLAG
+local terms = assert(txn:dbi_open("terms", F.CREATE + F.DUPSORT + F.DUPFIXED))
+for i = 1, 3000 do
+  local doc = string.format("%06d", i)
+  if i % 2 == 0 then assert(terms:put("even", doc)) end
+  if i % 3 == 0 then assert(terms:put("three", doc)) end
+end
+assert(terms:put("one", "000006"))
+local both = assert(lmdb.intersect{ {terms, "three"}, {terms, "even"} })
+assert(#both == 500 and both[1] == "000006" and both[500] == "003000")
+assert(#lmdb.intersect{ {terms, "even"}, {terms, "three"}, {terms, "one"} } == 1)
+assert(#lmdb.intersect{ {terms, "even"}, {terms, "none"} } == 0)
+assert(#assert(lmdb.union{ {terms, "even"}, {terms, "three"} }) == 2000)
+local rest = assert(lmdb.difference{ {terms, "three"}, {terms, "even"} })
+assert(#rest == 500 and rest[1] == "000003")
+
+local bm = assert(txn:dbi_open("bitmaps", F.CREATE))
+local ids = {}
+for i = 0, 9999 do ids[#ids + 1] = i * 3 end
+assert(bm:bitmap_add("threes", ids) and bm:bitmap_add("dense", ids))
+assert(bm:bitmap_add("sparse", {5, 6, 70000, 4000000000}))
+assert(bm:bitmap_remove("threes", 3) and not bm:bitmap_contains("threes", 3))
+assert(bm:bitmap_contains("threes", 29997) and bm:bitmap_contains("sparse", 4000000000))
+assert(bm:bitmap_count("threes") == 9999 and bm:bitmap_count("sparse") == 4)
+local common = assert(lmdb.bitmap_and{ {bm, "threes"}, {bm, "sparse"} })
+assert(#common == 1 and common[1] == 6)
+assert(lmdb.bitmap_or({ {bm, "threes"}, {bm, "sparse"} }, bm, "all") == 10002)
+assert(bm:bitmap_count("all") == 10002 and bm:bitmap_contains("all", 70000))
+-- 块内容按小端存储: 数组项 5, 6; 位图首字 0x9249249249249249
+assert(bm:get("sparse\0\0") == "\5\0\6\0")
+local dense = bm:get("dense\0\0")
+assert(#dense == 8192 and dense:byte(1) == 0x49 and dense:byte(8) == 0x92)
+
+-- 定长值用 schema 打包, LuaJIT 没有 string.pack
+local pair = lmdb.schema{ {"n", "int", 4}, {"v", "float", 8} }
+local int64 = lmdb.schema{ {"v", "int", 8} }
+local metrics = assert(txn:dbi_open("metrics", F.CREATE))
+for i = 1, 100 do
+  assert(metrics:put(string.format("cpu%03d", i), pair:pack{n = i - 50, v = i / 4}))
+end
+assert(metrics:put("mem", "x"))
+assert(metrics:aggregate() == 101 and metrics:aggregate{prefix = "cpu"} == 100)
+local total, n = metrics:aggregate{from = "cpu011", to = "cpu021", op = "sum", field = {0, 4}}
+assert(total == -345 and n == 10)
+assert(metrics:aggregate{prefix = "cpu", op = "min", field = {0, 4}} == -49)
+assert(metrics:aggregate{op = "max", field = {offset = 4, width = 8, type = "float"}} == 25)
+assert(metrics:aggregate{prefix = "cpu", op = "avg", field = {4, 8, "float"}} == 12.625)
+assert(metrics:aggregate{prefix = "none", op = "max", field = {0, 4}} == nil)
+local samples = assert(txn:dbi_open("samples", F.CREATE + F.DUPSORT + F.DUPFIXED + F.INTEGERDUP))
+for i = 1, 1000 do assert(samples:put("s" .. i % 2, int64:pack{v = i})) end
+assert(samples:aggregate{op = "sum"} == 500500 and samples:aggregate{prefix = "s1"} == 500)
+assert(samples:aggregate{to = "s1", op = "max"} == 1000)
+local wanted = {}
+for i = 1, 120 do wanted[i] = string.format("cpu%03d", i) end
+local got = assert(metrics:get_batch(wanted, {threads = 3}))
+assert(#got == 120 and got[7] == pair:pack{n = -43, v = 7 / 4} and got[101] == false)
+
+local scan = assert(metrics:cursor_open())
+local hits = {}
+for k in scan:range{prefix = "cpu", filter = {"or",
+    {"and", {offset = 0, width = 4, op = "ge", value = 40}, {"not", {on = "key", op = "contains", value = "5"}}},
+    {on = "key", op = "in", value = {"cpu001", "mem"}}}} do
+  hits[#hits + 1] = k
+end
+assert(#hits == 11 and hits[1] == "cpu001" and hits[2] == "cpu090" and hits[#hits] == "cpu100")
+local n = 0
+for k, v in scan:range{from = "cpu090", filter = {len = true, op = "lt", value = 12}} do
+  assert(k == "mem" and v == "x")
+  n = n + 1
+end
+assert(n == 1)
+scan:close()
 
 dbi:close()
 print('txn id', txn:id())
 -- 提交事务
 txn:commit()
 
+assert(env:set("heatmap", 1))
+assert(not pcall(env.set, env, "heatmap", -1))
+assert(env:set("slowlog", 0, {size=4, detail=true}))
 txn = assert(env:txn_begin())
 dbi = assert(txn:dbi_open())
 print(dbi)
+assert(dbi:get("key1") == "value1")
+assert(env:heatmap(dbi).samples > 0)
 -- 读取数据
 local cursor = assert(dbi:cursor_open())
 repeat
@@ -51,6 +163,225 @@ end
 
 txn:abort()
 
+local slow, seen = assert(env:slowlog(true))
+assert(#slow == 4 and seen > 4 and slow[1].usec >= 0)
+assert(env:set("slowlog", -1))
+
+local a, b = assert(env:snapshot()), assert(env:snapshot())
+assert(a:id() == b:id() and not pcall(a.reset, a))
+local da, db = assert(a:dbi_open()), assert(b:dbi_open())
+local sid = a:id()
+assert(da:get("key1") == "value1" and db:get("key2") == "value2")
+txn = assert(env:txn_begin())
+assert(assert(txn:dbi_open()):put("snap", "1") and txn:commit())
+local c, d = assert(env:snapshot(60)), assert(env:snapshot())
+assert(c:id() == sid and d:id() == sid and da:get("snap") == nil)
+a:abort(); b:abort(); assert(c:commit()); d:abort()
+local e = assert(env:snapshot())
+assert(e:id() > sid and assert(e:dbi_open()):get("snap") == "1")
+e:abort()
+
+-- 关闭环境时结束全部快照, 包括被新快照替下而仍有句柄的
+local senv = assert(lmdb.open("./var/snaps.mdb", {flags = lmdb.ENV_FLAG.NOSUBDIR + lmdb.ENV_FLAG.NOTLS, maxreaders = 4}))
+local old = assert(senv:snapshot())
+txn = assert(senv:txn_begin())
+assert(assert(txn:dbi_open()):put("k", "1") and txn:commit())
+assert(assert(senv:snapshot()):id() > old:id())
+senv:close()
+old = nil
+collectgarbage()
+
+-- 读事务中打开的库, get_batch 的工作线程也能用
+local benv = assert(lmdb.open("./var/batch.mdb", {flags = lmdb.ENV_FLAG.NOSUBDIR + lmdb.ENV_FLAG.NOTLS,
+  maxreaders = 8, maxdbs = 2}))
+txn = assert(benv:txn_begin())
+local kv = assert(txn:dbi_open("kv", F.CREATE))
+for i = 1, 120 do assert(kv:put(string.format("k%03d", i), tostring(i))) end
+assert(txn:commit())
+benv:close()
+benv = assert(lmdb.open("./var/batch.mdb", {flags = lmdb.ENV_FLAG.NOSUBDIR + lmdb.ENV_FLAG.NOTLS,
+  maxreaders = 8, maxdbs = 2}))
+txn = assert(benv:txn_begin(0x20000))
+local keys3 = {}
+for i = 1, 120 do keys3[i] = string.format("k%03d", i) end
+local batch, served = assert(assert(txn:dbi_open("kv")):get_batch(keys3, {threads = 3}))
+assert(batch[7] == "7" and batch[120] == "120" and served == 80)
+txn:abort()
+benv:close()
+
+local decoded = 0
+txn = assert(env:txn_begin())
+local objs = assert(txn:dbi_open("objs", F.CREATE))
+assert(objs:codec{cache = 4096, encode = function(t) return table.concat(t, ",") end,
+  decode = function(s)
+    local t = {}
+    for x in s:gmatch("[^,]+") do t[#t + 1] = x end
+    decoded = decoded + 1
+    return t
+  end})
+assert(objs:put("a", {"x", "y"}) and objs:get("a")[2] == "y" and objs:get("a")[1] == "x")
+assert(decoded == 2 and txn:commit())
+local r = assert(env:txn_begin(0x20000))
+local ro = assert(r:dbi_open("objs"))
+local obj = ro:get("a")
+assert(ro:get("a") == obj and decoded == 3 and ro:get("b") == nil)
+r:reset()
+txn = assert(env:txn_begin())
+assert(assert(txn:dbi_open()):put("other", "1") and txn:commit())
+assert(r:renew() and ro:get("a") == obj and decoded == 3)
+r:reset()
+txn = assert(env:txn_begin())
+assert(assert(txn:dbi_open("objs")):put("b", {"z"}) and txn:commit())
+assert(r:renew() and ro:get("a") ~= obj and ro:get("b")[1] == "z" and decoded == 5)
+r:abort()
+
+-- 中止释放的槽位分给别的库时, 不带过去旧库的扩展状态
+txn = assert(env:txn_begin())
+local gone = assert(txn:dbi_open("gone", F.CREATE))
+assert(gone:hotkeys_track(4) and gone:put("k", "v") and gone:hotkeys())
+txn:abort()
+txn = assert(env:txn_begin())
+assert(not assert(txn:dbi_open("fresh", F.CREATE)):hotkeys())
+txn:abort()
+
+-- 索引注册随事务提交才生效; 索引键过长时主库记录也不写入
+txn = assert(env:txn_begin())
+assert(txn:dbi_open("pets", F.CREATE) and txn:dbi_open("by_kind", F.CREATE + F.DUPSORT) and txn:commit())
+txn = assert(env:txn_begin())
+assert(assert(txn:dbi_open("pets")):add_index(assert(txn:dbi_open("by_kind")), {sep = ",", field = 2}))
+txn:abort()
+txn = assert(env:txn_begin())
+local pets, by_kind = assert(txn:dbi_open("pets")), assert(txn:dbi_open("by_kind"))
+assert(pets:put("p1", "rex,dog") and by_kind:stat().entries == 0)
+assert(pets:add_index(by_kind, {offset = 0}) and by_kind:stat().entries == 1)
+assert(not pets:put("p2", string.rep("y", 600)) and pets:get("p2") == nil)
+assert(txn:commit())
+-- 扩展状态按库名保存: 句柄关闭后槽位给了别的库, 重新打开仍带着索引
+txn = assert(env:txn_begin())
+assert(txn:dbi_open("pets")):close()
+assert(txn:dbi_open("pets_other", F.CREATE))
+pets = assert(txn:dbi_open("pets"))
+assert(pets:put("p3", "tom,cat") and txn:commit())
+txn = assert(env:txn_begin(0x20000))
+vals = assert(assert(txn:dbi_open("by_kind")):lookup("tom,cat"))
+assert(#vals == 1 and vals[1] == "tom,cat")
+txn:abort()
+-- 带索引的库不能交换, 否则索引描述的还是旧内容
+txn = assert(env:txn_begin())
+assert(not txn:swap(assert(txn:dbi_open("pets")), assert(txn:dbi_open("pets_other"))))
+txn:abort()
+
+txn = assert(env:txn_begin())
+local sess = assert(txn:dbi_open("sessions", F.CREATE))
+assert(sess:put("a", "1", {ttl = 0.05}) and sess:put("b", "2", {ttl = 3600}))
+assert(sess:put("c", "3", {ttl = 0.05}) and sess:put("c", "3") and sess:get("a") == "1")
+assert(sess:put("d", "4", {ttl = 0.05}) and sess:del("d"))
+-- 库名\0键超出键长上限时不写入值, 免得留下没有截止时间的键
+local long = string.rep("x", 505)
+assert(not sess:put(long, "5", {ttl = 60}) and sess:get(long) == nil)
+assert(sess:put(long, "5") and sess:del(long) and txn:commit())
+local t0 = os.clock()
+repeat until os.clock() - t0 > 0.06
+txn = assert(env:txn_begin(0x20000))
+sess = assert(txn:dbi_open("sessions"))
+assert(sess:get("a") == nil and sess:get("b") == "2" and sess:get("c") == "3")
+local got = assert(sess:get_batch{"a", "b"})
+assert(got[1] == false and got[2] == "2")
+txn:abort()
+assert(env:purge_expired{batch = 1} == 1 and env:purge_expired() == 0)
+txn = assert(env:txn_begin(0x20000))
+assert(assert(txn:dbi_open("sessions")):stat().entries == 2)
+txn:abort()
+
+-- 清理时按 ref 中的库名找扩展状态, 不管库被重新打开在哪个槽位
+txn = assert(env:txn_begin())
+local staff = assert(txn:dbi_open("staff", F.CREATE))
+local by_team = assert(txn:dbi_open("by_team", F.CREATE + F.DUPSORT))
+assert(staff:add_index(by_team, {sep = ",", field = 2}) and staff:put("u1", "ann,paris"))
+assert(assert(txn:dbi_open("logins", F.CREATE)):put("u1", "x", {ttl = 0.05}) and txn:commit())
+txn = assert(env:txn_begin(0x20000))
+assert(txn:dbi_open("staff")):close()
+assert(txn:dbi_open("logins")):close()
+txn:abort()
+t0 = os.clock()
+repeat until os.clock() - t0 > 0.06
+assert(env:purge_expired() == 1)
+txn = assert(env:txn_begin(0x20000))
+assert(assert(txn:dbi_open("by_team")):lookup("paris")[1] == "ann,paris")
+txn:abort()
+
+txn = assert(env:txn_begin())
+local series = assert(txn:dbi_open("series", F.CREATE))
+for i = 1, 600 do assert(series:ts_append(7, 1000 * i + (i % 10 == 0 and 3 or 0), i % 50 / 4)) end
+assert(series:ts_append(8, 5, -1.5) and not series:ts_append(7, 1000, 0))
+assert(series:stat().entries == 2 and series:ts_flush() == 89)
+assert(series:stat().entries == 4 and txn:commit())
+txn = assert(env:txn_begin(0x20000))
+series = assert(txn:dbi_open("series"))
+local stamps, vals = assert(series:ts_range(7, 249999, 260004))
+assert(#stamps == 11 and stamps[1] == 250003 and stamps[11] == 260003 and vals[11] == 10 / 4)
+stamps, vals = series:ts_range(8)
+assert(#stamps == 1 and vals[1] == -1.5 and #series:ts_range(7, 600004) == 0)
+txn:abort()
+txn = assert(env:txn_begin())
+series = assert(txn:dbi_open("series"))
+for i = 1, 300 do assert(series:ts_append(9, i, i)) end
+assert(series:ts_flush(9) == 44 and #series:ts_range(9) == 300)
+txn:abort()
+txn = assert(env:txn_begin())
+series = assert(txn:dbi_open("series"))
+assert(#series:ts_range(9) == 300 and not series:ts_append(9, 300, 0))
+assert(series:ts_flush() == 300 and #series:ts_range(9) == 300 and txn:commit())
+txn = assert(env:txn_begin(0x20000))
+series = assert(txn:dbi_open("series"))
+stamps = series:ts_range(9)
+assert(#stamps == 300 and stamps[300] == 300)
+txn:abort()
+
+local layout = lmdb.schema{ {"hits", "uint", 4}, {"temp", "float", 4}, {"tag", "bytes", 6},
+  {name = "total", type = "int", offset = 16} }
+assert(layout:size() == 24 and layout:unpack(layout:pack{tag = "ab"}).tag == "ab")
+txn = assert(env:txn_begin())
+local rows = assert(txn:dbi_open("rows", F.CREATE))
+assert(rows:bind(layout) and rows:put("r1", layout:pack{hits = 3, tag = "x"}))
+local rec = assert(rows:record("r1"))
+assert(rec.hits == 3 and rows:incr("r1", "hits", 4) == 7 and rec.hits == 7)
+assert(rows:update("r1", {tag = "yz", temp = 0.5}) and rec.tag == "yz" and rec.temp == 0.5)
+rec.total = -9
+assert(rows:incr("r2", "total") == 1 and rows:put("r3", "\1\0\0\0"))
+local rkeys, rcols = assert(rows:project({"hits", "total"}))
+assert(#rkeys == 3 and rcols.hits[1] == 7 and rcols.total[1] == -9 and rcols.total[3] == false)
+assert(not txn:dbi_open("terms"):bind(layout) and txn:commit())
+
+assert(select(2, lmdb.morton_decode(lmdb.morton(3, 0xffffffff), 2)) == 0xffffffff)
+assert(select(3, lmdb.hilbert_decode(lmdb.hilbert(7, 8, 9), 3)) == 9)
+txn = assert(env:txn_begin())
+local grid = assert(txn:dbi_open("grid", F.CREATE))
+for x = 0, 63 do
+  for y = 0, 63 do assert(grid:put(lmdb.morton(x, y) .. "p", x * 64 + y)) end
+end
+local inbox, at = assert(grid:box_scan({10, 20}, {13, 40}))
+assert(#inbox == 84 and #at == 84 and inbox[1] == lmdb.morton(10, 20) .. "p")
+for i = 1, #inbox do
+  local x, y = lmdb.morton_decode(inbox[i], 2)
+  assert(x >= 10 and x <= 13 and y >= 20 and y <= 40 and tonumber(at[i]) == x * 64 + y)
+end
+assert(#grid:box_scan({0, 0}, {63, 63}, {limit = 5, values = false}) == 5)
+txn:abort()
+
+local st = assert(lmdb.open_sharded("./var/shards", 4))
+local ops = {}
+for i = 1, 100 do ops[i] = {string.format("s%03d", i), tostring(i)} end
+assert(st:batch(ops) and st:get("s042") == "42")
+assert(st:batch({{"s001"}, {"s002", "two"}, {"s003", false}}, true))
+assert(st:get("s001") == nil and st:get("s002") == "two")
+assert(st:put("s101", "x") and st:del("s100"))
+local merged = {}
+for k in st:pairs{prefix = "s0"} do merged[#merged + 1] = k end
+assert(#merged == 97 and merged[1] == "s002" and merged[97] == "s099")
+st:close()
+assert(not lmdb.open_sharded("./var/shards", 2))
+
 -- 关闭环境
 -- env:close()
 print('Done')